@@ -4,13 +4,322 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+/* 锁的竞争统计。只有定义了 LOCK_PROFILE 宏时才编译，否则 sem、locker、cond 和原来完全相同，没有任何开销。
+开启之后每个 sem、locker、cond 对象登记到一个全局链表中，记录获得的次数、发生竞争（需要等待）的次数、
+等待时间的分布，以及竞争发生时的调用位置：locker 记录当时持有锁的线程在哪里加的锁，sem 和 cond 记录等待者在哪里等待。
+没有竞争时只多一次 trylock 和两次普通的写；有竞争时才读时钟、更新直方图，而那时线程本来就要睡眠，所以开销足够低，
+可以在一台灰度服务器上长期开启。lock_profile::dump 随时输出按等待总时间排序的统计。
+调用位置是返回地址，输出为可执行文件中的偏移，用 addr2line -f -C -e 可执行文件 偏移 得到函数名和行号 */
+#ifdef LOCK_PROFILE
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <algorithm>
+#include "chapter14/14_8_cycle_clock.h"
+
+// 加锁和等待的函数不能被内联，否则得到的返回地址是调用者的调用者
+#define LOCK_SITE __attribute__(( noinline ))
+
+class lock_profile
+{
+public:
+    // 每个锁最多区分的调用位置数，更多的位置合并为一项
+    static const int MAX_SITES = 8;
+    // dump 时最多区分的锁（名字和创建位置相同的锁合并为一组，例如文件缓存的各个分片）
+    static const int MAX_GROUPS = 256;
+
+    lock_profile( const char* kind, void* created_at )
+        : m_name( kind ), m_kind( kind ), m_created_at( created_at ), m_acquisitions( 0 ), m_contended( 0 ), m_holder( NULL ), m_prev( NULL )
+    {
+        m_recording.clear();
+        // 时钟在第一次使用时校准（10 毫秒），在这里触发，不让它落在第一次等待中
+        cycle_clock::now_ns();
+        for( int i = 0; i < MAX_SITES; ++i )
+        {
+            m_sites[i].site.store( NULL, std::memory_order_relaxed );
+            m_sites[i].count.store( 0, std::memory_order_relaxed );
+            m_sites[i].wait_ns.store( 0, std::memory_order_relaxed );
+        }
+        pthread_mutex_lock( &registry_lock() );
+        m_next = registry();
+        if( m_next )
+        {
+            m_next->m_prev = this;
+        }
+        registry() = this;
+        pthread_mutex_unlock( &registry_lock() );
+    }
+
+    ~lock_profile()
+    {
+        pthread_mutex_lock( &registry_lock() );
+        if( m_prev )
+        {
+            m_prev->m_next = m_next;
+        }
+        else
+        {
+            registry() = m_next;
+        }
+        if( m_next )
+        {
+            m_next->m_prev = m_prev;
+        }
+        pthread_mutex_unlock( &registry_lock() );
+    }
+
+    void set_name( const char* name ) { m_name = name; }
+
+    // 获得一次。exclusive 为 true 时调用者持有锁，计数只有它在写，不需要原子的读改写
+    void acquired( bool exclusive )
+    {
+        if( exclusive )
+        {
+            m_acquisitions.store( m_acquisitions.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+        }
+        else
+        {
+            m_acquisitions.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+
+    // 持有 locker 的线程的加锁位置
+    void set_holder( void* site ) { m_holder.store( site, std::memory_order_relaxed ); }
+    void* holder() const { return m_holder.load( std::memory_order_relaxed ); }
+
+    // 一次需要等待的获得：等待了 wait_ns 纳秒，site 是竞争发生的调用位置
+    void contended( void* site, long long wait_ns )
+    {
+        m_contended.fetch_add( 1, std::memory_order_relaxed );
+        // 直方图只允许一个线程写，等待的线程可能同时到达（信号量），用一个自旋标志串行化
+        while( m_recording.test_and_set( std::memory_order_acquire ) )
+        {
+        }
+        m_wait.record( wait_ns );
+        m_recording.clear( std::memory_order_release );
+        site_slot* slot = find_site( site );
+        slot->count.fetch_add( 1, std::memory_order_relaxed );
+        slot->wait_ns.fetch_add( wait_ns, std::memory_order_relaxed );
+    }
+
+    /* 输出所有登记的锁的统计，名字和创建位置相同的锁合并为一组，按等待总时间从大到小排列，只输出被使用过的锁 */
+    static void dump( FILE* fp )
+    {
+        group* groups = new group[ MAX_GROUPS ];
+        int count = 0;
+        int locks = 0;
+        pthread_mutex_lock( &registry_lock() );
+        for( lock_profile* p = registry(); p; p = p->m_next )
+        {
+            ++locks;
+            if( p->m_acquisitions.load( std::memory_order_relaxed ) == 0 && p->m_contended.load( std::memory_order_relaxed ) == 0 )
+            {
+                continue;
+            }
+            group* g = NULL;
+            for( int i = 0; i < count && ! g; ++i )
+            {
+                if( groups[i].created_at == p->m_created_at && strcmp( groups[i].name, p->m_name ) == 0 )
+                {
+                    g = groups + i;
+                }
+            }
+            if( ! g )
+            {
+                if( count == MAX_GROUPS )
+                {
+                    continue;
+                }
+                g = groups + count++;
+                g->name = p->m_name;
+                g->created_at = p->m_created_at;
+            }
+            g->add( *p );
+        }
+        pthread_mutex_unlock( &registry_lock() );
+
+        // 直方图不能复制，排序下标
+        int order[ MAX_GROUPS ];
+        for( int i = 0; i < count; ++i )
+        {
+            order[i] = i;
+        }
+        std::sort( order, order + count, [groups]( int a, int b ) { return groups[a].wait.sum_ns() > groups[b].wait.sum_ns(); } );
+        fprintf( fp, "lock profile: %d locks registered, %d groups used\n", locks, count );
+        for( int i = 0; i < count; ++i )
+        {
+            const group& g = groups[ order[i] ];
+            char where[ 256 ];
+            fprintf( fp, "%s x%d (created at %s): acquisitions %ld, contended %ld (%.2f%%), total wait %.3fms\n", g.name, g.instances,
+                     describe( g.created_at, where, sizeof( where ) ), g.acquisitions, g.contended,
+                     g.acquisitions ? 100.0 * g.contended / g.acquisitions : 0.0, g.wait.sum_ns() / 1e6 );
+            if( g.contended > 0 )
+            {
+                g.wait.print( fp, "    wait" );
+            }
+            for( int k = 0; k < g.site_count; ++k )
+            {
+                fprintf( fp, "    %s %s: contended %ld, wait %.3fms\n", strcmp( g.kind, "locker" ) == 0 ? "holder" : "waiter",
+                         describe( g.sites[k].site, where, sizeof( where ) ), g.sites[k].count, g.sites[k].wait_ns / 1e6 );
+            }
+        }
+        fflush( fp );
+        delete [] groups;
+    }
+
+private:
+    struct site_slot
+    {
+        std::atomic< void* > site;
+        std::atomic< long > count;
+        std::atomic< long long > wait_ns;
+    };
+
+    /* dump 中一组锁的合计 */
+    struct group
+    {
+        const char* name;
+        const char* kind;
+        void* created_at;
+        int instances;
+        long acquisitions;
+        long contended;
+        latency_histogram wait;
+        struct { void* site; long count; long long wait_ns; } sites[ MAX_SITES ];
+        int site_count;
+
+        group() : name( NULL ), kind( NULL ), created_at( NULL ), instances( 0 ), acquisitions( 0 ), contended( 0 ), site_count( 0 ) {}
+
+        void add( lock_profile& p )
+        {
+            kind = p.m_kind;
+            ++instances;
+            acquisitions += p.m_acquisitions.load( std::memory_order_relaxed );
+            contended += p.m_contended.load( std::memory_order_relaxed );
+            wait.merge( p.m_wait );
+            for( int i = 0; i < MAX_SITES; ++i )
+            {
+                void* site = p.m_sites[i].site.load( std::memory_order_relaxed );
+                long n = p.m_sites[i].count.load( std::memory_order_relaxed );
+                if( n == 0 )
+                {
+                    continue;
+                }
+                int k = 0;
+                while( k < site_count && sites[k].site != site )
+                {
+                    ++k;
+                }
+                if( k == site_count )
+                {
+                    if( site_count == MAX_SITES )
+                    {
+                        continue;
+                    }
+                    sites[k].site = site;
+                    sites[k].count = 0;
+                    sites[k].wait_ns = 0;
+                    ++site_count;
+                }
+                sites[k].count += n;
+                sites[k].wait_ns += p.m_sites[i].wait_ns.load( std::memory_order_relaxed );
+            }
+        }
+    };
+
+    /* 找到 site 的槽位，没有时占用一个空槽位；槽位用完时合并到最后一个槽位（它的地址记为 NULL） */
+    site_slot* find_site( void* site )
+    {
+        for( int i = 0; i < MAX_SITES - 1; ++i )
+        {
+            void* current = m_sites[i].site.load( std::memory_order_relaxed );
+            if( current == site )
+            {
+                return m_sites + i;
+            }
+            if( current == NULL )
+            {
+                if( m_sites[i].site.compare_exchange_strong( current, site, std::memory_order_relaxed ) || current == site )
+                {
+                    return m_sites + i;
+                }
+            }
+        }
+        return m_sites + MAX_SITES - 1;
+    }
+
+    /* 把代码地址写成 "模块+偏移"（加上 dladdr 能找到的符号）。返回地址指向调用指令之后，减一使 addr2line 给出调用所在的行 */
+    static const char* describe( void* addr, char* buf, int len )
+    {
+        if( ! addr )
+        {
+            snprintf( buf, len, "(other)" );
+            return buf;
+        }
+        Dl_info info;
+        if( dladdr( addr, &info ) && info.dli_fname )
+        {
+            const char* module = strrchr( info.dli_fname, '/' );
+            unsigned long offset = ( unsigned long )addr - ( unsigned long )info.dli_fbase - 1;
+            if( info.dli_sname )
+            {
+                snprintf( buf, len, "%s+0x%lx (%s+0x%lx)", module ? module + 1 : info.dli_fname, offset, info.dli_sname,
+                          ( unsigned long )addr - ( unsigned long )info.dli_saddr );
+            }
+            else
+            {
+                snprintf( buf, len, "%s+0x%lx", module ? module + 1 : info.dli_fname, offset );
+            }
+            return buf;
+        }
+        snprintf( buf, len, "%p", addr );
+        return buf;
+    }
+
+    static lock_profile*& registry()
+    {
+        static lock_profile* head = NULL;
+        return head;
+    }
+
+    static pthread_mutex_t& registry_lock()
+    {
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        return lock;
+    }
+
+    const char* m_name;
+    const char* m_kind;
+    void* m_created_at;
+    std::atomic< long > m_acquisitions;
+    std::atomic< long > m_contended;
+    std::atomic< void* > m_holder;
+    std::atomic_flag m_recording;
+    latency_histogram m_wait;
+    site_slot m_sites[ MAX_SITES ];
+    lock_profile* m_prev;
+    lock_profile* m_next;
+};
+#else
+#define LOCK_SITE
+#endif
 
 /* 封装信号量的类 */
 class sem
 {
 public:
     // 创建并初始化信号量
-    sem()
+    LOCK_SITE sem()
+#ifdef LOCK_PROFILE
+        : m_profile( "sem", __builtin_return_address( 0 ) )
+#endif
     {
         // 构造函数没有返回值，可以通过抛出异常来报告错误
         if( sem_init( &m_sem, 0, 0 ) != 0 ){
@@ -25,8 +334,43 @@ public:
     }
 
     // 等待信号量
-    bool wait(){
+    LOCK_SITE bool wait(){
+#ifdef LOCK_PROFILE
+        if( sem_trywait( &m_sem ) == 0 )
+        {
+            m_profile.acquired( false );
+            return true;
+        }
+        long long start = cycle_clock::now_ns();
+        bool ret = sem_wait( &m_sem ) == 0;
+        m_profile.acquired( false );
+        m_profile.contended( __builtin_return_address( 0 ), cycle_clock::now_ns() - start );
+        return ret;
+#else
         return sem_wait( &m_sem ) == 0;
+#endif
+    }
+
+    // 等待信号量，最多等待 timeout_ms 毫秒，超时（或被信号中断）时返回 false
+    LOCK_SITE bool timed_wait( long timeout_ms ){
+#ifdef LOCK_PROFILE
+        if( sem_trywait( &m_sem ) == 0 )
+        {
+            m_profile.acquired( false );
+            return true;
+        }
+        long long start = cycle_clock::now_ns();
+        // 超时也算一次竞争，等待的时间同样被浪费了
+        bool ret = wait_for( timeout_ms );
+        if( ret )
+        {
+            m_profile.acquired( false );
+        }
+        m_profile.contended( __builtin_return_address( 0 ), cycle_clock::now_ns() - start );
+        return ret;
+#else
+        return wait_for( timeout_ms );
+#endif
     }
 
     // 增加信号量
@@ -34,8 +378,43 @@ public:
         return sem_post( &m_sem ) == 0;
     }
 
+    // 设置在竞争统计中显示的名字（name 必须一直有效），没有定义 LOCK_PROFILE 时什么也不做
+    void set_name( const char* name ){
+#ifdef LOCK_PROFILE
+        m_profile.set_name( name );
+#endif
+    }
+
 private:
+    /* 最多等待 timeout_ms 毫秒。sem_timedwait 的截止时间是 CLOCK_REALTIME，系统时间被调整时等待会变长或者提前结束，
+    所以有 sem_clockwait 时（glibc 2.30 以后）按 CLOCK_MONOTONIC 计算截止时间 */
+    bool wait_for( long timeout_ms ){
+#if defined( __GLIBC__ ) && ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 30 ) )
+        struct timespec ts = deadline( CLOCK_MONOTONIC, timeout_ms );
+        return sem_clockwait( &m_sem, CLOCK_MONOTONIC, &ts ) == 0;
+#else
+        struct timespec ts = deadline( CLOCK_REALTIME, timeout_ms );
+        return sem_timedwait( &m_sem, &ts ) == 0;
+#endif
+    }
+
+    // 时钟 clock 上 timeout_ms 毫秒之后的时刻
+    static struct timespec deadline( clockid_t clock, long timeout_ms ){
+        struct timespec ts;
+        clock_gettime( clock, &ts );
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += ( timeout_ms % 1000 ) * 1000000L;
+        if( ts.tv_nsec >= 1000000000L ){
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        return ts;
+    }
+
     sem_t m_sem;        // 信号量
+#ifdef LOCK_PROFILE
+    lock_profile m_profile;
+#endif
 };
 
 /* 封装互斥锁的类 */
@@ -43,7 +422,10 @@ class locker
 {
 public:
     // 创建并初始化互斥锁
-    locker()
+    LOCK_SITE locker()
+#ifdef LOCK_PROFILE
+        : m_profile( "locker", __builtin_return_address( 0 ) )
+#endif
     {
         if( pthread_mutex_init( &m_mutex, NULL ) != 0 )
         {
@@ -57,8 +439,29 @@ public:
     }
 
     // 获得互斥锁
-    bool lock(){
+    LOCK_SITE bool lock(){
+#ifdef LOCK_PROFILE
+        // 没有竞争时 trylock 就能获得；否则记下此刻持有锁的线程的加锁位置，等待之后把等待时间记在它名下
+        void* site = __builtin_return_address( 0 );
+        if( pthread_mutex_trylock( &m_mutex ) == 0 )
+        {
+            m_profile.acquired( true );
+            m_profile.set_holder( site );
+            return true;
+        }
+        void* holder = m_profile.holder();
+        long long start = cycle_clock::now_ns();
+        if( pthread_mutex_lock( &m_mutex ) != 0 )
+        {
+            return false;
+        }
+        m_profile.acquired( true );
+        m_profile.contended( holder, cycle_clock::now_ns() - start );
+        m_profile.set_holder( site );
+        return true;
+#else
         return pthread_mutex_lock( &m_mutex ) == 0;
+#endif
     }
 
     // 释放互斥锁
@@ -66,8 +469,18 @@ public:
         return pthread_mutex_unlock( &m_mutex ) == 0;
     }
 
+    // 设置在竞争统计中显示的名字（name 必须一直有效），没有定义 LOCK_PROFILE 时什么也不做
+    void set_name( const char* name ){
+#ifdef LOCK_PROFILE
+        m_profile.set_name( name );
+#endif
+    }
+
 private:
     pthread_mutex_t m_mutex;// 互斥锁
+#ifdef LOCK_PROFILE
+    lock_profile m_profile;
+#endif
 };
 
 /* 封装条件变量的类 */
@@ -75,7 +488,10 @@ class cond
 {
 public:
     // 创建并初始化条件变量
-    cond()
+    LOCK_SITE cond()
+#ifdef LOCK_PROFILE
+        : m_profile( "cond", __builtin_return_address( 0 ) )
+#endif
     {
         if( pthread_mutex_init( &m_mutex, NULL ) != 0 ){
             throw std::exception();
@@ -95,11 +511,19 @@ public:
     }
 
     // 等待条件变量
-    bool wait()
+    LOCK_SITE bool wait()
     {
         int ret = 0;
         pthread_mutex_lock( &m_mutex );
+#ifdef LOCK_PROFILE
+        // 条件变量的每次等待都要睡眠，都记为一次竞争。返回时持有 m_mutex，计数不需要原子的读改写
+        long long start = cycle_clock::now_ns();
+        ret = pthread_cond_wait( &m_cond, &m_mutex );
+        m_profile.acquired( true );
+        m_profile.contended( __builtin_return_address( 0 ), cycle_clock::now_ns() - start );
+#else
         ret = pthread_cond_wait( &m_cond, &m_mutex );
+#endif
         pthread_mutex_unlock( &m_mutex );
         return ret == 0;
     }
@@ -109,9 +533,297 @@ public:
         return pthread_cond_signal( &m_cond ) == 0;
     }
 
+    // 设置在竞争统计中显示的名字（name 必须一直有效），没有定义 LOCK_PROFILE 时什么也不做
+    void set_name( const char* name ){
+#ifdef LOCK_PROFILE
+        m_profile.set_name( name );
+#endif
+    }
+
 private:
     pthread_mutex_t m_mutex;    // 用于保护条件变量的互斥锁
     pthread_cond_t m_cond;      // 条件变量
+#ifdef LOCK_PROFILE
+    lock_profile m_profile;
+#endif
+};
+
+/* futex 系统调用的封装，下面几个类在没有竞争时完全在用户态完成，只有需要睡眠或唤醒时才进入内核。
+所有 futex 都只在本进程内使用，所以用 FUTEX_PRIVATE_FLAG，内核不需要按物理页查找等待队列 */
+namespace futex
+{
+    // 如果 *addr 仍然等于 val 就睡眠，直到被唤醒、被信号中断或者超时（timeout 为相对时间，NULL 表示不超时）
+    inline int wait( std::atomic< int >* addr, int val, const struct timespec* timeout = NULL )
+    {
+        return syscall( SYS_futex, reinterpret_cast< int* >( addr ), FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0 );
+    }
+
+    // 唤醒最多 count 个等待 addr 的线程，返回唤醒的线程数
+    inline int wake( std::atomic< int >* addr, int count )
+    {
+        return syscall( SYS_futex, reinterpret_cast< int* >( addr ), FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+    }
+
+    // 自旋等待时提示 CPU 降低功耗、让出超线程的执行资源
+    inline void cpu_relax()
+    {
+#if defined( __x86_64__ ) || defined( __i386__ )
+        __builtin_ia32_pause();
+#elif defined( __aarch64__ )
+        asm volatile( "yield" ::: "memory" );
+#endif
+    }
+
+    // 只有一个在线 CPU 时持有锁的线程不可能同时在运行，自旋没有意义
+    inline bool multi_cpu()
+    {
+        static const bool multi = sysconf( _SC_NPROCESSORS_ONLN ) > 1;
+        return multi;
+    }
+}
+
+/* 先自旋、再睡眠的互斥锁（Drepper，"Futexes Are Tricky" 中的第三种实现）。状态 0 表示未加锁，1 表示加锁且没有等待者，
+2 表示加锁并且可能有等待者。没有竞争时加锁和解锁各只有一次原子操作，解锁时只有状态为 2 才调用 FUTEX_WAKE。
+临界区很短时，持有者往往在几百个周期内就会释放锁，这时自旋等待比睡眠再被唤醒（两次上下文切换）便宜得多。
+自旋的次数是自适应的：记录最近几次加锁实际自旋的次数的平均值，上限取它的两倍，和 glibc 的 PTHREAD_MUTEX_ADAPTIVE_NP 相同 */
+class spin_locker
+{
+public:
+    // 自旋次数的上限
+    static const int MAX_SPIN = 1000;
+
+    spin_locker() : m_state( 0 ), m_spin( 0 ) {}
+
+    // 获得互斥锁
+    bool lock()
+    {
+        int c = 0;
+        if( m_state.compare_exchange_strong( c, 1, std::memory_order_acquire, std::memory_order_relaxed ) )
+        {
+            return true;
+        }
+        // 锁被占用：先自旋等待它被释放
+        if( futex::multi_cpu() )
+        {
+            int limit = m_spin.load( std::memory_order_relaxed ) * 2 + 10;
+            if( limit > MAX_SPIN )
+            {
+                limit = MAX_SPIN;
+            }
+            int spins = 0;
+            for( ; spins < limit; ++spins )
+            {
+                c = 0;
+                if( m_state.load( std::memory_order_relaxed ) == 0
+                    && m_state.compare_exchange_weak( c, 1, std::memory_order_acquire, std::memory_order_relaxed ) )
+                {
+                    int spin = m_spin.load( std::memory_order_relaxed );
+                    m_spin.store( spin + ( spins - spin ) / 8, std::memory_order_relaxed );
+                    return true;
+                }
+                futex::cpu_relax();
+            }
+            int spin = m_spin.load( std::memory_order_relaxed );
+            m_spin.store( spin + ( spins - spin ) / 8, std::memory_order_relaxed );
+        }
+        // 自旋没有等到，把状态改为 2（可能有等待者）然后睡眠。被唤醒之后仍然以 2 抢锁，因为可能还有其他等待者
+        c = m_state.exchange( 2, std::memory_order_acquire );
+        while( c != 0 )
+        {
+            futex::wait( &m_state, 2 );
+            c = m_state.exchange( 2, std::memory_order_acquire );
+        }
+        return true;
+    }
+
+    // 尝试获得互斥锁，锁被占用时立即返回 false
+    bool try_lock()
+    {
+        int c = 0;
+        return m_state.compare_exchange_strong( c, 1, std::memory_order_acquire, std::memory_order_relaxed );
+    }
+
+    // 释放互斥锁
+    bool unlock()
+    {
+        if( m_state.exchange( 0, std::memory_order_release ) == 2 )
+        {
+            futex::wake( &m_state, 1 );
+        }
+        return true;
+    }
+
+private:
+    std::atomic< int > m_state;
+    // 最近加锁时自旋的次数的滑动平均
+    std::atomic< int > m_spin;
+};
+
+/* 封装读写锁的类：多个读者可以同时持有，写者独占。设置为写者优先，有写者在等待时新的读者也要等待，读多写少时写者不会被饿死 */
+class rw_locker
+{
+public:
+    rw_locker()
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init( &attr );
+        pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+        int ret = pthread_rwlock_init( &m_rwlock, &attr );
+        pthread_rwlockattr_destroy( &attr );
+        if( ret != 0 )
+        {
+            throw std::exception();
+        }
+    }
+
+    ~rw_locker(){
+        pthread_rwlock_destroy( &m_rwlock );
+    }
+
+    // 以读者的身份获得锁
+    bool rdlock(){
+        return pthread_rwlock_rdlock( &m_rwlock ) == 0;
+    }
+
+    // 以写者的身份获得锁
+    bool wrlock(){
+        return pthread_rwlock_wrlock( &m_rwlock ) == 0;
+    }
+
+    // 释放读锁或者写锁
+    bool unlock(){
+        return pthread_rwlock_unlock( &m_rwlock ) == 0;
+    }
+
+private:
+    pthread_rwlock_t m_rwlock;
+};
+
+/* 顺序锁：适合读得很频繁、写得很少、并且可以整体复制的数据（配置、统计快照）。读者不加锁也不写任何共享内存，
+只在读之前和读之后各读一次序号，序号是奇数（写者正在修改）或者前后不同时重新读；写者之间用 spin_locker 互斥，
+修改前后各把序号加一。读者永远不会阻塞写者，代价是读者可能读到修改到一半的数据（然后丢弃重读），
+所以被保护的数据只能复制出来再使用，不能通过其中的指针访问其他内存。用法：
+    unsigned seq;
+    do { seq = lock.read_begin(); copy = data; } while( lock.read_retry( seq ) );
+*/
+class seqlock
+{
+public:
+    seqlock() : m_seq( 0 ) {}
+
+    // 读者开始读，返回当前的序号。有写者正在修改时等它修改完
+    unsigned read_begin() const
+    {
+        unsigned seq;
+        while( ( seq = m_seq.load( std::memory_order_acquire ) ) & 1 )
+        {
+            futex::cpu_relax();
+        }
+        return seq;
+    }
+
+    // 读者读完，返回 true 表示读的过程中有写者修改过数据，必须重读
+    bool read_retry( unsigned seq ) const
+    {
+        // 读数据的操作不能被移到读序号之后
+        std::atomic_thread_fence( std::memory_order_acquire );
+        return m_seq.load( std::memory_order_relaxed ) != seq;
+    }
+
+    // 写者开始修改
+    void write_lock()
+    {
+        m_writer.lock();
+        m_seq.store( m_seq.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+        // 写数据的操作不能被移到序号变为奇数之前
+        std::atomic_thread_fence( std::memory_order_release );
+    }
+
+    // 写者修改完
+    void write_unlock()
+    {
+        m_seq.store( m_seq.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+        m_writer.unlock();
+    }
+
+private:
+    std::atomic< unsigned > m_seq;
+    spin_locker m_writer;
+};
+
+/* 基于 futex 的计数信号量，接口和 sem 相同。计数大于 0 时 wait 只需一次 CAS；post 只有在有线程睡眠时才进入内核，
+并且 post( n ) 一次唤醒至多 n 个线程（sem_post 每次只能加一、唤醒一个）。
+m_value 是可用的计数，m_waiters 是正在睡眠或者准备睡眠的线程数 */
+class futex_sem
+{
+public:
+    explicit futex_sem( int value = 0 ) : m_value( value ), m_waiters( 0 ) {}
+
+    // 等待信号量
+    bool wait(){
+        return wait_until( NULL );
+    }
+
+    // 等待信号量，最多等待 timeout_ms 毫秒，超时（或被信号中断）时返回 false
+    bool timed_wait( long timeout_ms ){
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000L;
+        return wait_until( &ts );
+    }
+
+    // 尝试减少信号量，计数为 0 时立即返回 false
+    bool try_wait()
+    {
+        int v = m_value.load( std::memory_order_relaxed );
+        while( v > 0 )
+        {
+            if( m_value.compare_exchange_weak( v, v - 1, std::memory_order_acquire, std::memory_order_relaxed ) )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 增加信号量 n 次，唤醒至多 n 个等待的线程
+    bool post( int n = 1 ){
+        m_value.fetch_add( n, std::memory_order_release );
+        // 和 wait 中先增加 m_waiters 再检查 m_value 的顺序配对：要么 wait 看到新的计数，要么这里看到等待者
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( m_waiters.load( std::memory_order_relaxed ) > 0 )
+        {
+            futex::wake( &m_value, n );
+        }
+        return true;
+    }
+
+private:
+    // 超时时间是相对的：被唤醒之后没有抢到计数时重新等待完整的 timeout，简化了实现，实际等待时间可能略长
+    bool wait_until( const struct timespec* timeout )
+    {
+        if( try_wait() )
+        {
+            return true;
+        }
+        m_waiters.fetch_add( 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        bool ok = true;
+        while( ! try_wait() )
+        {
+            // 计数仍然为 0 才睡眠，post 在这之间增加了计数时 futex 立即返回 EAGAIN
+            if( futex::wait( &m_value, 0, timeout ) != 0 && ( errno == ETIMEDOUT || errno == EINTR ) )
+            {
+                ok = try_wait();
+                break;
+            }
+        }
+        m_waiters.fetch_sub( 1, std::memory_order_relaxed );
+        return ok;
+    }
+
+    std::atomic< int > m_value;
+    std::atomic< int > m_waiters;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <atomic>
+
+#include "chapter14/14_2_locker.h"
+
+/* 同步原语的竞争测试：同样的工作分别用 locker 和 spin_locker、locker 和 rw_locker 和 seqlock、sem 和 futex_sem 完成，
+比较每次操作的平均耗时和每次操作的自愿上下文切换数（睡眠的次数）。
+编译：g++ -std=c++11 -O2 -I.. 14_7_lock_bench.cpp -o lock_bench -lpthread
+加上 -DLOCK_PROFILE 编译时，sem 和 locker 的结果就是开启竞争统计之后的开销，结束时输出统计
+运行：./lock_bench [线程数] [每个线程的操作数] */
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 整个进程（所有线程）累计的自愿上下文切换数
+static long voluntary_switches()
+{
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    return usage.ru_nvcsw;
+}
+
+static int thread_number = 4;
+static long iterations = 1000000;
+
+/* 启动 thread_number 个线程执行 body( index )，等它们全部结束，输出结果 */
+static void run( const char* name, void* ( *body )( void* ), long ops )
+{
+    pthread_t tids[ 64 ];
+    long switches = voluntary_switches();
+    long long start = now_ns();
+    for( long i = 0; i < thread_number; ++i )
+    {
+        pthread_create( &tids[i], NULL, body, ( void* )i );
+    }
+    for( int i = 0; i < thread_number; ++i )
+    {
+        pthread_join( tids[i], NULL );
+    }
+    long long ns = now_ns() - start;
+    switches = voluntary_switches() - switches;
+    printf( "%-32s %10ld ops  %8.1f ns/op  %7.4f sleeps/op\n", name, ops, ( double )ns / ops, ( double )switches / ops );
+}
+
+/* 1. 互斥锁：所有线程反复在锁内增加同一个计数器，临界区只有几条指令 */
+static locker mutex_lock;
+static spin_locker spin_lock;
+static long counter = 0;
+
+static void* mutex_body( void* )
+{
+    for( long i = 0; i < iterations; ++i )
+    {
+        mutex_lock.lock();
+        ++counter;
+        mutex_lock.unlock();
+    }
+    return NULL;
+}
+
+static void* spin_body( void* )
+{
+    for( long i = 0; i < iterations; ++i )
+    {
+        spin_lock.lock();
+        ++counter;
+        spin_lock.unlock();
+    }
+    return NULL;
+}
+
+/* 2. 读多写少：第 0 个线程每 1000 次操作更新一次配置，其余线程读取整个配置并检查它的一致性（各个字段相等） */
+struct config
+{
+    long values[8];
+};
+
+static config shared_config;
+static rw_locker config_rwlock;
+static seqlock config_seqlock;
+static std::atomic< long > torn_reads( 0 );
+
+static void check( const config& c )
+{
+    for( int k = 1; k < 8; ++k )
+    {
+        if( c.values[k] != c.values[0] )
+        {
+            torn_reads.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        }
+    }
+}
+
+static void update( long v )
+{
+    for( int k = 0; k < 8; ++k )
+    {
+        shared_config.values[k] = v;
+    }
+}
+
+static void* config_mutex_body( void* arg )
+{
+    long index = ( long )arg;
+    for( long i = 0; i < iterations; ++i )
+    {
+        mutex_lock.lock();
+        if( index == 0 && i % 1000 == 0 )
+        {
+            update( i );
+        }
+        config copy = shared_config;
+        mutex_lock.unlock();
+        check( copy );
+    }
+    return NULL;
+}
+
+static void* config_rwlock_body( void* arg )
+{
+    long index = ( long )arg;
+    for( long i = 0; i < iterations; ++i )
+    {
+        if( index == 0 && i % 1000 == 0 )
+        {
+            config_rwlock.wrlock();
+            update( i );
+            config_rwlock.unlock();
+        }
+        config_rwlock.rdlock();
+        config copy = shared_config;
+        config_rwlock.unlock();
+        check( copy );
+    }
+    return NULL;
+}
+
+/* 顺序锁保护的数据会被读者和写者同时访问，这里逐个字段用 relaxed 的原子操作读写，避免 C++ 意义上的数据竞争 */
+static void seq_update( long v )
+{
+    for( int k = 0; k < 8; ++k )
+    {
+        __atomic_store_n( &shared_config.values[k], v, __ATOMIC_RELAXED );
+    }
+}
+
+static void* config_seqlock_body( void* arg )
+{
+    long index = ( long )arg;
+    for( long i = 0; i < iterations; ++i )
+    {
+        if( index == 0 && i % 1000 == 0 )
+        {
+            config_seqlock.write_lock();
+            seq_update( i );
+            config_seqlock.write_unlock();
+        }
+        config copy;
+        unsigned seq;
+        do
+        {
+            seq = config_seqlock.read_begin();
+            for( int k = 0; k < 8; ++k )
+            {
+                copy.values[k] = __atomic_load_n( &shared_config.values[k], __ATOMIC_RELAXED );
+            }
+        } while( config_seqlock.read_retry( seq ) );
+        check( copy );
+    }
+    return NULL;
+}
+
+/* 3. 信号量：线程两两配对做乒乓，偶数号线程 post 对方的信号量然后等待自己的，奇数号线程相反。每次交接都必须唤醒睡眠的线程 */
+static sem* sems[ 64 ];
+static futex_sem* futex_sems[ 64 ];
+
+static void* sem_body( void* arg )
+{
+    long index = ( long )arg;
+    long peer = index ^ 1;
+    for( long i = 0; i < iterations / 10; ++i )
+    {
+        if( index & 1 )
+        {
+            sems[ index ]->wait();
+            sems[ peer ]->post();
+        }
+        else
+        {
+            sems[ peer ]->post();
+            sems[ index ]->wait();
+        }
+    }
+    return NULL;
+}
+
+static void* futex_sem_body( void* arg )
+{
+    long index = ( long )arg;
+    long peer = index ^ 1;
+    for( long i = 0; i < iterations / 10; ++i )
+    {
+        if( index & 1 )
+        {
+            futex_sems[ index ]->wait();
+            futex_sems[ peer ]->post();
+        }
+        else
+        {
+            futex_sems[ peer ]->post();
+            futex_sems[ index ]->wait();
+        }
+    }
+    return NULL;
+}
+
+/* 4. 没有竞争的信号量：一个线程连续 post 再 wait，只有用户态的快速路径 */
+static void* sem_fast_body( void* arg )
+{
+    sem* s = sems[ ( long )arg ];
+    for( long i = 0; i < iterations; ++i )
+    {
+        s->post();
+        s->wait();
+    }
+    return NULL;
+}
+
+static void* futex_sem_fast_body( void* arg )
+{
+    futex_sem* s = futex_sems[ ( long )arg ];
+    for( long i = 0; i < iterations; ++i )
+    {
+        s->post();
+        s->wait();
+    }
+    return NULL;
+}
+
+int main( int argc, char* argv[] )
+{
+    thread_number = ( argc > 1 ) ? atoi( argv[1] ) : 4;
+    iterations = ( argc > 2 ) ? atol( argv[2] ) : 1000000;
+    if( thread_number <= 0 || thread_number > 64 || ( thread_number & 1 ) || iterations <= 0 )
+    {
+        printf( "usage: %s [threads (even, at most 64)] [iterations per thread]\n", basename( argv[0] ) );
+        return 1;
+    }
+    long ops = thread_number * iterations;
+    printf( "%d threads, %ld iterations per thread, %ld online cpus\n", thread_number, iterations, sysconf( _SC_NPROCESSORS_ONLN ) );
+
+    counter = 0;
+    run( "locker (pthread mutex)", mutex_body, ops );
+    run( "spin_locker (spin + futex)", spin_body, ops );
+    printf( "counter: %ld (expected %ld)\n", counter, 2 * ops );
+
+    run( "read-mostly: locker", config_mutex_body, ops );
+    run( "read-mostly: rw_locker", config_rwlock_body, ops );
+    run( "read-mostly: seqlock", config_seqlock_body, ops );
+    printf( "torn reads: %ld\n", torn_reads.load() );
+
+    for( int i = 0; i < thread_number; ++i )
+    {
+        sems[i] = new sem;
+        futex_sems[i] = new futex_sem;
+    }
+    run( "ping-pong: sem", sem_body, ops / 10 );
+    run( "ping-pong: futex_sem", futex_sem_body, ops / 10 );
+    run( "uncontended post+wait: sem", sem_fast_body, ops );
+    run( "uncontended post+wait: futex_sem", futex_sem_fast_body, ops );
+#ifdef LOCK_PROFILE
+    lock_profile::dump( stdout );
+#endif
+    for( int i = 0; i < thread_number; ++i )
+    {
+        delete sems[i];
+        delete futex_sems[i];
+    }
+    return 0;
+}
@@ -0,0 +1,222 @@
+#ifndef CYCLE_CLOCK_H
+#define CYCLE_CLOCK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+
+/* 计时的基础设施：基于时间戳计数器的时钟和延迟直方图。锁的竞争统计（14_2_locker.h）、线程池的运行统计和请求跟踪（第 15 章）都使用它们，
+所以它们放在这里，不依赖任何上层的模块 */
+
+/* 基于时间戳计数器的单调时钟。x86 上的不变 TSC（constant_tsc 和 nonstop_tsc）频率固定、各个 CPU 同步，
+读一次只要几纳秒，而 clock_gettime 即使走 vDSO 也要二三十纳秒。第一次使用时用 CLOCK_MONOTONIC 校准一次，
+没有不变 TSC 或者不是 x86 时退回到 clock_gettime */
+class cycle_clock
+{
+public:
+    /* 当前时间（纳秒），和 CLOCK_MONOTONIC 的起点相同 */
+    static long long now_ns()
+    {
+#if defined( __x86_64__ ) || defined( __i386__ )
+        const calibration& c = get();
+        if( c.tsc )
+        {
+            return c.ns0 + ( long long )( ( __rdtsc() - c.tick0 ) * c.ns_per_tick );
+        }
+#endif
+        return monotonic_ns();
+    }
+
+    /* 是否使用时间戳计数器 */
+    static bool uses_tsc() { return get().tsc; }
+
+private:
+    struct calibration
+    {
+        bool tsc;
+        unsigned long long tick0;
+        long long ns0;
+        double ns_per_tick;
+    };
+
+    static long long monotonic_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    /* /proc/cpuinfo 的 flags 中同时有 constant_tsc 和 nonstop_tsc */
+    static bool invariant_tsc()
+    {
+        FILE* fp = fopen( "/proc/cpuinfo", "r" );
+        if( ! fp )
+        {
+            return false;
+        }
+        bool found = false;
+        char line[ 4096 ];
+        while( fgets( line, sizeof( line ), fp ) )
+        {
+            if( strncmp( line, "flags", 5 ) == 0 )
+            {
+                found = strstr( line, " constant_tsc" ) && strstr( line, " nonstop_tsc" );
+                break;
+            }
+        }
+        fclose( fp );
+        return found;
+    }
+
+    /* 校准结果在第一次调用时计算，之后只读。校准用 10 毫秒，在线程池的构造函数中完成，不会落在处理请求的路径上 */
+    static const calibration& get()
+    {
+        static const calibration c = calibrate();
+        return c;
+    }
+
+    static calibration calibrate()
+    {
+        calibration c;
+        c.tsc = false;
+        c.tick0 = 0;
+        c.ns0 = 0;
+        c.ns_per_tick = 1.0;
+#if defined( __x86_64__ ) || defined( __i386__ )
+        if( invariant_tsc() )
+        {
+            c.ns0 = monotonic_ns();
+            c.tick0 = __rdtsc();
+            long long ns = 0;
+            while( ( ns = monotonic_ns() - c.ns0 ) < 10000000LL )
+            {
+            }
+            unsigned long long ticks = __rdtsc() - c.tick0;
+            if( ticks > 0 )
+            {
+                c.ns_per_tick = ( double )ns / ticks;
+                c.tsc = true;
+            }
+        }
+#endif
+        return c;
+    }
+};
+
+/* 对数分桶的延迟直方图（纳秒）：每个 2 的幂区间再等分成 4 个桶，相对误差不超过 25%，覆盖到约 18 分钟。
+record 只能由一个线程调用（计数只是普通的读加写，没有原子的读改写）；其他线程随时可以用 merge 读取一份快照 */
+class latency_histogram
+{
+public:
+    static const int SUB_BUCKETS = 4;
+    static const int BUCKETS = 40 * SUB_BUCKETS;
+
+    latency_histogram() : m_sum( 0 )
+    {
+        for( int i = 0; i < BUCKETS; ++i )
+        {
+            m_buckets[i].store( 0, std::memory_order_relaxed );
+        }
+    }
+
+    void record( long long ns )
+    {
+        if( ns < 0 )
+        {
+            ns = 0;
+        }
+        std::atomic< long >& b = m_buckets[ bucket_of( ns ) ];
+        b.store( b.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+        m_sum.store( m_sum.load( std::memory_order_relaxed ) + ns, std::memory_order_relaxed );
+    }
+
+    /* 把 other 的计数加到这个直方图上。这个直方图必须只被调用者使用（例如一份快照） */
+    void merge( const latency_histogram& other )
+    {
+        for( int i = 0; i < BUCKETS; ++i )
+        {
+            long n = other.m_buckets[i].load( std::memory_order_relaxed );
+            m_buckets[i].store( m_buckets[i].load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+        }
+        m_sum.store( m_sum.load( std::memory_order_relaxed ) + other.m_sum.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+    }
+
+    long count() const
+    {
+        long n = 0;
+        for( int i = 0; i < BUCKETS; ++i )
+        {
+            n += m_buckets[i].load( std::memory_order_relaxed );
+        }
+        return n;
+    }
+
+    long long sum_ns() const { return m_sum.load( std::memory_order_relaxed ); }
+
+    /* 第 p 百分位数（0 到 100）所在的桶的上界 */
+    long long percentile( double p ) const
+    {
+        long total = count();
+        if( total == 0 )
+        {
+            return 0;
+        }
+        long rank = ( long )( total * p / 100.0 );
+        if( rank >= total )
+        {
+            rank = total - 1;
+        }
+        long seen = 0;
+        for( int i = 0; i < BUCKETS; ++i )
+        {
+            seen += m_buckets[i].load( std::memory_order_relaxed );
+            if( seen > rank )
+            {
+                return upper_bound( i );
+            }
+        }
+        return upper_bound( BUCKETS - 1 );
+    }
+
+    /* 输出一行摘要，时间单位为微秒 */
+    void print( FILE* fp, const char* name ) const
+    {
+        long n = count();
+        fprintf( fp, "%s: count %ld, mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, p99.9 %.1fus\n", name, n,
+                 n ? sum_ns() / 1000.0 / n : 0.0, percentile( 50 ) / 1000.0, percentile( 90 ) / 1000.0,
+                 percentile( 99 ) / 1000.0, percentile( 99.9 ) / 1000.0 );
+    }
+
+private:
+    /* 小于 4 的值各占一个桶；其余的值按最高位 msb 和其后的两位分桶 */
+    static int bucket_of( long long ns )
+    {
+        if( ns < SUB_BUCKETS )
+        {
+            return ( int )ns;
+        }
+        int msb = 63 - __builtin_clzll( ( unsigned long long )ns );
+        int index = ( msb - 1 ) * SUB_BUCKETS + ( int )( ( ns >> ( msb - 2 ) ) & ( SUB_BUCKETS - 1 ) );
+        return ( index < BUCKETS ) ? index : BUCKETS - 1;
+    }
+
+    static long long upper_bound( int index )
+    {
+        if( index < SUB_BUCKETS )
+        {
+            return index;
+        }
+        int msb = index / SUB_BUCKETS + 1;
+        long long lower = ( long long )( SUB_BUCKETS + index % SUB_BUCKETS ) << ( msb - 2 );
+        return lower + ( 1LL << ( msb - 2 ) ) - 1;
+    }
+
+    std::atomic< long > m_buckets[ BUCKETS ];
+    std::atomic< long long > m_sum;
+};
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "chapter14/14_2_locker.h"
+
+/* 上游服务器的地址。配置文件中写作 "unix:/run/app.sock" 或 "127.0.0.1:8080"，name 保存原始写法，同时用作连接池的键 */
+struct upstream
+{
+    static const int NAME_LEN = 128;
+
+    char name[ NAME_LEN ];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    /* 解析上游地址，格式错误时返回 false */
+    static bool parse( const char* spec, upstream* u )
+    {
+        if( strlen( spec ) >= ( size_t )NAME_LEN )
+        {
+            return false;
+        }
+        memset( u, 0, sizeof( *u ) );
+        strcpy( u->name, spec );
+        if( strncmp( spec, "unix:", 5 ) == 0 )
+        {
+            struct sockaddr_un* un = ( struct sockaddr_un* )&u->addr;
+            const char* path = spec + 5;
+            if( *path != '/' || strlen( path ) >= sizeof( un->sun_path ) )
+            {
+                return false;
+            }
+            un->sun_family = AF_UNIX;
+            strcpy( un->sun_path, path );
+            u->addrlen = sizeof( struct sockaddr_un );
+            return true;
+        }
+        const char* colon = strrchr( spec, ':' );
+        if( ! colon || colon - spec >= INET_ADDRSTRLEN || atoi( colon + 1 ) <= 0 )
+        {
+            return false;
+        }
+        char ip[ INET_ADDRSTRLEN ];
+        memcpy( ip, spec, colon - spec );
+        ip[ colon - spec ] = '\0';
+        struct sockaddr_in* in = ( struct sockaddr_in* )&u->addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons( atoi( colon + 1 ) );
+        if( inet_pton( AF_INET, ip, &in->sin_addr ) != 1 )
+        {
+            return false;
+        }
+        u->addrlen = sizeof( struct sockaddr_in );
+        return true;
+    }
+};
+
+/* 上游长连接池。每个事件循环有一个连接池：共享事件表的 oneshot 和领导者/追随者模式共用一个，连接归属模式下每个拥有者线程一个。
+上游连接的事件注册在客户连接所在的事件表中，所以连接总是归还到这个事件循环的池中，之后由处理这个事件循环的任何线程取出复用。
+oneshot 模式下取出连接的是工作线程，归还连接的是主线程，所以存取都要加锁；锁内只操作数组，检查连接是否失效的 recv 在锁外进行。
+池中的连接都是非阻塞的。 */
+class upstream_pool
+{
+public:
+    // 每个连接池最多保留的空闲连接数，超过时关闭最早归还的连接
+    static const int MAX_IDLE = 32;
+    // 空闲连接的最长保留时间（秒），上游服务器通常会关闭空闲太久的连接
+    static const int IDLE_TIMEOUT = 30;
+    // 新建连接时 SYN 的最大重传次数。内核默认重传 6 次，上游主机不可达时要两分钟才失败；重传 2 次约 7 秒后失败
+    static const int SYN_RETRIES = 2;
+
+private:
+    struct idle_conn
+    {
+        char name[ upstream::NAME_LEN ];
+        int fd;
+        time_t since;
+    };
+
+public:
+    upstream_pool() : m_count( 0 )
+    {
+        m_lock.set_name( "upstream pool" );
+    }
+    ~upstream_pool()
+    {
+        for( int i = 0; i < m_count; ++i )
+        {
+            close( m_idle[i].fd );
+        }
+    }
+
+    /* 取出一个到 u 的空闲连接，优先使用最近归还的连接。没有可用的空闲连接时返回 -1，由调用者用 connect_to 新建连接 */
+    int acquire( const upstream& u )
+    {
+        time_t now = time( NULL );
+        while( true )
+        {
+            m_lock.lock();
+            int i = m_count - 1;
+            while( i >= 0 && strcmp( m_idle[i].name, u.name ) != 0 )
+            {
+                --i;
+            }
+            if( i < 0 )
+            {
+                m_lock.unlock();
+                return -1;
+            }
+            int fd = m_idle[i].fd;
+            bool expired = ( now - m_idle[i].since > IDLE_TIMEOUT );
+            remove( i );
+            m_lock.unlock();
+
+            // 空闲期间上游关闭了连接（读到 EOF）或者发来了多余的数据，这个连接都不能再用
+            char c;
+            if( expired || recv( fd, &c, 1, MSG_PEEK | MSG_DONTWAIT ) >= 0 || errno != EAGAIN )
+            {
+                close( fd );
+                continue;
+            }
+            return fd;
+        }
+    }
+
+    /* 把应答已经读完的连接归还到池中 */
+    void release( const upstream& u, int fd )
+    {
+        int evicted = -1;
+        m_lock.lock();
+        if( m_count == MAX_IDLE )
+        {
+            evicted = m_idle[0].fd;
+            remove( 0 );
+        }
+        strcpy( m_idle[ m_count ].name, u.name );
+        m_idle[ m_count ].fd = fd;
+        m_idle[ m_count ].since = time( NULL );
+        ++m_count;
+        m_lock.unlock();
+        if( evicted >= 0 )
+        {
+            close( evicted );
+        }
+    }
+
+    /* 发起一个到 u 的非阻塞连接，不等待连接建立。连接立即建立时（例如 Unix 域 socket）*connected 为 true，
+    否则等到 fd 可写之后用 connect_error 取得连接的结果。失败时返回 -1 */
+    static int connect_to( const upstream& u, bool* connected )
+    {
+        int fd = socket( u.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+        if( fd < 0 )
+        {
+            return -1;
+        }
+        if( u.addr.ss_family == AF_INET )
+        {
+            int retries = SYN_RETRIES;
+            setsockopt( fd, IPPROTO_TCP, TCP_SYNCNT, &retries, sizeof( retries ) );
+        }
+        *connected = ( connect( fd, ( const struct sockaddr* )&u.addr, u.addrlen ) == 0 );
+        if( ! *connected && errno != EINPROGRESS )
+        {
+            close( fd );
+            return -1;
+        }
+        return fd;
+    }
+
+    /* 正在进行的连接的结果：0 表示连接已经建立，否则是连接失败的错误码 */
+    static int connect_error( int fd )
+    {
+        int error = 0;
+        socklen_t len = sizeof( error );
+        if( getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &len ) < 0 )
+        {
+            return errno;
+        }
+        return error;
+    }
+
+    /* 不等待地检查 fd 上是否已经发生了 events 中的事件（或者出错、对方关闭） */
+    static bool ready( int fd, short events )
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        return poll( &pfd, 1, 0 ) > 0;
+    }
+
+private:
+    void remove( int i )
+    {
+        memmove( m_idle + i, m_idle + i + 1, ( m_count - i - 1 ) * sizeof( idle_conn ) );
+        --m_count;
+    }
+
+private:
+    // 保护空闲连接数组
+    locker m_lock;
+    // 空闲连接，按归还的先后顺序排列
+    idle_conn m_idle[ MAX_IDLE ];
+    int m_count;
+};
+
+#endif
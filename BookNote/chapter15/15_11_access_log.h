@@ -0,0 +1,309 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <exception>
+#include <atomic>
+#include "chapter14/14_2_locker.h"
+
+/* 一条访问日志记录。记录是定长的，写入环形缓冲时只需要一次 memcpy，格式化留给后台线程 */
+struct access_record
+{
+    static const int HOST_LEN = 48;
+    static const int URL_LEN = 160;
+
+    // 应答发送完的时间（CLOCK_REALTIME，纳秒）和请求的处理时长（微秒）
+    long long time_ns;
+    long long duration_us;
+    // 应答的总字节数（头部加消息体）
+    long long bytes;
+    // 客户端地址
+    struct in_addr addr;
+    unsigned short port;
+    // 状态码和请求方法
+    unsigned short status;
+    const char* method;
+    // Host 和 URL，超长时截断
+    char host[ HOST_LEN ];
+    char url[ URL_LEN ];
+};
+
+/* 异步访问日志：每个工作线程把记录写入自己的单生产者单消费者环形缓冲，不需要加锁；后台线程定期取出所有缓冲中的记录，
+格式化之后用一次 writev 写入日志文件。缓冲满时丢弃记录并计数，写日志永远不会阻塞工作线程。
+线程退出时它的环形缓冲交还给日志对象，由之后的新线程继续使用，弹性伸缩反复创建线程也不会用完环形缓冲 */
+class access_log
+{
+public:
+    // 每个环形缓冲的记录数，必须是 2 的幂
+    static const int RING_SIZE = 1024;
+    // 最多同时写日志的线程数，超出的线程写入的记录都被丢弃
+    static const int MAX_RINGS = 128;
+    // 后台线程在没有记录时的休眠时间（毫秒）
+    static const int FLUSH_INTERVAL = 10;
+    // 每条记录格式化之后的最大长度
+    static const int LINE_LEN = 320;
+
+private:
+    // 环形缓冲的状态：没有线程使用、正在被一个线程使用、日志对象已经析构而线程还在使用（由线程退出时释放）
+    enum ring_state { RING_FREE = 0, RING_USED, RING_ORPHANED };
+
+    /* 一个线程的环形缓冲。head 和 dropped 只由生产者（工作线程）修改，tail 只由消费者（后台线程）修改，
+    两者之间隔开一个缓存行，避免生产者和消费者互相使对方的缓存行失效。用填充而不是 alignas( 64 )：
+    C++17 之前 new 不保证超过 16 字节的对齐 */
+    struct ring
+    {
+        std::atomic< unsigned long > head;
+        std::atomic< unsigned long > dropped;
+        char pad_head[ 64 ];
+        std::atomic< unsigned long > tail;
+        char pad_tail[ 64 ];
+        std::atomic< int > state;
+        access_record records[ RING_SIZE ];
+    };
+
+    /* 线程局部的环形缓冲句柄。线程退出时析构，把环形缓冲交还给日志对象 */
+    struct ring_handle
+    {
+        access_log* owner;
+        ring* local;
+
+        ring_handle() : owner( NULL ), local( NULL ) {}
+        ~ring_handle() { release(); }
+
+        /* acq_rel 保证下一个使用者看到这个线程最后写入的 head。日志对象已经析构时由这里释放环形缓冲 */
+        void release()
+        {
+            if( local )
+            {
+                int expected = RING_USED;
+                if( ! local->state.compare_exchange_strong( expected, RING_FREE, std::memory_order_acq_rel ) )
+                {
+                    delete local;
+                }
+                local = NULL;
+            }
+        }
+    };
+
+public:
+    /* 以追加方式打开日志文件 filename 并创建后台线程，失败时抛出异常 */
+    access_log( const char* filename ) : m_ring_count( 0 ), m_overflow( 0 ), m_written( 0 ), m_stop( false )
+    {
+        m_fd = open( filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+        if( m_fd < 0 )
+        {
+            throw std::exception();
+        }
+        m_ringlocker.set_name( "access_log ring" );
+        for( int i = 0; i < MAX_RINGS; ++i )
+        {
+            m_rings[i] = NULL;
+        }
+        m_lines = new char[ MAX_RINGS * RING_SIZE / 8 * LINE_LEN ];
+        if( pthread_create( &m_thread, NULL, worker, this ) != 0 )
+        {
+            delete [] m_lines;
+            close( m_fd );
+            throw std::exception();
+        }
+    }
+
+    /* 停止后台线程，写出剩下的记录。还在被线程使用的环形缓冲由这些线程退出时释放 */
+    ~access_log()
+    {
+        m_stop = true;
+        pthread_join( m_thread, NULL );
+        while( flush() > 0 ) {}
+        for( int i = 0; i < m_ring_count; ++i )
+        {
+            int expected = RING_USED;
+            if( ! m_rings[i]->state.compare_exchange_strong( expected, RING_ORPHANED, std::memory_order_acq_rel ) )
+            {
+                delete m_rings[i];
+            }
+        }
+        delete [] m_lines;
+        close( m_fd );
+    }
+
+    /* 写入一条记录，由工作线程调用。当前线程的缓冲已满时丢弃该记录，不会等待 */
+    void append( const access_record& record )
+    {
+        ring* r = local_ring();
+        if( ! r )
+        {
+            m_overflow.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        }
+        unsigned long head = r->head.load( std::memory_order_relaxed );
+        if( head - r->tail.load( std::memory_order_acquire ) == RING_SIZE )
+        {
+            r->dropped.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        }
+        r->records[ head & ( RING_SIZE - 1 ) ] = record;
+        // release 保证后台线程看到新的 head 时也能看到完整的记录
+        r->head.store( head + 1, std::memory_order_release );
+    }
+
+    /* 已经写入文件的记录数 */
+    long written() const { return m_written; }
+
+    /* 因为缓冲已满（或者线程太多）而丢弃的记录数 */
+    long dropped() const
+    {
+        long total = m_overflow.load( std::memory_order_relaxed );
+        int count = m_ring_count.load( std::memory_order_acquire );
+        for( int i = 0; i < count; ++i )
+        {
+            total += m_rings[i]->dropped.load( std::memory_order_relaxed );
+        }
+        return total;
+    }
+
+private:
+    /* 返回当前线程的环形缓冲，第一次调用时取出一个已经退出的线程留下的缓冲，没有时创建并登记。
+    只有这时需要加锁，每个线程只发生一次。留下的缓冲中还没有写出的记录由后台线程照常写出 */
+    ring* local_ring()
+    {
+        static thread_local ring_handle handle;
+        if( handle.owner == this )
+        {
+            return handle.local;
+        }
+        handle.release();
+        handle.owner = this;
+        m_ringlocker.lock();
+        int count = m_ring_count.load( std::memory_order_relaxed );
+        for( int i = 0; i < count && ! handle.local; ++i )
+        {
+            int expected = RING_FREE;
+            if( m_rings[i]->state.compare_exchange_strong( expected, RING_USED, std::memory_order_acquire ) )
+            {
+                handle.local = m_rings[i];
+            }
+        }
+        if( ! handle.local && count < MAX_RINGS )
+        {
+            ring* r = new ring;
+            r->head = 0;
+            r->tail = 0;
+            r->dropped = 0;
+            r->state = RING_USED;
+            m_rings[ count ] = r;
+            m_ring_count.store( count + 1, std::memory_order_release );
+            handle.local = r;
+        }
+        m_ringlocker.unlock();
+        return handle.local;
+    }
+
+    static void* worker( void* arg )
+    {
+        access_log* log = ( access_log* )arg;
+        while( ! log->m_stop )
+        {
+            if( log->flush() == 0 )
+            {
+                struct timespec ts = { 0, FLUSH_INTERVAL * 1000000L };
+                nanosleep( &ts, NULL );
+            }
+        }
+        return NULL;
+    }
+
+    /* 取出所有环形缓冲中的记录（每个缓冲最多 RING_SIZE / 8 条，避免一个繁忙的线程占满一批），
+    每个缓冲的记录格式化为一段连续的文本，所有缓冲的文本用一次 writev 写入文件。返回写出的记录数 */
+    int flush()
+    {
+        struct iovec iov[ MAX_RINGS ];
+        int iov_count = 0;
+        int total = 0;
+        int count = m_ring_count.load( std::memory_order_acquire );
+        for( int i = 0; i < count; ++i )
+        {
+            ring* r = m_rings[i];
+            unsigned long tail = r->tail.load( std::memory_order_relaxed );
+            unsigned long head = r->head.load( std::memory_order_acquire );
+            if( head - tail > RING_SIZE / 8 )
+            {
+                head = tail + RING_SIZE / 8;
+            }
+            if( head == tail )
+            {
+                continue;
+            }
+            char* text = m_lines + i * ( RING_SIZE / 8 ) * LINE_LEN;
+            int len = 0;
+            for( ; tail != head; ++tail )
+            {
+                len += format( r->records[ tail & ( RING_SIZE - 1 ) ], text + len );
+                ++total;
+            }
+            // 记录已经格式化，可以让生产者覆盖它们了
+            r->tail.store( tail, std::memory_order_release );
+            iov[ iov_count ].iov_base = text;
+            iov[ iov_count ].iov_len = len;
+            ++iov_count;
+        }
+        if( iov_count > 0 )
+        {
+            // 日志文件是普通文件，writev 一次写完；写失败时（例如磁盘已满）只能放弃这一批记录
+            if( writev( m_fd, iov, iov_count ) < 0 )
+            {
+                return total;
+            }
+            m_written += total;
+        }
+        return total;
+    }
+
+    /* 把一条记录格式化为一行日志，格式与 Common Log Format 相近，最后加上 Host 和处理时长。返回写入的长度 */
+    static int format( const access_record& record, char* line )
+    {
+        char ip[ INET_ADDRSTRLEN ];
+        inet_ntop( AF_INET, &record.addr, ip, INET_ADDRSTRLEN );
+        time_t sec = record.time_ns / 1000000000LL;
+        struct tm tm;
+        gmtime_r( &sec, &tm );
+        char date[ 32 ];
+        strftime( date, sizeof( date ), "%d/%b/%Y:%H:%M:%S +0000", &tm );
+        int len = snprintf( line, LINE_LEN, "%s:%u [%s] \"%s %s\" %u %lld \"%s\" %lldus\n", ip, record.port, date,
+                            record.method, record.url, record.status, record.bytes, record.host, record.duration_us );
+        if( len >= LINE_LEN )
+        {
+            // 被截断的行也要以换行结束
+            len = LINE_LEN - 1;
+            line[ len - 1 ] = '\n';
+        }
+        return len;
+    }
+
+private:
+    // 日志文件和后台线程
+    int m_fd;
+    pthread_t m_thread;
+    // 已经登记的环形缓冲。数组中的元素只增不减（线程退出时只是把缓冲标记为空闲），后台线程读取 m_ring_count 之后就可以不加锁地访问前面的元素
+    ring* m_rings[ MAX_RINGS ];
+    std::atomic< int > m_ring_count;
+    locker m_ringlocker;
+    // 同时写日志的线程太多、没有分配到环形缓冲的线程丢弃的记录数
+    std::atomic< long > m_overflow;
+    // 已经写入的记录数，只由后台线程修改
+    std::atomic< long > m_written;
+    // 格式化文本的缓冲区，每个环形缓冲占其中的一段
+    char* m_lines;
+    // 是否结束后台线程
+    std::atomic< bool > m_stop;
+};
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* 请求级的跟踪：记录每个线程上带时间戳的区间（读取、入队、解析、查找文件、发送等），退出时导出为 Chrome trace-event JSON，
+可以用 chrome://tracing 或 Perfetto 打开，直观地看到主线程、线程池和 write 对同一个请求的处理是如何交错的。
+只有定义了 HTTP_TRACE 宏时才编译跟踪代码，否则下面的宏都展开为空语句，没有任何开销。 */
+
+#ifdef HTTP_TRACE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include "chapter14/14_2_locker.h"
+#include "chapter14/14_8_cycle_clock.h"
+
+/* 一个跟踪事件。ph 为 'X' 时是一个完整的区间 [start, end)，为 's' 和 'f' 时是连接两个区间的箭头（例如从入队到出队），
+id 把同一个请求的事件关联起来 */
+struct trace_event
+{
+    const char* name;
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long id;
+    char ph;
+};
+
+class tracer
+{
+public:
+    // 每个线程最多记录的事件数，记满之后丢弃后面的事件
+    static const int BUFFER_EVENTS = 1 << 16;
+    // 最多同时跟踪的线程数
+    static const int MAX_THREADS = 128;
+
+private:
+    /* 一个线程的事件缓冲。只有所属线程写入，count 用 release 发布，导出时用 acquire 读取。
+    线程退出时缓冲交还给 tracer，由之后的新线程接着写入，所以导出的一条轨迹可能依次包含几个线程的事件，它们的时间不会重叠 */
+    struct thread_buffer
+    {
+        const char* name;
+        std::atomic< int > count;
+        long dropped;
+        trace_event events[ BUFFER_EVENTS ];
+    };
+
+    /* 线程局部的缓冲句柄，线程退出时析构，把缓冲放进空闲列表 */
+    struct buffer_handle
+    {
+        thread_buffer* buf;
+        bool registered;
+
+        buffer_handle() : buf( NULL ), registered( false ) {}
+        ~buffer_handle()
+        {
+            if( buf )
+            {
+                tracer& t = instance();
+                t.m_lock.lock();
+                t.m_free[ t.m_free_count++ ] = buf;
+                t.m_lock.unlock();
+            }
+        }
+    };
+
+public:
+    /* 开始跟踪，记下开始的时间，导出的时间戳都相对于它 */
+    static void start()
+    {
+        tracer& t = instance();
+        t.m_start_ns = now();
+        t.m_enabled = true;
+    }
+
+    static bool enabled() { return instance().m_enabled.load( std::memory_order_relaxed ); }
+
+    /* 当前时间戳（纳秒）。和线程池的统计使用同一个时钟 cycle_clock：有不变 TSC 时读取时间戳计数器（几纳秒），否则使用单调时钟 */
+    static unsigned long long now()
+    {
+        return cycle_clock::now_ns();
+    }
+
+    /* 设置当前线程在跟踪中显示的名字，name 必须是字符串常量 */
+    static void set_thread_name( const char* name )
+    {
+        thread_buffer* buf = local_buffer();
+        if( buf )
+        {
+            buf->name = name;
+        }
+    }
+
+    /* 记录一个事件 */
+    static void record( const char* name, char ph, unsigned long long start, unsigned long long end, unsigned long long id )
+    {
+        thread_buffer* buf = local_buffer();
+        if( ! buf )
+        {
+            return;
+        }
+        int count = buf->count.load( std::memory_order_relaxed );
+        if( count == BUFFER_EVENTS )
+        {
+            ++buf->dropped;
+            return;
+        }
+        trace_event& e = buf->events[ count ];
+        e.name = name;
+        e.ph = ph;
+        e.start = start;
+        e.end = end;
+        e.id = id;
+        buf->count.store( count + 1, std::memory_order_release );
+    }
+
+    /* 记录从一个区间指向另一个区间的箭头的起点（ph 为 's'）或终点（ph 为 'f'），必须在区间之内调用 */
+    static void flow( const char* name, char ph, unsigned long long id )
+    {
+        if( enabled() )
+        {
+            unsigned long long ts = now();
+            record( name, ph, ts, ts, id );
+        }
+    }
+
+    /* 把所有线程记录的事件以 Chrome trace-event JSON 格式写入 filename */
+    static bool dump( const char* filename )
+    {
+        tracer& t = instance();
+        FILE* fp = fopen( filename, "w" );
+        if( ! fp )
+        {
+            return false;
+        }
+        fprintf( fp, "{\"traceEvents\":[\n" );
+        bool first = true;
+        long dropped = 0;
+        int threads = t.m_thread_count.load( std::memory_order_acquire );
+        for( int tid = 0; tid < threads; ++tid )
+        {
+            thread_buffer* buf = t.m_buffers[ tid ];
+            fprintf( fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                     first ? "" : ",\n", tid, buf->name, tid );
+            first = false;
+            int count = buf->count.load( std::memory_order_acquire );
+            for( int i = 0; i < count; ++i )
+            {
+                const trace_event& e = buf->events[i];
+                double ts = ( double )( long long )( e.start - t.m_start_ns ) / 1000.0;
+                if( e.ph == 'X' )
+                {
+                    double dur = ( double )( e.end - e.start ) / 1000.0;
+                    fprintf( fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%llu}}",
+                             e.name, tid, ts, dur, e.id );
+                }
+                else
+                {
+                    // 箭头的终点绑定到包含它的区间上
+                    fprintf( fp, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%c\",\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%.3f%s}",
+                             e.name, e.ph, e.id, tid, ts, ( e.ph == 'f' ) ? ",\"bp\":\"e\"" : "" );
+                }
+            }
+            dropped += buf->dropped;
+        }
+        fprintf( fp, "\n]}\n" );
+        fclose( fp );
+        if( dropped > 0 )
+        {
+            printf( "trace buffers full, %ld events dropped\n", dropped );
+        }
+        return true;
+    }
+
+private:
+    tracer() : m_enabled( false ), m_start_ns( 0 ), m_thread_count( 0 ), m_free_count( 0 ) {}
+
+    static tracer& instance()
+    {
+        static tracer t;
+        return t;
+    }
+
+    /* 当前线程的事件缓冲，第一次调用时取出一个已经退出的线程留下的缓冲，没有时分配并登记。跟踪没有开启或线程太多时返回 NULL */
+    static thread_buffer* local_buffer()
+    {
+        static thread_local buffer_handle handle;
+        if( handle.registered )
+        {
+            return handle.buf;
+        }
+        tracer& t = instance();
+        if( ! t.m_enabled )
+        {
+            return NULL;
+        }
+        handle.registered = true;
+        t.m_lock.lock();
+        int tid = t.m_thread_count.load( std::memory_order_relaxed );
+        if( t.m_free_count > 0 )
+        {
+            handle.buf = t.m_free[ --t.m_free_count ];
+        }
+        else if( tid < MAX_THREADS )
+        {
+            handle.buf = new thread_buffer;
+            handle.buf->name = "thread";
+            handle.buf->count = 0;
+            handle.buf->dropped = 0;
+            t.m_buffers[ tid ] = handle.buf;
+            t.m_thread_count.store( tid + 1, std::memory_order_release );
+        }
+        t.m_lock.unlock();
+        return handle.buf;
+    }
+
+private:
+    std::atomic< bool > m_enabled;
+    // 开始跟踪的时间（纳秒）
+    unsigned long long m_start_ns;
+    // 已经登记的线程缓冲，只增不减；其中所属线程已经退出的缓冲同时放在 m_free 中，由 m_lock 保护
+    thread_buffer* m_buffers[ MAX_THREADS ];
+    std::atomic< int > m_thread_count;
+    thread_buffer* m_free[ MAX_THREADS ];
+    int m_free_count;
+    locker m_lock;
+};
+
+/* 作用域区间：构造时记下开始时间，析构时记录一个完整的区间 */
+class trace_span
+{
+public:
+    trace_span( const char* name, unsigned long long id ) : m_name( name ), m_id( id ),
+        m_start( tracer::enabled() ? tracer::now() : 0 ) {}
+    ~trace_span()
+    {
+        if( m_start )
+        {
+            tracer::record( m_name, 'X', m_start, tracer::now(), m_id );
+        }
+    }
+
+private:
+    const char* m_name;
+    unsigned long long m_id;
+    unsigned long long m_start;
+};
+
+#define TRACE_CONCAT2( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT2( a, b )
+// 记录从这里到当前作用域结束的区间，id 用来关联同一个请求的事件
+#define TRACE_SPAN( name, id ) trace_span TRACE_CONCAT( trace_span_, __LINE__ )( name, ( unsigned long long )( id ) )
+// 不受作用域限制的区间：TRACE_MARK 记下开始时间，TRACE_SPAN_END 记录区间，适合在区间结束之后才知道 id 的情况
+#define TRACE_MARK( var ) unsigned long long var = tracer::enabled() ? tracer::now() : 0
+#define TRACE_SPAN_END( name, var, id ) \
+    do { if( var ) tracer::record( name, 'X', var, tracer::now(), ( unsigned long long )( id ) ); } while( 0 )
+// 从当前区间画一个箭头到另一个线程中 id 相同的区间，例如从入队到出队
+#define TRACE_FLOW_BEGIN( name, id ) tracer::flow( name, 's', ( unsigned long long )( id ) )
+#define TRACE_FLOW_END( name, id ) tracer::flow( name, 'f', ( unsigned long long )( id ) )
+#define TRACE_THREAD_NAME( name ) tracer::set_thread_name( name )
+
+#else
+
+#define TRACE_SPAN( name, id ) do {} while( 0 )
+#define TRACE_MARK( var ) do {} while( 0 )
+#define TRACE_SPAN_END( name, var, id ) do {} while( 0 )
+#define TRACE_FLOW_BEGIN( name, id ) do {} while( 0 )
+#define TRACE_FLOW_END( name, id ) do {} while( 0 )
+#define TRACE_THREAD_NAME( name ) do {} while( 0 )
+
+#endif
+
+#endif
@@ -0,0 +1,480 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <string.h>
+#include <string>
+#include <deque>
+
+/* HPACK（RFC 7541）：HTTP/2 的头部压缩。解码器维护对端编码器的动态表，完整实现静态表、动态表和 Huffman 解码；
+编码器只输出不加入索引的字面量（名字尽量引用静态表），不使用动态表和 Huffman 编码，所以对端的 SETTINGS_HEADER_TABLE_SIZE 不影响编码。 */
+
+/* 静态表中的一项 */
+struct hpack_field
+{
+    const char* name;
+    const char* value;
+};
+
+class hpack
+{
+public:
+    // 静态表的项数，动态表的索引从 STATIC_TABLE_SIZE + 1 开始
+    static const int STATIC_TABLE_SIZE = 61;
+    // 动态表的默认容量，也就是 SETTINGS_HEADER_TABLE_SIZE 的初始值。服务器不修改这个设置
+    static const int DEFAULT_TABLE_SIZE = 4096;
+
+    /* 静态表，下标 0 不用 */
+    static const hpack_field* static_table()
+    {
+        static const hpack_field table[ STATIC_TABLE_SIZE + 1 ] =
+        {
+            { "", "" },
+            { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+            { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+            { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+            { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+            { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+            { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+            { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+            { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+            { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+            { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+            { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+            { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+            { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+            { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+            { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+            { "www-authenticate", "" }
+        };
+        return table;
+    }
+
+    /* 编码一个整数：first 是第一个字节中整数前缀以外的标志位，prefix 是前缀的位数。返回写入的字节数，空间不足时返回 -1 */
+    static int encode_int( unsigned int value, int prefix, unsigned char first, unsigned char* buf, int len )
+    {
+        unsigned int max = ( 1u << prefix ) - 1;
+        int idx = 0;
+        if( len < 1 )
+        {
+            return -1;
+        }
+        if( value < max )
+        {
+            buf[ idx++ ] = first | value;
+            return idx;
+        }
+        buf[ idx++ ] = first | max;
+        for( value -= max; value >= 128; value >>= 7 )
+        {
+            if( idx == len )
+            {
+                return -1;
+            }
+            buf[ idx++ ] = ( value & 127 ) | 128;
+        }
+        if( idx == len )
+        {
+            return -1;
+        }
+        buf[ idx++ ] = value;
+        return idx;
+    }
+
+    /* 解码一个整数，成功时 *pos 移到整数之后。数据不完整或者整数超过 2^28 时返回 false */
+    static bool decode_int( const unsigned char* buf, int len, int* pos, int prefix, unsigned int* value )
+    {
+        unsigned int max = ( 1u << prefix ) - 1;
+        if( *pos >= len )
+        {
+            return false;
+        }
+        *value = buf[ ( *pos )++ ] & max;
+        if( *value < max )
+        {
+            return true;
+        }
+        for( int shift = 0; *pos < len && shift <= 21; shift += 7 )
+        {
+            unsigned char b = buf[ ( *pos )++ ];
+            *value += ( unsigned int )( b & 127 ) << shift;
+            if( ! ( b & 128 ) )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* 编码一个字符串（不使用 Huffman 编码） */
+    static int encode_string( const char* str, int str_len, unsigned char* buf, int len )
+    {
+        int idx = encode_int( str_len, 7, 0, buf, len );
+        if( idx < 0 || idx + str_len > len )
+        {
+            return -1;
+        }
+        memcpy( buf + idx, str, str_len );
+        return idx + str_len;
+    }
+
+    /* 编码一个头部字段。名字和值都与静态表中的某一项相同时只输出索引，否则输出不加入索引的字面量，名字尽量引用静态表 */
+    static int encode_field( const char* name, const char* value, unsigned char* buf, int len )
+    {
+        const hpack_field* table = static_table();
+        int name_index = 0;
+        for( int i = 1; i <= STATIC_TABLE_SIZE; ++i )
+        {
+            if( strcmp( table[i].name, name ) != 0 )
+            {
+                continue;
+            }
+            if( strcmp( table[i].value, value ) == 0 )
+            {
+                return encode_int( i, 7, 0x80, buf, len );
+            }
+            if( name_index == 0 )
+            {
+                name_index = i;
+            }
+        }
+        int idx = encode_int( name_index, 4, 0x00, buf, len );
+        if( idx > 0 && name_index == 0 )
+        {
+            int ret = encode_string( name, strlen( name ), buf + idx, len - idx );
+            idx = ( ret < 0 ) ? -1 : idx + ret;
+        }
+        if( idx > 0 )
+        {
+            int ret = encode_string( value, strlen( value ), buf + idx, len - idx );
+            idx = ( ret < 0 ) ? -1 : idx + ret;
+        }
+        return idx;
+    }
+
+    /* Huffman 解码，结果写入长度为 len 的 out 中。返回解码得到的长度；编码无效（包含 EOS、填充超过 7 位或者不全为 1）或者结果太长时返回 -1 */
+    static int huffman_decode( const unsigned char* in, int in_len, char* out, int len )
+    {
+        const huffman_tree& tree = decode_tree();
+        int node = 0;
+        int depth = 0;
+        bool ones = true;
+        int idx = 0;
+        for( int i = 0; i < in_len; ++i )
+        {
+            for( int bit = 7; bit >= 0; --bit )
+            {
+                int b = ( in[i] >> bit ) & 1;
+                int next = tree.next[ node ][ b ];
+                ++depth;
+                ones = ones && b;
+                if( next > 0 )
+                {
+                    node = next;
+                    continue;
+                }
+                int symbol = -next - 1;
+                if( symbol == 256 || idx == len )
+                {
+                    return -1;
+                }
+                out[ idx++ ] = symbol;
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+        // 最后一个符号之后的填充是 EOS 编码的前缀，也就是不超过 7 个 1
+        return ( depth <= 7 && ones ) ? idx : -1;
+    }
+
+private:
+    /* Huffman 码表（RFC 7541 附录 B），按符号排列：码字（右对齐）和位数，最后一项是 EOS */
+    struct huffman_code
+    {
+        unsigned int code;
+        int bits;
+    };
+
+    /* 由码表构造的解码树。next[node][bit] 大于 0 时是子节点，小于 0 时是叶子，值为 -( 符号 + 1 ) */
+    struct huffman_tree
+    {
+        short next[ 256 ][ 2 ];
+
+        huffman_tree()
+        {
+            static const huffman_code codes[ 257 ] =
+            {
+                { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+                { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+                { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+                { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+                { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+                { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+                { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+                { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+                { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+                { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+                { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+                { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+                { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+                { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+                { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+                { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+                { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+                { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+                { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+                { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+                { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+                { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+                { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+                { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+                { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+                { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+                { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+                { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+                { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+                { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+                { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+                { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+                { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+                { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+                { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+                { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+                { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+                { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+                { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+                { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+                { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+                { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+                { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+                { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+                { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+                { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+                { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+                { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+                { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+                { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+                { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+                { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+                { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+                { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+                { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+                { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+                { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+                { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+                { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+                { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+                { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+                { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+                { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+                { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+                { 0x3fffffff, 30 },
+            };
+            memset( next, 0, sizeof( next ) );
+            int nodes = 1;
+            for( int symbol = 0; symbol < 257; ++symbol )
+            {
+                int node = 0;
+                for( int bit = codes[ symbol ].bits - 1; bit > 0; --bit )
+                {
+                    int b = ( codes[ symbol ].code >> bit ) & 1;
+                    if( next[ node ][ b ] == 0 )
+                    {
+                        next[ node ][ b ] = nodes++;
+                    }
+                    node = next[ node ][ b ];
+                }
+                next[ node ][ codes[ symbol ].code & 1 ] = -( symbol + 1 );
+            }
+        }
+    };
+
+    /* 解码树在第一次使用时构造，局部静态对象的初始化是线程安全的 */
+    static const huffman_tree& decode_tree()
+    {
+        static const huffman_tree tree;
+        return tree;
+    }
+};
+
+/* HPACK 解码器。每个 HTTP/2 连接有一个，头部块必须按到达的顺序解码，因为每个块都可能修改动态表 */
+class hpack_decoder
+{
+public:
+    // 解码之后单个名字或值的最大长度
+    static const int STRING_LEN = 4096;
+
+    /* 每解码出一个字段调用一次的回调函数。name 和 value 都以 '\0' 结尾，只在回调期间有效 */
+    typedef void ( *field_callback )( const char* name, int name_len, const char* value, int value_len, void* arg );
+
+    hpack_decoder() : m_size( 0 ), m_max_size( hpack::DEFAULT_TABLE_SIZE ) {}
+
+    /* 解码一个完整的头部块。头部块无效时返回 false，这时压缩状态已经与对端不一致，只能关闭连接 */
+    bool decode( const unsigned char* block, int len, field_callback callback, void* arg )
+    {
+        int pos = 0;
+        while( pos < len )
+        {
+            unsigned char first = block[ pos ];
+            unsigned int index = 0;
+            if( first & 0x80 )
+            {
+                // 索引字段：名字和值都来自静态表或动态表
+                if( ! hpack::decode_int( block, len, &pos, 7, &index ) || ! lookup( index, true ) )
+                {
+                    return false;
+                }
+            }
+            else if( ( first & 0xe0 ) == 0x20 )
+            {
+                // 动态表容量更新，不能超过服务器通告的 SETTINGS_HEADER_TABLE_SIZE
+                if( ! hpack::decode_int( block, len, &pos, 5, &index ) || index > ( unsigned int )hpack::DEFAULT_TABLE_SIZE )
+                {
+                    return false;
+                }
+                m_max_size = index;
+                evict( 0 );
+                continue;
+            }
+            else
+            {
+                // 字面量字段：01 开头的加入动态表，0000 和 0001 开头的不加入。索引为 0 时名字也是字面量
+                bool indexing = ( ( first & 0xc0 ) == 0x40 );
+                if( ! hpack::decode_int( block, len, &pos, indexing ? 6 : 4, &index ) )
+                {
+                    return false;
+                }
+                if( index == 0 ? ! decode_string( block, len, &pos, m_name, &m_name_len ) : ! lookup( index, false ) )
+                {
+                    return false;
+                }
+                if( ! decode_string( block, len, &pos, m_value, &m_value_len ) )
+                {
+                    return false;
+                }
+                if( indexing )
+                {
+                    insert();
+                }
+            }
+            callback( m_name, m_name_len, m_value, m_value_len, arg );
+        }
+        return true;
+    }
+
+private:
+    /* 动态表中的一项 */
+    struct entry
+    {
+        std::string name;
+        std::string value;
+    };
+
+    /* 把索引 index 对应的名字（with_value 为 true 时还有值）复制到 m_name 和 m_value 中 */
+    bool lookup( unsigned int index, bool with_value )
+    {
+        const char* name = NULL;
+        const char* value = NULL;
+        if( index == 0 )
+        {
+            return false;
+        }
+        if( index <= ( unsigned int )hpack::STATIC_TABLE_SIZE )
+        {
+            name = hpack::static_table()[ index ].name;
+            value = hpack::static_table()[ index ].value;
+        }
+        else if( index - hpack::STATIC_TABLE_SIZE - 1 < m_table.size() )
+        {
+            const entry& e = m_table[ index - hpack::STATIC_TABLE_SIZE - 1 ];
+            name = e.name.c_str();
+            value = e.value.c_str();
+        }
+        else
+        {
+            return false;
+        }
+        // 动态表中每一项都不超过表的容量，一定放得下
+        m_name_len = strlen( name );
+        memcpy( m_name, name, m_name_len + 1 );
+        if( with_value )
+        {
+            m_value_len = strlen( value );
+            memcpy( m_value, value, m_value_len + 1 );
+        }
+        return true;
+    }
+
+    /* 解码一个字符串到 out 中，*pos 移到字符串之后 */
+    bool decode_string( const unsigned char* block, int len, int* pos, char* out, int* out_len )
+    {
+        if( *pos >= len )
+        {
+            return false;
+        }
+        bool huffman = ( block[ *pos ] & 0x80 );
+        unsigned int length = 0;
+        if( ! hpack::decode_int( block, len, pos, 7, &length ) || length > ( unsigned int )( len - *pos ) )
+        {
+            return false;
+        }
+        if( huffman )
+        {
+            *out_len = hpack::huffman_decode( block + *pos, length, out, STRING_LEN - 1 );
+        }
+        else
+        {
+            *out_len = ( length < ( unsigned int )STRING_LEN ) ? ( int )length : -1;
+            if( *out_len >= 0 )
+            {
+                memcpy( out, block + *pos, length );
+            }
+        }
+        if( *out_len < 0 )
+        {
+            return false;
+        }
+        out[ *out_len ] = '\0';
+        *pos += length;
+        return true;
+    }
+
+    /* 把 m_name 和 m_value 加入动态表的最前面。每一项按名字和值的长度加 32 字节计算大小，比整个表还大的项会清空动态表 */
+    void insert()
+    {
+        int size = m_name_len + m_value_len + 32;
+        evict( size );
+        if( size <= m_max_size )
+        {
+            entry e;
+            e.name.assign( m_name, m_name_len );
+            e.value.assign( m_value, m_value_len );
+            m_table.push_front( e );
+            m_size += size;
+        }
+    }
+
+    /* 从最旧的一项开始淘汰，直到还能放下 size 字节 */
+    void evict( int size )
+    {
+        while( ! m_table.empty() && m_size + size > m_max_size )
+        {
+            const entry& e = m_table.back();
+            m_size -= e.name.size() + e.value.size() + 32;
+            m_table.pop_back();
+        }
+    }
+
+private:
+    // 动态表，最新的一项在最前面；表的当前大小和容量
+    std::deque< entry > m_table;
+    int m_size;
+    int m_max_size;
+    // 正在解码的字段
+    char m_name[ STRING_LEN ];
+    int m_name_len;
+    char m_value[ STRING_LEN ];
+    int m_value_len;
+};
+
+#endif
@@ -0,0 +1,1020 @@
+#ifndef H2_SESSION_H
+#define H2_SESSION_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include "chapter15/15_11_access_log.h"
+#include "chapter15/15_13_hpack.h"
+
+/* HTTP/2 请求中服务器关心的字段，都以 '\0' 结尾，请求中没有的字段为 NULL。只在请求处理函数执行期间有效 */
+struct h2_request
+{
+    const char* method;
+    const char* path;
+    const char* authority;
+    const char* range;
+    const char* if_none_match;
+    const char* if_modified_since;
+};
+
+/* 请求处理函数填写的应答：状态码、额外的头部字段（content-length 由会话根据消息体生成），
+以及消息体。消息体是文件区间 [offset, end)（fd 的所有权交给会话，发送完之后由会话关闭），或者内存中长期有效的 body */
+struct h2_response
+{
+    static const int MAX_HEADERS = 8;
+    static const int VALUE_LEN = 64;
+
+    int status;
+    int fd;
+    off_t offset;
+    off_t end;
+    const char* body;
+    int body_len;
+    int header_count;
+    const char* names[ MAX_HEADERS ];
+    char values[ MAX_HEADERS ][ VALUE_LEN ];
+
+    /* 添加一个头部字段，name 必须是小写的字符串常量 */
+    bool add_header( const char* name, const char* format, ... )
+    {
+        if( header_count == MAX_HEADERS )
+        {
+            return false;
+        }
+        va_list arg_list;
+        va_start( arg_list, format );
+        int len = vsnprintf( values[ header_count ], VALUE_LEN, format, arg_list );
+        va_end( arg_list );
+        if( len >= VALUE_LEN )
+        {
+            return false;
+        }
+        names[ header_count++ ] = name;
+        return true;
+    }
+};
+
+/* 一个 HTTP/2 连接（RFC 7540）的会话：分帧、HPACK 解码、流的管理和流量控制。会话只负责协议本身，
+请求由创建者提供的处理函数（和 acceptor 的回调函数一样是函数指针加参数）同步地转换为应答。
+多个流的应答按轮转的顺序交错成 DATA 帧发送，文件内容仍然用 sendfile 直接从文件发送到 socket。
+会话不是线程安全的，和 http_conn 一样依靠 EPOLLONESHOT 或连接归属保证同一时刻只有一个线程在处理它。 */
+class h2_session
+{
+public:
+    // 请求处理函数
+    typedef void ( *request_handler )( const h2_request& request, h2_response* response, void* arg );
+
+    // 客户端连接前言的长度，以及帧头部的长度
+    static const int PREFACE_LEN = 24;
+    static const int FRAME_HEADER_LEN = 9;
+    // 接收的最大帧长度，也就是 SETTINGS_MAX_FRAME_SIZE 的默认值；发送的 DATA 帧同样不超过这个长度，这是对端一定能接收的
+    static const int MAX_FRAME_SIZE = 16384;
+    // 每个连接上同时打开的流的最大数目，通过 SETTINGS_MAX_CONCURRENT_STREAMS 通告给客户端
+    static const int MAX_STREAMS = 100;
+    // 流量控制窗口的初始值和最大值
+    static const int DEFAULT_WINDOW = 65535;
+    static const long long MAX_WINDOW = 0x7fffffff;
+    // 输入缓冲至少能放下两个最大的帧；输出缓冲存放控制帧、HEADERS 帧和 DATA 帧的头部
+    static const int INPUT_SIZE = 2 * ( FRAME_HEADER_LEN + MAX_FRAME_SIZE );
+    static const int OUTPUT_SIZE = 32768;
+    // 一个头部块（HEADERS 加上 CONTINUATION）的最大长度，以及请求中保存的字段值的总长度
+    static const int HEADER_BLOCK_SIZE = 16384;
+    static const int FIELDS_SIZE = 4096;
+
+    // 帧类型
+    enum FRAME_TYPE { DATA = 0, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION };
+    // 帧标志
+    enum FRAME_FLAG { FLAG_ACK = 0x1, FLAG_END_STREAM = 0x1, FLAG_END_HEADERS = 0x4, FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20 };
+    // 错误码
+    enum ERROR_CODE { NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT, STREAM_CLOSED,
+                      FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM };
+    // 设置项
+    enum SETTING { SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS,
+                   SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE };
+
+    /* 客户端连接前言 */
+    static const char* preface() { return "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"; }
+
+private:
+    /* 一个流。id 为 0 表示空闲的槽位 */
+    struct stream
+    {
+        unsigned int id;
+        // 发送窗口。对端减小 SETTINGS_INITIAL_WINDOW_SIZE 时可能成为负数
+        long long window;
+        // 尚未发送的消息体：文件区间 [offset, end) 或者内存中的 body
+        int fd;
+        off_t offset;
+        off_t end;
+        const char* body;
+        int body_len;
+        // 访问日志：开始处理请求的时间（CLOCK_MONOTONIC，纳秒）和已经填好请求信息的记录
+        long long start_ns;
+        access_record record;
+    };
+
+public:
+    /* 在连接 sockfd 上创建会话，并把服务器的 SETTINGS 放入输出缓冲，它是服务器连接前言，必须是发送的第一个帧。
+    log 不为空时每个流结束时写一条访问日志 */
+    h2_session( int sockfd, const sockaddr_in& addr, request_handler handler, void* arg, access_log* log )
+        : m_sockfd( sockfd ), m_address( addr ), m_handler( handler ), m_arg( arg ), m_log( log ),
+          m_preface_left( PREFACE_LEN ), m_in_len( 0 ), m_out_len( 0 ), m_out_sent( 0 ),
+          m_frame_stream( NULL ), m_frame_left( 0 ), m_frame_barrier( 0 ), m_block_len( 0 ), m_block_stream( 0 ),
+          m_host( NULL ), m_last_stream( 0 ), m_active( 0 ), m_next( 0 ), m_window( DEFAULT_WINDOW ),
+          m_initial_window( DEFAULT_WINDOW ), m_closing( false ), m_broken( false ), m_peer_goaway( false )
+    {
+        for( int i = 0; i < MAX_STREAMS; ++i )
+        {
+            m_streams[i].id = 0;
+            m_streams[i].fd = -1;
+        }
+        unsigned char settings[ 6 ];
+        put_setting( settings, SETTINGS_MAX_CONCURRENT_STREAMS, MAX_STREAMS );
+        queue_frame( SETTINGS, 0, 0, settings, sizeof( settings ) );
+    }
+
+    ~h2_session()
+    {
+        for( int i = 0; i < MAX_STREAMS; ++i )
+        {
+            if( m_streams[i].fd >= 0 )
+            {
+                close( m_streams[i].fd );
+            }
+        }
+    }
+
+    /* 放入切换协议之前已经读入的数据，数据太多时返回 false */
+    bool feed( const char* data, int len )
+    {
+        if( len > INPUT_SIZE - m_in_len )
+        {
+            return false;
+        }
+        memcpy( m_in + m_in_len, data, len );
+        m_in_len += len;
+        return true;
+    }
+
+    /* 通过 HTTP/1.1 的 Upgrade 切换到 HTTP/2：settings 是 HTTP2-Settings 字段的值（base64url 编码的 SETTINGS 帧负载），
+    升级前的请求成为流 1，它已经处于半关闭（远端）状态。字段无效时返回 false */
+    bool upgrade( const char* settings, const h2_request& request )
+    {
+        unsigned char payload[ 256 ];
+        int len = base64url_decode( settings, payload, sizeof( payload ) );
+        if( len < 0 || len % 6 != 0 || ! apply_settings( payload, len ) )
+        {
+            return false;
+        }
+        m_last_stream = 1;
+        open_stream( 1, request );
+        return true;
+    }
+
+    /* 循环读取数据直到没有数据可读。输入缓冲已满时停止读取，*more 置为 true，处理完缓冲中的帧之后应该继续读。
+    对方关闭连接或者出错时返回 false */
+    bool read( bool* more )
+    {
+        *more = false;
+        while( true )
+        {
+            if( m_in_len == INPUT_SIZE )
+            {
+                *more = true;
+                return true;
+            }
+            int ret = recv( m_sockfd, m_in + m_in_len, INPUT_SIZE - m_in_len, 0 );
+            if( ret < 0 )
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if( ret == 0 )
+            {
+                return false;
+            }
+            m_in_len += ret;
+        }
+    }
+
+    /* 处理输入缓冲中所有完整的帧，需要发送的应答和控制帧都放入输出缓冲，由 write 发送 */
+    void process()
+    {
+        int pos = 0;
+        if( m_preface_left > 0 )
+        {
+            int len = ( m_in_len < m_preface_left ) ? m_in_len : m_preface_left;
+            if( memcmp( m_in, preface() + PREFACE_LEN - m_preface_left, len ) != 0 )
+            {
+                // 对方说的不是 HTTP/2，不必发送 GOAWAY
+                m_broken = true;
+                return;
+            }
+            m_preface_left -= len;
+            pos = len;
+        }
+        while( ! m_closing && m_in_len - pos >= FRAME_HEADER_LEN )
+        {
+            const unsigned char* header = ( const unsigned char* )m_in + pos;
+            int len = ( header[0] << 16 ) | ( header[1] << 8 ) | header[2];
+            if( len > MAX_FRAME_SIZE )
+            {
+                connection_error( FRAME_SIZE_ERROR );
+                break;
+            }
+            if( m_in_len - pos < FRAME_HEADER_LEN + len )
+            {
+                break;
+            }
+            unsigned int id = get_u32( header + 5 ) & 0x7fffffff;
+            handle_frame( header[3], header[4], id, header + FRAME_HEADER_LEN, len );
+            pos += FRAME_HEADER_LEN + len;
+        }
+        // 出错之后对方发来的数据都不再处理
+        if( m_closing )
+        {
+            pos = m_in_len;
+        }
+        memmove( m_in, m_in + pos, m_in_len - pos );
+        m_in_len -= pos;
+    }
+
+    /* 发送输出缓冲中的帧，并从有数据、有窗口的流中轮流取出 DATA 帧发送。
+    返回 1 表示当前能发送的数据都已经发送完（剩下的流在等待对方的 WINDOW_UPDATE），0 表示 socket 发送缓冲已满，-1 表示出错 */
+    int write()
+    {
+        if( m_broken )
+        {
+            return -1;
+        }
+        while( true )
+        {
+            // DATA 帧的负载必须紧跟在它的头部之后，所以负载发送完之前只发送到该头部为止，之后放入的控制帧排在负载后面
+            int limit = m_frame_stream ? m_frame_barrier : m_out_len;
+            if( m_out_sent < limit )
+            {
+                int ret = send( m_sockfd, m_out + m_out_sent, limit - m_out_sent, MSG_NOSIGNAL | ( m_frame_stream ? MSG_MORE : 0 ) );
+                if( ret < 0 )
+                {
+                    return ( errno == EAGAIN ) ? 0 : -1;
+                }
+                m_out_sent += ret;
+                continue;
+            }
+            if( m_frame_stream )
+            {
+                int ret = send_payload();
+                if( ret <= 0 )
+                {
+                    return ret;
+                }
+                continue;
+            }
+            if( m_out_sent == m_out_len )
+            {
+                m_out_sent = m_out_len = 0;
+            }
+            if( m_closing )
+            {
+                return 1;
+            }
+            stream* s = next_stream( true );
+            if( ! s || ! start_data( s ) )
+            {
+                return 1;
+            }
+        }
+    }
+
+    /* 是否有可以立即发送的数据 */
+    bool want_write()
+    {
+        return m_broken || m_out_sent < m_out_len || m_frame_stream || ( ! m_closing && next_stream( false ) );
+    }
+
+    /* 会话已经结束，应该关闭连接：出错（GOAWAY 已经发出），或者对方发来 GOAWAY 之后所有的流都已经完成 */
+    bool finished() const
+    {
+        if( m_broken )
+        {
+            return true;
+        }
+        return ( m_closing || ( m_peer_goaway && m_active == 0 ) ) && ! m_frame_stream && m_out_sent == m_out_len;
+    }
+
+private:
+    static unsigned int get_u32( const unsigned char* p )
+    {
+        return ( ( unsigned int )p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+    }
+
+    static void put_u32( unsigned char* p, unsigned int value )
+    {
+        p[0] = value >> 24;
+        p[1] = value >> 16;
+        p[2] = value >> 8;
+        p[3] = value;
+    }
+
+    static void put_setting( unsigned char* p, int id, unsigned int value )
+    {
+        p[0] = id >> 8;
+        p[1] = id;
+        put_u32( p + 2, value );
+    }
+
+    static long long monotonic_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    /* 解码没有填充的 base64url，结果太长或者有非法字符时返回 -1 */
+    static int base64url_decode( const char* text, unsigned char* out, int len )
+    {
+        unsigned int bits = 0;
+        int count = 0;
+        int idx = 0;
+        for( ; *text && *text != '=' && *text != ' ' && *text != '\t'; ++text )
+        {
+            const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+            const char* p = strchr( alphabet, *text );
+            if( ! p )
+            {
+                return -1;
+            }
+            bits = ( bits << 6 ) | ( p - alphabet );
+            count += 6;
+            if( count >= 8 )
+            {
+                count -= 8;
+                if( idx == len )
+                {
+                    return -1;
+                }
+                out[ idx++ ] = bits >> count;
+            }
+        }
+        return idx;
+    }
+
+    /* 在输出缓冲中预留 len 字节，末尾放不下时把尚未发送的部分移到缓冲的开头 */
+    bool reserve( int len )
+    {
+        if( m_out_len + len > OUTPUT_SIZE && m_out_sent > 0 )
+        {
+            memmove( m_out, m_out + m_out_sent, m_out_len - m_out_sent );
+            m_out_len -= m_out_sent;
+            m_frame_barrier -= ( m_frame_barrier > m_out_sent ) ? m_out_sent : m_frame_barrier;
+            m_out_sent = 0;
+        }
+        return m_out_len + len <= OUTPUT_SIZE;
+    }
+
+    /* 把一个帧放入输出缓冲。payload 为 NULL 时只放入头部（DATA 帧的负载另外发送）。输出缓冲已满时返回 false */
+    bool queue_frame( int type, int flags, unsigned int id, const void* payload, int len )
+    {
+        int size = FRAME_HEADER_LEN + ( payload ? len : 0 );
+        if( ! reserve( size ) )
+        {
+            return false;
+        }
+        unsigned char* p = ( unsigned char* )m_out + m_out_len;
+        p[0] = len >> 16;
+        p[1] = len >> 8;
+        p[2] = len;
+        p[3] = type;
+        p[4] = flags;
+        put_u32( p + 5, id );
+        if( payload )
+        {
+            memcpy( p + FRAME_HEADER_LEN, payload, len );
+        }
+        m_out_len += size;
+        return true;
+    }
+
+    /* 放入一个控制帧。对方让输出缓冲堆满（例如大量的 PING 而不读取应答）时按连接错误处理 */
+    void queue_control( int type, int flags, unsigned int id, const void* payload, int len )
+    {
+        if( ! queue_frame( type, flags, id, payload, len ) )
+        {
+            connection_error( ENHANCE_YOUR_CALM );
+        }
+    }
+
+    void queue_rst_stream( unsigned int id, unsigned int code )
+    {
+        unsigned char payload[ 4 ];
+        put_u32( payload, code );
+        queue_control( RST_STREAM, 0, id, payload, 4 );
+    }
+
+    void queue_window_update( unsigned int id, unsigned int increment )
+    {
+        unsigned char payload[ 4 ];
+        put_u32( payload, increment );
+        queue_control( WINDOW_UPDATE, 0, id, payload, 4 );
+    }
+
+    /* 连接错误：发送 GOAWAY，之后不再处理输入，也不再开始新的 DATA 帧。连输出缓冲都放不下 GOAWAY 时直接关闭连接 */
+    void connection_error( unsigned int code )
+    {
+        if( m_closing )
+        {
+            return;
+        }
+        m_closing = true;
+        unsigned char payload[ 8 ];
+        put_u32( payload, m_last_stream );
+        put_u32( payload + 4, code );
+        if( ! queue_frame( GOAWAY, 0, 0, payload, 8 ) )
+        {
+            m_broken = true;
+        }
+    }
+
+    stream* find_stream( unsigned int id )
+    {
+        for( int i = 0; i < MAX_STREAMS; ++i )
+        {
+            if( m_streams[i].id == id )
+            {
+                return &m_streams[i];
+            }
+        }
+        return NULL;
+    }
+
+    /* 按轮转的顺序找到下一个有数据可发、发送窗口大于 0 的流。advance 为 true 时从它之后开始下一次查找 */
+    stream* next_stream( bool advance )
+    {
+        // 通过 Upgrade 切换时，客户端收到 101 之后才发送连接前言。在此之前只发送 HEADERS，不发送 DATA，
+        // 否则 101 之后紧跟着的整个窗口的数据可能超出客户端切换协议时的缓冲（例如 curl 只有 32KB）
+        if( m_window <= 0 || m_active == 0 || m_preface_left > 0 )
+        {
+            return NULL;
+        }
+        for( int i = 0; i < MAX_STREAMS; ++i )
+        {
+            int slot = ( m_next + i ) % MAX_STREAMS;
+            stream* s = &m_streams[ slot ];
+            if( s->id != 0 && s->window > 0 && remaining( s ) > 0 )
+            {
+                if( advance )
+                {
+                    m_next = ( slot + 1 ) % MAX_STREAMS;
+                }
+                return s;
+            }
+        }
+        return NULL;
+    }
+
+    static long long remaining( const stream* s )
+    {
+        return ( s->fd >= 0 ) ? s->end - s->offset : s->body_len;
+    }
+
+    /* 为流 s 开始一个 DATA 帧：长度取剩余的消息体、最大帧长、流和连接的发送窗口中最小的一个，先放入帧头部，负载由 send_payload 发送 */
+    bool start_data( stream* s )
+    {
+        long long len = remaining( s );
+        int flags = FLAG_END_STREAM;
+        if( len > MAX_FRAME_SIZE || len > s->window || len > m_window )
+        {
+            len = ( s->window < m_window ) ? s->window : m_window;
+            len = ( len < MAX_FRAME_SIZE ) ? len : MAX_FRAME_SIZE;
+            flags = 0;
+        }
+        if( ! queue_frame( DATA, flags, s->id, NULL, len ) )
+        {
+            return false;
+        }
+        s->window -= len;
+        m_window -= len;
+        m_frame_stream = s;
+        m_frame_left = len;
+        m_frame_barrier = m_out_len;
+        return true;
+    }
+
+    /* 发送当前 DATA 帧的负载。返回 1 表示负载已经发送完，0 表示 socket 发送缓冲已满，-1 表示出错 */
+    int send_payload()
+    {
+        stream* s = m_frame_stream;
+        while( m_frame_left > 0 )
+        {
+            int ret;
+            if( s->fd >= 0 )
+            {
+                ret = sendfile( m_sockfd, s->fd, &s->offset, m_frame_left );
+                // 文件在发送过程中被截断，帧已经无法按声明的长度发完，只能关闭连接
+                if( ret == 0 )
+                {
+                    return -1;
+                }
+            }
+            else
+            {
+                ret = send( m_sockfd, s->body, m_frame_left, MSG_NOSIGNAL );
+                if( ret > 0 )
+                {
+                    s->body += ret;
+                    s->body_len -= ret;
+                }
+            }
+            if( ret < 0 )
+            {
+                return ( errno == EAGAIN ) ? 0 : -1;
+            }
+            m_frame_left -= ret;
+            s->record.bytes += ret;
+        }
+        m_frame_stream = NULL;
+        if( remaining( s ) == 0 )
+        {
+            finish_stream( s );
+        }
+        return 1;
+    }
+
+    /* 流结束（最后一个帧已经发出或者被对方重置）：写访问日志，关闭文件，释放槽位 */
+    void finish_stream( stream* s )
+    {
+        if( m_log )
+        {
+            s->record.duration_us = ( monotonic_ns() - s->start_ns ) / 1000;
+            struct timespec ts;
+            clock_gettime( CLOCK_REALTIME, &ts );
+            s->record.time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            m_log->append( s->record );
+        }
+        if( s->fd >= 0 )
+        {
+            close( s->fd );
+            s->fd = -1;
+        }
+        s->id = 0;
+        --m_active;
+    }
+
+    /* 提前结束一个流。正在发送负载的流要等这个帧发完才能释放，所以只截掉帧之后的部分，帧发完时它自然结束 */
+    void reset_stream( stream* s )
+    {
+        if( s != m_frame_stream )
+        {
+            finish_stream( s );
+        }
+        else if( s->fd >= 0 )
+        {
+            s->end = s->offset + m_frame_left;
+        }
+        else
+        {
+            s->body_len = m_frame_left;
+        }
+    }
+
+    /* 打开一个新的流：调用请求处理函数得到应答，把应答的 HEADERS 帧放入输出缓冲。没有消息体的应答随 HEADERS 帧一起结束 */
+    void open_stream( unsigned int id, const h2_request& request )
+    {
+        stream* s = find_stream( 0 );
+        if( ! s )
+        {
+            queue_rst_stream( id, REFUSED_STREAM );
+            return;
+        }
+        s->id = id;
+        s->window = m_initial_window;
+        s->start_ns = monotonic_ns();
+        ++m_active;
+
+        h2_response response;
+        response.status = 500;
+        response.fd = -1;
+        response.offset = response.end = 0;
+        response.body = NULL;
+        response.body_len = 0;
+        response.header_count = 0;
+        if( request.method && request.path )
+        {
+            m_handler( request, &response, m_arg );
+        }
+        else
+        {
+            // 缺少必需的伪头部字段，请求格式错误
+            response.status = 400;
+        }
+        s->fd = response.fd;
+        s->offset = response.offset;
+        s->end = response.end;
+        s->body = response.body;
+        s->body_len = response.body ? response.body_len : 0;
+        fill_record( s, request, response.status );
+
+        unsigned char block[ 1024 ];
+        int len = encode_headers( response, remaining( s ), block, sizeof( block ) );
+        if( len < 0 )
+        {
+            // 头部字段太长，放弃消息体，改为没有字段的 500 应答
+            if( s->fd >= 0 )
+            {
+                close( s->fd );
+                s->fd = -1;
+            }
+            s->body_len = 0;
+            response.status = 500;
+            response.header_count = 0;
+            s->record.status = 500;
+            len = encode_headers( response, 0, block, sizeof( block ) );
+        }
+        bool empty = ( remaining( s ) == 0 );
+        queue_control( HEADERS, FLAG_END_HEADERS | ( empty ? FLAG_END_STREAM : 0 ), id, block, len );
+        if( empty )
+        {
+            finish_stream( s );
+        }
+    }
+
+    /* 编码应答的头部块，length 是消息体的长度。空间不足时返回 -1 */
+    static int encode_headers( const h2_response& response, long long length, unsigned char* block, int len )
+    {
+        char value[ 32 ];
+        snprintf( value, sizeof( value ), "%d", response.status );
+        int idx = hpack::encode_field( ":status", value, block, len );
+        if( idx >= 0 && response.status != 304 && response.status != 204 )
+        {
+            snprintf( value, sizeof( value ), "%lld", length );
+            int ret = hpack::encode_field( "content-length", value, block + idx, len - idx );
+            idx = ( ret < 0 ) ? -1 : idx + ret;
+        }
+        for( int i = 0; i < response.header_count && idx >= 0; ++i )
+        {
+            int ret = hpack::encode_field( response.names[i], response.values[i], block + idx, len - idx );
+            idx = ( ret < 0 ) ? -1 : idx + ret;
+        }
+        return idx;
+    }
+
+    /* 填写流的访问日志记录，请求的字段在流结束时已经无效，所以在这里复制 */
+    void fill_record( stream* s, const h2_request& request, int status )
+    {
+        static const char* methods[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+        access_record& record = s->record;
+        record.bytes = 0;
+        record.addr = m_address.sin_addr;
+        record.port = ntohs( m_address.sin_port );
+        record.status = status;
+        record.method = "-";
+        for( size_t i = 0; request.method && i < sizeof( methods ) / sizeof( methods[0] ); ++i )
+        {
+            if( strcmp( request.method, methods[i] ) == 0 )
+            {
+                record.method = methods[i];
+            }
+        }
+        snprintf( record.host, access_record::HOST_LEN, "%s", request.authority ? request.authority : "-" );
+        snprintf( record.url, access_record::URL_LEN, "%s", request.path ? request.path : "-" );
+    }
+
+    /* 应用对方的 SETTINGS。SETTINGS_INITIAL_WINDOW_SIZE 的变化要同时调整所有已经打开的流的发送窗口 */
+    bool apply_settings( const unsigned char* payload, int len )
+    {
+        for( int i = 0; i + 6 <= len; i += 6 )
+        {
+            int id = ( payload[i] << 8 ) | payload[ i + 1 ];
+            unsigned int value = get_u32( payload + i + 2 );
+            if( id == SETTINGS_ENABLE_PUSH && value > 1 )
+            {
+                connection_error( PROTOCOL_ERROR );
+                return false;
+            }
+            if( id == SETTINGS_INITIAL_WINDOW_SIZE )
+            {
+                if( value > MAX_WINDOW )
+                {
+                    connection_error( FLOW_CONTROL_ERROR );
+                    return false;
+                }
+                long long delta = ( long long )value - m_initial_window;
+                for( int j = 0; j < MAX_STREAMS; ++j )
+                {
+                    if( m_streams[j].id != 0 )
+                    {
+                        m_streams[j].window += delta;
+                    }
+                }
+                m_initial_window = value;
+            }
+            // 服务器发送的 DATA 帧不超过默认的最大帧长，对方只能把它调大，所以只需要检查取值范围
+            if( id == SETTINGS_MAX_FRAME_SIZE && ( value < ( unsigned int )MAX_FRAME_SIZE || value > 0xffffff ) )
+            {
+                connection_error( PROTOCOL_ERROR );
+                return false;
+            }
+            // 其他设置项不影响服务器：编码器不使用动态表，也不会主动推送
+        }
+        return true;
+    }
+
+    /* 处理一个完整的帧 */
+    void handle_frame( int type, int flags, unsigned int id, const unsigned char* payload, int len )
+    {
+        // 头部块没有结束时只能收到同一个流的 CONTINUATION 帧
+        if( m_block_stream != 0 && ( type != CONTINUATION || id != m_block_stream ) )
+        {
+            connection_error( PROTOCOL_ERROR );
+            return;
+        }
+        switch( type )
+        {
+            case DATA:
+            {
+                // 服务器不接收请求的消息体，收到的 DATA 帧直接丢弃，但要归还占用的窗口，对方才能继续发送
+                if( id == 0 )
+                {
+                    connection_error( PROTOCOL_ERROR );
+                }
+                else if( len > 0 )
+                {
+                    queue_window_update( 0, len );
+                    if( ! ( flags & FLAG_END_STREAM ) && find_stream( id ) )
+                    {
+                        queue_window_update( id, len );
+                    }
+                }
+                break;
+            }
+            case HEADERS:
+            {
+                // 去掉填充和优先级信息，剩下的是头部块的第一段
+                if( flags & FLAG_PADDED )
+                {
+                    int pad = ( len > 0 ) ? payload[0] : 0;
+                    payload += 1;
+                    len -= 1 + pad;
+                }
+                if( flags & FLAG_PRIORITY )
+                {
+                    payload += 5;
+                    len -= 5;
+                }
+                if( id == 0 || id % 2 == 0 || len < 0 )
+                {
+                    connection_error( PROTOCOL_ERROR );
+                    break;
+                }
+                m_block_len = 0;
+                m_block_stream = id;
+                append_block( payload, len, flags );
+                break;
+            }
+            case CONTINUATION:
+            {
+                if( m_block_stream == 0 )
+                {
+                    connection_error( PROTOCOL_ERROR );
+                    break;
+                }
+                append_block( payload, len, flags );
+                break;
+            }
+            case PRIORITY:
+            {
+                // 不支持优先级，所有的流按轮转的顺序平等地发送
+                if( len != 5 )
+                {
+                    connection_error( FRAME_SIZE_ERROR );
+                }
+                break;
+            }
+            case RST_STREAM:
+            {
+                if( len != 4 || id == 0 )
+                {
+                    connection_error( len != 4 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR );
+                    break;
+                }
+                stream* s = find_stream( id );
+                if( s )
+                {
+                    reset_stream( s );
+                }
+                break;
+            }
+            case SETTINGS:
+            {
+                if( id != 0 || ( flags & FLAG_ACK && len != 0 ) || len % 6 != 0 )
+                {
+                    connection_error( id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR );
+                    break;
+                }
+                if( ! ( flags & FLAG_ACK ) && apply_settings( payload, len ) )
+                {
+                    queue_control( SETTINGS, FLAG_ACK, 0, NULL, 0 );
+                }
+                break;
+            }
+            case PING:
+            {
+                if( len != 8 || id != 0 )
+                {
+                    connection_error( len != 8 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR );
+                }
+                else if( ! ( flags & FLAG_ACK ) )
+                {
+                    queue_control( PING, FLAG_ACK, 0, payload, 8 );
+                }
+                break;
+            }
+            case GOAWAY:
+            {
+                // 对方不再发起新的流，已经打开的流发送完之后关闭连接
+                m_peer_goaway = true;
+                break;
+            }
+            case WINDOW_UPDATE:
+            {
+                if( len != 4 )
+                {
+                    connection_error( FRAME_SIZE_ERROR );
+                    break;
+                }
+                long long increment = get_u32( payload ) & 0x7fffffff;
+                if( increment == 0 )
+                {
+                    connection_error( PROTOCOL_ERROR );
+                }
+                else if( id == 0 )
+                {
+                    m_window += increment;
+                    if( m_window > MAX_WINDOW )
+                    {
+                        connection_error( FLOW_CONTROL_ERROR );
+                    }
+                }
+                else
+                {
+                    stream* s = find_stream( id );
+                    if( s && ( s->window += increment ) > MAX_WINDOW )
+                    {
+                        queue_rst_stream( id, FLOW_CONTROL_ERROR );
+                        reset_stream( s );
+                    }
+                }
+                break;
+            }
+            case PUSH_PROMISE:
+            {
+                // 客户端不能推送
+                connection_error( PROTOCOL_ERROR );
+                break;
+            }
+            default:
+            {
+                // 未知类型的帧必须忽略
+                break;
+            }
+        }
+    }
+
+    /* 把头部块的一段追加到 m_block 中，头部块结束时解码并打开流 */
+    void append_block( const unsigned char* data, int len, int flags )
+    {
+        if( len > HEADER_BLOCK_SIZE - m_block_len )
+        {
+            connection_error( ENHANCE_YOUR_CALM );
+            return;
+        }
+        memcpy( m_block + m_block_len, data, len );
+        m_block_len += len;
+        if( ! ( flags & FLAG_END_HEADERS ) )
+        {
+            return;
+        }
+        unsigned int id = m_block_stream;
+        m_block_stream = 0;
+
+        // 无论这个流最终是否被处理，头部块都必须解码，否则动态表会与对方不一致
+        memset( &m_request, 0, sizeof( m_request ) );
+        m_host = NULL;
+        m_fields_len = 0;
+        m_fields_overflow = false;
+        if( ! m_decoder.decode( m_block, m_block_len, on_field, this ) )
+        {
+            connection_error( COMPRESSION_ERROR );
+            return;
+        }
+        if( id <= m_last_stream )
+        {
+            // 已经打开的流上的 HEADERS 是请求的尾部字段，忽略；已经关闭的流上不能再有 HEADERS
+            if( ! find_stream( id ) )
+            {
+                connection_error( STREAM_CLOSED );
+            }
+            return;
+        }
+        m_last_stream = id;
+        if( m_peer_goaway )
+        {
+            return;
+        }
+        if( m_fields_overflow )
+        {
+            queue_rst_stream( id, REFUSED_STREAM );
+            return;
+        }
+        if( ! m_request.authority )
+        {
+            m_request.authority = m_host;
+        }
+        open_stream( id, m_request );
+    }
+
+    /* 解码出一个字段：只保存服务器关心的字段 */
+    static void on_field( const char* name, int name_len, const char* value, int value_len, void* arg )
+    {
+        h2_session* session = ( h2_session* )arg;
+        h2_request& request = session->m_request;
+        const char** field = NULL;
+        if( strcmp( name, ":method" ) == 0 ) field = &request.method;
+        else if( strcmp( name, ":path" ) == 0 ) field = &request.path;
+        else if( strcmp( name, ":authority" ) == 0 ) field = &request.authority;
+        else if( strcmp( name, "host" ) == 0 ) field = &session->m_host;
+        else if( strcmp( name, "range" ) == 0 ) field = &request.range;
+        else if( strcmp( name, "if-none-match" ) == 0 ) field = &request.if_none_match;
+        else if( strcmp( name, "if-modified-since" ) == 0 ) field = &request.if_modified_since;
+        if( ! field )
+        {
+            return;
+        }
+        if( value_len >= FIELDS_SIZE - session->m_fields_len )
+        {
+            session->m_fields_overflow = true;
+            return;
+        }
+        char* copy = session->m_fields + session->m_fields_len;
+        memcpy( copy, value, value_len + 1 );
+        session->m_fields_len += value_len + 1;
+        *field = copy;
+    }
+
+private:
+    // 连接的 socket 和客户端地址
+    int m_sockfd;
+    sockaddr_in m_address;
+    // 请求处理函数及其参数，以及访问日志
+    request_handler m_handler;
+    void* m_arg;
+    access_log* m_log;
+
+    // 还没有收到的客户端连接前言的字节数
+    int m_preface_left;
+    // 输入缓冲和其中的字节数
+    char m_in[ INPUT_SIZE ];
+    int m_in_len;
+    // 输出缓冲：其中的字节数和已经发送的字节数
+    char m_out[ OUTPUT_SIZE ];
+    int m_out_len;
+    int m_out_sent;
+    // 正在发送负载的 DATA 帧所属的流、剩余的负载长度，以及输出缓冲中必须在负载之前发送的部分（到该帧头部为止）
+    stream* m_frame_stream;
+    int m_frame_left;
+    int m_frame_barrier;
+
+    // 正在接收的头部块，以及它所属的流（0 表示没有）
+    unsigned char m_block[ HEADER_BLOCK_SIZE ];
+    int m_block_len;
+    unsigned int m_block_stream;
+    // HPACK 解码器，以及解码出的请求和 host 字段（没有 :authority 时代替它）。字段值保存在 m_fields 中
+    hpack_decoder m_decoder;
+    h2_request m_request;
+    const char* m_host;
+    char m_fields[ FIELDS_SIZE ];
+    int m_fields_len;
+    bool m_fields_overflow;
+
+    // 所有的流、对方最后打开的流、当前打开的流的数目，以及下一次轮转的起点
+    stream m_streams[ MAX_STREAMS ];
+    unsigned int m_last_stream;
+    int m_active;
+    int m_next;
+    // 连接的发送窗口，以及新打开的流的初始发送窗口
+    long long m_window;
+    long long m_initial_window;
+    // 已经发送（或放入）GOAWAY、连接已经无法继续使用、对方已经发送 GOAWAY
+    bool m_closing;
+    bool m_broken;
+    bool m_peer_goaway;
+};
+
+#endif
@@ -0,0 +1,1041 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+#include <atomic>
+#include "chapter14/14_2_locker.h"
+#if defined( __SSE2__ ) || defined( __AVX2__ )
+#include <immintrin.h>
+#elif defined( __ARM_NEON )
+#include <arm_neon.h>
+#endif
+
+// 定义在 http_conn.cpp 中：以 EPOLLONESHOT 方式重新注册 fd 上的事件
+extern void modfd( int epollfd, int fd, int ev );
+
+/* 客户端帧的头部 */
+struct ws_frame
+{
+    bool fin;
+    int opcode;
+    long long length;
+    unsigned char mask[4];
+};
+
+/* WebSocket（RFC 6455）的帧编解码和握手 */
+class ws_codec
+{
+public:
+    // 客户端帧头部的最大长度：2 字节基本头部、8 字节扩展长度和 4 字节掩码
+    static const int MAX_HEADER_LEN = 14;
+    // Sec-WebSocket-Accept 字段值的长度（SHA-1 摘要的 base64 编码）
+    static const int ACCEPT_LEN = 28;
+    // 操作码
+    enum OPCODE { CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xa };
+    // 关闭帧的状态码
+    enum CLOSE_CODE { CLOSE_NORMAL = 1000, CLOSE_GOING_AWAY = 1001, CLOSE_PROTOCOL_ERROR = 1002, CLOSE_INVALID_DATA = 1007,
+                      CLOSE_TOO_BIG = 1009, CLOSE_TRY_AGAIN_LATER = 1013 };
+
+    /* 由客户端的 Sec-WebSocket-Key 计算 Sec-WebSocket-Accept：key 加上固定的 GUID 之后取 SHA-1，再做 base64 编码。
+    accept 至少要有 ACCEPT_LEN + 1 字节 */
+    static void accept_key( const char* key, char* accept )
+    {
+        static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        char text[ 128 ];
+        int len = snprintf( text, sizeof( text ), "%.64s%s", key, guid );
+        unsigned char digest[ 20 ];
+        sha1( ( const unsigned char* )text, len, digest );
+        base64_encode( digest, sizeof( digest ), accept );
+    }
+
+    /* 解析客户端帧的头部。返回头部的长度，数据不够一个完整的头部时返回 0，帧不合法时返回 -1：
+    使用了没有协商的扩展（RSV 位）、没有掩码（客户端帧必须带掩码）、未知的操作码、控制帧分片或者负载超过 125 字节 */
+    static int parse_header( const unsigned char* p, int len, ws_frame* frame )
+    {
+        if( len < 2 )
+        {
+            return 0;
+        }
+        if( ( p[0] & 0x70 ) || ! ( p[1] & 0x80 ) )
+        {
+            return -1;
+        }
+        frame->fin = p[0] & 0x80;
+        frame->opcode = p[0] & 0x0f;
+        if( frame->opcode & 0x8 )
+        {
+            if( frame->opcode > PONG || ! frame->fin || ( p[1] & 0x7f ) > 125 )
+            {
+                return -1;
+            }
+        }
+        else if( frame->opcode > BINARY )
+        {
+            return -1;
+        }
+        int pos = 2;
+        frame->length = p[1] & 0x7f;
+        if( frame->length == 126 )
+        {
+            if( len < 8 )
+            {
+                return 0;
+            }
+            frame->length = ( p[2] << 8 ) | p[3];
+            pos = 4;
+        }
+        else if( frame->length == 127 )
+        {
+            if( len < 14 )
+            {
+                return 0;
+            }
+            // 最高位必须为 0
+            if( p[2] & 0x80 )
+            {
+                return -1;
+            }
+            frame->length = 0;
+            for( int i = 2; i < 10; ++i )
+            {
+                frame->length = ( frame->length << 8 ) | p[i];
+            }
+            pos = 10;
+        }
+        else if( len < 6 )
+        {
+            return 0;
+        }
+        memcpy( frame->mask, p + pos, 4 );
+        return pos + 4;
+    }
+
+    /* 生成服务器帧（不带掩码、不分片）的头部，返回头部的长度。buf 至少要有 10 字节 */
+    static int encode_header( unsigned char* buf, int opcode, long long len )
+    {
+        buf[0] = 0x80 | opcode;
+        if( len < 126 )
+        {
+            buf[1] = len;
+            return 2;
+        }
+        if( len < 65536 )
+        {
+            buf[1] = 126;
+            buf[2] = len >> 8;
+            buf[3] = len;
+            return 4;
+        }
+        buf[1] = 127;
+        for( int i = 9; i >= 2; --i )
+        {
+            buf[i] = len;
+            len >>= 8;
+        }
+        return 10;
+    }
+
+    /* 用 4 字节的掩码原地解码负载：第 i 个字节与 mask[ i % 4 ] 异或。掩码按 4 字节重复之后与向量寄存器一样宽，
+    所以每次异或 32（AVX2）或 16（SSE2、NEON）字节，剩下的部分按 8 字节和单个字节处理。
+    聊天消息通常只有几十字节，但浏览器推送的二进制帧可能有几十 KB，逐字节异或是接收路径上最大的开销 */
+    static void unmask( unsigned char* data, long long len, const unsigned char* mask )
+    {
+        uint32_t key32;
+        memcpy( &key32, mask, 4 );
+        long long i = 0;
+#if defined( __AVX2__ )
+        __m256i key256 = _mm256_set1_epi32( key32 );
+        for( ; i + 32 <= len; i += 32 )
+        {
+            __m256i v = _mm256_loadu_si256( ( const __m256i* )( data + i ) );
+            _mm256_storeu_si256( ( __m256i* )( data + i ), _mm256_xor_si256( v, key256 ) );
+        }
+#endif
+#if defined( __SSE2__ )
+        __m128i key128 = _mm_set1_epi32( key32 );
+        for( ; i + 16 <= len; i += 16 )
+        {
+            __m128i v = _mm_loadu_si128( ( const __m128i* )( data + i ) );
+            _mm_storeu_si128( ( __m128i* )( data + i ), _mm_xor_si128( v, key128 ) );
+        }
+#elif defined( __ARM_NEON )
+        uint8x16_t key128 = vreinterpretq_u8_u32( vdupq_n_u32( key32 ) );
+        for( ; i + 16 <= len; i += 16 )
+        {
+            vst1q_u8( data + i, veorq_u8( vld1q_u8( data + i ), key128 ) );
+        }
+#endif
+        // 上面每次处理的长度都是 4 的倍数，所以掩码的相位没有变化
+        uint64_t key64 = ( ( uint64_t )key32 << 32 ) | key32;
+        for( ; i + 8 <= len; i += 8 )
+        {
+            uint64_t v;
+            memcpy( &v, data + i, 8 );
+            v ^= key64;
+            memcpy( data + i, &v, 8 );
+        }
+        for( ; i < len; ++i )
+        {
+            data[i] ^= mask[ i & 3 ];
+        }
+    }
+
+    /* 检查 text 是否是合法的 UTF-8（文本消息必须是），拒绝过长编码、代理项和超出 U+10FFFF 的码点。
+    聊天消息大多是 ASCII，所以先按 8 字节检查最高位 */
+    static bool valid_utf8( const unsigned char* text, int len )
+    {
+        int i = 0;
+        while( i < len )
+        {
+            if( i + 8 <= len )
+            {
+                uint64_t v;
+                memcpy( &v, text + i, 8 );
+                if( ( v & 0x8080808080808080ULL ) == 0 )
+                {
+                    i += 8;
+                    continue;
+                }
+            }
+            unsigned char c = text[i];
+            if( c < 0x80 )
+            {
+                ++i;
+                continue;
+            }
+            int n;
+            unsigned char low = 0x80, high = 0xbf;
+            if( c >= 0xc2 && c <= 0xdf )
+            {
+                n = 1;
+            }
+            else if( c >= 0xe0 && c <= 0xef )
+            {
+                // E0 之后小于 A0 是过长编码，ED 之后大于 9F 是代理项
+                n = 2;
+                low = ( c == 0xe0 ) ? 0xa0 : 0x80;
+                high = ( c == 0xed ) ? 0x9f : 0xbf;
+            }
+            else if( c >= 0xf0 && c <= 0xf4 )
+            {
+                // F0 之后小于 90 是过长编码，F4 之后大于 8F 超出了 U+10FFFF
+                n = 3;
+                low = ( c == 0xf0 ) ? 0x90 : 0x80;
+                high = ( c == 0xf4 ) ? 0x8f : 0xbf;
+            }
+            else
+            {
+                return false;
+            }
+            if( i + n >= len )
+            {
+                return false;
+            }
+            // 第一个后续字节的范围取决于首字节，其余的后续字节都在 [0x80, 0xbf] 中
+            if( text[ i + 1 ] < low || text[ i + 1 ] > high )
+            {
+                return false;
+            }
+            for( int k = 2; k <= n; ++k )
+            {
+                if( ( text[ i + k ] & 0xc0 ) != 0x80 )
+                {
+                    return false;
+                }
+            }
+            i += n + 1;
+        }
+        return true;
+    }
+
+private:
+    static uint32_t rotl( uint32_t x, int n ) { return ( x << n ) | ( x >> ( 32 - n ) ); }
+
+    /* SHA-1（RFC 3174）。握手时只计算一次几十字节的摘要，不需要为此引入密码学库 */
+    static void sha1( const unsigned char* data, int len, unsigned char* digest )
+    {
+        uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+        // 填充之后的消息：原文、0x80、若干个 0 和 8 字节的位长度，总长度是 64 的倍数
+        unsigned char block[ 192 ];
+        int total = ( ( len + 8 ) / 64 + 1 ) * 64;
+        if( total > ( int )sizeof( block ) )
+        {
+            memset( digest, 0, 20 );
+            return;
+        }
+        memset( block, 0, total );
+        memcpy( block, data, len );
+        block[ len ] = 0x80;
+        unsigned long long bits = ( unsigned long long )len * 8;
+        for( int i = 0; i < 8; ++i )
+        {
+            block[ total - 1 - i ] = bits >> ( i * 8 );
+        }
+        for( int offset = 0; offset < total; offset += 64 )
+        {
+            uint32_t w[ 80 ];
+            for( int i = 0; i < 16; ++i )
+            {
+                const unsigned char* p = block + offset + i * 4;
+                w[i] = ( ( uint32_t )p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+            }
+            for( int i = 16; i < 80; ++i )
+            {
+                w[i] = rotl( w[ i - 3 ] ^ w[ i - 8 ] ^ w[ i - 14 ] ^ w[ i - 16 ], 1 );
+            }
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for( int i = 0; i < 80; ++i )
+            {
+                uint32_t f, k;
+                if( i < 20 )
+                {
+                    f = ( b & c ) | ( ~b & d );
+                    k = 0x5a827999;
+                }
+                else if( i < 40 )
+                {
+                    f = b ^ c ^ d;
+                    k = 0x6ed9eba1;
+                }
+                else if( i < 60 )
+                {
+                    f = ( b & c ) | ( b & d ) | ( c & d );
+                    k = 0x8f1bbcdc;
+                }
+                else
+                {
+                    f = b ^ c ^ d;
+                    k = 0xca62c1d6;
+                }
+                uint32_t temp = rotl( a, 5 ) + f + e + k + w[i];
+                e = d;
+                d = c;
+                c = rotl( b, 30 );
+                b = a;
+                a = temp;
+            }
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+        }
+        for( int i = 0; i < 5; ++i )
+        {
+            digest[ i * 4 ] = h[i] >> 24;
+            digest[ i * 4 + 1 ] = h[i] >> 16;
+            digest[ i * 4 + 2 ] = h[i] >> 8;
+            digest[ i * 4 + 3 ] = h[i];
+        }
+    }
+
+    /* 标准 base64 编码，带填充，结果以 '\0' 结尾 */
+    static void base64_encode( const unsigned char* data, int len, char* out )
+    {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        int pos = 0;
+        for( int i = 0; i < len; i += 3 )
+        {
+            unsigned int v = data[i] << 16;
+            v |= ( i + 1 < len ) ? data[ i + 1 ] << 8 : 0;
+            v |= ( i + 2 < len ) ? data[ i + 2 ] : 0;
+            out[ pos++ ] = table[ ( v >> 18 ) & 0x3f ];
+            out[ pos++ ] = table[ ( v >> 12 ) & 0x3f ];
+            out[ pos++ ] = ( i + 1 < len ) ? table[ ( v >> 6 ) & 0x3f ] : '=';
+            out[ pos++ ] = ( i + 2 < len ) ? table[ v & 0x3f ] : '=';
+        }
+        out[ pos ] = '\0';
+    }
+};
+
+/* 一段待发送的数据，通常是一个完整的服务器帧。广播时帧只编码一次，所有接收者的输出队列引用同一个对象，最后一个引用释放时回收 */
+struct ws_message
+{
+    std::atomic< int > refs;
+    int len;
+    unsigned char data[1];
+
+    /* 创建一个长度为 len 的空消息，引用计数为 1 */
+    static ws_message* create( int len )
+    {
+        void* mem = malloc( sizeof( ws_message ) + len );
+        if( ! mem )
+        {
+            return NULL;
+        }
+        ws_message* message = new( mem ) ws_message;
+        message->refs = 1;
+        message->len = len;
+        return message;
+    }
+
+    /* 把 payload 编码为一个服务器帧 */
+    static ws_message* frame( int opcode, const void* payload, int len )
+    {
+        unsigned char header[ 10 ];
+        int header_len = ws_codec::encode_header( header, opcode, len );
+        ws_message* message = create( header_len + len );
+        if( message )
+        {
+            memcpy( message->data, header, header_len );
+            memcpy( message->data + header_len, payload, len );
+        }
+        return message;
+    }
+
+    void acquire() { refs.fetch_add( 1, std::memory_order_relaxed ); }
+
+    void release()
+    {
+        if( refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+        {
+            this->~ws_message();
+            free( this );
+        }
+    }
+};
+
+class ws_room;
+
+/* 一个 WebSocket 连接。输入方向（读取、分帧、解码、重组分片）和 h2_session 一样只由当前处理连接的线程访问；
+输出方向是一个消息队列，广播的线程可以随时往里面放入消息并尝试发送，所以队列和发送都由 m_lock 保护。
+EPOLLONESHOT 模式下，广播的线程发送受阻时需要替连接注册 EPOLLOUT，但只有在连接没有被线程处理（m_armed）时才能这样做，
+否则会有两个线程同时处理同一个连接；主线程收到事件时用 claim 检查这一点，过滤掉因为这种重新注册而产生的重复事件。
+会话对象在连接关闭之后并不释放，而是留给同一个 http_conn 的下一个 WebSocket 连接使用：主线程可能在连接关闭的同时
+对它调用 claim，会话必须一直有效 */
+class ws_session
+{
+public:
+    // 消息处理函数：data 是完整的（已经重组分片的）消息，在这次调用期间有效
+    typedef void ( *message_handler )( ws_session* session, int opcode, const char* data, int len, void* arg );
+
+    // 接收的最大消息长度，超过时以 1009 关闭连接
+    static const int MAX_MESSAGE = 65536;
+    // 输入缓冲能放下一个最大的帧
+    static const int INPUT_SIZE = MAX_MESSAGE + ws_codec::MAX_HEADER_LEN;
+    // 输出队列的长度。接收者太慢，队列满时断开它，而不是让广播阻塞或者无限地占用内存
+    static const int QUEUE_SIZE = 256;
+    // 每次 sendmsg 最多合并的消息数
+    static const int SEND_BATCH = 16;
+
+public:
+    ws_session() : m_sockfd( -1 ), m_open( false ), m_count( 0 ) {}
+
+    ~ws_session()
+    {
+        drop_queue();
+    }
+
+    /* 在连接 sockfd 上开始一个会话。oneshot 为 true 时连接以 EPOLLONESHOT 方式注册在 epollfd 上，
+    调用者此时正在处理这个连接。消息交给 handler 处理 */
+    void open( int sockfd, int epollfd, bool oneshot, message_handler handler, void* arg )
+    {
+        m_sockfd = sockfd;
+        m_epollfd = epollfd;
+        m_oneshot = oneshot;
+        m_handler = handler;
+        m_arg = arg;
+        m_in_len = 0;
+        m_message_len = 0;
+        m_fragment_opcode = 0;
+        m_closing = false;
+        m_room = NULL;
+        m_room_index = -1;
+        m_lock.lock();
+        m_head = 0;
+        m_count = 0;
+        m_offset = 0;
+        m_armed = false;
+        m_armed_out = false;
+        m_broken = false;
+        m_bytes_sent = 0;
+        m_open = true;
+        m_lock.unlock();
+    }
+
+    /* 结束会话：离开房间，丢弃还没有发送的消息。之后广播和 claim 都不再访问这个连接 */
+    void close();
+
+    bool is_open() const { return m_open.load( std::memory_order_acquire ); }
+
+    /* 所在的房间，没有加入房间时为空 */
+    ws_room* room() const { return m_room; }
+
+    /* 放入切换协议之前已经读入的数据（客户端紧跟在握手请求之后发送的帧），数据太多时返回 false */
+    bool feed( const char* data, int len )
+    {
+        if( len > INPUT_SIZE - m_in_len )
+        {
+            return false;
+        }
+        memcpy( m_in + m_in_len, data, len );
+        m_in_len += len;
+        return true;
+    }
+
+    /* 循环读取数据直到没有数据可读，和 h2_session::read 一样：输入缓冲已满时 *more 置为 true。对方关闭连接或者出错时返回 false */
+    bool read( bool* more )
+    {
+        *more = false;
+        while( true )
+        {
+            if( m_in_len == INPUT_SIZE )
+            {
+                *more = true;
+                return true;
+            }
+            int ret = recv( m_sockfd, m_in + m_in_len, INPUT_SIZE - m_in_len, 0 );
+            if( ret < 0 )
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if( ret == 0 )
+            {
+                return false;
+            }
+            m_in_len += ret;
+        }
+    }
+
+    /* 处理输入缓冲中所有完整的帧：控制帧在这里应答，数据消息交给消息处理函数 */
+    void process()
+    {
+        int pos = 0;
+        while( ! m_closing )
+        {
+            ws_frame frame;
+            int header = ws_codec::parse_header( m_in + pos, m_in_len - pos, &frame );
+            if( header == 0 )
+            {
+                break;
+            }
+            if( header < 0 )
+            {
+                fail( ws_codec::CLOSE_PROTOCOL_ERROR );
+                break;
+            }
+            if( frame.length > MAX_MESSAGE )
+            {
+                fail( ws_codec::CLOSE_TOO_BIG );
+                break;
+            }
+            if( m_in_len - pos - header < frame.length )
+            {
+                break;
+            }
+            unsigned char* payload = m_in + pos + header;
+            ws_codec::unmask( payload, frame.length, frame.mask );
+            handle_frame( frame, payload, ( int )frame.length );
+            pos += header + ( int )frame.length;
+        }
+        // 发出关闭帧之后对方发来的数据都不再处理
+        if( m_closing )
+        {
+            pos = m_in_len;
+        }
+        memmove( m_in, m_in + pos, m_in_len - pos );
+        m_in_len -= pos;
+    }
+
+    /* 发送一个帧 */
+    bool send( int opcode, const void* payload, int len )
+    {
+        ws_message* message = ws_message::frame( opcode, payload, len );
+        if( ! message )
+        {
+            return false;
+        }
+        bool ret = send( message );
+        message->release();
+        return ret;
+    }
+
+    /* 发送原始数据（切换协议的 101 应答） */
+    bool send_raw( const char* data, int len )
+    {
+        ws_message* message = ws_message::create( len );
+        if( ! message )
+        {
+            return false;
+        }
+        memcpy( message->data, data, len );
+        bool ret = send( message );
+        message->release();
+        return ret;
+    }
+
+    /* 把消息放入输出队列，队列原来为空时立即尝试发送。可以由任何线程调用，会话已经结束时返回 false */
+    bool send( ws_message* message )
+    {
+        bool first = false;
+        if( ! enqueue( message, &first ) )
+        {
+            return false;
+        }
+        return ! first || flush();
+    }
+
+    /* 把消息放入输出队列（增加它的引用计数），但不发送。*first 为 true 表示队列原来为空，调用者负责随后调用 flush；
+    否则说明上一次发送受阻（会有 EPOLLOUT 事件），或者已经有其他线程负责发送。
+    队列已满说明接收者太慢，此时关闭 socket 的两个方向，处理这个连接的线程会因为 EPOLLHUP 或读取失败而关闭连接 */
+    bool enqueue( ws_message* message, bool* first )
+    {
+        m_lock.lock();
+        if( ! m_open || m_broken )
+        {
+            m_lock.unlock();
+            return false;
+        }
+        if( m_count == QUEUE_SIZE )
+        {
+            m_broken = true;
+            shutdown( m_sockfd, SHUT_RDWR );
+            m_lock.unlock();
+            return false;
+        }
+        message->acquire();
+        m_queue[ ( m_head + m_count ) % QUEUE_SIZE ] = message;
+        ++m_count;
+        *first = ( m_count == 1 );
+        m_lock.unlock();
+        return true;
+    }
+
+    /* 发送输出队列中的消息，出错时返回 false */
+    bool flush()
+    {
+        m_lock.lock();
+        bool ret = flush_locked();
+        m_lock.unlock();
+        return ret;
+    }
+
+    /* EPOLLONESHOT 模式下，处理连接的线程在处理完之后调用：重新注册连接的事件，输出队列中还有消息时同时等待可写。
+    注册之后连接可能马上被另一个线程处理，调用者不能再访问会话 */
+    void rearm()
+    {
+        m_lock.lock();
+        m_armed = true;
+        m_armed_out = m_count > 0;
+        modfd( m_epollfd, m_sockfd, m_armed_out ? EPOLLIN | EPOLLOUT : EPOLLIN );
+        m_lock.unlock();
+    }
+
+    /* EPOLLONESHOT 模式下，主线程收到连接的事件时调用，返回 true 表示调用者接手了连接。
+    返回 false 说明事件是广播的线程重新注册产生的，而连接此时正在被另一个线程处理，或者连接已经关闭，应该忽略这个事件 */
+    bool claim()
+    {
+        m_lock.lock();
+        bool ret = m_open && m_armed;
+        m_armed = false;
+        m_lock.unlock();
+        return ret;
+    }
+
+    /* 会话已经结束，应该关闭连接：发送失败，或者关闭帧已经发送完 */
+    bool finished()
+    {
+        m_lock.lock();
+        bool ret = m_broken || ( m_closing && m_count == 0 );
+        m_lock.unlock();
+        return ret;
+    }
+
+    /* 发送关闭帧，之后不再处理对方发来的数据 */
+    void fail( int code )
+    {
+        unsigned char payload[2] = { ( unsigned char )( code >> 8 ), ( unsigned char )code };
+        send( ws_codec::CLOSE, payload, sizeof( payload ) );
+        m_closing = true;
+    }
+
+    /* 已经写入 socket 的字节数，用于访问日志 */
+    long long bytes_sent() const { return m_bytes_sent; }
+
+private:
+    void handle_frame( const ws_frame& frame, unsigned char* payload, int len )
+    {
+        switch( frame.opcode )
+        {
+            case ws_codec::PING:
+            {
+                send( ws_codec::PONG, payload, len );
+                break;
+            }
+            case ws_codec::PONG:
+            {
+                break;
+            }
+            case ws_codec::CLOSE:
+            {
+                // 回应关闭帧（带上对方的状态码）之后关闭连接
+                if( len == 1 )
+                {
+                    fail( ws_codec::CLOSE_PROTOCOL_ERROR );
+                    break;
+                }
+                send( ws_codec::CLOSE, payload, len >= 2 ? 2 : 0 );
+                m_closing = true;
+                break;
+            }
+            case ws_codec::TEXT:
+            case ws_codec::BINARY:
+            {
+                if( m_fragment_opcode != 0 )
+                {
+                    fail( ws_codec::CLOSE_PROTOCOL_ERROR );
+                    break;
+                }
+                if( frame.fin )
+                {
+                    // 没有分片的消息直接在输入缓冲中处理，不需要复制
+                    deliver( frame.opcode, payload, len );
+                    break;
+                }
+                m_fragment_opcode = frame.opcode;
+                memcpy( m_message, payload, len );
+                m_message_len = len;
+                break;
+            }
+            case ws_codec::CONTINUATION:
+            {
+                if( m_fragment_opcode == 0 )
+                {
+                    fail( ws_codec::CLOSE_PROTOCOL_ERROR );
+                    break;
+                }
+                if( len > MAX_MESSAGE - m_message_len )
+                {
+                    fail( ws_codec::CLOSE_TOO_BIG );
+                    break;
+                }
+                memcpy( m_message + m_message_len, payload, len );
+                m_message_len += len;
+                if( frame.fin )
+                {
+                    int opcode = m_fragment_opcode;
+                    m_fragment_opcode = 0;
+                    deliver( opcode, m_message, m_message_len );
+                }
+                break;
+            }
+        }
+    }
+
+    void deliver( int opcode, const unsigned char* data, int len )
+    {
+        if( opcode == ws_codec::TEXT && ! ws_codec::valid_utf8( data, len ) )
+        {
+            fail( ws_codec::CLOSE_INVALID_DATA );
+            return;
+        }
+        m_handler( this, opcode, ( const char* )data, len, m_arg );
+    }
+
+    /* 在持有 m_lock 时调用：用 sendmsg 把队列开头的若干个消息一次发送出去，直到队列为空或者 socket 发送缓冲已满 */
+    bool flush_locked()
+    {
+        while( m_count > 0 && ! m_broken )
+        {
+            struct iovec iov[ SEND_BATCH ];
+            int n = 0;
+            for( ; n < m_count && n < SEND_BATCH; ++n )
+            {
+                ws_message* message = m_queue[ ( m_head + n ) % QUEUE_SIZE ];
+                int offset = ( n == 0 ) ? m_offset : 0;
+                iov[n].iov_base = message->data + offset;
+                iov[n].iov_len = message->len - offset;
+            }
+            struct msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            ssize_t ret = sendmsg( m_sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT );
+            if( ret < 0 )
+            {
+                if( errno == EINTR )
+                {
+                    continue;
+                }
+                if( errno == EAGAIN || errno == EWOULDBLOCK )
+                {
+                    // 连接没有被任何线程处理，并且只注册了 EPOLLIN，必须替它注册 EPOLLOUT，否则剩下的消息要等到对方发来数据才会发送
+                    if( m_oneshot && m_armed && ! m_armed_out )
+                    {
+                        modfd( m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT );
+                        m_armed_out = true;
+                    }
+                    return true;
+                }
+                m_broken = true;
+                return false;
+            }
+            m_bytes_sent += ret;
+            while( ret > 0 )
+            {
+                ws_message* message = m_queue[ m_head ];
+                int left = message->len - m_offset;
+                if( ret < left )
+                {
+                    m_offset += ret;
+                    break;
+                }
+                ret -= left;
+                message->release();
+                m_head = ( m_head + 1 ) % QUEUE_SIZE;
+                --m_count;
+                m_offset = 0;
+            }
+        }
+        return ! m_broken;
+    }
+
+    void drop_queue()
+    {
+        for( int i = 0; i < m_count; ++i )
+        {
+            m_queue[ ( m_head + i ) % QUEUE_SIZE ]->release();
+        }
+        m_head = 0;
+        m_count = 0;
+        m_offset = 0;
+    }
+
+private:
+    friend class ws_room;
+
+    int m_sockfd;
+    int m_epollfd;
+    bool m_oneshot;
+    message_handler m_handler;
+    void* m_arg;
+
+    // 输入方向，只由处理连接的线程访问
+    unsigned char m_in[ INPUT_SIZE ];
+    int m_in_len;
+    // 正在重组的分片消息及其操作码，m_fragment_opcode 为 0 表示没有分片消息
+    unsigned char m_message[ MAX_MESSAGE ];
+    int m_message_len;
+    int m_fragment_opcode;
+    // 已经发出关闭帧
+    bool m_closing;
+
+    // 所在的房间和在房间成员数组中的下标，由房间的锁保护
+    ws_room* m_room;
+    int m_room_index;
+
+    // 输出方向，由 m_lock 保护
+    locker m_lock;
+    std::atomic< bool > m_open;
+    ws_message* m_queue[ QUEUE_SIZE ];
+    int m_head;
+    int m_count;
+    // 队列开头的消息已经发送的字节数
+    int m_offset;
+    // 连接已经重新注册（没有被任何线程处理），以及注册时是否包含 EPOLLOUT
+    bool m_armed;
+    bool m_armed_out;
+    // 发送出错或者接收者太慢
+    bool m_broken;
+    long long m_bytes_sent;
+};
+
+/* 一个聊天室：加入其中的会话都能收到广播。房间按名字（WebSocket 请求的路径）查找，第一次查找时创建。
+房间有引用计数：find 返回的引用在加入房间之后交给会话，会话关闭时释放；最后一个引用释放时房间从表中删除并释放，
+所以客户端随意构造的路径不会一直占用房间。
+广播时消息只编码一次，在房间的锁内放入每个成员的输出队列，所以所有成员收到消息的顺序都相同；
+发送（系统调用）放在锁外，多个线程可以同时向同一个房间广播 */
+class ws_room
+{
+public:
+    // 房间名的最大长度、同时存在的房间数和每个房间的成员数
+    static const int NAME_LEN = 64;
+    static const int MAX_ROOMS = 64;
+    static const int MAX_MEMBERS = 4096;
+
+    /* 查找名为 name 的房间并增加它的引用计数，不存在时创建。名字太长或者房间太多时返回 NULL。
+    调用者用完之后要调用 release，或者通过 join 把引用交给会话 */
+    static ws_room* find( const char* name, int len )
+    {
+        if( len >= NAME_LEN )
+        {
+            return NULL;
+        }
+        registry& table = rooms();
+        ws_room* room = NULL;
+        table.lock.lock();
+        for( int i = 0; i < table.count; ++i )
+        {
+            if( strncmp( table.rooms[i]->m_name, name, len ) == 0 && table.rooms[i]->m_name[ len ] == '\0' )
+            {
+                room = table.rooms[i];
+                break;
+            }
+        }
+        if( ! room && table.count < MAX_ROOMS )
+        {
+            room = new ws_room( name, len );
+            room->m_index = table.count;
+            table.rooms[ table.count++ ] = room;
+        }
+        if( room )
+        {
+            ++room->m_refs;
+        }
+        table.lock.unlock();
+        return room;
+    }
+
+    /* 释放 find 取得的引用。最后一个引用释放时房间已经没有成员，把它从表中删除并释放 */
+    void release()
+    {
+        registry& table = rooms();
+        table.lock.lock();
+        if( --m_refs > 0 )
+        {
+            table.lock.unlock();
+            return;
+        }
+        // 用最后一个房间填补空位
+        ws_room* last = table.rooms[ --table.count ];
+        table.rooms[ m_index ] = last;
+        last->m_index = m_index;
+        table.lock.unlock();
+        delete this;
+    }
+
+    const char* name() const { return m_name; }
+
+    /* 加入房间，调用者持有的引用交给会话，在会话关闭时释放。房间已满时释放这个引用并返回 false */
+    bool join( ws_session* session )
+    {
+        m_lock.lock();
+        if( m_count == MAX_MEMBERS )
+        {
+            m_lock.unlock();
+            release();
+            return false;
+        }
+        session->m_room = this;
+        session->m_room_index = m_count;
+        m_members[ m_count++ ] = session;
+        m_lock.unlock();
+        return true;
+    }
+
+    /* 离开房间。返回之后不会再有广播访问这个会话 */
+    void leave( ws_session* session )
+    {
+        m_lock.lock();
+        int index = session->m_room_index;
+        if( index >= 0 )
+        {
+            // 用最后一个成员填补空位
+            ws_session* last = m_members[ --m_count ];
+            m_members[ index ] = last;
+            last->m_room_index = index;
+            session->m_room_index = -1;
+        }
+        m_lock.unlock();
+    }
+
+    /* 把一个消息广播给房间中除 except 之外的所有成员，返回成功放入输出队列的成员数 */
+    int broadcast( int opcode, const char* data, int len, ws_session* except )
+    {
+        ws_message* message = ws_message::frame( opcode, data, len );
+        if( ! message )
+        {
+            return 0;
+        }
+        // 输出队列原来为空的成员由这次广播负责发送。会话对象不会被释放，离开房间之后再 flush 也是安全的
+        static thread_local ws_session* flush_list[ MAX_MEMBERS ];
+        int flush_count = 0;
+        int sent = 0;
+        m_lock.lock();
+        for( int i = 0; i < m_count; ++i )
+        {
+            bool first = false;
+            if( m_members[i] != except && m_members[i]->enqueue( message, &first ) )
+            {
+                ++sent;
+                if( first )
+                {
+                    flush_list[ flush_count++ ] = m_members[i];
+                }
+            }
+        }
+        m_lock.unlock();
+        message->release();
+        for( int i = 0; i < flush_count; ++i )
+        {
+            flush_list[i]->flush();
+        }
+        return sent;
+    }
+
+    /* 当前的成员数 */
+    int size()
+    {
+        m_lock.lock();
+        int count = m_count;
+        m_lock.unlock();
+        return count;
+    }
+
+private:
+    // 房间表，由 lock 保护。房间的引用计数也由它保护，这样查找和释放最后一个引用不会交错
+    struct registry
+    {
+        ws_room* rooms[ MAX_ROOMS ];
+        int count;
+        locker lock;
+    };
+
+    static registry& rooms()
+    {
+        static registry table;
+        return table;
+    }
+
+    ws_room( const char* name, int len ) : m_refs( 0 ), m_index( -1 ), m_count( 0 )
+    {
+        memcpy( m_name, name, len );
+        m_name[ len ] = '\0';
+    }
+
+private:
+    char m_name[ NAME_LEN ];
+    // 引用计数和在房间表中的位置，由房间表的锁保护
+    int m_refs;
+    int m_index;
+    // 成员数组，由 m_lock 保护。加锁的顺序总是先房间后会话，会话在离开房间时不持有自己的锁
+    locker m_lock;
+    ws_session* m_members[ MAX_MEMBERS ];
+    int m_count;
+};
+
+inline void ws_session::close()
+{
+    if( m_room )
+    {
+        m_room->leave( this );
+        m_room->release();
+        m_room = NULL;
+    }
+    m_lock.lock();
+    m_open = false;
+    m_armed = false;
+    drop_queue();
+    m_lock.unlock();
+}
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef TLS_H
+#define TLS_H
+
+/* HTTPS：握手由 OpenSSL 在用户态完成，之后由 OpenSSL 把会话密钥交给内核（kTLS，软件加密即可，不需要网卡卸载），
+内核在 TCP 层加密 socket 上发出的所有数据，于是 sendfile 和 splice 在加密连接上仍然是零拷贝的，http_conn 的发送路径不需要任何改变。
+内核不支持 kTLS（没有 tls 模块，或者协商出的密码套件内核不支持）时退回到用户态加密：消息体先读入缓冲，再用 SSL_write 发送。
+接收方向始终经过 SSL_read，请求很小，这里没有零拷贝的需要。
+只有定义了 HTTP_TLS 宏时才编译 OpenSSL 相关的代码（链接时需要 -lssl -lcrypto），否则只保留接口，tls_context 不能被创建。 */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <exception>
+#ifdef HTTP_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/* 服务器的 TLS 配置：证书、私钥以及是否尝试启用 kTLS，所有连接共享 */
+class tls_context
+{
+public:
+#ifdef HTTP_TLS
+    /* 加载 PEM 格式的证书链和私钥，失败时抛出异常。ktls 为 false 时总是用户态加密，用于对比 */
+    tls_context( const char* cert_file, const char* key_file, bool ktls )
+    {
+        m_ctx = SSL_CTX_new( TLS_server_method() );
+        if( ! m_ctx )
+        {
+            throw std::exception();
+        }
+        SSL_CTX_set_min_proto_version( m_ctx, TLS1_2_VERSION );
+        // 客户端不发送 close_notify 就关闭连接是很常见的，当作正常关闭处理
+        long options = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION;
+        if( ktls )
+        {
+            options |= SSL_OP_ENABLE_KTLS;
+        }
+        SSL_CTX_set_options( m_ctx, options );
+        // 不发送 TLS 1.3 的会话票据：握手完成之后不会再有 OpenSSL 自己要写的记录，发送路径可以完全交给内核
+        SSL_CTX_set_num_tickets( m_ctx, 0 );
+        // 非阻塞写：允许只写出一部分，重试时缓冲区的地址可以改变；空闲连接释放 OpenSSL 的读写缓冲
+        SSL_CTX_set_mode( m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS );
+        if( SSL_CTX_use_certificate_chain_file( m_ctx, cert_file ) != 1
+            || SSL_CTX_use_PrivateKey_file( m_ctx, key_file, SSL_FILETYPE_PEM ) != 1
+            || SSL_CTX_check_private_key( m_ctx ) != 1 )
+        {
+            SSL_CTX_free( m_ctx );
+            throw std::exception();
+        }
+    }
+
+    ~tls_context()
+    {
+        SSL_CTX_free( m_ctx );
+    }
+
+    SSL_CTX* get() const { return m_ctx; }
+#else
+    tls_context( const char* cert_file, const char* key_file, bool ktls )
+    {
+        throw std::exception();
+    }
+#endif
+
+private:
+#ifdef HTTP_TLS
+    SSL_CTX* m_ctx;
+#endif
+};
+
+/* 一个 TLS 连接。recv、send 的返回值和 errno 与同名的系统调用相同，http_conn 可以像使用 socket 一样使用它 */
+class tls_conn
+{
+public:
+    // 用户态加密时每次读入并加密的消息体长度，等于 TLS 记录的最大长度
+    static const int CHUNK_SIZE = 16384;
+
+#ifdef HTTP_TLS
+    tls_conn( tls_context* ctx, int sockfd ) : m_ready( false ), m_want_write( false ), m_ktls( false ),
+        m_buf( NULL ), m_buf_len( 0 ), m_buf_sent( 0 )
+    {
+        // SSL_new 失败时 m_ssl 为空，握手会失败，连接随之关闭
+        m_ssl = SSL_new( ctx->get() );
+        if( m_ssl )
+        {
+            SSL_set_fd( m_ssl, sockfd );
+            SSL_set_accept_state( m_ssl );
+        }
+    }
+
+    ~tls_conn()
+    {
+        SSL_free( m_ssl );
+        delete [] m_buf;
+    }
+
+    /* 推进握手。返回 1 表示握手完成，0 表示需要等待 socket 可读（want_write 为 false）或可写（want_write 为 true），-1 表示失败 */
+    int handshake()
+    {
+        if( ! m_ssl )
+        {
+            return -1;
+        }
+        ERR_clear_error();
+        int ret = SSL_do_handshake( m_ssl );
+        if( ret == 1 )
+        {
+            m_ready = true;
+            m_want_write = false;
+            // OpenSSL 在安装应用数据密钥时尝试设置 TCP_ULP "tls"，成功之后 socket 上的写操作都由内核加密
+            m_ktls = BIO_get_ktls_send( SSL_get_wbio( m_ssl ) );
+            return 1;
+        }
+        int err = SSL_get_error( m_ssl, ret );
+        if( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE )
+        {
+            m_want_write = ( err == SSL_ERROR_WANT_WRITE );
+            return 0;
+        }
+        return -1;
+    }
+
+    int recv( char* buf, int len )
+    {
+        ERR_clear_error();
+        int ret = SSL_read( m_ssl, buf, len );
+        return ( ret > 0 ) ? ret : io_error( ret );
+    }
+
+    int send( const char* buf, int len )
+    {
+        ERR_clear_error();
+        int ret = SSL_write( m_ssl, buf, len );
+        if( ret > 0 )
+        {
+            return ret;
+        }
+        ret = io_error( ret );
+        if( ret == 0 )
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        return ret;
+    }
+
+    /* OpenSSL 中已经解密、还没有被读走的数据的字节数。这些数据不在 socket 中，不会再触发 EPOLLIN */
+    int pending() const { return SSL_pending( m_ssl ); }
+
+    /* 尽力发送 close_notify，不等待对方的回应 */
+    void shutdown()
+    {
+        if( m_ready )
+        {
+            ERR_clear_error();
+            SSL_shutdown( m_ssl );
+        }
+    }
+#else
+    tls_conn( tls_context* ctx, int sockfd ) : m_ready( false ), m_want_write( false ), m_ktls( false ),
+        m_buf( NULL ), m_buf_len( 0 ), m_buf_sent( 0 ) {}
+    ~tls_conn() { delete [] m_buf; }
+    int handshake() { return -1; }
+    int recv( char* buf, int len ) { errno = EPROTO; return -1; }
+    int send( const char* buf, int len ) { errno = EPROTO; return -1; }
+    int pending() const { return 0; }
+    void shutdown() {}
+#endif
+
+    bool ready() const { return m_ready; }
+    bool want_write() const { return m_want_write; }
+    /* 内核负责加密：send、sendfile 和 splice 可以直接作用于 socket */
+    bool ktls() const { return m_ktls; }
+
+    /* 用户态加密时发送消息体：从 fd 的 *offset 处（offset 为 NULL 时从 fd 的当前位置，例如管道）读入至多 len 字节，
+    用 SSL_write 发送。和 sendfile 一样返回从 fd 读入的字节数，0 表示 fd 中已经没有数据。
+    没有发送完的部分留在缓冲中，之后由 flush 发送，缓冲非空时不能再调用这个函数 */
+    int send_body( int fd, off_t* offset, int len )
+    {
+        if( ! m_buf )
+        {
+            m_buf = new char[ CHUNK_SIZE ];
+        }
+        if( len > CHUNK_SIZE )
+        {
+            len = CHUNK_SIZE;
+        }
+        int ret = offset ? pread( fd, m_buf, len, *offset ) : ::read( fd, m_buf, len );
+        if( ret <= 0 )
+        {
+            return ret;
+        }
+        if( offset )
+        {
+            *offset += ret;
+        }
+        m_buf_len = ret;
+        m_buf_sent = 0;
+        return ( flush() < 0 ) ? -1 : ret;
+    }
+
+    /* 发送缓冲中剩下的消息体。返回 1 表示已经发送完，0 表示 socket 发送缓冲已满，-1 表示出错 */
+    int flush()
+    {
+        while( m_buf_sent < m_buf_len )
+        {
+            // SSL_write 返回 WANT_WRITE 之后必须用同样的数据重试，缓冲中的数据正好满足这个要求
+            int ret = send( m_buf + m_buf_sent, m_buf_len - m_buf_sent );
+            if( ret < 0 )
+            {
+                return ( errno == EAGAIN ) ? 0 : -1;
+            }
+            m_buf_sent += ret;
+        }
+        return 1;
+    }
+
+    /* 缓冲中还有没发送完的消息体 */
+    bool buffered() const { return m_buf_sent < m_buf_len; }
+
+private:
+#ifdef HTTP_TLS
+    /* 把 SSL_read、SSL_write 的失败转换为系统调用的形式：需要等待时返回 -1 并把 errno 置为 EAGAIN，
+    对方正常关闭时返回 0，其他错误返回 -1 */
+    int io_error( int ret )
+    {
+        int err = SSL_get_error( m_ssl, ret );
+        if( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE )
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if( err == SSL_ERROR_ZERO_RETURN )
+        {
+            return 0;
+        }
+        if( err != SSL_ERROR_SYSCALL || errno == 0 || errno == EAGAIN )
+        {
+            errno = EPROTO;
+        }
+        return -1;
+    }
+
+    SSL* m_ssl;
+#endif
+    // 握手已经完成，以及握手在等待可写事件
+    bool m_ready;
+    bool m_want_write;
+    bool m_ktls;
+    // 用户态加密时的消息体缓冲，以及其中已经发送的字节数
+    char* m_buf;
+    int m_buf_len;
+    int m_buf_sent;
+};
+
+#endif
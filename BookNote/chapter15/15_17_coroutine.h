@@ -0,0 +1,204 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+/* 用 C++20 协程把按事件分段执行的解析逻辑写成顺序的代码：数据不够时 co_await 挂起，读入新数据之后从挂起的地方继续，
+解析进度保存在协程帧中，不再需要用状态变量和返回码把它串起来。
+挂起和恢复本身不分配内存，只有创建协程时需要分配一个协程帧。协程帧由每个线程的 frame_pool 按大小分级缓存，
+稳定运行时每个请求的协程帧都来自缓存，不会调用 malloc。
+只有定义了 HTTP_COROUTINE 宏时才编译（需要 -std=c++20），否则 http_conn 使用原来的状态机。 */
+
+#ifdef HTTP_COROUTINE
+
+#include <stdlib.h>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <atomic>
+
+/* 协程帧的分配器。每个线程按 64 字节分级缓存释放的协程帧，分配时优先从当前线程的缓存中取出。
+EPOLLONESHOT 模式下一个连接的协程可能在一个工作线程中创建、在另一个工作线程中释放，释放的帧进入释放线程的缓存，
+每一级的缓存有上限，超出时归还给 malloc，线程之间的不均衡不会让缓存无限增长。线程退出时缓存中的帧全部归还给 malloc */
+class frame_pool
+{
+public:
+    // 分级的粒度、缓存的最大帧长度，以及每一级最多缓存的帧数
+    static const size_t GRANULE = 64;
+    static const size_t MAX_FRAME = 1024;
+    static const int MAX_CACHED = 256;
+
+private:
+    static const int CLASSES = MAX_FRAME / GRANULE;
+
+    // 缓存中的帧用开头的字节链接起来
+    struct free_frame
+    {
+        free_frame* next;
+    };
+
+    /* 一个线程的缓存，线程退出时析构 */
+    struct cache
+    {
+        free_frame* head[ CLASSES ];
+        int count[ CLASSES ];
+
+        cache() : head(), count() {}
+        /* 释放缓存中的帧。之后（线程局部变量析构期间）再释放的帧不再进入缓存，直接归还给 malloc */
+        ~cache()
+        {
+            for( int c = 0; c < CLASSES; ++c )
+            {
+                while( head[c] )
+                {
+                    free_frame* next = head[c]->next;
+                    free( head[c] );
+                    head[c] = next;
+                }
+                count[c] = MAX_CACHED;
+            }
+        }
+    };
+
+public:
+    static void* allocate( size_t size )
+    {
+        if( size > MAX_FRAME )
+        {
+            return heap_allocate( size );
+        }
+        int c = size_class( size );
+        cache& local = local_cache();
+        free_frame* frame = local.head[c];
+        if( ! frame )
+        {
+            return heap_allocate( ( c + 1 ) * GRANULE );
+        }
+        local.head[c] = frame->next;
+        --local.count[c];
+        return frame;
+    }
+
+    static void deallocate( void* ptr, size_t size )
+    {
+        if( size > MAX_FRAME )
+        {
+            free( ptr );
+            return;
+        }
+        int c = size_class( size );
+        cache& local = local_cache();
+        if( local.count[c] >= MAX_CACHED )
+        {
+            free( ptr );
+            return;
+        }
+        free_frame* frame = static_cast< free_frame* >( ptr );
+        frame->next = local.head[c];
+        local.head[c] = frame;
+        ++local.count[c];
+    }
+
+    /* 所有线程缓存没有命中、调用 malloc 分配协程帧的次数 */
+    static long heap_allocations() { return heap_count().load( std::memory_order_relaxed ); }
+
+private:
+    static int size_class( size_t size ) { return ( size + GRANULE - 1 ) / GRANULE - 1; }
+
+    static void* heap_allocate( size_t size )
+    {
+        heap_count().fetch_add( 1, std::memory_order_relaxed );
+        void* ptr = malloc( size );
+        if( ! ptr )
+        {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    /* 当前线程的缓存 */
+    static cache& local_cache()
+    {
+        static thread_local cache local;
+        return local;
+    }
+
+    static std::atomic< long >& heap_count()
+    {
+        static std::atomic< long > count( 0 );
+        return count;
+    }
+};
+
+/* 一个返回 T 的协程。协程创建之后先挂起，由持有者调用 resume 开始和继续执行；执行完之后停在最终挂起点，
+持有者通过 result 取出返回值，task 析构时销毁协程帧。task 只能移动，不能复制 */
+template< typename T >
+class task
+{
+public:
+    struct promise_type
+    {
+        T value;
+
+        task get_return_object() { return task( std::coroutine_handle< promise_type >::from_promise( *this ) ); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value( T v ) { value = v; }
+        // 协程中的代码不抛出异常，出现异常说明程序有错误
+        void unhandled_exception() { std::terminate(); }
+
+        // 协程帧从当前线程的缓存中分配
+        static void* operator new( size_t size ) { return frame_pool::allocate( size ); }
+        static void operator delete( void* ptr, size_t size ) { frame_pool::deallocate( ptr, size ); }
+    };
+
+    task() : m_handle( NULL ) {}
+    task( task&& other ) noexcept : m_handle( other.m_handle ) { other.m_handle = NULL; }
+    task& operator=( task&& other ) noexcept
+    {
+        if( this != &other )
+        {
+            reset();
+            m_handle = other.m_handle;
+            other.m_handle = NULL;
+        }
+        return *this;
+    }
+    task( const task& ) = delete;
+    task& operator=( const task& ) = delete;
+    ~task() { reset(); }
+
+    /* 协程已经创建，还没有被 reset */
+    bool valid() const { return m_handle != NULL; }
+    /* 协程已经执行到 co_return */
+    bool done() const { return m_handle.done(); }
+    /* 从上一个挂起点继续执行，直到下一次挂起或者执行完 */
+    void resume() { m_handle.resume(); }
+    T result() const { return m_handle.promise().value; }
+
+    /* 销毁协程帧，协程不必已经执行完：挂起中的协程帧中的局部变量也会被正确地析构 */
+    void reset()
+    {
+        if( m_handle )
+        {
+            m_handle.destroy();
+            m_handle = NULL;
+        }
+    }
+
+private:
+    explicit task( std::coroutine_handle< promise_type > handle ) : m_handle( handle ) {}
+
+    std::coroutine_handle< promise_type > m_handle;
+};
+
+/* 等待连接读入更多数据：总是挂起，控制权回到调用 resume 的地方。
+读取仍然由事件循环完成（EPOLLONESHOT 模式下在主线程中），之后处理连接的线程再恢复协程，协程重新检查缓冲中的数据 */
+struct read_some
+{
+    bool await_ready() const noexcept { return false; }
+    void await_suspend( std::coroutine_handle<> ) const noexcept {}
+    void await_resume() const noexcept {}
+};
+
+#endif
+
+#endif
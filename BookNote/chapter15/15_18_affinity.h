@@ -0,0 +1,296 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <new>
+#include <exception>
+
+/* CPU 和 NUMA 节点的亲和性。默认情况下线程运行在调度器选择的任意 CPU 上，多路服务器上一个连接的数据会在节点之间来回迁移：
+连接对象由主线程构造，落在主线程所在节点的内存中，处理它的线程却可能在另一个节点上，每次访问都要跨越节点互联。
+这里提供把线程固定到指定 CPU、查询 CPU 所在的节点、找出网卡中断所在的 CPU，以及让一段内存从指定节点分配的工具。
+内存策略直接使用 mbind 系统调用，不依赖 libnuma。 */
+
+/* 一组 CPU 编号，按照内核 cpulist 的格式解析，例如 "0-3,8,10-11" */
+class cpu_list
+{
+public:
+    static const int MAX_CPUS = CPU_SETSIZE;
+
+    cpu_list() : m_count( 0 ) {}
+
+    /* 解析 cpulist 格式的字符串并追加到列表中，格式错误时返回 false */
+    bool parse( const char* text )
+    {
+        while( *text && *text != '\n' )
+        {
+            char* end = NULL;
+            long first = strtol( text, &end, 10 );
+            if( end == text || first < 0 || first >= MAX_CPUS )
+            {
+                return false;
+            }
+            long last = first;
+            text = end;
+            if( *text == '-' )
+            {
+                last = strtol( text + 1, &end, 10 );
+                if( end == text + 1 || last < first || last >= MAX_CPUS )
+                {
+                    return false;
+                }
+                text = end;
+            }
+            for( long cpu = first; cpu <= last; ++cpu )
+            {
+                add( cpu );
+            }
+            if( *text == ',' )
+            {
+                ++text;
+            }
+            else if( *text && *text != '\n' )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* 读取 cpulist 格式的文件（sysfs 和 procfs 中的 *_list 文件）并追加到列表中 */
+    bool load( const char* path )
+    {
+        char buf[ 4096 ];
+        FILE* fp = fopen( path, "r" );
+        if( ! fp )
+        {
+            return false;
+        }
+        bool ok = fgets( buf, sizeof( buf ), fp ) && parse( buf );
+        fclose( fp );
+        return ok;
+    }
+
+    /* 追加一个 CPU，已经在列表中时忽略 */
+    void add( int cpu )
+    {
+        if( ! contains( cpu ) && m_count < MAX_CPUS )
+        {
+            m_cpus[ m_count++ ] = cpu;
+        }
+    }
+
+    bool contains( int cpu ) const
+    {
+        for( int i = 0; i < m_count; ++i )
+        {
+            if( m_cpus[i] == cpu )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+    /* 第 i 个 CPU，i 超出列表长度时循环使用，便于把任意多个线程轮流分配到这些 CPU 上 */
+    int at( int i ) const { return m_cpus[ i % m_count ]; }
+
+private:
+    int m_cpus[ MAX_CPUS ];
+    int m_count;
+};
+
+class affinity
+{
+public:
+    /* cpu 所在的 NUMA 节点。没有 NUMA 信息（单节点或者不支持 NUMA 的内核）时返回 0 */
+    static int node_of( int cpu )
+    {
+        char path[ 64 ];
+        snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d", cpu );
+        DIR* dir = opendir( path );
+        if( ! dir )
+        {
+            return 0;
+        }
+        int node = 0;
+        struct dirent* entry;
+        while( ( entry = readdir( dir ) ) != NULL )
+        {
+            if( strncmp( entry->d_name, "node", 4 ) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9' )
+            {
+                node = atoi( entry->d_name + 4 );
+                break;
+            }
+        }
+        closedir( dir );
+        return node;
+    }
+
+    /* 节点 node 上的所有 CPU */
+    static bool node_cpus( int node, cpu_list* cpus )
+    {
+        char path[ 64 ];
+        snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", node );
+        return cpus->load( path );
+    }
+
+    /* 网卡 ifname 的收发队列中断所在的 CPU。在 /proc/interrupts 中查找名字里带有网卡名（如 eth0-TxRx-3）
+    或者网卡设备名（如 virtio3-input.0、mlx5_comp3@pci:0000:3b:00.0）的中断，跳过配置和异步事件中断，
+    再从 /proc/irq/N/effective_affinity_list（旧内核没有时用 smp_affinity_list）读出它们实际所在的 CPU。
+    没有找到任何中断时返回 false */
+    static bool irq_cpus( const char* ifname, cpu_list* cpus )
+    {
+        // /sys/class/net/<ifname>/device 指向网卡设备，它的名字出现在很多驱动注册的中断名中
+        char path[ 256 ];
+        char device[ 256 ] = "";
+        snprintf( path, sizeof( path ), "/sys/class/net/%s/device", ifname );
+        char target[ 256 ];
+        ssize_t len = readlink( path, target, sizeof( target ) - 1 );
+        if( len > 0 )
+        {
+            target[ len ] = '\0';
+            snprintf( device, sizeof( device ), "%s", basename( target ) );
+        }
+
+        FILE* fp = fopen( "/proc/interrupts", "r" );
+        if( ! fp )
+        {
+            return false;
+        }
+        bool found = false;
+        char line[ 4096 ];
+        while( fgets( line, sizeof( line ), fp ) )
+        {
+            char* end = NULL;
+            long irq = strtol( line, &end, 10 );
+            if( end == line || *end != ':' )
+            {
+                continue;
+            }
+            line[ strcspn( line, "\n" ) ] = '\0';
+            char* name = strrchr( line, ' ' );
+            name = name ? name + 1 : line;
+            bool match = strstr( name, ifname ) || ( device[0] && strstr( name, device ) );
+            if( ! match || strstr( name, "config" ) || strstr( name, "async" ) )
+            {
+                continue;
+            }
+            snprintf( path, sizeof( path ), "/proc/irq/%ld/effective_affinity_list", irq );
+            cpu_list irq_list;
+            if( ! irq_list.load( path ) || irq_list.empty() )
+            {
+                snprintf( path, sizeof( path ), "/proc/irq/%ld/smp_affinity_list", irq );
+                irq_list.load( path );
+            }
+            for( int i = 0; i < irq_list.size(); ++i )
+            {
+                cpus->add( irq_list.at( i ) );
+                found = true;
+            }
+        }
+        fclose( fp );
+        return found;
+    }
+
+    /* 设置线程属性，使用它创建的线程只运行在 cpu 上。线程从创建时起就固定在这个 CPU 上，
+    它第一次访问的内存（线程局部的缓存、栈以及 malloc 分配区）都从所在节点分配 */
+    static bool set_attr( pthread_attr_t* attr, int cpu )
+    {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        return pthread_attr_setaffinity_np( attr, sizeof( set ), &set ) == 0;
+    }
+
+    /* 把调用线程固定到 cpu 上 */
+    static bool pin_self( int cpu )
+    {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+    }
+
+    /* 让 [addr, addr + len) 中还没有分配物理页的内存优先从节点 node 分配（MPOL_PREFERRED），
+    不论是哪个线程第一次访问它。addr 必须按页对齐 */
+    static bool prefer_node( void* addr, size_t len, int node )
+    {
+        const int MPOL_PREFERRED_MODE = 1;
+        if( node < 0 || node >= ( int )( sizeof( unsigned long ) * 8 ) )
+        {
+            return false;
+        }
+        unsigned long mask = 1UL << node;
+        return syscall( SYS_mbind, addr, len, MPOL_PREFERRED_MODE, &mask, sizeof( mask ) * 8, 0 ) == 0;
+    }
+};
+
+/* 一个节点本地的对象表：内存用 mmap 保留，并通过 prefer_node 从指定节点分配；对象在第一次被 get 时才构造，
+没有用到的表项不占用物理内存。表项的下标就是连接的文件描述符，和 http_conn 数组的用法相同 */
+template< typename T >
+class node_table
+{
+public:
+    node_table( int size, int node ) : m_size( size ), m_node( node )
+    {
+        m_bytes = sizeof( T ) * size;
+        void* mem = mmap( NULL, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        if( mem == MAP_FAILED )
+        {
+            throw std::exception();
+        }
+        m_objects = static_cast< T* >( mem );
+        // 单节点的机器上 mbind 可能失败，这时退回到默认的首次访问分配，不影响正确性
+        affinity::prefer_node( mem, m_bytes, m_node );
+        m_built = new unsigned char[ size ]();
+    }
+
+    ~node_table()
+    {
+        for( int i = 0; i < m_size; ++i )
+        {
+            if( m_built[i] )
+            {
+                m_objects[i].~T();
+            }
+        }
+        delete [] m_built;
+        munmap( m_objects, m_bytes );
+    }
+
+    /* 第 i 个对象，第一次访问时构造 */
+    T* get( int i )
+    {
+        if( ! m_built[i] )
+        {
+            new ( m_objects + i ) T;
+            m_built[i] = 1;
+        }
+        return m_objects + i;
+    }
+
+    /* 表的起始地址。已经通过 get 构造过的表项可以直接用下标访问 */
+    T* data() { return m_objects; }
+    int node() const { return m_node; }
+
+private:
+    T* m_objects;
+    unsigned char* m_built;
+    size_t m_bytes;
+    int m_size;
+    int m_node;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <atomic>
+#include "chapter14/14_2_locker.h"
+
+/* 线程池中的通用任务：任意一个没有参数、没有返回值的可调用对象（lambda、函数指针、函数对象），只能移动，不能复制。
+std::function 要求可调用对象可以复制，并且在 libstdc++ 中只能在对象内部保存 16 字节，捕获稍多一点的 lambda 就要在堆上分配。
+task_function 在对象内部保留 INLINE_SIZE 字节（小缓冲区优化），大小和对齐都满足要求、移动时不抛出异常的可调用对象直接构造在这里，
+只有更大的可调用对象才在堆上分配（并计入 heap_count）。 */
+class task_function
+{
+public:
+    // 对象内部保存可调用对象的空间
+    static const size_t INLINE_SIZE = 48;
+
+    task_function() : m_ops( NULL ) {}
+    task_function( task_function&& other ) : m_ops( NULL ) { move_from( other ); }
+    task_function& operator=( task_function&& other )
+    {
+        if( this != &other )
+        {
+            reset();
+            move_from( other );
+        }
+        return *this;
+    }
+    task_function( const task_function& ) = delete;
+    task_function& operator=( const task_function& ) = delete;
+    ~task_function() { reset(); }
+
+    /* 保存可调用对象 f，原来保存的对象先被销毁 */
+    template< typename F >
+    void assign( F&& f )
+    {
+        typedef typename std::decay< F >::type callable;
+        reset();
+        if( fits_inline< callable >() )
+        {
+            new ( m_storage ) callable( std::forward< F >( f ) );
+            m_ops = &inline_ops< callable >::table;
+        }
+        else
+        {
+            heap_counter().fetch_add( 1, std::memory_order_relaxed );
+            *reinterpret_cast< callable** >( m_storage ) = new callable( std::forward< F >( f ) );
+            m_ops = &heap_ops< callable >::table;
+        }
+    }
+
+    /* 调用保存的可调用对象，必须已经保存了一个 */
+    void operator()() { m_ops->invoke( m_storage ); }
+    explicit operator bool() const { return m_ops != NULL; }
+
+    /* 销毁保存的可调用对象 */
+    void reset()
+    {
+        if( m_ops )
+        {
+            m_ops->destroy( m_storage );
+            m_ops = NULL;
+        }
+    }
+
+    /* 因为太大而在堆上分配的可调用对象的个数 */
+    static long heap_count() { return heap_counter().load( std::memory_order_relaxed ); }
+
+private:
+    /* 对保存的可调用对象的操作，每种可调用对象类型一张表 */
+    struct ops
+    {
+        void ( *invoke )( void* storage );
+        void ( *move )( void* dst, void* src );
+        void ( *destroy )( void* storage );
+    };
+
+    template< typename F >
+    static constexpr bool fits_inline()
+    {
+        return sizeof( F ) <= INLINE_SIZE && alignof( F ) <= alignof( max_align_t ) && std::is_nothrow_move_constructible< F >::value;
+    }
+
+    /* 可调用对象直接构造在 m_storage 中 */
+    template< typename F >
+    struct inline_ops
+    {
+        static void invoke( void* storage ) { ( *static_cast< F* >( storage ) )(); }
+        static void move( void* dst, void* src )
+        {
+            new ( dst ) F( std::move( *static_cast< F* >( src ) ) );
+            static_cast< F* >( src )->~F();
+        }
+        static void destroy( void* storage ) { static_cast< F* >( storage )->~F(); }
+        static const ops table;
+    };
+
+    /* m_storage 中只保存指向堆上的可调用对象的指针 */
+    template< typename F >
+    struct heap_ops
+    {
+        static void invoke( void* storage ) { ( **static_cast< F** >( storage ) )(); }
+        static void move( void* dst, void* src ) { *static_cast< F** >( dst ) = *static_cast< F** >( src ); }
+        static void destroy( void* storage ) { delete *static_cast< F** >( storage ); }
+        static const ops table;
+    };
+
+    void move_from( task_function& other )
+    {
+        if( other.m_ops )
+        {
+            other.m_ops->move( m_storage, other.m_storage );
+            m_ops = other.m_ops;
+            other.m_ops = NULL;
+        }
+    }
+
+    static std::atomic< long >& heap_counter()
+    {
+        static std::atomic< long > count( 0 );
+        return count;
+    }
+
+    alignas( max_align_t ) unsigned char m_storage[ INLINE_SIZE ];
+    const ops* m_ops;
+};
+
+template< typename F >
+const task_function::ops task_function::inline_ops< F >::table = { &inline_ops< F >::invoke, &inline_ops< F >::move, &inline_ops< F >::destroy };
+
+template< typename F >
+const task_function::ops task_function::heap_ops< F >::table = { &heap_ops< F >::invoke, &heap_ops< F >::move, &heap_ops< F >::destroy };
+
+/* 任务完成的通知。提交者持有它（在栈上或者作为成员），提交时把它的地址交给线程池，之后用 wait 等待任务执行完。
+它不分配内存，wait 返回之后可以 reset 并用于下一个任务。提交之后必须调用 wait 才能销毁它：线程池在任务执行完之后还要访问它 */
+class task_completion
+{
+public:
+    task_completion() : m_state( PENDING ) {}
+
+    /* 等待任务结束。返回 true 表示任务被执行，false 表示任务因为过载被丢弃，没有执行 */
+    bool wait()
+    {
+        while( ! m_done.wait() )
+        {
+        }
+        return m_state.load( std::memory_order_acquire ) == DONE;
+    }
+
+    /* 任务已经结束，不等待 */
+    bool done() const { return m_state.load( std::memory_order_acquire ) != PENDING; }
+
+    void reset() { m_state.store( PENDING, std::memory_order_relaxed ); }
+
+    /* 由线程池在任务结束时调用 */
+    void finish( bool executed )
+    {
+        m_state.store( executed ? DONE : CANCELLED, std::memory_order_release );
+        m_done.post();
+    }
+
+private:
+    enum { PENDING = 0, DONE, CANCELLED };
+    std::atomic< int > m_state;
+    sem m_done;
+};
+
+#endif
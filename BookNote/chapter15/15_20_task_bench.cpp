@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <functional>
+
+#include "chapter15/15_3_threadpool.h"
+
+/* 通用任务的分配开销测试：统计每个任务调用 malloc 的次数和平均耗时。
+编译：g++ -std=c++11 -O2 -I.. 15_20_task_bench.cpp -o task_bench -lpthread
+运行：./task_bench [任务数] [线程数]
+提交的任务都必须执行：有任务被过载控制丢弃、或者累加的结果不对时以非零状态退出 */
+
+/* 替换 glibc 的 malloc 系列函数，统计整个进程中的分配次数（operator new 最终也调用 malloc） */
+extern "C" void* __libc_malloc( size_t size );
+extern "C" void* __libc_calloc( size_t n, size_t size );
+extern "C" void* __libc_realloc( void* ptr, size_t size );
+extern "C" void __libc_free( void* ptr );
+
+static std::atomic< long > malloc_count( 0 );
+
+extern "C" void* malloc( size_t size )
+{
+    malloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_malloc( size );
+}
+
+extern "C" void* calloc( size_t n, size_t size )
+{
+    malloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_calloc( n, size );
+}
+
+extern "C" void* realloc( void* ptr, size_t size )
+{
+    malloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_realloc( ptr, size );
+}
+
+extern "C" void free( void* ptr )
+{
+    __libc_free( ptr );
+}
+
+/* 线程池的模板参数，这里只提交通用任务 */
+struct no_request
+{
+    void process() {}
+    void shed() {}
+};
+
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* 任务捕获的数据，大小和一个带有几个指针和长度的回调相当 */
+struct payload
+{
+    long values[4];
+    std::atomic< long >* sum;
+};
+
+static void report( const char* name, long tasks, long mallocs, long long us )
+{
+    printf( "%-28s %8ld tasks  %6.3f mallocs/task  %7.1f ns/task\n", name, tasks, ( double )mallocs / tasks, us * 1000.0 / tasks );
+}
+
+int main( int argc, char* argv[] )
+{
+    long tasks = ( argc > 1 ) ? atol( argv[1] ) : 1000000;
+    int threads = ( argc > 2 ) ? atoi( argv[2] ) : 4;
+    if( tasks <= 0 || threads <= 0 )
+    {
+        printf( "usage: %s [tasks] [threads]\n", basename( argv[0] ) );
+        return 1;
+    }
+
+    threadpool< no_request >* pool = new threadpool< no_request >( threads );
+    std::atomic< long > sum( 0 );
+    payload data = { { 1, 2, 3, 4 }, &sum };
+    task_completion done;
+
+    /* 预热：让队列的环形缓冲、线程的栈和 libc 的内部缓存都分配好，不计入结果 */
+    for( int i = 0; i < 1000; ++i )
+    {
+        done.reset();
+        pool->submit( [data]() { data.sum->fetch_add( data.values[0], std::memory_order_relaxed ); }, &done );
+        done.wait();
+    }
+
+    /* 1. 连续提交，不等待结果。槽位用完时 submit 返回 false，让出 CPU 之后重试 */
+    long mallocs = malloc_count.load();
+    long long start = now_us();
+    for( long i = 0; i < tasks; )
+    {
+        if( pool->submit( [data]() { data.sum->fetch_add( data.values[1], std::memory_order_relaxed ); } ) )
+        {
+            ++i;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    // 最后提交一个带通知的任务，等它执行完：同一个类别的任务按顺序取出，它之前的任务都已经被取走
+    done.reset();
+    while( ! pool->submit( [data]() { data.sum->fetch_add( data.values[0], std::memory_order_relaxed ); }, &done ) )
+    {
+        sched_yield();
+    }
+    done.wait();
+    report( "task_function submit", tasks, malloc_count.load() - mallocs, now_us() - start );
+
+    /* 2. 提交之后等待完成，测量一次往返 */
+    long round_trips = tasks / 10;
+    mallocs = malloc_count.load();
+    start = now_us();
+    for( long i = 0; i < round_trips; ++i )
+    {
+        done.reset();
+        pool->submit( [data]() { data.sum->fetch_add( data.values[2], std::memory_order_relaxed ); }, &done );
+        done.wait();
+    }
+    report( "task_function submit+wait", round_trips, malloc_count.load() - mallocs, now_us() - start );
+
+    /* 3. 对照：同样的捕获放进 std::function，它只能在对象内部保存 16 字节 */
+    mallocs = malloc_count.load();
+    start = now_us();
+    for( long i = 0; i < tasks; ++i )
+    {
+        std::function< void() > fn = [data]() { data.sum->fetch_add( data.values[3], std::memory_order_relaxed ); };
+        fn();
+    }
+    report( "std::function construct", tasks, malloc_count.load() - mallocs, now_us() - start );
+
+    long pool_shed = pool->shed_count();
+    delete pool;
+    // 预热、测试 1 最后的任务、测试 1、2、3 分别累加 values[0..3]
+    long expected = 1000 * data.values[0] + data.values[0] + tasks * data.values[1] + round_trips * data.values[2] + tasks * data.values[3];
+    printf( "heap-allocated task_function: %ld, shed: %ld, sum: %ld (expected %ld)\n", task_function::heap_count(), pool_shed, sum.load(), expected );
+    if( pool_shed != 0 || sum.load() != expected )
+    {
+        printf( "FAILED: submitted tasks were dropped\n" );
+        return 1;
+    }
+    return 0;
+}
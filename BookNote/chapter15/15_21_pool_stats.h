@@ -0,0 +1,89 @@
+#ifndef POOL_STATS_H
+#define POOL_STATS_H
+
+#include <stdio.h>
+#include <atomic>
+#include "chapter14/14_8_cycle_clock.h"
+
+/* 线程池的运行统计：每个任务在队列中等待的时间、处理的时间，以及每个工作线程忙碌和空闲的时间。
+线程池的大小取决于任务中有多少时间阻塞在 I/O 上，只看 CPU 使用率无法判断；有了这些数据，平均忙碌的线程数（Little 定律）
+和排队时间的分布直接说明线程是否够用。统计始终开启：每个任务只多读两次时间戳计数器，计数由各个工作线程写入自己的槽位，没有共享的写。 */
+
+/* 一个工作线程的统计，只有它自己写入。前后各填充一个缓存行，相邻线程的计数不会落在同一个缓存行中、互相使对方的缓存行失效。
+不用 alignas( 64 )：它嵌在线程池对象中，C++17 之前 new 不保证超过 16 字节的对齐，对齐的要求反而得不到满足 */
+struct worker_stats
+{
+    char pad_before[ 64 ];
+    // 任务在队列中等待的时间和处理的时间
+    latency_histogram wait;
+    latency_histogram service;
+    // 处理任务的时间、在信号量上睡眠的时间（纳秒）和处理的任务数。两者之外是取任务、加锁等开销
+    std::atomic< long long > busy_ns;
+    std::atomic< long long > idle_ns;
+    std::atomic< long > tasks;
+    char pad_after[ 64 ];
+
+    worker_stats() : busy_ns( 0 ), idle_ns( 0 ), tasks( 0 ) {}
+
+    void add_busy( long long ns )
+    {
+        busy_ns.store( busy_ns.load( std::memory_order_relaxed ) + ns, std::memory_order_relaxed );
+        tasks.store( tasks.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+    }
+
+    void add_idle( long long ns )
+    {
+        idle_ns.store( idle_ns.load( std::memory_order_relaxed ) + ns, std::memory_order_relaxed );
+    }
+};
+
+/* 线程池统计的一份快照，由 threadpool::stats 填写 */
+struct pool_stats
+{
+    static const int MAX_WORKERS = 256;
+
+    /* 一个用过的线程槽位。弹性伸缩中退出的线程的统计保留在槽位中，之后在这个槽位上创建的线程继续累加 */
+    struct worker
+    {
+        int slot;
+        bool running;
+        long tasks;
+        long long busy_ns;
+        long long idle_ns;
+    };
+
+    // 所有线程合并的等待时间和处理时间
+    latency_histogram wait;
+    latency_histogram service;
+    // 线程池创建以来的时间、当前的线程数
+    long long elapsed_ns;
+    int threads;
+    worker workers[ MAX_WORKERS ];
+    int worker_count;
+
+    pool_stats() : elapsed_ns( 0 ), threads( 0 ), worker_count( 0 ) {}
+
+    /* 输出快照。平均忙碌的线程数是所有线程处理任务的时间之和除以经过的时间，也就是持续处理这样的负载所需的线程数；
+    它接近线程数、同时等待时间在增长时，线程池偏小 */
+    void print( FILE* fp ) const
+    {
+        long long busy = 0;
+        for( int i = 0; i < worker_count; ++i )
+        {
+            busy += workers[i].busy_ns;
+        }
+        double seconds = elapsed_ns / 1e9;
+        fprintf( fp, "pool stats over %.1fs (%s clock): threads %d, average busy threads %.2f\n", seconds,
+                 cycle_clock::uses_tsc() ? "tsc" : "monotonic", threads, elapsed_ns > 0 ? ( double )busy / elapsed_ns : 0.0 );
+        wait.print( fp, "  queue wait" );
+        service.print( fp, "  service" );
+        for( int i = 0; i < worker_count; ++i )
+        {
+            const worker& w = workers[i];
+            fprintf( fp, "  worker %d%s: tasks %ld, busy %.1f%%, idle %.1f%%\n", w.slot, w.running ? "" : " (exited)", w.tasks,
+                     elapsed_ns > 0 ? 100.0 * w.busy_ns / elapsed_ns : 0.0, elapsed_ns > 0 ? 100.0 * w.idle_ns / elapsed_ns : 0.0 );
+        }
+    }
+};
+
+#endif
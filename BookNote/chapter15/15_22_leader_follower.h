@@ -0,0 +1,195 @@
+#ifndef LEADER_FOLLOWER_H
+#define LEADER_FOLLOWER_H
+
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <exception>
+#include <atomic>
+#include "chapter14/14_2_locker.h"
+#include "chapter15/15_12_trace.h"
+#include "chapter15/15_18_affinity.h"
+#include "chapter15/15_21_pool_stats.h"
+
+/* 领导者/追随者模式（第 8 章）：一组线程轮流在同一个事件表上调用 epoll_wait。任何时候只有一个线程（领导者）在等待事件，
+其他线程（追随者）等待成为领导者；领导者拿到事件之后先推选一个追随者成为新的领导者，再自己处理这个事件。
+和半同步/半反应堆模式相比，事件不经过请求队列，没有从主线程到工作线程的交接：不需要唤醒另一个线程，
+读入的请求数据也留在读取它的线程所在 CPU 的缓存中。
+连接以 EPOLLONESHOT 注册，一个连接的事件在处理完、重新注册之前不会再交给别的线程，所以同一个连接不会被两个线程同时处理。 */
+class leader_follower
+{
+public:
+    // 线程数的上限，以及领导者一次最多取出的事件数的上限
+    static const int MAX_THREADS = 256;
+    static const int MAX_EVENTS = 64;
+
+    /* 事件的处理函数，fd 和 events 来自 epoll_event，arg 是构造时传入的参数。返回 false 表示 fd 对应的对象已经关闭，
+    同一批中之后 fd 相同的事件都已经过时（描述符可能已经被复用），不再交给处理函数 */
+    typedef bool ( *event_handler )( int fd, uint32_t events, void* arg );
+
+    /* 创建 thread_number 个线程，轮流等待 epollfd 上的事件并调用 handler 处理。领导者每次最多取出 max_events 个事件，
+    默认为 1：取出多个事件时它们由同一个线程依次处理，减少了 epoll_wait 的次数，但其中后面的事件要等前面的处理完。
+    cpus 不为空时第 i 个线程固定在 cpus 的第 i 个 CPU 上 */
+    leader_follower( int thread_number, int epollfd, event_handler handler, void* arg, const cpu_list* cpus = NULL, int max_events = 1 )
+        : m_thread_number( 0 ), m_epollfd( epollfd ), m_handler( handler ), m_arg( arg ), m_max_events( max_events ), m_stop( false ),
+          m_start_ns( cycle_clock::now_ns() )
+    {
+        if( ( thread_number <= 0 ) || ( thread_number > MAX_THREADS ) )
+        {
+            throw std::exception();
+        }
+        m_leader.set_name( "leader/follower leader" );
+        if( m_max_events < 1 )
+        {
+            m_max_events = 1;
+        }
+        else if( m_max_events > MAX_EVENTS )
+        {
+            m_max_events = MAX_EVENTS;
+        }
+        for( int i = 0; i < thread_number; ++i )
+        {
+            m_slots[i].lf = this;
+            pthread_attr_t attr;
+            pthread_attr_init( &attr );
+            if( cpus && ! cpus->empty() )
+            {
+                printf( "create the %dth leader/follower thread on cpu %d\n", i, cpus->at( i ) );
+                affinity::set_attr( &attr, cpus->at( i ) );
+            }
+            else
+            {
+                printf( "create the %dth leader/follower thread\n", i );
+            }
+            int ret = pthread_create( &m_slots[i].tid, &attr, worker, m_slots + i );
+            pthread_attr_destroy( &attr );
+            if( ret != 0 )
+            {
+                shutdown();
+                throw std::exception();
+            }
+            ++m_thread_number;
+        }
+    }
+
+    /* 等待所有线程处理完手中的事件之后退出。等待中的领导者最多在 1 秒之后看到结束标志 */
+    ~leader_follower()
+    {
+        shutdown();
+    }
+
+    /* 填写运行统计的快照。这个模式中没有请求队列，等待时间的分布为空；空闲时间是等待成为领导者和等待事件的时间 */
+    void stats( pool_stats* out )
+    {
+        out->elapsed_ns = cycle_clock::now_ns() - m_start_ns;
+        out->threads = m_thread_number;
+        out->worker_count = 0;
+        for( int i = 0; i < m_thread_number && i < pool_stats::MAX_WORKERS; ++i )
+        {
+            worker_stats& s = m_slots[i].stats;
+            pool_stats::worker& w = out->workers[ out->worker_count++ ];
+            w.slot = i;
+            w.running = true;
+            w.tasks = s.tasks.load( std::memory_order_relaxed );
+            w.busy_ns = s.busy_ns.load( std::memory_order_relaxed );
+            w.idle_ns = s.idle_ns.load( std::memory_order_relaxed );
+            out->wait.merge( s.wait );
+            out->service.merge( s.service );
+        }
+    }
+
+private:
+    struct worker_slot
+    {
+        leader_follower* lf;
+        pthread_t tid;
+        worker_stats stats;
+    };
+
+    static void* worker( void* arg )
+    {
+        worker_slot* slot = ( worker_slot* )arg;
+        TRACE_THREAD_NAME( "leader/follower" );
+        slot->lf->run( slot );
+        return slot->lf;
+    }
+
+    void run( worker_slot* slot )
+    {
+        epoll_event events[ MAX_EVENTS ];
+        // 这一批事件中已经关闭的 fd
+        int closed[ MAX_EVENTS ];
+        worker_stats& stats = slot->stats;
+        while( ! m_stop )
+        {
+            long long wait_start = cycle_clock::now_ns();
+            // 获得互斥锁的线程成为领导者，其他线程阻塞在锁上，是追随者。设置超时时间是为了定期检查 m_stop
+            m_leader.lock();
+            int number = m_stop ? 0 : epoll_wait( m_epollfd, events, m_max_events, 1000 );
+            int wait_errno = errno;
+            // 释放互斥锁，推选一个追随者成为新的领导者，之后当前线程作为处理者处理拿到的事件
+            m_leader.unlock();
+            long long start = cycle_clock::now_ns();
+            stats.add_idle( start - wait_start );
+            if( ( number < 0 ) && ( wait_errno != EINTR ) )
+            {
+                printf( "epoll failure\n" );
+                break;
+            }
+            int closed_count = 0;
+            for( int i = 0; i < number; ++i )
+            {
+                int fd = events[i].data.fd;
+                if( is_closed( closed, closed_count, fd ) )
+                {
+                    continue;
+                }
+                TRACE_SPAN( "handle", fd );
+                if( ! m_handler( fd, events[i].events, m_arg ) )
+                {
+                    closed[ closed_count++ ] = fd;
+                }
+                long long end = cycle_clock::now_ns();
+                stats.service.record( end - start );
+                stats.add_busy( end - start );
+                start = end;
+            }
+        }
+    }
+
+    static bool is_closed( const int* closed, int count, int fd )
+    {
+        for( int i = 0; i < count; ++i )
+        {
+            if( closed[i] == fd )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void shutdown()
+    {
+        m_stop = true;
+        for( int i = 0; i < m_thread_number; ++i )
+        {
+            pthread_join( m_slots[i].tid, NULL );
+        }
+    }
+
+private:
+    worker_slot m_slots[ MAX_THREADS ];
+    int m_thread_number;
+    int m_epollfd;
+    event_handler m_handler;
+    void* m_arg;
+    int m_max_events;
+    // 领导者持有的互斥锁
+    locker m_leader;
+    std::atomic< bool > m_stop;
+    long long m_start_ns;
+};
+
+#endif
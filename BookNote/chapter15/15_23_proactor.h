@@ -0,0 +1,367 @@
+#ifndef PROACTOR_H
+#define PROACTOR_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <exception>
+
+/* Proactor 模式（第 8 章）：应用程序发起异步的读、写、接受连接等操作，由内核完成实际的 I/O，完成之后通知应用程序结果（传输的字节数）。
+和 Reactor 的区别在于：Reactor 通知的是"可以读写了"，读写仍由应用程序自己循环完成；Proactor 通知的是"已经读写完了"。
+这里用 io_uring 实现：操作写入提交队列（SQ），完成事件从完成队列（CQ）中取出，两个队列都是和内核共享的内存环，
+一次 io_uring_enter 就能提交一批操作并等待完成。没有依赖 liburing，直接使用系统调用和 <linux/io_uring.h> 中的定义。
+proactor 对象不是线程安全的，提交操作和处理完成事件都必须在同一个线程中进行。 */
+
+/* 一个异步操作。发起操作的对象持有它（通常是成员变量），操作完成之前不能释放或者复用；
+完成时 proactor 调用 handler，result 和对应的系统调用的返回值相同，只是出错时为 -errno */
+struct async_op;
+class proactor;
+typedef void ( *completion_handler )( async_op* op, int result );
+struct async_op
+{
+    completion_handler handler;
+    void* arg;
+};
+
+/* 异步 sendfile 的状态。io_uring 没有 sendfile 操作，文件经由一个管道发送：先把文件的一段 splice 到管道，
+再从管道 splice 到 socket，数据不进入用户空间。socket 只接收了一部分时剩下的数据留在管道中，下一次先发送它们 */
+struct async_file
+{
+    int pipefd[2];
+    // 管道的容量，以及其中还没有发送到 socket 的字节数
+    int capacity;
+    int piped;
+    int sockfd;
+    int flags;
+    // 两段 splice 的内部操作，以及全部完成之后通知的操作
+    async_op fill;
+    async_op drain;
+    async_op* done;
+    proactor* owner;
+
+    async_file() : capacity( 0 ), piped( 0 ), sockfd( -1 ), flags( 0 ), done( NULL ), owner( NULL )
+    {
+        pipefd[0] = pipefd[1] = -1;
+    }
+    ~async_file() { close_pipe(); }
+
+    /* 关闭管道，丢弃其中的数据。连接关闭时调用，这时不能有进行中的操作 */
+    void close_pipe()
+    {
+        if( pipefd[0] >= 0 )
+        {
+            close( pipefd[0] );
+            close( pipefd[1] );
+            pipefd[0] = pipefd[1] = -1;
+        }
+        piped = 0;
+    }
+};
+
+class proactor
+{
+public:
+    /* 创建提交队列长度为 entries 的 io_uring（完成队列的长度是它的两倍），内核不支持时抛出异常 */
+    explicit proactor( unsigned entries = 4096 )
+        : m_ringfd( -1 ), m_sq_ring( NULL ), m_cq_ring( NULL ), m_sqes( NULL ), m_sq_ring_size( 0 ), m_cq_ring_size( 0 ),
+          m_sqes_size( 0 ), m_sq_tail( 0 ), m_pending( 0 ), m_submitted( 0 ), m_completed( 0 ), m_enters( 0 )
+    {
+        struct io_uring_params params;
+        memset( &params, 0, sizeof( params ) );
+        m_ringfd = syscall( __NR_io_uring_setup, entries, &params );
+        if( m_ringfd < 0 )
+        {
+            throw std::exception();
+        }
+        // 提交队列环、完成队列环和提交队列项数组分别映射。新内核（IORING_FEAT_SINGLE_MMAP）中两个环共用一次映射
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if( single && m_cq_ring_size > m_sq_ring_size )
+        {
+            m_sq_ring_size = m_cq_ring_size;
+        }
+        m_sq_ring = mmap( NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING );
+        if( m_sq_ring == MAP_FAILED )
+        {
+            close( m_ringfd );
+            throw std::exception();
+        }
+        m_cq_ring = single ? m_sq_ring
+                           : mmap( NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_CQ_RING );
+        m_sqes_size = params.sq_entries * sizeof( struct io_uring_sqe );
+        m_sqes = ( struct io_uring_sqe* )mmap( NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES );
+        if( m_cq_ring == MAP_FAILED || m_sqes == MAP_FAILED )
+        {
+            release();
+            throw std::exception();
+        }
+
+        char* sq = ( char* )m_sq_ring;
+        m_sq_head = ( unsigned* )( sq + params.sq_off.head );
+        m_sq_ktail = ( unsigned* )( sq + params.sq_off.tail );
+        m_sq_mask = *( unsigned* )( sq + params.sq_off.ring_mask );
+        m_sq_entries = *( unsigned* )( sq + params.sq_off.ring_entries );
+        unsigned* array = ( unsigned* )( sq + params.sq_off.array );
+        char* cq = ( char* )m_cq_ring;
+        m_cq_head = ( unsigned* )( cq + params.cq_off.head );
+        m_cq_tail = ( unsigned* )( cq + params.cq_off.tail );
+        m_cq_mask = *( unsigned* )( cq + params.cq_off.ring_mask );
+        m_cqes = ( struct io_uring_cqe* )( cq + params.cq_off.cqes );
+        // 提交队列环中保存的是提交队列项的下标，这里固定为一一对应，第 i 个槽位总是使用第 i 个提交队列项
+        for( unsigned i = 0; i < m_sq_entries; ++i )
+        {
+            array[i] = i;
+        }
+        m_sq_tail = *m_sq_ktail;
+    }
+
+    ~proactor()
+    {
+        release();
+    }
+
+    /* 异步接受连接，result 是新连接的描述符，对方的地址写入 addr。监听 socket 应该是阻塞的：
+    非阻塞的监听 socket 上没有连接时 io_uring 直接以 -EAGAIN 完成操作，而不是等待 */
+    bool async_accept( int listenfd, sockaddr_in* addr, socklen_t* addrlen, async_op* op )
+    {
+        struct io_uring_sqe* sqe = get_sqe( IORING_OP_ACCEPT, listenfd, op );
+        *addrlen = sizeof( *addr );
+        sqe->addr = ( unsigned long )addr;
+        sqe->addr2 = ( unsigned long )addrlen;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        return true;
+    }
+
+    /* 异步读取至多 len 字节，result 是读到的字节数，0 表示对方关闭了连接 */
+    bool async_recv( int fd, void* buf, size_t len, async_op* op )
+    {
+        struct io_uring_sqe* sqe = get_sqe( IORING_OP_RECV, fd, op );
+        sqe->addr = ( unsigned long )buf;
+        sqe->len = len;
+        return true;
+    }
+
+    /* 异步发送至多 len 字节，flags 和 send 的相同（例如 MSG_MORE），result 是发送的字节数 */
+    bool async_send( int fd, const void* buf, size_t len, int flags, async_op* op )
+    {
+        struct io_uring_sqe* sqe = get_sqe( IORING_OP_SEND, fd, op );
+        sqe->addr = ( unsigned long )buf;
+        sqe->len = len;
+        sqe->msg_flags = flags | MSG_NOSIGNAL;
+        return true;
+    }
+
+    /* 异步地把文件 filefd 中从 offset 开始的至多 len 字节发送到 sockfd，result 是发送到 socket 的字节数，
+    和 sendfile 一样，调用者据此推进 offset 并再次调用，直到发送完。文件在发送过程中被截断时 result 为 0。
+    file 保存同一个 socket 上的管道和其中剩余的数据，第一次使用时创建管道；flags 为 SPLICE_F_MORE 时提示后面还有数据 */
+    bool async_sendfile( int sockfd, int filefd, off_t offset, size_t len, int flags, async_file* file, async_op* op )
+    {
+        if( file->pipefd[0] < 0 )
+        {
+            if( pipe2( file->pipefd, O_CLOEXEC ) < 0 )
+            {
+                return false;
+            }
+            file->capacity = fcntl( file->pipefd[1], F_GETPIPE_SZ );
+            file->piped = 0;
+            file->fill.handler = on_fill;
+            file->fill.arg = file;
+            file->drain.handler = on_drain;
+            file->drain.arg = file;
+        }
+        // 一次最多发送一管道的数据，管道不够大时尝试扩大它（受 /proc/sys/fs/pipe-max-size 限制）
+        if( len > ( size_t )file->capacity )
+        {
+            int size = fcntl( file->pipefd[1], F_SETPIPE_SZ, ( int )len );
+            if( size > 0 )
+            {
+                file->capacity = size;
+            }
+            if( len > ( size_t )file->capacity )
+            {
+                len = file->capacity;
+            }
+        }
+        file->owner = this;
+        file->sockfd = sockfd;
+        file->flags = flags;
+        file->done = op;
+        // 管道中还有上一次没有发送完的数据（它们就是从 offset 开始的数据），先发送它们
+        if( file->piped > 0 )
+        {
+            splice( file->pipefd[0], -1, sockfd, -1, file->piped, flags, &file->drain );
+        }
+        else
+        {
+            splice( filefd, offset, file->pipefd[1], -1, len, 0, &file->fill );
+        }
+        return true;
+    }
+
+    /* 异步等待 fd 上的 events 事件（一次性的），result 是就绪的事件。用于没有对应的异步操作的描述符，例如 inotify */
+    bool async_poll( int fd, short events, async_op* op )
+    {
+        struct io_uring_sqe* sqe = get_sqe( IORING_OP_POLL_ADD, fd, op );
+        sqe->poll_events = events;
+        return true;
+    }
+
+    /* 提交所有已经发起的操作，等待至少一个操作完成，然后依次调用已经完成的操作的处理函数（处理函数中可以发起新的操作）。
+    返回处理的完成事件数，等待被信号中断时返回 0 */
+    int run_once()
+    {
+        if( enter( m_pending, 1, IORING_ENTER_GETEVENTS ) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+        {
+            return -1;
+        }
+        int count = 0;
+        unsigned head = *m_cq_head;
+        while( head != __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE ) )
+        {
+            struct io_uring_cqe* cqe = m_cqes + ( head & m_cq_mask );
+            async_op* op = ( async_op* )( unsigned long )cqe->user_data;
+            int result = cqe->res;
+            // 先归还完成队列项，处理函数可能发起新的操作，甚至等待完成
+            ++head;
+            __atomic_store_n( m_cq_head, head, __ATOMIC_RELEASE );
+            ++m_completed;
+            ++count;
+            if( op )
+            {
+                op->handler( op, result );
+            }
+        }
+        return count;
+    }
+
+    // 提交的操作数、处理的完成事件数和 io_uring_enter 的调用次数，用来和 Reactor 每个请求的系统调用数比较
+    long submitted() const { return m_submitted; }
+    long completed() const { return m_completed; }
+    long enter_calls() const { return m_enters; }
+
+private:
+    /* 取得一个提交队列项并填写公共的字段。队列已满时先把已有的操作提交给内核 */
+    struct io_uring_sqe* get_sqe( int opcode, int fd, async_op* op )
+    {
+        while( m_sq_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE ) >= m_sq_entries )
+        {
+            enter( m_pending, 0, 0 );
+        }
+        struct io_uring_sqe* sqe = m_sqes + ( m_sq_tail & m_sq_mask );
+        memset( sqe, 0, sizeof( *sqe ) );
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = ( unsigned long )op;
+        ++m_sq_tail;
+        ++m_pending;
+        // 发布新的队尾，内核在下一次 io_uring_enter 时看到这些操作
+        __atomic_store_n( m_sq_ktail, m_sq_tail, __ATOMIC_RELEASE );
+        return sqe;
+    }
+
+    void splice( int fd_in, long long off_in, int fd_out, long long off_out, size_t len, int flags, async_op* op )
+    {
+        struct io_uring_sqe* sqe = get_sqe( IORING_OP_SPLICE, fd_out, op );
+        sqe->off = ( unsigned long long )off_out;
+        sqe->splice_fd_in = fd_in;
+        sqe->splice_off_in = ( unsigned long long )off_in;
+        sqe->len = len;
+        sqe->splice_flags = flags;
+    }
+
+    int enter( unsigned to_submit, unsigned min_complete, unsigned flags )
+    {
+        ++m_enters;
+        int ret = syscall( __NR_io_uring_enter, m_ringfd, to_submit, min_complete, flags, NULL, 0 );
+        if( ret > 0 )
+        {
+            m_pending -= ret;
+            m_submitted += ret;
+        }
+        return ret;
+    }
+
+    /* 文件的一段已经读入管道，接着把它们发送到 socket */
+    static void on_fill( async_op* op, int result )
+    {
+        async_file* file = ( async_file* )op->arg;
+        if( result <= 0 )
+        {
+            file->done->handler( file->done, result );
+            return;
+        }
+        file->piped = result;
+        file->owner->splice( file->pipefd[0], -1, file->sockfd, -1, result, file->flags, &file->drain );
+    }
+
+    /* 管道中的数据发送到了 socket，通知调用者发送的字节数 */
+    static void on_drain( async_op* op, int result )
+    {
+        async_file* file = ( async_file* )op->arg;
+        if( result > 0 )
+        {
+            file->piped -= result;
+        }
+        else if( result == 0 )
+        {
+            // 管道中有数据时 splice 不会返回 0，出现时当作连接出错
+            result = -EPIPE;
+        }
+        file->done->handler( file->done, result );
+    }
+
+    void release()
+    {
+        if( m_sqes && m_sqes != MAP_FAILED )
+        {
+            munmap( m_sqes, m_sqes_size );
+        }
+        if( m_cq_ring && m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring )
+        {
+            munmap( m_cq_ring, m_cq_ring_size );
+        }
+        if( m_sq_ring && m_sq_ring != MAP_FAILED )
+        {
+            munmap( m_sq_ring, m_sq_ring_size );
+        }
+        if( m_ringfd >= 0 )
+        {
+            close( m_ringfd );
+        }
+    }
+
+private:
+    int m_ringfd;
+    // 三块共享内存
+    void* m_sq_ring;
+    void* m_cq_ring;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sq_ring_size;
+    size_t m_cq_ring_size;
+    size_t m_sqes_size;
+    // 提交队列：内核消费到的队头、共享的队尾，以及本地的队尾和还没有提交给内核的操作数
+    unsigned* m_sq_head;
+    unsigned* m_sq_ktail;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned m_sq_tail;
+    unsigned m_pending;
+    // 完成队列
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+    // 统计
+    long m_submitted;
+    long m_completed;
+    long m_enters;
+};
+
+#endif
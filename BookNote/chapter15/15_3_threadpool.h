@@ -1,108 +1,829 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <atomic>
+#include <errno.h>
 #include "chapter14/14_2_locker.h"
+#include "chapter15/15_12_trace.h"
+#include "chapter15/15_18_affinity.h"
+#include "chapter15/15_19_task.h"
+#include "chapter15/15_21_pool_stats.h"
 
-/* 线程池类：将它定义为模板类是为了代码复用。模板参数 T 是任务类。 */
+/* 线程池类：将它定义为模板类是为了代码复用。模板参数 T 是任务类，它需要提供 process 方法处理任务，
+以及 shed 方法在过载时以最小的代价拒绝任务。
+线程数可以在运行时伸缩：工作线程阻塞在磁盘 I/O 或者缺页上时，队列中的请求越等越久，这时增加线程；负载下降之后，
+空闲太久的线程自行退出。所有线程都是可连接的，析构函数等待它们全部退出之后才返回。
+任务可以分成多个类别，每个类别有自己的队列：工作线程按照权重在类别之间轮流取任务，并且可以限制一个类别同时占用的线程数，
+这样一批慢任务（磁盘 I/O、上游请求）既不会让快任务排在它们后面，也不会占满所有的线程。
+任务可以成批地加入和取出：一轮 epoll_wait 返回的请求用 append_batch 一次加锁全部加入，只唤醒需要的线程；
+工作线程每次加锁最多取出 max_batch 个任务。信号量只用来唤醒睡眠中的线程，不再和任务一一对应，线程在队列为空时才睡眠。
+除了 T 类型的任务，其他模块（定时器、日志刷新、文件预读等）也可以用 submit 提交任意的可调用对象，和 T 共享工作线程。
+队列是预先分配的环形缓冲，可调用对象保存在预先分配的槽位中，稳定运行时加入和取出任务都不分配内存。 */
 template< typename T >
 class threadpool
 {
 public:
-    /* 参数 thread_number 是线程池中线程的数量，max_requests 是请求队列中最多允许、等待处理的请求的数量 */ 
-    threadpool( int thread_number = 8, int max_requests = 10000 );
+    // 线程数的上限
+    static const int MAX_THREADS = 256;
+    // 任务类别数的上限
+    static const int MAX_CLASSES = 8;
+    // 一次加入或取出的任务数的上限
+    static const int MAX_BATCH = 64;
+    // 同时在队列中的通用任务（submit 提交的可调用对象）数的上限
+    static const int MAX_TASKS = 1024;
+
+    /* 参数 thread_number 是线程池中线程的数量（开启弹性伸缩后是线程数的下限），max_requests 是请求队列中最多允许、等待处理的请求的数量。
+    cpus 不为空时第 i 个线程从创建起就固定在 cpus 的第 i 个 CPU 上（CPU 不够时循环使用） */ 
+    threadpool( int thread_number = 8, int max_requests = 10000, const cpu_list* cpus = NULL );
     ~threadpool();
-    /* 往请求队列中添加任务 */
-    bool append( T* request );
+    /* 往类别 cls 的请求队列中添加任务。所有类别的任务总数达到 max_requests 时返回 false，调用者负责拒绝该任务 */
+    bool append( T* request, int cls = 0 );
+    /* 一次加锁把 n 个任务按顺序加入 classes 指定的类别（classes 为 NULL 时都加入类别 0），至多 MAX_BATCH 个。
+    返回加入的任务数 k，任务总数达到 max_requests 时 requests[k..n) 没有被加入，调用者负责拒绝它们 */
+    int append_batch( T* const* requests, const int* classes, int n );
+    /* 提交一个通用任务：没有参数和返回值的可调用对象 fn（可以只能移动），由工作线程在类别 cls 中执行。
+    不超过 task_function::INLINE_SIZE 字节的可调用对象直接移动到预先分配的槽位中，整个过程不分配内存。
+    done 不为空时，任务执行完（或者因为过载被丢弃、线程池析构时还没有执行）之后通知它。没有 done 的任务无法得知自己被丢弃，
+    所以过载控制只丢弃带有 done 的任务，其他任务总会执行。槽位用完或者队列已满时返回 false，由调用者决定重试还是放弃，不计入丢弃数 */
+    template< typename F >
+    bool submit( F&& fn, task_completion* done = NULL, int cls = 0 );
+    /* 设置工作线程每次加锁最多取出的任务数（1 到 MAX_BATCH，默认为 1）。线程不会取走超过平均份额的任务，
+    队列中的任务不多时仍然分给多个线程并行处理 */
+    void set_batch( int max_batch );
+    /* 设置类别 cls 的权重（默认为 1）和同时处理它的任务的最大线程数（0 表示不限制，默认不限制）。
+    多个类别都有任务时，每个类别被取出的任务数与权重成正比 */
+    void set_class( int cls, int weight, int max_running );
+    /* 类别 cls 已经被取出的任务数 */
+    long class_count( int cls ) const { return m_classes[ cls ].dequeued; }
+    /* 设置过载控制的参数（微秒）。target 为 0 时关闭过载控制 */
+    void set_queue_delay( long target_us, long interval_us );
+    /* 因为过载而被丢弃的任务数：append 和 append_batch 没有加入的请求，以及过载控制丢弃的请求和带有 done 的通用任务 */
+    long shed_count() const { return m_shed_count; }
+    /* 开启弹性伸缩，线程数在 [thread_number, max_threads] 之间变化（微秒、毫秒）：队首的请求排队超过 grow_target_us、
+    并且没有空闲的线程时增加一个线程，两次增加之间至少间隔 grow_interval_us；超过 idle_ms 没有拿到任务的线程退出。
+    grow_target_us 为 0 时不再增加线程，idle_ms 为 0 时线程不再退出。
+    新线程由第一次开启时创建的管理线程创建，加入任务的线程（主线程的事件循环）只负责通知它。只能在一个线程中调用 */
+    void set_elastic( int max_threads, long grow_target_us, long grow_interval_us, long idle_ms );
+    /* 当前的线程数，以及弹性伸缩中增加和退出的线程数 */
+    int thread_count();
+    long grown_count() const { return m_grown; }
+    long retired_count() const { return m_retired; }
+    /* 填写运行统计的快照：等待时间和处理时间的分布，以及每个线程槽位忙碌和空闲的时间。可以在任何线程中随时调用 */
+    void stats( pool_stats* out );
 
 private:
+    /* 通用任务的槽位：可调用对象和完成通知。槽位预先分配 MAX_TASKS 个，空闲的槽位用 next 串成链表，由 m_queuelocker 保护 */
+    struct task_slot
+    {
+        task_function fn;
+        task_completion* done;
+        task_slot* next;
+    };
+    /* 队列中的任务（T 类型的任务 request 或者通用任务 task，两者只有一个不为空），以及它入队的时间 */
+    struct queued_request
+    {
+        T* request;
+        task_slot* task;
+        long long enqueue_ns;
+    };
+    /* 一个类别的请求队列：容量为 max_requests 的环形缓冲，第一次使用时分配。所有类别的任务总数不超过 max_requests，所以它不会溢出。
+    std::list 每次 push_back 都要分配一个节点，环形缓冲在稳定运行时不分配内存 */
+    struct request_ring
+    {
+        queued_request* items;
+        int capacity;
+        int head;
+        int count;
+
+        bool empty() const { return count == 0; }
+        queued_request& front() { return items[ head ]; }
+        void pop_front()
+        {
+            head = ( head + 1 == capacity ) ? 0 : head + 1;
+            --count;
+        }
+        void push_back( const queued_request& item )
+        {
+            int tail = head + count;
+            items[ ( tail >= capacity ) ? tail - capacity : tail ] = item;
+            ++count;
+        }
+    };
+    /* 一个线程的槽位。FREE 的槽位没有线程；RUNNING 的线程正在运行；EXITED 的线程已经退出、还没有被回收（pthread_join）。
+    状态由 m_queuelocker 保护 */
+    enum slot_state { SLOT_FREE = 0, SLOT_RUNNING, SLOT_EXITED };
+    struct worker_slot
+    {
+        threadpool* pool;
+        pthread_t tid;
+        slot_state state;
+        // 只有槽位上的线程写入，跨越线程的生命周期累加
+        worker_stats stats;
+    };
+    /* 一个工作线程取出的任务：任务本身、所属的类别、是否需要在处理完之后减少类别的运行数、是否因为过载而丢弃，以及在队列中等待的时间 */
+    struct taken_request
+    {
+        T* request;
+        task_slot* task;
+        int cls;
+        bool capped;
+        bool shed;
+        long long wait_ns;
+    };
+    /* 一个任务类别：队列、调度参数、过载控制的状态和统计，除了 dequeued 都由 m_queuelocker 保护 */
+    struct task_class
+    {
+        request_ring queue;
+        int weight;
+        int max_running;
+        // 正在处理这个类别的任务的线程数
+        int running;
+        // 平滑加权轮询的当前值
+        int current;
+        // 过载控制的当前观察窗口的结束时间、窗口内的最小排队时间，以及上一个窗口是否处于过载状态
+        long long interval_end;
+        long long min_sojourn;
+        bool overloaded;
+        std::atomic< long > dequeued;
+    };
+    static long long now_ns();
+    bool should_shed( task_class* c, long long sojourn, long long now );
+    bool dispatchable( const task_class* c ) const;
+    int pick_class();
+    bool enqueue( T* request, task_slot* task, int cls, long long now );
+    int claim_sleepers( int added );
+    int take( taken_request* batch, task_slot*& released );
+    void run_task( task_slot* task, bool shed );
+    void finish( int cls, bool busy );
+    bool should_grow( long long now );
+    bool spawn();
+    static bool start_thread( pthread_t* tid, const pthread_attr_t* attr, void* ( *fn )( void* ), void* arg );
+    static void* manager( void* arg );
+    bool leave_wait( worker_slot* slot, bool idle );
+    void shutdown();
+
     /* 工作线程允许的函数，它不断从工作队列中取出任务并执行之 */
     static void* worker( void* arg );
-    void run();
+    void run( worker_slot* slot );
 
 private:
-    // 线程池中的线程数
+    // 线程池中的线程数的下限和上限，以及当前的线程数（由 m_queuelocker 保护）
     int m_thread_number;
+    int m_max_threads;
+    int m_live;
     // 请求队列中允许的最大请求数
     int m_max_requests;
-    // 描述线程池的数据，其大小为 m_thread_number
-    pthread_t* m_threads;
-    // 请求队列
-    std::list< T* > m_workqueue;
+    // 描述线程池的数据。只有构造函数、析构函数和管理线程创建和回收线程，同一时刻只有其中一个
+    worker_slot m_slots[ MAX_THREADS ];
+    // 新线程固定运行的 CPU
+    cpu_list m_cpus;
+    // 各个类别的请求队列，以及所有队列中的任务总数
+    task_class m_classes[ MAX_CLASSES ];
+    int m_queued;
+    // 通用任务的槽位和其中空闲的槽位
+    task_slot* m_task_slots;
+    task_slot* m_free_tasks;
+    // 工作线程每次最多取出的任务数
+    int m_max_batch;
     // 保护请求队列的互斥锁
     locker m_queuelocker;
-    // 是否有任务需要处理
+    // 唤醒睡眠中的线程。线程在没有可以取出的任务时把 m_sleepers 加一再睡眠，生产者加入任务时从 m_sleepers 中认领需要唤醒的线程数，
+    // 减去之后再 post 同样的次数，所以每次 post 都对应一个确实在睡眠（或即将睡眠）的线程。m_sleepers 由 m_queuelocker 保护
     sem m_queuestat;
+    int m_sleepers;
     // 是否结束线程
-    bool m_stop;
+    std::atomic< bool > m_stop;
+    // 过载控制（CoDel）：排队时间的目标值和观察窗口长度，单位都是纳秒。每个类别分别判断是否过载
+    long long m_target_ns;
+    long long m_interval_ns;
+    // 被丢弃的任务数
+    std::atomic< long > m_shed_count;
+    // 弹性伸缩：增加线程的排队时间阈值、两次增加之间的最小间隔（纳秒）和下一次允许增加的时间，它们由 m_queuelocker 保护；
+    // 线程退出前的空闲时间（毫秒）
+    long long m_grow_target_ns;
+    long long m_grow_interval_ns;
+    long long m_next_grow;
+    std::atomic< long > m_idle_ms;
+    // 弹性伸缩的管理线程：append_batch 和 submit 发现需要增加线程时 post m_grow_request，由它调用 spawn。
+    // pthread_create、回收退出的线程和输出日志都不在加入任务的线程中执行
+    pthread_t m_manager;
+    bool m_has_manager;
+    sem m_grow_request;
+    // 增加和退出的线程数
+    std::atomic< long > m_grown;
+    std::atomic< long > m_retired;
+    // 线程池创建的时间
+    long long m_start_ns;
 };
 
 template< typename T >
-threadpool< T >::threadpool( int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL )
+threadpool< T >::threadpool( int thread_number, int max_requests, const cpu_list* cpus ) : 
+        m_thread_number( thread_number ), m_max_threads( thread_number ), m_live( 0 ), m_max_requests( max_requests ),
+        m_queued( 0 ), m_task_slots( NULL ), m_free_tasks( NULL ), m_max_batch( 1 ), m_sleepers( 0 ), m_stop( false ), m_target_ns( 5000000 ), m_interval_ns( 100000000 ), m_shed_count( 0 ), m_grow_target_ns( 0 ), m_grow_interval_ns( 0 ), m_next_grow( 0 ),
+        m_idle_ms( 0 ), m_has_manager( false ), m_grown( 0 ), m_retired( 0 ), m_start_ns( now_ns() )
 {
-    if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
+    if( ( thread_number <= 0 ) || ( thread_number > MAX_THREADS ) || ( max_requests <= 0 ) )
     {
         throw std::exception();
     }
-
-    // 申请 m_thread_number 个子线程空间
-    m_threads = new pthread_t[ m_thread_number ];
-    if( ! m_threads )
+    // 在 LOCK_PROFILE 构建的竞争统计中显示的名字
+    m_queuelocker.set_name( "threadpool queue" );
+    m_queuestat.set_name( "threadpool queuestat" );
+    m_grow_request.set_name( "threadpool grow" );
+    for( int i = 0; i < MAX_THREADS; ++i )
     {
-        throw std::exception();
+        m_slots[i].pool = this;
+        m_slots[i].state = SLOT_FREE;
+    }
+    for( int i = 0; i < MAX_CLASSES; ++i )
+    {
+        task_class& c = m_classes[i];
+        c.queue.items = NULL;
+        c.queue.capacity = 0;
+        c.queue.head = 0;
+        c.queue.count = 0;
+        c.weight = 1;
+        c.max_running = 0;
+        c.running = 0;
+        c.current = 0;
+        c.interval_end = 0;
+        c.min_sojourn = 0;
+        c.overloaded = false;
+        c.dequeued = 0;
     }
+    if( cpus )
+    {
+        m_cpus = *cpus;
+    }
+    m_task_slots = new task_slot[ MAX_TASKS ];
+    for( int i = 0; i < MAX_TASKS; ++i )
+    {
+        m_task_slots[i].next = ( i + 1 < MAX_TASKS ) ? m_task_slots + i + 1 : NULL;
+    }
+    m_free_tasks = m_task_slots;
 
-    /* 创建 thread_number 个线程，并将它们都设置为脱离线程 */
+    /* 创建 thread_number 个线程。任何一个创建失败时，结束已经创建的线程 */
     for ( int i = 0; i < thread_number; ++i )
     {
-        printf( "create the %dth thread\n", i );
-        /* C++ 中使用 pthread_create 函数式，第三个参数必须指向一个静态函数，而要在一个静态函数中使用类的动态成员有两种方法： */
-        /* 1）通过类的静态对象来调用。比如在单体模式中，静态函数通过类的全局唯一实例来访问动态成员函数。 */
-        /* 2）将类的对象作为参数传递给该静态函数，然后在静态函数中引用这个对象，并调用其动态方法。下面就是将线程参数设置为 this 指针，
-        然后在 worker 函数中获取该指针并调用其动态方法 run。 */
-        if( pthread_create( m_threads + i, NULL, worker, this ) != 0 )
+        if( ! spawn() )
         {
-            delete [] m_threads;
+            shutdown();
+            delete [] m_task_slots;
             throw std::exception();
         }
-        if( pthread_detach( m_threads[i] ) )
+    }
+}
+
+// 线程池的析构函数：等待所有线程退出。正在处理任务的线程处理完当前的任务之后退出，队列中剩下的任务不再处理，
+// 其中的通用任务被取消，等待它们的提交者会收到通知
+template< typename T >
+threadpool< T >::~threadpool()
+{
+    shutdown();
+    for( int i = 0; i < MAX_CLASSES; ++i )
+    {
+        request_ring& queue = m_classes[i].queue;
+        for( ; ! queue.empty(); queue.pop_front() )
         {
-            delete [] m_threads;
-            throw std::exception();
+            if( queue.front().task )
+            {
+                run_task( queue.front().task, true );
+            }
         }
+        delete [] queue.items;
     }
+    delete [] m_task_slots;
 }
 
-// 线程池的析构函数
 template< typename T >
-threadpool< T >::~threadpool()
+void threadpool< T >::shutdown()
 {
-    delete [] m_threads;
     m_stop = true;
+    // 先结束管理线程，之后不会再有新的线程
+    if( m_has_manager )
+    {
+        m_grow_request.post();
+        pthread_join( m_manager, NULL );
+        m_has_manager = false;
+    }
+    // 每个线程最多消耗一次 post 就会看到 m_stop
+    m_queuelocker.lock();
+    int live = m_live;
+    m_queuelocker.unlock();
+    for( int i = 0; i < live; ++i )
+    {
+        m_queuestat.post();
+    }
+    for( int i = 0; i < MAX_THREADS; ++i )
+    {
+        if( m_slots[i].state != SLOT_FREE )
+        {
+            pthread_join( m_slots[i].tid, NULL );
+            m_slots[i].state = SLOT_FREE;
+        }
+    }
+}
+
+/* 在一个空闲的槽位上创建线程，先回收槽位上已经退出的线程 */
+template< typename T >
+bool threadpool< T >::spawn()
+{
+    m_queuelocker.lock();
+    int i = 0;
+    while( i < m_max_threads && m_slots[i].state == SLOT_RUNNING )
+    {
+        ++i;
+    }
+    if( i == m_max_threads )
+    {
+        m_queuelocker.unlock();
+        return false;
+    }
+    bool reap = ( m_slots[i].state == SLOT_EXITED );
+    m_slots[i].state = SLOT_RUNNING;
+    ++m_live;
+    m_queuelocker.unlock();
+    if( reap )
+    {
+        pthread_join( m_slots[i].tid, NULL );
+    }
+
+    // 亲和性必须在创建时设置：线程启动之后马上会分配线程局部的缓存，这些内存从它第一次运行的节点分配
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    if( ! m_cpus.empty() )
+    {
+        printf( "create the %dth thread on cpu %d\n", i, m_cpus.at( i ) );
+        affinity::set_attr( &attr, m_cpus.at( i ) );
+    }
+    else
+    {
+        printf( "create the %dth thread\n", i );
+    }
+    /* C++ 中使用 pthread_create 函数式，第三个参数必须指向一个静态函数，而要在一个静态函数中使用类的动态成员有两种方法： */
+    /* 1）通过类的静态对象来调用。比如在单体模式中，静态函数通过类的全局唯一实例来访问动态成员函数。 */
+    /* 2）将类的对象作为参数传递给该静态函数，然后在静态函数中引用这个对象，并调用其动态方法。下面就是将线程参数设置为线程的槽位，
+    槽位中保存了 this 指针，在 worker 函数中获取该指针并调用其动态方法 run。 */
+    bool ret = start_thread( &m_slots[i].tid, &attr, worker, m_slots + i );
+    pthread_attr_destroy( &attr );
+    if( ! ret )
+    {
+        m_queuelocker.lock();
+        m_slots[i].state = SLOT_FREE;
+        --m_live;
+        m_queuelocker.unlock();
+        return false;
+    }
+    return true;
+}
+
+/* 创建线程。线程池可能在主线程解除了对 SIGINT 等信号的屏蔽之后才创建，新线程继承创建者的信号掩码，
+所以创建期间屏蔽所有信号，保证信号仍然只递送给主线程 */
+template< typename T >
+bool threadpool< T >::start_thread( pthread_t* tid, const pthread_attr_t* attr, void* ( *fn )( void* ), void* arg )
+{
+    sigset_t all, old;
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &old );
+    int ret = pthread_create( tid, attr, fn, arg );
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+    return ret == 0;
+}
+
+/* 管理线程：等待增加线程的请求，直到线程池析构 */
+template< typename T >
+void* threadpool< T >::manager( void* arg )
+{
+    threadpool* pool = ( threadpool* )arg;
+    while( true )
+    {
+        pool->m_grow_request.wait();
+        if( pool->m_stop )
+        {
+            break;
+        }
+        if( pool->spawn() )
+        {
+            pool->m_grown++;
+        }
+    }
+    return NULL;
+}
+
+/* 线程没有等到唤醒（超时或者被信号中断）就停止等待。如果 m_sleepers 中已经没有未被认领的线程，说明生产者已经认领了它，
+对应的 post 马上就会到达，线程当作被唤醒继续运行；否则把自己从 m_sleepers 中去掉。idle 为 true 表示等待超时，
+这时线程数超过下限的话线程退出，返回 true */
+template< typename T >
+bool threadpool< T >::leave_wait( worker_slot* slot, bool idle )
+{
+    m_queuelocker.lock();
+    bool retire = false;
+    if( m_sleepers > 0 )
+    {
+        --m_sleepers;
+        retire = idle && ( m_live > m_thread_number );
+        if( retire )
+        {
+            slot->state = SLOT_EXITED;
+            --m_live;
+        }
+    }
+    m_queuelocker.unlock();
+    if( retire )
+    {
+        m_retired++;
+    }
+    return retire;
+}
+
+template< typename T >
+void threadpool< T >::set_elastic( int max_threads, long grow_target_us, long grow_interval_us, long idle_ms )
+{
+    m_queuelocker.lock();
+    m_max_threads = ( max_threads < m_thread_number ) ? m_thread_number : ( max_threads > MAX_THREADS ) ? MAX_THREADS : max_threads;
+    m_grow_target_ns = grow_target_us * 1000LL;
+    m_grow_interval_ns = grow_interval_us * 1000LL;
+    m_queuelocker.unlock();
+    m_idle_ms = idle_ms;
+    if( grow_target_us > 0 && ! m_has_manager )
+    {
+        m_has_manager = start_thread( &m_manager, NULL, manager, this );
+    }
+}
+
+template< typename T >
+int threadpool< T >::thread_count()
+{
+    m_queuelocker.lock();
+    int live = m_live;
+    m_queuelocker.unlock();
+    return live;
+}
+
+template< typename T >
+void threadpool< T >::stats( pool_stats* out )
+{
+    bool running[ MAX_THREADS ];
+    m_queuelocker.lock();
+    out->threads = m_live;
+    for( int i = 0; i < MAX_THREADS; ++i )
+    {
+        running[i] = ( m_slots[i].state == SLOT_RUNNING );
+    }
+    m_queuelocker.unlock();
+    out->elapsed_ns = now_ns() - m_start_ns;
+    out->worker_count = 0;
+    for( int i = 0; i < MAX_THREADS && out->worker_count < pool_stats::MAX_WORKERS; ++i )
+    {
+        worker_stats& s = m_slots[i].stats;
+        long tasks = s.tasks.load( std::memory_order_relaxed );
+        if( ! running[i] && tasks == 0 && s.idle_ns.load( std::memory_order_relaxed ) == 0 )
+        {
+            continue;
+        }
+        pool_stats::worker& w = out->workers[ out->worker_count++ ];
+        w.slot = i;
+        w.running = running[i];
+        w.tasks = tasks;
+        w.busy_ns = s.busy_ns.load( std::memory_order_relaxed );
+        w.idle_ns = s.idle_ns.load( std::memory_order_relaxed );
+        out->wait.merge( s.wait );
+        out->service.merge( s.service );
+    }
 }
 
 /* 往请求队列中添加任务 */
 template< typename T >
-bool threadpool< T >::append( T* request )
+bool threadpool< T >::append( T* request, int cls )
+{
+    return append_batch( &request, &cls, 1 ) == 1;
+}
+
+template< typename T >
+int threadpool< T >::append_batch( T* const* requests, const int* classes, int n )
 {
+    if( n <= 0 )
+    {
+        return 0;
+    }
+    if( n > MAX_BATCH )
+    {
+        n = MAX_BATCH;
+    }
+    TRACE_SPAN( "enqueue", requests[0] );
+    long long now = now_ns();
     /* 操作工作队列时一定要加锁，因为它被所有线程共享 */
     m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests )
+    // 按顺序添加请求，直到请求队列的大小达到最大请求数
+    int added = 0;
+    while( added < n && enqueue( requests[ added ], NULL, classes ? classes[ added ] : 0, now ) )
+    {
+        ++added;
+    }
+    bool grow = ( added > 0 ) && should_grow( now );
+    int wakeups = claim_sleepers( added );
+    // 解锁
+    m_queuelocker.unlock();
+    for( int i = 0; i < wakeups; ++i )
+    {
+        m_queuestat.post();
+    }
+    m_shed_count += n - added;
+    // 所有线程都忙，队首的请求又等了太久，通知管理线程增加一个线程
+    if( grow )
+    {
+        m_grow_request.post();
+    }
+    for( int i = 0; i < added; ++i )
+    {
+        TRACE_FLOW_BEGIN( "request", requests[i] );
+    }
+    return added;
+}
+
+template< typename T >
+template< typename F >
+bool threadpool< T >::submit( F&& fn, task_completion* done, int cls )
+{
+    long long now = now_ns();
+    m_queuelocker.lock();
+    task_slot* slot = m_free_tasks;
+    if( ! slot || ! enqueue( NULL, slot, cls, now ) )
     {
-        // 请求队列的大小比最大请求数还大，需要解锁，并返回添加任务失败
         m_queuelocker.unlock();
         return false;
     }
-    // 添加请求
-    m_workqueue.push_back( request );
-    // 解锁
+    m_free_tasks = slot->next;
+    // 可调用对象直接移动到槽位中，工作线程只有在取出它时才会访问这个槽位，而取出需要先获得 m_queuelocker
+    slot->fn.assign( std::forward< F >( fn ) );
+    slot->done = done;
+    bool grow = should_grow( now );
+    int wakeups = claim_sleepers( 1 );
+    m_queuelocker.unlock();
+    for( int i = 0; i < wakeups; ++i )
+    {
+        m_queuestat.post();
+    }
+    if( grow )
+    {
+        m_grow_request.post();
+    }
+    TRACE_FLOW_BEGIN( "request", slot );
+    return true;
+}
+
+/* 把任务加入类别 cls 的队列，任务总数已经达到最大请求数时返回 false。调用者需要持有 m_queuelocker */
+template< typename T >
+bool threadpool< T >::enqueue( T* request, task_slot* task, int cls, long long now )
+{
+    if( m_queued >= m_max_requests )
+    {
+        return false;
+    }
+    request_ring& queue = m_classes[ ( cls >= 0 && cls < MAX_CLASSES ) ? cls : 0 ].queue;
+    if( ! queue.items )
+    {
+        queue.items = new queued_request[ m_max_requests ];
+        queue.capacity = m_max_requests;
+    }
+    queued_request item;
+    item.request = request;
+    item.task = task;
+    item.enqueue_ns = now;
+    queue.push_back( item );
+    ++m_queued;
+    return true;
+}
+
+/* 认领需要唤醒的睡眠线程：每个线程醒来后最多取走 m_max_batch 个任务。调用者需要持有 m_queuelocker，解锁之后 post 返回的次数 */
+template< typename T >
+int threadpool< T >::claim_sleepers( int added )
+{
+    int wakeups = ( added + m_max_batch - 1 ) / m_max_batch;
+    if( wakeups > m_sleepers )
+    {
+        wakeups = m_sleepers;
+    }
+    m_sleepers -= wakeups;
+    return wakeups;
+}
+
+template< typename T >
+void threadpool< T >::set_batch( int max_batch )
+{
+    m_queuelocker.lock();
+    m_max_batch = ( max_batch < 1 ) ? 1 : ( max_batch > MAX_BATCH ) ? MAX_BATCH : max_batch;
+    m_queuelocker.unlock();
+}
+
+template< typename T >
+void threadpool< T >::set_class( int cls, int weight, int max_running )
+{
+    if( cls < 0 || cls >= MAX_CLASSES )
+    {
+        return;
+    }
+    m_queuelocker.lock();
+    m_classes[ cls ].weight = ( weight > 0 ) ? weight : 1;
+    m_classes[ cls ].max_running = ( max_running > 0 ) ? max_running : 0;
+    m_queuelocker.unlock();
+}
+
+template< typename T >
+void threadpool< T >::set_queue_delay( long target_us, long interval_us )
+{
+    m_queuelocker.lock();
+    m_target_ns = target_us * 1000LL;
+    m_interval_ns = interval_us * 1000LL;
+    m_queuelocker.unlock();
+}
+
+/* 线程池中所有的计时（入队时间、过载控制、弹性伸缩和统计）都使用时间戳计数器，每个任务的计时开销只有几纳秒 */
+template< typename T >
+long long threadpool< T >::now_ns()
+{
+    return cycle_clock::now_ns();
+}
+
+/* 过载控制，采用 CoDel 的思想：偶尔的突发会让排队时间暂时变长，但队列很快就会排空；只有一个观察窗口内的最小排队时间都超过
+target 时，才说明处理能力已经跟不上，队列成为了持续存在的"坏队列"。这时排队超过 2 * target 的请求即使处理了，客户端也多半已经
+等得不耐烦，不如直接丢弃，把工作线程留给新的请求，让排队时间回落。调用者需要持有 m_queuelocker。 */
+template< typename T >
+bool threadpool< T >::should_shed( task_class* c, long long sojourn, long long now )
+{
+    if ( m_target_ns <= 0 )
+    {
+        return false;
+    }
+    if ( now >= c->interval_end )
+    {
+        c->overloaded = ( c->min_sojourn > m_target_ns );
+        c->interval_end = now + m_interval_ns;
+        c->min_sojourn = sojourn;
+    }
+    else if ( sojourn < c->min_sojourn )
+    {
+        c->min_sojourn = sojourn;
+    }
+    return c->overloaded && sojourn > 2 * m_target_ns;
+}
+
+/* 类别中有任务，并且处理它的线程数还没有达到上限。调用者需要持有 m_queuelocker */
+template< typename T >
+bool threadpool< T >::dispatchable( const task_class* c ) const
+{
+    return ! c->queue.empty() && ( c->max_running == 0 || c->running < c->max_running );
+}
+
+/* 选择下一个取任务的类别，采用平滑加权轮询（和 nginx 的 upstream 负载均衡相同）：每次给每个可以取任务的类别的当前值加上它的权重，
+选出当前值最大的类别，再把它的当前值减去这些权重之和。权重为 5、1、1 时的顺序是 a a b a c a a，而不是连续的 5 个 a。
+没有可以取任务的类别时返回 -1。调用者需要持有 m_queuelocker */
+template< typename T >
+int threadpool< T >::pick_class()
+{
+    int best = -1;
+    int total = 0;
+    for ( int i = 0; i < MAX_CLASSES; ++i )
+    {
+        task_class* c = m_classes + i;
+        if ( ! dispatchable( c ) )
+        {
+            continue;
+        }
+        c->current += c->weight;
+        total += c->weight;
+        if ( best < 0 || c->current > m_classes[ best ].current )
+        {
+            best = i;
+        }
+    }
+    if ( best >= 0 )
+    {
+        m_classes[ best ].current -= total;
+    }
+    return best;
+}
+
+/* 取出至多 m_max_batch 个任务，但不超过平均份额：队列中的任务数除以没有睡眠的线程数（包括自己和已经被认领、即将醒来的线程），
+这样任务不多时仍然分给多个线程并行处理。调用者需要持有 m_queuelocker */
+template< typename T >
+int threadpool< T >::take( taken_request* batch, task_slot*& released )
+{
+    // 先归还上一批中执行完的通用任务的槽位，这样归还不需要额外加锁
+    while ( released )
+    {
+        task_slot* next = released->next;
+        released->next = m_free_tasks;
+        m_free_tasks = released;
+        released = next;
+    }
+    if ( m_queued == 0 )
+    {
+        return 0;
+    }
+    int awake = m_live - m_sleepers;
+    int limit = ( awake > 1 ) ? ( m_queued + awake - 1 ) / awake : m_queued;
+    if ( limit > m_max_batch )
+    {
+        limit = m_max_batch;
+    }
+    long long now = now_ns();
+    int n = 0;
+    while ( n < limit )
+    {
+        // 按照权重选择一个类别，获得该类别队列的对头事件。只有限制了线程数的类别需要记录正在处理它的线程数
+        int cls = pick_class();
+        if ( cls < 0 )
+        {
+            break;
+        }
+        task_class* c = m_classes + cls;
+        queued_request item = c->queue.front();
+        c->queue.pop_front();
+        --m_queued;
+        taken_request& taken = batch[ n++ ];
+        taken.request = item.request;
+        taken.task = item.task;
+        taken.cls = cls;
+        taken.capped = ( c->max_running > 0 );
+        if ( taken.capped )
+        {
+            ++c->running;
+        }
+        c->dequeued++;
+        taken.wait_ns = now - item.enqueue_ns;
+        // 所有任务的排队时间都参与过载判断，但没有完成通知的通用任务不能丢弃：提交者无从得知，它的工作就悄悄丢失了
+        taken.shed = should_shed( c, taken.wait_ns, now ) && ( item.request || item.task->done );
+    }
+    return n;
+}
+
+/* 执行一个通用任务，shed 为 true 时不执行、直接取消。可调用对象（以及它捕获的资源）在通知提交者之前销毁 */
+template< typename T >
+void threadpool< T >::run_task( task_slot* task, bool shed )
+{
+    if ( ! shed )
+    {
+        TRACE_SPAN( "task", task );
+        TRACE_FLOW_END( "request", task );
+        task->fn();
+    }
+    task->fn.reset();
+    if ( task->done )
+    {
+        task->done->finish( ! shed );
+    }
+}
+
+/* 一个类别的任务处理完。busy 为 true 表示当前线程还有取出的任务要处理，这时如果有线程因为这个类别达到上限而没有取到任务、
+正在睡眠，唤醒其中一个，让它重新选择；否则当前线程马上会自己回来取任务，不必唤醒别的线程 */
+template< typename T >
+void threadpool< T >::finish( int cls, bool busy )
+{
+    m_queuelocker.lock();
+    task_class* c = m_classes + cls;
+    --c->running;
+    bool wake = ( busy && m_sleepers > 0 && ! c->queue.empty() );
+    if ( wake )
+    {
+        --m_sleepers;
+    }
     m_queuelocker.unlock();
-    // 信号量+1
-    m_queuestat.post();
+    if ( wake )
+    {
+        m_queuestat.post();
+    }
+}
+
+/* 是否需要增加线程。只看排队时间不够：CPU 已经跑满时排队时间同样会变长，这时增加线程没有帮助；
+只有所有线程都在忙（没有未被唤醒的睡眠线程）、队首的请求仍然等待超过阈值时，才说明有线程阻塞在 I/O 或者缺页上，CPU 还有余力。
+调用者需要持有 m_queuelocker。 */
+template< typename T >
+bool threadpool< T >::should_grow( long long now )
+{
+    if( m_grow_target_ns <= 0 || m_live >= m_max_threads || now < m_next_grow || m_sleepers > 0 )
+    {
+        return false;
+    }
+    // 只看可以取任务的类别：达到线程数上限的类别即使排队很久，增加线程也帮不上它
+    long long oldest = now;
+    for( int i = 0; i < MAX_CLASSES; ++i )
+    {
+        if( dispatchable( m_classes + i ) && m_classes[i].queue.front().enqueue_ns < oldest )
+        {
+            oldest = m_classes[i].queue.front().enqueue_ns;
+        }
+    }
+    if( now - oldest <= m_grow_target_ns )
+    {
+        return false;
+    }
+    m_next_grow = now + m_grow_interval_ns;
     return true;
 }
 
@@ -110,39 +831,89 @@ bool threadpool< T >::append( T* request )
 template< typename T >
 void* threadpool< T >::worker( void* arg )
 {
-    threadpool* pool = ( threadpool* )arg;
-    pool->run();
-    return pool;
+    worker_slot* slot = ( worker_slot* )arg;
+    TRACE_THREAD_NAME( "worker" );
+    slot->pool->run( slot );
+    return slot->pool;
 }
 
 template< typename T >
-void threadpool< T >::run()
+void threadpool< T >::run( worker_slot* slot )
 {
+    taken_request batch[ MAX_BATCH ];
+    // 执行完的通用任务的槽位，下一次取任务时归还
+    task_slot* released = NULL;
+    worker_stats& stats = slot->stats;
     // 直到线程结束，循环就终止
     while ( ! m_stop )
     {
-        // P 操作：申请信号量
-        m_queuestat.wait();
-        // 加锁
+        TRACE_MARK( dequeue_start );
+        // 加锁，取出一批任务
         m_queuelocker.lock();
-        // 工作队列为空，就解锁，并进入下一次循环
-        if ( m_workqueue.empty() )
+        int n = take( batch, released );
+        if ( n == 0 )
         {
+            // 没有可以取出的任务（队列为空，或者任务都属于已经达到线程数上限的类别），解锁并睡眠，直到被生产者或者 finish 唤醒。
+            // P 操作：申请信号量。开启了弹性伸缩时最多等待 idle_ms，等不到任务的线程尝试退出
+            ++m_sleepers;
             m_queuelocker.unlock();
+            long idle_ms = m_idle_ms;
+            long long sleep_start = now_ns();
+            bool woken = ( idle_ms > 0 ) ? m_queuestat.timed_wait( idle_ms ) : m_queuestat.wait();
+            int wait_errno = errno;
+            stats.add_idle( now_ns() - sleep_start );
+            if ( ! woken && leave_wait( slot, wait_errno == ETIMEDOUT ) )
+            {
+                break;
+            }
             continue;
         }
-        // 获得工作队列的对头事件
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
         // 解锁
         m_queuelocker.unlock();
-        // 事件为空，就进入下一次循环
-        if ( ! request )
+        TRACE_SPAN_END( "dequeue", dequeue_start, batch[0].request ? ( void* )batch[0].request : ( void* )batch[0].task );
+        long long start = now_ns();
+        for ( int i = 0; i < n; ++i )
         {
-            continue;
+            stats.wait.record( batch[i].wait_ns );
+            T* request = batch[i].request;
+            // 事件为空时什么也不做
+            if ( request )
+            {
+                // 过载时丢弃排队太久的请求
+                if ( batch[i].shed )
+                {
+                    m_shed_count++;
+                    request->shed();
+                }
+                else
+                {
+                    // 处理该事件。跟踪中的箭头从主线程的 enqueue 区间指向这里的 process 区间
+                    TRACE_SPAN( "process", request );
+                    TRACE_FLOW_END( "request", request );
+                    request->process();
+                }
+            }
+            else if ( batch[i].task )
+            {
+                if ( batch[i].shed )
+                {
+                    m_shed_count++;
+                }
+                run_task( batch[i].task, batch[i].shed );
+                batch[i].task->next = released;
+                released = batch[i].task;
+            }
+            // 处理时间从上一个任务结束（或者取出这一批）到这个任务结束，被丢弃的任务也计入，它们同样占用了线程
+            long long end = now_ns();
+            stats.service.record( end - start );
+            stats.add_busy( end - start );
+            start = end;
+            if ( batch[i].capped )
+            {
+                finish( batch[i].cls, i + 1 < n );
+                start = now_ns();
+            }
         }
-        // 处理该事件
-        request->process();
     }
 }
 
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <sys/stat.h>
@@ -16,9 +17,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
+#include <atomic>
 #include "chapter14/14_2_locker.h"
+#include "chapter15/15_7_file_cache.h"
+#include "chapter15/15_9_route_table.h"
+#include "chapter15/15_10_upstream.h"
+#include "chapter15/15_11_access_log.h"
+#include "chapter15/15_12_trace.h"
+#include "chapter15/15_14_h2_session.h"
+#include "chapter15/15_15_websocket.h"
+#include "chapter15/15_16_tls.h"
+#include "chapter15/15_17_coroutine.h"
+#include "chapter15/15_23_proactor.h"
 
 /* 线程池的模板参数类，用来封装对逻辑任务的处理。 */
 class http_conn
@@ -30,67 +45,205 @@ public:
     static const int READ_BUFFER_SIZE = 2048;
     // 写缓冲区的大小
     static const int WRITE_BUFFER_SIZE = 1024;
+    // 每次调用 sendfile 发送的文件窗口的最大长度，避免大文件一次占满 socket 发送缓冲或整块映射到内存
+    static const int FILE_WINDOW_SIZE = 256 * 1024;
+    // ETag 的最大长度
+    static const int ETAG_LEN = 64;
     // HTTP 请求方法，但是仅支持 GET
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH };
     // 解析客户请求时，主状态机所处的状态。分别表示：当前正在分析请求行、当前正在分析头部字段
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
     // 服务器处理 HTTP 请求的可能结果
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, NOT_MODIFIED, RANGE_NOT_SATISFIABLE, PROXY_REQUEST, PROXY_PENDING, BAD_GATEWAY, MISDIRECTED_REQUEST, H2_UPGRADE, H2_PREFACE, WS_UPGRADE, INTERNAL_ERROR, CLOSED_CONNECTION };
     // 行的读取状态，分别表示：读取到一个完整的行、行出错、行数据尚且不完整 
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // 应答的发送策略，分别表示：保持默认的 Nagle 算法、设置 TCP_NODELAY、组装应答期间设置 TCP_CORK 并在发送完之后一次性取消
+    enum FLUSH_POLICY { FLUSH_NAGLE = 0, FLUSH_NODELAY, FLUSH_CORK };
+    // 请求在线程池中的类别，分别表示：文件信息已经缓存的静态文件（以及其他不需要等待的请求）、需要调用 stat 访问磁盘的静态文件、转发到上游服务器的代理请求（工作线程只负责发起，不等待上游）
+    enum REQUEST_CLASS { CLASS_CACHED = 0, CLASS_DISK, CLASS_UPSTREAM, CLASS_NUMBER };
+    // 代理请求在收到上游应答头部之前的阶段，分别表示：没有进行中的代理请求（或者已经在转发消息体）、正在建立连接、正在发送请求、正在读取应答头部
+    enum UPSTREAM_STATE { UPSTREAM_IDLE = 0, UPSTREAM_CONNECT, UPSTREAM_SEND, UPSTREAM_HEADER };
 
 public:
-    http_conn(){}
-    ~http_conn(){}
+    http_conn() : m_generation( 0 ), m_ws( NULL ), m_tls( NULL ), m_request_class( CLASS_CACHED ), m_proactor( NULL ), m_route_table( NULL ) {}
+    ~http_conn(){ delete m_ws; delete m_tls; release_routes(); }
 
 public:
-    /* 初始化新接受的连接 */
+    /* 初始化新接受的连接，注册到共享的事件表 m_epollfd 上，每次事件都由 EPOLLONESHOT 交给一个工作线程处理。
+    sockfd 必须是非阻塞的（由 accept4 的 SOCK_NONBLOCK 设置） */
     void init( int sockfd, const sockaddr_in& addr );
+    /* 初始化新接受的连接，连接归属于等待在 epollfd 上的线程。连接只注册一次 EPOLLIN | EPOLLOUT 边沿触发事件，之后不再需要 EPOLL_CTL_MOD。
+    代理请求使用这个线程的上游连接池 upstreams */
+    void init( int sockfd, const sockaddr_in& addr, int epollfd, upstream_pool* upstreams );
+    /* 初始化新接受的连接，它的读写都作为异步操作提交给 proactor，由完成事件驱动。连接不注册到任何事件表，
+    只支持 HTTP/1.1 的静态文件请求（没有 TLS、代理、HTTP/2 和 WebSocket）。sockfd 可以是阻塞的 */
+    void init( int sockfd, const sockaddr_in& addr, proactor* p );
     // 关闭连接
     void close_conn( bool real_close = true );
     // 处理客户请求
     void process();
+    // 过载时拒绝客户请求：发送预先生成的 503 应答并关闭连接（WebSocket 和 HTTP/2 连接照常处理）
+    void shed();
     // 非阻塞读操作
     bool read();
     // 非阻塞写操作
     bool write();
+    // 连接归属模式下处理就绪事件，返回 false 表示应该关闭连接
+    bool handle_events( uint32_t events );
+    // 应答已经发送完，并且读缓冲中还有流水线请求等待处理
+    bool has_buffered_request() const
+    {
+        return m_write_idx == 0 && m_upstream_state == UPSTREAM_IDLE && ( m_read_idx > 0 || ( m_tls && m_tls->pending() > 0 ) );
+    }
+    // 代理请求正在等待上游连接（建立连接、发送请求、读取应答头部或者转发消息体）。此时上游连接以 EPOLLONESHOT 注册在连接的事件表中，
+    // 事件的 data.fd 是客户连接，收到事件后应该调用 upstream_event
+    bool waiting_upstream() const { return m_upstream_waiting; }
+    // 处理上游连接上的事件：推进代理请求，收到应答头部之后开始向客户发送应答。返回 false 表示应该关闭连接
+    bool upstream_event();
+    // 连接已经切换到 WebSocket。EPOLLONESHOT 模式下它的事件不再由主线程读写，而是经过 claim 检查之后直接交给工作线程
+    bool websocket() const { return m_websocket; }
+    // 主线程接手 WebSocket 连接的事件，返回 false 表示这是一个重复的事件，应该忽略（见 ws_session::claim）
+    bool claim() { return m_ws->claim(); }
+    /* 连接真正关闭的次数。一次 epoll_wait 取出的事件中可能有同一个连接的多个事件（例如客户连接和上游连接的事件），
+    处理前面的事件时连接被关闭之后，描述符随时可能被主线程重新 accept，后面的事件都已经过时，应该丢弃 */
+    unsigned int generation() const { return m_generation; }
+    // 主线程读入请求之后、交给线程池之前判断它的类别，只查看请求行和 Host 字段，不会阻塞
+    REQUEST_CLASS request_class();
 
 private:
     // 初始化连接
     void init();
+    // 为新连接设置 socket 选项
+    void init_socket();
+    // 连接归属模式下循环处理请求
+    bool serve_requests();
+    // Proactor 模式下推进连接：发起下一个异步操作（发送应答的剩余部分，或者读取请求），或者关闭连接
+    void serve_async();
+    // Proactor 模式下接收和发送操作的完成处理函数，arg 是连接对象
+    static void on_recv( async_op* op, int result );
+    static void on_send( async_op* op, int result );
+    // 切换到 HTTP/2，upgraded 为 true 时是通过 Upgrade 切换，否则是客户端直接发送了连接前言
+    bool start_h2( bool upgraded );
+    // HTTP/2 连接的读取之后的处理、发送，以及连接归属模式下的循环
+    void process_h2();
+    bool write_h2();
+    bool serve_h2();
+    // HTTP/2 会话的请求处理函数：像 HTTP/1.1 请求一样查找路由和文件，把结果填入应答
+    static void h2_handler( const h2_request& request, h2_response* response, void* arg );
+    void serve_stream( const h2_request& request, h2_response* response );
+    // 检查 WebSocket 握手请求并找到对应的房间
+    HTTP_CODE do_websocket();
+    // 切换到 WebSocket，之后连接上的读写都由 m_ws 完成
+    bool start_ws();
+    // EPOLLONESHOT 模式下工作线程处理 WebSocket 连接，以及两种模式共用的读取、处理和发送，后者返回 false 表示应该关闭连接
+    void process_ws();
+    bool serve_ws();
+    // WebSocket 会话的消息处理函数：把消息广播给房间中的其他成员
+    static void ws_handler( ws_session* session, int opcode, const char* data, int len, void* arg );
+    // EPOLLONESHOT 模式下重新注册 ev 事件，连接归属模式下什么也不做
+    void rearm( int ev );
+    // 推进 TLS 握手，返回值和 tls_conn::handshake 相同
+    int tls_handshake();
+    // 用户态加密的 TLS 连接，应答必须经过 SSL_write。kTLS 连接和明文连接一样直接写 socket，由内核加密
+    bool tls_userspace() const { return m_tls && ! m_tls->ktls(); }
+    // 向客户发送 buf 中的数据，TLS 连接经过 m_tls，返回值和 send 相同
+    int send_client( const char* buf, int len, int flags );
+    // 保持连接时为下一个请求做准备，保留读缓冲中的流水线请求
+    void next_request();
+    // 放弃当前请求对路由表的引用
+    void release_routes();
+    // 设置或取消 TCP_CORK
+    void set_cork( bool on );
+    // 统计一个应答发送的报文段数
+    void count_segments();
     // 解析 HTTP 请求
     HTTP_CODE process_read();
+#ifdef HTTP_COROUTINE
+    // 以协程的形式解析一个请求，需要更多数据时挂起，由 process_read 在读入新数据之后恢复
+    task< HTTP_CODE > parse_request();
+#endif
     // 填充 HTTP 应答
     bool process_write( HTTP_CODE ret );
+    // 应答发送完毕时写一条访问日志
+    void log_access();
 
     // 下面这组函数被 process_read 调用以分析 HTTP 请求
     HTTP_CODE parse_request_line( char* text );
     HTTP_CODE parse_headers( char* text );
     HTTP_CODE parse_content( char* text );
     HTTP_CODE do_request();
+    HTTP_CODE do_proxy( const route* r, const char* path );
+    int make_upstream_request( const char* path, char* buf, int len );
+    bool connect_upstream( bool pooled );
+    bool retry_upstream();
+    HTTP_CODE advance_upstream();
+    HTTP_CODE finish_upstream_header( int header_len );
+    bool parse_upstream_header( char* buf );
+    void fill_pipe();
+    int relay_body();
+    void wait_upstream();
+    void release_upstream( bool reuse );
+    bool parse_range();
+    bool not_modified();
+    void make_etag( char* etag, int len );
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     // 下面这组函数被 process_write 调用以填充 HTTP 应答
-    void unmap();
+    void close_file();
     bool add_response( const char* format, ... );
     bool add_content( const char* content );
     bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_headers( off_t content_length );
+    bool add_content_length( off_t content_length );
+    bool add_content_range();
+    bool add_validators();
     bool add_linger();
     bool add_blank_line();
 
 public:
     // 所有 socket 上的事件都被注册到同一个 epoll 内核事件表中，所以将 epoll 文件描述符设置为静态的
     static int m_epollfd;
-    // 统计用户数量
-    static int m_user_count;
+    // 统计用户数量。owned 模式下各个拥有者线程在 close_conn 中减少它，主线程在接受连接时增加和读取它，所以是原子变量
+    static std::atomic< int > m_user_count;
+    // 所有连接共享的文件信息缓存，为空时每个请求都调用 stat
+    static file_cache* m_file_cache;
+    // 当前使用的路由表。主线程重新加载配置时替换为新表，每个请求在 do_request 中取得它的一个引用
+    static route_holder m_routes;
+    // 注册在共享事件表 m_epollfd 上的连接（oneshot 和领导者/追随者模式）使用的上游连接池
+    static upstream_pool m_shared_upstreams;
+    // 统计 epoll_ctl 的调用次数和处理的请求数，用来比较两种连接模型每个请求的 epoll_ctl 开销
+    static std::atomic< long > m_epoll_ctl_count;
+    static std::atomic< long > m_request_count;
+    // 应答的发送策略
+    static FLUSH_POLICY m_flush_policy;
+    // 是否通过 TCP_INFO 统计每个应答发送的报文段数，以及统计结果
+    static bool m_count_segments;
+    static std::atomic< long > m_segment_count;
+    static std::atomic< long > m_response_count;
+    // 访问日志，为空时不记录
+    static access_log* m_access_log;
+    // HTTPS 的配置，为空时所有连接都是明文的
+    static tls_context* m_tls_context;
+    // 统计完成的 TLS 握手数，以及其中成功启用了 kTLS 的连接数
+    static std::atomic< long > m_tls_handshakes;
+    static std::atomic< long > m_ktls_count;
 
 private:
+    // 连接关闭时加 1，init 不会重置它（见 generation）
+    std::atomic< unsigned int > m_generation;
     // 该 HTTP 连接的 socket 和对方的 socket 地址
     int m_sockfd;
     sockaddr_in m_address;
+    // 该连接注册到的事件表，以及是否以 EPOLLONESHOT 方式注册
+    int m_conn_epollfd;
+    bool m_oneshot;
+    // 连接归属模式下，应答尚未发送完时到达的读事件被推迟到应答发送完之后处理；读缓冲已满时也用它记录 socket 中还有数据
+    bool m_read_pending;
+    // 当前是否设置了 TCP_CORK
+    bool m_corked;
+    // 上一次读取 TCP_INFO 时该连接已经发送的数据报文段数
+    unsigned int m_segs_out;
 
     // 读缓冲区
     char m_read_buf[ READ_BUFFER_SIZE ];
@@ -104,13 +257,15 @@ private:
     char m_write_buf[ WRITE_BUFFER_SIZE ];
     // 写缓冲区中待发送的字节数
     int m_write_idx;
+    // 写缓冲区中已经发送的字节数，writev/send 只写出一部分时从这里继续
+    int m_write_sent;
 
     // 主状态机当前所处的状态
     CHECK_STATE m_check_state;
     // 请求方法
     METHOD m_method;
 
-    // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root 是网站根目录
+    // 客户请求的目标文件的完整路径，其内容等于路由的根目录 + 规范化之后的 m_url 去掉路由前缀的部分
     char m_real_file[ FILENAME_LEN ];
     // 客户请求的目标文件的文件名
     char* m_url;
@@ -118,18 +273,88 @@ private:
     char* m_version;
     // 主机名
     char* m_host;
+    // Range 头部字段的原始内容，等到 stat 得到文件大小之后再解析
+    char* m_range;
+    // 条件请求的 If-None-Match 和 If-Modified-Since 头部字段
+    char* m_if_none_match;
+    char* m_if_modified_since;
     // HTTP 请求的消息体的长度
     int m_content_length;
     // HTTP 请求是否要求保持连接
     bool m_linger;
+    // 请求要求通过 Upgrade 切换到 h2c，以及 HTTP2-Settings 字段的值
+    bool m_upgrade_h2c;
+    char* m_http2_settings;
+    // 请求要求通过 Upgrade 切换到 WebSocket，以及 Sec-WebSocket-Key 和 Sec-WebSocket-Version 字段的值
+    bool m_upgrade_websocket;
+    char* m_ws_key;
+    char* m_ws_version;
+    // WebSocket 连接加入的房间，由请求的路径决定
+    ws_room* m_ws_room;
 
-    // 客户请求的目标文件被 mmap 到内存中的起始位置
-    char* m_file_address;
+    // 客户请求的目标文件的描述符。文件内容不再整块 mmap，而是用 sendfile 按窗口从这里发送
+    int m_file_fd;
     // 目标文件的状态。通过它可以判断文件是否存在、是否为目录、是否可读、并获取文件大小等信息
     struct stat m_file_stat;
-    // 采用 writev 来执行写操作，所以定义下面两个成员，其中 m_iv_count 表示被写内存块的数量
-    struct iovec m_iv[2];
-    int m_iv_count;
+    // 待发送的文件区间 [m_file_offset, m_file_end)，sendfile 每次发送后会自动推进 m_file_offset
+    off_t m_file_offset;
+    off_t m_file_end;
+    // 请求中带有可满足的 Range 字段，应答 206 Partial Content
+    bool m_partial;
+
+    // 访问日志需要的信息：开始处理请求的时间（CLOCK_MONOTONIC，纳秒）、应答的状态码和已经发送的字节数
+    long long m_request_start;
+    int m_status;
+    long long m_bytes_sent;
+
+    // 反向代理：当前使用的上游连接及其地址（路由表可能在转发期间被替换，所以保存一份地址的副本）
+    int m_upstream_fd;
+    upstream m_backend;
+    // 取出和归还上游连接的连接池，属于连接所在的事件循环
+    upstream_pool* m_upstream_pool;
+    // 收到上游应答头部之前的阶段，以及当前的上游连接是否取自连接池（失效时可以换一个新建的连接重试）
+    UPSTREAM_STATE m_upstream_state;
+    bool m_upstream_reused;
+    // 发送请求时，请求放在写缓冲中，长度为 m_upstream_request_len，m_upstream_idx 是已经发送的字节数；
+    // 读取应答头部时，头部读入写缓冲，m_upstream_idx 是已经读入的字节数
+    int m_upstream_request_len;
+    int m_upstream_idx;
+    // 需要等待的上游连接上的事件（EPOLLOUT 或 EPOLLIN），由 wait_upstream 注册
+    int m_upstream_events;
+    // 应答读完之后上游连接是否可以放回连接池
+    bool m_upstream_reusable;
+    // 上游连接是否已经注册到连接的事件表中，以及是否正在等待它的事件
+    bool m_upstream_registered;
+    bool m_upstream_waiting;
+    // 上游应答的消息体还没有读入管道的字节数，-1 表示消息体以上游关闭连接为结束
+    long long m_proxy_remaining;
+    // 消息体经由这个管道从上游 socket splice 到客户 socket，数据不进入用户空间。管道在第一次代理时创建，随连接一起关闭
+    int m_pipefd[2];
+    // 管道的容量和其中尚未发送给客户的字节数
+    int m_pipe_size;
+    int m_pipe_pending;
+
+    // 切换到 HTTP/2 之后的会话，HTTP/1.1 连接为空。切换之后读写都交给会话，读缓冲和写缓冲只在切换时使用
+    h2_session* m_h2;
+    // 连接是否已经切换到 WebSocket，以及它的会话。会话对象在第一次切换时创建，连接关闭时并不释放，留给这个 http_conn 上的下一个 WebSocket 连接
+    bool m_websocket;
+    ws_session* m_ws;
+    // HTTPS 连接的 TLS 状态，明文连接为空
+    tls_conn* m_tls;
+    // 上一次判断出的请求类别，请求分成几次读入时沿用第一次的结果
+    REQUEST_CLASS m_request_class;
+#ifdef HTTP_COROUTINE
+    // 正在解析的请求的协程，请求解析完之后立即销毁
+    task< HTTP_CODE > m_parser;
+#endif
+    // Proactor 模式下连接的读写操作提交到的 proactor，其他模式为空。连接同一时刻最多只有一个进行中的操作：
+    // 接收请求、发送头部和发送文件依次进行，所以各用一个操作对象，完成之前不会被复用
+    proactor* m_proactor;
+    async_op m_recv_op;
+    async_op m_send_op;
+    async_file m_async_file;
+    // 当前请求持有引用的路由表，它返回的 route 在请求结束之前一直有效（代理请求要在上游应答转发完之后才结束）
+    route_table* m_route_table;
 };
 
 #endif
\ No newline at end of file
@@ -2,17 +2,30 @@
 
 // 定义了 HTTP 相应的一些状态信息
 const char* ok_200_title = "OK";
+const char* ok_200_form = "<html><body></body></html>";
+const char* ok_206_title = "Partial Content";
+const char* ok_304_title = "Not Modified";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_416_title = "Range Not Satisfiable";
+const char* error_416_form = "The requested range is not satisfiable.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-// 网站的根目录
-const char* doc_root = "/var/www/html";
-
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server did not return a valid response.\n";
+const char* error_421_title = "Misdirected Request";
+const char* error_421_form = "This resource is not served over HTTP/2, retry with HTTP/1.1.\n";
+const char* switching_101_title = "Switching Protocols";
+// 过载时的应答是固定的，预先生成完整的报文，拒绝请求时只需要一次 send
+const char overload_503_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                     "Content-Length: 37\r\n"
+                                     "Retry-After: 1\r\n"
+                                     "Connection: close\r\n\r\n"
+                                     "The server is temporarily overloaded.";
 /* 将文件描述符设置为非阻塞的 */
 int setnonblocking( int fd )
 {
@@ -25,7 +38,8 @@ int setnonblocking( int fd )
     return old_option;
 }
 
-/* 将 fd 上的 EPOLLIN 和 EPOLLET 事件注册到 epollfd 指示的 epoll 内核事件表中，参数 oneshot 指定是否注册 fd 上的 EPOLLONESHOT 事件 */
+/* 将 fd 上的 EPOLLIN 和 EPOLLET 事件注册到 epollfd 指示的 epoll 内核事件表中，参数 oneshot 指定是否注册 fd 上的 EPOLLONESHOT 事件。
+ET 模式要求 fd 是非阻塞的：监听 socket 和连接 socket 分别在 socket 和 accept4 时设置了 SOCK_NONBLOCK，这里不再调用 fcntl */
 void addfd( int epollfd, int fd, bool one_shot )
 {
     epoll_event event;
@@ -40,14 +54,14 @@ void addfd( int epollfd, int fd, bool one_shot )
     }
     // 往事件表中注册 fd 上的事件
     epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
-    // 将文件描述符设置为非阻塞的
-    setnonblocking( fd );
+    http_conn::m_epoll_ctl_count++;
 }
 
 /* 将事件表 epollfd 上注册 fd 的事件都进行删除，然后关闭 fd 文件描述符。 */
 void removefd( int epollfd, int fd )
 {
     epoll_ctl( epollfd, EPOLL_CTL_DEL, fd, 0 );
+    http_conn::m_epoll_ctl_count++;
     close( fd );
 }
 
@@ -58,21 +72,162 @@ void modfd( int epollfd, int fd, int ev )
     event.data.fd = fd;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+    http_conn::m_epoll_ctl_count++;
 }
 
-int http_conn::m_user_count = 0;
+std::atomic< int > http_conn::m_user_count( 0 );
 int http_conn::m_epollfd = -1;
+file_cache* http_conn::m_file_cache = NULL;
+route_holder http_conn::m_routes;
+upstream_pool http_conn::m_shared_upstreams;
+std::atomic< long > http_conn::m_epoll_ctl_count( 0 );
+std::atomic< long > http_conn::m_request_count( 0 );
+http_conn::FLUSH_POLICY http_conn::m_flush_policy = http_conn::FLUSH_NAGLE;
+bool http_conn::m_count_segments = false;
+std::atomic< long > http_conn::m_segment_count( 0 );
+std::atomic< long > http_conn::m_response_count( 0 );
+access_log* http_conn::m_access_log = NULL;
+tls_context* http_conn::m_tls_context = NULL;
+std::atomic< long > http_conn::m_tls_handshakes( 0 );
+std::atomic< long > http_conn::m_ktls_count( 0 );
+
+/* 单调时钟的当前时间，单位是纳秒 */
+static long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* 将十六进制字符转换为数值，不是十六进制字符时返回 -1 */
+static int hex_value( char c )
+{
+    if ( c >= '0' && c <= '9' ) return c - '0';
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+/* 对 URL 进行百分号解码和规范化，结果写入长度为 len 的 path 中：去掉查询字符串和片段，合并连续的 '/'，
+处理 "." 和 ".." 路径段。".." 越过网站根目录、解码得到 '\0' 或者结果太长时返回 false。
+先解码再处理路径段，所以 "%2e%2e" 和 "%2f" 这类编码过的路径穿越同样会被识别。 */
+static bool canonicalize_url( const char* url, char* path, int len )
+{
+    int idx = 0;
+    path[ idx++ ] = '/';
+    const char* end = url + strcspn( url, "?#" );
+    while ( url < end )
+    {
+        // 解码出下一个路径段
+        char segment[ http_conn::FILENAME_LEN ];
+        int seg_len = 0;
+        for ( ; url < end; ++url )
+        {
+            char c = *url;
+            if ( c == '%' )
+            {
+                if ( end - url < 3 )
+                {
+                    return false;
+                }
+                int high = hex_value( url[1] );
+                int low = hex_value( url[2] );
+                if ( high < 0 || low < 0 || ( high == 0 && low == 0 ) )
+                {
+                    return false;
+                }
+                c = ( char )( high * 16 + low );
+                url += 2;
+            }
+            if ( c == '/' )
+            {
+                ++url;
+                break;
+            }
+            if ( seg_len >= http_conn::FILENAME_LEN - 1 )
+            {
+                return false;
+            }
+            segment[ seg_len++ ] = c;
+        }
+
+        // 空路径段（连续的 '/'）和 "." 直接跳过，".." 回退到上一级目录
+        if ( seg_len == 0 || ( seg_len == 1 && segment[0] == '.' ) )
+        {
+            continue;
+        }
+        if ( seg_len == 2 && segment[0] == '.' && segment[1] == '.' )
+        {
+            if ( idx == 1 )
+            {
+                return false;
+            }
+            for ( idx -= 2; path[ idx ] != '/'; --idx ) {}
+            ++idx;
+            continue;
+        }
+        if ( idx + seg_len + 1 >= len )
+        {
+            return false;
+        }
+        memcpy( path + idx, segment, seg_len );
+        idx += seg_len;
+        path[ idx++ ] = '/';
+    }
+
+    // 最后一个路径段之后的 '/' 只有在原 URL 以 '/' 结尾时才保留
+    if ( idx > 1 && *( end - 1 ) != '/' )
+    {
+        --idx;
+    }
+    path[ idx ] = '\0';
+    return true;
+}
 
 /* 关闭连接 */
 void http_conn::close_conn( bool real_close )
 {
     if( real_close && ( m_sockfd != -1 ) )
     {
-        /* 删除 m_sockfd 这个 socket 连接 */
-        removefd( m_epollfd, m_sockfd );
-        m_sockfd = -1;
+        // 发送到一半的文件也要关闭，避免泄漏文件描述符。转发到一半的上游连接还有未读的应答，不能放回连接池
+        close_file();
+        release_upstream( false );
+        if ( m_pipefd[0] >= 0 )
+        {
+            close( m_pipefd[0] );
+            close( m_pipefd[1] );
+            m_pipefd[0] = m_pipefd[1] = -1;
+        }
+        delete m_h2;
+        m_h2 = NULL;
+        // 空闲的连接对象不应让重新加载之前的路由表一直留在内存中
+        release_routes();
+        // 离开房间之后广播不会再访问这个连接
+        if ( m_websocket )
+        {
+            m_ws->close();
+        }
+        if ( m_tls )
+        {
+            m_tls->shutdown();
+            delete m_tls;
+            m_tls = NULL;
+        }
         // 关闭一个连接时，将客户数量减 1
         m_user_count--;
+        /* 删除 m_sockfd 这个 socket 连接。这一步必须放在最后：描述符一旦关闭就可能被主线程重新 accept 并复用这个对象 */
+        int sockfd = m_sockfd;
+        m_sockfd = -1;
+        m_generation++;
+        if ( m_proactor )
+        {
+            // Proactor 模式下连接没有注册到事件表，也没有进行中的操作（关闭总是发生在完成处理函数中）
+            m_async_file.close_pipe();
+            m_proactor = NULL;
+            close( sockfd );
+            return;
+        }
+        removefd( m_conn_epollfd, sockfd );
     }
 }
 
@@ -81,17 +236,153 @@ void http_conn::init( int sockfd, const sockaddr_in& addr )
 {
     m_sockfd = sockfd;
     m_address = addr;
-    int error = 0;
-    socklen_t len = sizeof( error );
-    getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
-    // 如下两行是为了避免 TIME_WAIT 状态，仅用于调试，实际使用时应该去掉
-    int reuse = 1;
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    // 在事件表 m_epollfd 上注册 sockfd 的事件
+    m_file_fd = -1;
+    m_read_pending = false;
+    m_proactor = NULL;
+    m_upstream_pool = &m_shared_upstreams;
+    m_user_count++;
+
+    init_socket();
+    init();
+    // 在事件表 m_epollfd 上注册 sockfd 的事件。注册之后事件随时可能到来，所以必须先初始化连接的状态
+    m_conn_epollfd = m_epollfd;
+    m_oneshot = true;
     addfd( m_epollfd, sockfd, true );
+}
+
+void http_conn::init( int sockfd, const sockaddr_in& addr, int epollfd, upstream_pool* upstreams )
+{
+    m_sockfd = sockfd;
+    m_address = addr;
+    m_file_fd = -1;
+    m_read_pending = false;
+    m_proactor = NULL;
+    m_upstream_pool = upstreams;
+    m_user_count++;
+
+    init_socket();
+    init();
+    // 连接只会被拥有它的线程处理，所以不需要 EPOLLONESHOT，一次注册可读、可写两种边沿触发事件即可
+    m_conn_epollfd = epollfd;
+    m_oneshot = false;
+    epoll_event event;
+    event.data.fd = sockfd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, sockfd, &event );
+    m_epoll_ctl_count++;
+}
+
+void http_conn::init( int sockfd, const sockaddr_in& addr, proactor* p )
+{
+    m_sockfd = sockfd;
+    m_address = addr;
+    m_file_fd = -1;
+    m_read_pending = false;
+    m_upstream_pool = NULL;
     m_user_count++;
 
+    init_socket();
     init();
+    // 不注册任何事件，直接发起第一个接收操作
+    m_conn_epollfd = -1;
+    m_oneshot = false;
+    m_proactor = p;
+    m_recv_op.handler = on_recv;
+    m_recv_op.arg = this;
+    m_send_op.handler = on_send;
+    m_send_op.arg = this;
+    serve_async();
+}
+
+/* 按照发送策略设置新连接的 socket 选项，并清空读缓冲和代理状态 */
+void http_conn::init_socket()
+{
+    m_upstream_fd = -1;
+    m_upstream_state = UPSTREAM_IDLE;
+    m_upstream_registered = false;
+    m_upstream_waiting = false;
+    m_pipefd[0] = m_pipefd[1] = -1;
+    m_pipe_pending = 0;
+    m_h2 = NULL;
+    m_websocket = false;
+    m_tls = m_tls_context ? new tls_conn( m_tls_context, m_sockfd ) : NULL;
+    m_corked = false;
+    m_segs_out = 0;
+    m_read_idx = 0;
+    memset( m_read_buf, '\0', READ_BUFFER_SIZE );
+    if ( m_flush_policy == FLUSH_NODELAY )
+    {
+        int on = 1;
+        setsockopt( m_sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    }
+    if ( m_count_segments )
+    {
+        // 记下握手期间发送的报文段数，使它不被计入第一个应答
+        struct tcp_info info;
+        socklen_t len = sizeof( info );
+        if ( getsockopt( m_sockfd, IPPROTO_TCP, TCP_INFO, &info, &len ) == 0 )
+        {
+            m_segs_out = info.tcpi_data_segs_out;
+        }
+    }
+}
+
+/* TCP_CORK 设置期间内核只发送满长度的报文段，取消时把剩余的数据一次性发送出去 */
+void http_conn::set_cork( bool on )
+{
+    if ( m_corked != on )
+    {
+        int value = on;
+        setsockopt( m_sockfd, IPPROTO_TCP, TCP_CORK, &value, sizeof( value ) );
+        m_corked = on;
+    }
+}
+
+/* 通过 TCP_INFO 读取连接累计发送的数据报文段数，与上一次的差值就是刚发送完的应答所用的报文段数 */
+void http_conn::count_segments()
+{
+    struct tcp_info info;
+    socklen_t len = sizeof( info );
+    if ( getsockopt( m_sockfd, IPPROTO_TCP, TCP_INFO, &info, &len ) == 0 )
+    {
+        m_segment_count += info.tcpi_data_segs_out - m_segs_out;
+        m_response_count++;
+        m_segs_out = info.tcpi_data_segs_out;
+    }
+}
+
+/* 推进 TLS 握手。握手完成时 OpenSSL 已经尝试把会话密钥交给内核，记下它是否成功 */
+int http_conn::tls_handshake()
+{
+    TRACE_SPAN( "tls_handshake", m_sockfd );
+    int ret = m_tls->handshake();
+    if ( ret == 1 )
+    {
+        m_tls_handshakes++;
+        if ( m_tls->ktls() )
+        {
+            m_ktls_count++;
+        }
+    }
+    return ret;
+}
+
+int http_conn::send_client( const char* buf, int len, int flags )
+{
+    if ( tls_userspace() )
+    {
+        return m_tls->send( buf, len );
+    }
+    return send( m_sockfd, buf, len, flags );
+}
+
+void http_conn::rearm( int ev )
+{
+    if ( m_oneshot )
+    {
+        TRACE_SPAN( "rearm", m_sockfd );
+        modfd( m_conn_epollfd, m_sockfd, ev );
+    }
 }
 
 void http_conn::init()
@@ -104,15 +395,54 @@ void http_conn::init()
     m_version = 0;                              // HTTP 协议版本号
     m_content_length = 0;                       // HTTP 请求的消息体的长度
     m_host = 0;                                 // 主机名
+    m_range = 0;                                // Range 头部字段
+    m_if_none_match = 0;                        // 条件请求头部字段
+    m_if_modified_since = 0;
+    m_upgrade_h2c = false;                      // 没有要求切换到 HTTP/2
+    m_http2_settings = 0;
+    m_upgrade_websocket = false;                // 没有要求切换到 WebSocket
+    m_ws_key = 0;
+    m_ws_version = 0;
+    m_ws_room = NULL;
+#ifdef HTTP_COROUTINE
+    m_parser.reset();                           // 丢弃没有解析完的请求的协程
+#endif
+    m_partial = false;                          // 默认应答完整文件
+    m_file_offset = 0;                          // 待发送的文件区间
+    m_file_end = 0;
+    m_proxy_remaining = 0;                      // 没有待转发的上游应答
+    release_routes();                           // 上一个请求使用的路由表
+    m_status = 0;                               // 访问日志记录的状态码和应答字节数
+    m_bytes_sent = 0;
     m_start_line = 0;                           // 当前正在解析的行的起始位置
     m_checked_idx = 0;                          // 当前正在分析的字符在读缓冲区中的位置
-    m_read_idx = 0;                             // 标识读缓冲中已经读入的客户数据的最后一个字节的下一个位置
     m_write_idx = 0;                            // 写缓冲区中待发送的字节数
-    memset( m_read_buf, '\0', READ_BUFFER_SIZE );   // 读缓冲区初始化
-    memset( m_write_buf, '\0', WRITE_BUFFER_SIZE ); // 写缓冲区初始化
+    m_write_sent = 0;                           // 写缓冲区中已经发送的字节数
+    // 读缓冲由 init_socket 和 next_request 负责；写缓冲不需要清零，vsnprintf 总会写入字符串结束符
     memset( m_real_file, '\0', FILENAME_LEN );      // 客户请求的目标文件的完整路径的初始化
 }
 
+/* 放弃当前请求对路由表的引用 */
+void http_conn::release_routes()
+{
+    if ( m_route_table )
+    {
+        m_route_table->release();
+        m_route_table = NULL;
+    }
+}
+
+/* 客户端可以不等应答就连续发送多个请求（流水线），这些请求可能已经和当前请求一起被读入了读缓冲。
+当前请求处理完之后把它们移动到读缓冲的开头，而不是随着 init 一起丢弃。 */
+void http_conn::next_request()
+{
+    int consumed = m_checked_idx + ( ( m_check_state == CHECK_STATE_CONTENT ) ? m_content_length : 0 );
+    int leftover = ( m_read_idx > consumed ) ? m_read_idx - consumed : 0;
+    memmove( m_read_buf, m_read_buf + m_read_idx - leftover, leftover );
+    m_read_idx = leftover;
+    init();
+}
+
 /* 从状态机：参考 8.6 节 */
 /* 从状态机，用于解析出一行内容 */
 http_conn::LINE_STATUS http_conn::parse_line()
@@ -163,16 +493,45 @@ http_conn::LINE_STATUS http_conn::parse_line()
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read()
 {
+    TRACE_SPAN( "read", m_sockfd );
+    if( m_h2 )
+    {
+        // 会话的输入缓冲已满时剩下的数据留在 socket 中，重新注册 EPOLLONESHOT 事件时内核会再次检查 socket，不会丢失
+        bool more = false;
+        return m_h2->read( &more );
+    }
     if( m_read_idx >= READ_BUFFER_SIZE )
     {
         return false;
     }
+    // TLS 握手还没有完成时先推进握手，需要等待时由 process 按照握手的需要重新注册事件
+    if( m_tls && ! m_tls->ready() )
+    {
+        int ret = tls_handshake();
+        if( ret <= 0 )
+        {
+            return ret == 0;
+        }
+    }
 
     int bytes_read = 0;
     while( true )
     {
-        // 读取客户端数据
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        // 读缓冲已满（通常是一次收到了多个流水线请求），剩余的数据先留在 socket 中，等缓冲中的请求处理完之后再读
+        if( m_read_idx >= READ_BUFFER_SIZE )
+        {
+            m_read_pending = true;
+            break;
+        }
+        // 读取客户端数据。TLS 连接读出的是 OpenSSL 解密之后的数据
+        if( m_tls )
+        {
+            bytes_read = m_tls->recv( m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx );
+        }
+        else
+        {
+            bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        }
         if ( bytes_read == -1 )// 读取数据失败
         {
             if( errno == EAGAIN || errno == EWOULDBLOCK )
@@ -298,40 +657,192 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
         text += strspn( text, " \t" );
         m_host = text;// 获得主机名
     }
-    else
+    // 处理 Range 头部字段，先记下原始内容，在 do_request 中得到文件大小后再解析
+    else if ( strncasecmp( text, "Range:", 6 ) == 0 )
+    {
+        text += 6;
+        text += strspn( text, " \t" );
+        m_range = text;
+    }
+    // 处理条件请求的头部字段，客户端用它们询问缓存的副本是否仍然有效
+    else if ( strncasecmp( text, "If-None-Match:", 14 ) == 0 )
+    {
+        text += 14;
+        text += strspn( text, " \t" );
+        m_if_none_match = text;
+    }
+    else if ( strncasecmp( text, "If-Modified-Since:", 18 ) == 0 )
+    {
+        text += 18;
+        text += strspn( text, " \t" );
+        m_if_modified_since = text;
+    }
+    // 处理 HTTP/2 的升级请求（RFC 7540 3.2），只有同时带有 HTTP2-Settings 字段时才切换；以及 WebSocket 的握手请求（RFC 6455 4.2.1）
+    else if ( strncasecmp( text, "Upgrade:", 8 ) == 0 )
+    {
+        text += 8;
+        text += strspn( text, " \t" );
+        m_upgrade_h2c = ( strcasecmp( text, "h2c" ) == 0 );
+        m_upgrade_websocket = ( strcasecmp( text, "websocket" ) == 0 );
+    }
+    else if ( strncasecmp( text, "HTTP2-Settings:", 15 ) == 0 )
+    {
+        text += 15;
+        text += strspn( text, " \t" );
+        m_http2_settings = text;
+    }
+    else if ( strncasecmp( text, "Sec-WebSocket-Key:", 18 ) == 0 )
     {
-        printf( "oop! unknow header %s\n", text );
+        text += 18;
+        text += strspn( text, " \t" );
+        m_ws_key = text;
+    }
+    else if ( strncasecmp( text, "Sec-WebSocket-Version:", 22 ) == 0 )
+    {
+        text += 22;
+        text += strspn( text, " \t" );
+        m_ws_version = text;
     }
+    // 其他头部字段都不需要处理，直接忽略
 
     return NO_REQUEST;
 
 }
 
-// 我们没有真正解析 HTTP 请求的消息体，只是判断它是否被完全地读入了
+// 我们没有真正解析 HTTP 请求的消息体，只是判断它是否被完全地读入了。
+// 消息体之后可能紧跟着流水线中的下一个请求，所以不能在消息体的结尾写入字符串结束符
 http_conn::HTTP_CODE http_conn::parse_content( char* text )
 {
     if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
     {
-        text[ m_content_length ] = '\0';
         return GET_REQUEST;
     }
 
     return NO_REQUEST;
 }
 
+#ifdef HTTP_COROUTINE
+/* 主状态机的协程版本：每个请求由一个 parse_request 协程解析，数据不够时协程挂起，这里在读入新数据之后恢复它，
+直到它返回整个请求的处理结果 */
+http_conn::HTTP_CODE http_conn::process_read()
+{
+    TRACE_SPAN( "parse", m_sockfd );
+    if ( ! m_parser.valid() )
+    {
+        m_parser = parse_request();
+    }
+    m_parser.resume();
+    if ( ! m_parser.done() )
+    {
+        return NO_REQUEST;
+    }
+    HTTP_CODE ret = m_parser.result();
+    // 协程帧归还到当前线程的缓存中，下一个请求的协程直接复用它
+    m_parser.reset();
+    return ret;
+}
+
+/* 按顺序解析一个请求：可能的 h2c 连接前言、请求行、头部字段和消息体，每一步在数据不够时 co_await read_some 等待更多数据。
+m_check_state 仍然随解析推进，next_request 据此计算这个请求占用的字节数 */
+task< http_conn::HTTP_CODE > http_conn::parse_request()
+{
+    LINE_STATUS line_status;
+    HTTP_CODE ret;
+
+    // 以 HTTP/2 连接前言开头的连接（h2c prior knowledge）不是 HTTP/1.1 请求，前言收全之后切换到 HTTP/2。TLS 连接上不接受
+    if ( ! m_tls )
+    {
+        while ( m_read_idx < h2_session::PREFACE_LEN && memcmp( m_read_buf, h2_session::preface(), m_read_idx ) == 0 )
+        {
+            co_await read_some();
+        }
+        if ( memcmp( m_read_buf, h2_session::preface(), h2_session::PREFACE_LEN ) == 0 )
+        {
+            co_return H2_PREFACE;
+        }
+    }
+
+    // 请求行
+    while ( ( line_status = parse_line() ) == LINE_OPEN )
+    {
+        co_await read_some();
+    }
+    if ( line_status == LINE_BAD )
+    {
+        co_return BAD_REQUEST;
+    }
+    char* text = get_line();
+    m_start_line = m_checked_idx;
+    if ( parse_request_line( text ) == BAD_REQUEST )
+    {
+        co_return BAD_REQUEST;
+    }
+
+    // 头部字段，直到空行为止
+    while ( true )
+    {
+        while ( ( line_status = parse_line() ) == LINE_OPEN )
+        {
+            co_await read_some();
+        }
+        if ( line_status == LINE_BAD )
+        {
+            co_return BAD_REQUEST;
+        }
+        text = get_line();
+        m_start_line = m_checked_idx;
+        ret = parse_headers( text );
+        if ( ret == BAD_REQUEST )
+        {
+            co_return BAD_REQUEST;
+        }
+        if ( ret == GET_REQUEST )
+        {
+            // 没有消息体的升级请求切换到 HTTP/2，它的应答在流 1 上发送
+            if ( m_upgrade_websocket && ! m_proactor )
+            {
+                co_return do_websocket();
+            }
+            co_return ( m_upgrade_h2c && m_http2_settings && ! m_tls && ! m_proactor ) ? H2_UPGRADE : do_request();
+        }
+        if ( m_check_state == CHECK_STATE_CONTENT )
+        {
+            break;
+        }
+    }
+
+    // 消息体：只等待它被完整地读入
+    while ( parse_content( get_line() ) != GET_REQUEST )
+    {
+        co_await read_some();
+    }
+    co_return do_request();
+}
+#else
 // 主状态机：其分析参考 8.6
 http_conn::HTTP_CODE http_conn::process_read()
 {
+    TRACE_SPAN( "parse", m_sockfd );
     LINE_STATUS line_status = LINE_OK;  // 记录当前行的读取状态
     HTTP_CODE ret = NO_REQUEST;         // 记录 HTTP 请求的处理结果
     char* text = 0;
 
+    // 以 HTTP/2 连接前言开头的连接（h2c prior knowledge）不是 HTTP/1.1 请求，前言收全之后切换到 HTTP/2
+    // h2c 是明文的 HTTP/2，TLS 连接上不接受
+    if ( ! m_tls && m_check_state == CHECK_STATE_REQUESTLINE && m_checked_idx == 0 && m_read_idx > 0 )
+    {
+        int len = ( m_read_idx < h2_session::PREFACE_LEN ) ? m_read_idx : h2_session::PREFACE_LEN;
+        if ( memcmp( m_read_buf, h2_session::preface(), len ) == 0 )
+        {
+            return ( len == h2_session::PREFACE_LEN ) ? H2_PREFACE : NO_REQUEST;
+        }
+    }
+
     while ( ( ( m_check_state == CHECK_STATE_CONTENT ) && ( line_status == LINE_OK  ) )
                 || ( ( line_status = parse_line() ) == LINE_OK ) )
     {
         text = get_line();// 得到当前行的内容
         m_start_line = m_checked_idx;// 行的起始位置
-        printf( "got 1 http line: %s\n", text );
 
         switch ( m_check_state )// m_check_state 记录主状态机当前的状态
         {
@@ -360,7 +871,12 @@ http_conn::HTTP_CODE http_conn::process_read()
                 }
                 else if ( ret == GET_REQUEST )
                 {
-                    return do_request();
+                    // 没有消息体的升级请求切换到 HTTP/2，它的应答在流 1 上发送
+                    if ( m_upgrade_websocket && ! m_proactor )
+                    {
+                        return do_websocket();
+                    }
+                    return ( m_upgrade_h2c && m_http2_settings && ! m_tls && ! m_proactor ) ? H2_UPGRADE : do_request();
                 }
                 break;
             }
@@ -373,8 +889,9 @@ http_conn::HTTP_CODE http_conn::process_read()
                 {
                     return do_request();
                 }
-                line_status = LINE_OPEN;
-                break;
+                // 消息体还没有读完，等待更多数据。不能继续调用 parse_line：它会把消息体当作头部行来分析，并且改写其中的 "\r\n"，
+                // 下次调用时 m_checked_idx 仍然指向消息体的开头，从这里继续检查
+                return NO_REQUEST;
             }
             default:
             {
@@ -384,251 +901,1818 @@ http_conn::HTTP_CODE http_conn::process_read()
         }
     }
 
+    // 行的格式错误（单独的 "\r" 或者 "\n"）和协程版本一样应答 400，而不是继续等待数据
+    if ( line_status == LINE_BAD )
+    {
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
+#endif
 
-/* 当得到一个完整、正确的 HTTP 请求时，我们就分析目标文件的属性。
-如果目标文件存在，对所有用户可读，且不是目录，则使用 mmap 将其映射到内存地址 m_file_addres 处，并告诉调用者获取文件成功。 */
-http_conn::HTTP_CODE http_conn::do_request()
+/* 解析 Range 字段，得到待发送的文件区间 [m_file_offset, m_file_end)。只支持单个区间的 "bytes=a-b"、"bytes=a-" 和 "bytes=-n" 三种形式，
+多区间请求按照 RFC 7233 的规定直接忽略，应答完整文件。区间不可满足时返回 false。 */
+bool http_conn::parse_range()
 {
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    if ( stat( m_real_file, &m_file_stat ) < 0 )
+    off_t size = m_file_stat.st_size;
+    m_file_offset = 0;
+    m_file_end = size;
+    if ( ! m_range || size == 0 || strncasecmp( m_range, "bytes=", 6 ) != 0 || strchr( m_range, ',' ) )
     {
-        return NO_RESOURCE;
+        return true;
     }
 
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) )
+    char* text = m_range + 6;
+    char* end = 0;
+    off_t first = 0;
+    off_t last = size - 1;
+    if ( *text == '-' )
     {
-        return FORBIDDEN_REQUEST;
+        // "bytes=-n"：最后 n 个字节
+        off_t suffix = strtoll( text + 1, &end, 10 );
+        if ( end == text + 1 || suffix <= 0 )
+        {
+            return false;
+        }
+        first = ( suffix >= size ) ? 0 : size - suffix;
     }
-
-    if ( S_ISDIR( m_file_stat.st_mode ) )
+    else
     {
-        return BAD_REQUEST;
+        first = strtoll( text, &end, 10 );
+        if ( end == text || *end != '-' || first < 0 )
+        {
+            return true;
+        }
+        text = end + 1;
+        if ( *text != '\0' )
+        {
+            last = strtoll( text, &end, 10 );
+            if ( end == text || last < first )
+            {
+                return true;
+            }
+            last = ( last >= size ) ? size - 1 : last;
+        }
+        if ( first >= size )
+        {
+            return false;
+        }
     }
 
-    int fd = open( m_real_file, O_RDONLY );
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
-    return FILE_REQUEST;
+    m_file_offset = first;
+    m_file_end = last + 1;
+    m_partial = true;
+    return true;
 }
 
-/* 对内存映射区执行 munmap 操作 */
-void http_conn::unmap()
+/* 由 inode、文件大小和修改时间生成 ETag，三者任何一个变化都说明文件内容可能已经改变 */
+void http_conn::make_etag( char* etag, int len )
 {
-    if( m_file_address )
-    {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
-    }
+    snprintf( etag, len, "\"%llx-%llx-%llx\"", ( unsigned long long )m_file_stat.st_ino,
+              ( unsigned long long )m_file_stat.st_size, ( unsigned long long )m_file_stat.st_mtime );
 }
 
-/* 写 HTTP 响应 */
-bool http_conn::write()
+/* 判断客户端缓存的副本是否仍然有效。If-None-Match 存在时优先使用它，此时忽略 If-Modified-Since。
+只需要 stat 得到的文件信息，不必打开文件。 */
+bool http_conn::not_modified()
 {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if ( bytes_to_send == 0 )
-    {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        init();
-        return true;
-    }
-
-    while( 1 )
+    if ( m_if_none_match )
     {
-        temp = writev( m_sockfd, m_iv, m_iv_count );
-        if ( temp <= -1 )
+        char etag[ ETAG_LEN ];
+        make_etag( etag, ETAG_LEN );
+        int etag_len = strlen( etag );
+        // If-None-Match 的值是以逗号分隔的 ETag 列表，或者是 "*"；GET 请求使用弱比较，所以忽略 "W/" 前缀
+        char* text = m_if_none_match;
+        while ( *text != '\0' )
         {
-            // 如果 TCP 写缓冲没有空间，则等待下一轮 EPOLLOUT 事件。虽然在此期间，服务器无法理解接收到同一客户的下一个请求，但这可以保证连接的完整性。
-            if( errno == EAGAIN )
+            text += strspn( text, " \t," );
+            if ( *text == '*' )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
                 return true;
             }
-            unmap();
-            return false;
-        }
-
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send )
-        {
-            // 发送 HTTP 响应成功，根据 HTTP 请求中的 Connection 字段决定是否立即关闭连接
-            unmap();
-            if( m_linger )
+            if ( strncmp( text, "W/", 2 ) == 0 )
             {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
+                text += 2;
             }
-            else
+            int len = strcspn( text, " \t," );
+            if ( len == etag_len && strncmp( text, etag, len ) == 0 )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
+                return true;
+            }
+            text += len;
         }
+        return false;
     }
-}
 
-// 往写缓冲中写入待发送的数据
-bool http_conn::add_response( const char* format, ... )
-{
+    if ( m_if_modified_since )
+    {
+        struct tm tm;
+        memset( &tm, 0, sizeof( tm ) );
+        if ( ! strptime( m_if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm ) )
+        {
+            return false;
+        }
+        return m_file_stat.st_mtime <= timegm( &tm );
+    }
+    return false;
+}
+
+/* 当得到一个完整、正确的 HTTP 请求时，我们就分析目标文件的属性。
+如果目标文件存在，对所有用户可读，且不是目录，则打开该文件并确定待发送的区间，文件内容留给 write 用 sendfile 分窗口发送。
+这样无论文件多大，都不会把整个文件映射到进程的地址空间中。 */
+http_conn::HTTP_CODE http_conn::do_request()
+{
+    // 先规范化再匹配路由，"/static/../secret" 这样的 URL 不会被当作 "/static/" 下的文件
+    char path[ FILENAME_LEN ];
+    if ( ! canonicalize_url( m_url, path, FILENAME_LEN ) )
+    {
+        return BAD_REQUEST;
+    }
+    // 根据 Host 和路径找到路由，把路径中的路由前缀替换为该路由的根目录。规范化之后的路径一定位于根目录之下
+    release_routes();
+    m_route_table = m_routes.acquire();
+    const route* r = m_route_table ? m_route_table->match( m_host, path ) : NULL;
+    if ( ! r )
+    {
+        return NO_RESOURCE;
+    }
+    if ( r->proxy )
+    {
+        // Proactor 模式下没有实现向上游的异步转发
+        if ( m_proactor )
+        {
+            return BAD_GATEWAY;
+        }
+        // 代理转发的消息体经由管道直接 splice 到 socket，无法分成 HTTP/2 的 DATA 帧，客户端需要用 HTTP/1.1 重新请求
+        return m_h2 ? MISDIRECTED_REQUEST : do_proxy( r, path );
+    }
+    const char* rest = path + r->prefix.size() - 1;
+    int len = r->root.size();
+    if ( len + strlen( rest ) >= ( size_t )FILENAME_LEN )
+    {
+        return BAD_REQUEST;
+    }
+    memcpy( m_real_file, r->root.c_str(), len );
+    strcpy( m_real_file + len, rest );
+    // 优先从文件信息缓存中查找，命中时不需要调用 stat
+    TRACE_MARK( lookup_start );
+    bool exists = m_file_cache ? m_file_cache->lookup( m_real_file, len, &m_file_stat )
+                               : ( stat( m_real_file, &m_file_stat ) == 0 );
+    TRACE_SPAN_END( "file lookup", lookup_start, m_sockfd );
+    if ( ! exists )
+    {
+        return NO_RESOURCE;
+    }
+
+    if ( ! ( m_file_stat.st_mode & S_IROTH ) )
+    {
+        return FORBIDDEN_REQUEST;
+    }
+
+    if ( S_ISDIR( m_file_stat.st_mode ) )
+    {
+        return BAD_REQUEST;
+    }
+
+    // 客户端的缓存仍然有效，直接应答 304，不必打开文件
+    if ( not_modified() )
+    {
+        return NOT_MODIFIED;
+    }
+
+    if ( ! parse_range() )
+    {
+        return RANGE_NOT_SATISFIABLE;
+    }
+
+    m_file_fd = open( m_real_file, O_RDONLY );
+    if ( m_file_fd < 0 )
+    {
+        return INTERNAL_ERROR;
+    }
+    return FILE_REQUEST;
+}
+
+/* 判断读缓冲中的请求的类别。和 do_request 一样规范化 URL、匹配路由，代理路由是 CLASS_UPSTREAM；静态文件的信息已经在缓存中时是 CLASS_CACHED，
+否则工作线程需要调用 stat，是 CLASS_DISK。这里只查看缓冲中的请求行和 Host 字段，不修改缓冲，也不调用 stat。
+请求行还不完整、路由不存在或者 URL 非法的请求很快就会得到应答，算作 CLASS_CACHED；已经开始解析的请求沿用之前的类别。
+HTTP/2、WebSocket 连接和 TLS 握手不按请求分类，算作 CLASS_CACHED */
+http_conn::REQUEST_CLASS http_conn::request_class()
+{
+    if ( m_h2 || m_websocket || ( m_tls && ! m_tls->ready() ) )
+    {
+        return CLASS_CACHED;
+    }
+    if ( m_checked_idx > 0 )
+    {
+        return m_request_class;
+    }
+    m_request_class = CLASS_CACHED;
+
+    // 请求行：方法、URL 和版本号之间以空格分隔
+    const char* end = m_read_buf + m_read_idx;
+    const char* line_end = ( const char* )memchr( m_read_buf, '\n', m_read_idx );
+    const char* url = line_end ? ( const char* )memchr( m_read_buf, ' ', line_end - m_read_buf ) : NULL;
+    if ( ! url )
+    {
+        return m_request_class;
+    }
+    ++url;
+    int url_len = strcspn( url, " \t\r\n" );
+    char target[ FILENAME_LEN ];
+    if ( url + url_len > line_end || url_len >= FILENAME_LEN )
+    {
+        return m_request_class;
+    }
+    memcpy( target, url, url_len );
+    target[ url_len ] = '\0';
+    const char* start = target;
+    if ( strncasecmp( start, "http://", 7 ) == 0 )
+    {
+        start = strchr( start + 7, '/' );
+    }
+    char path[ FILENAME_LEN ];
+    if ( ! start || ! canonicalize_url( start, path, FILENAME_LEN ) )
+    {
+        return m_request_class;
+    }
+
+    // 在头部中查找 Host 字段，遇到空行或者不完整的行时停止
+    char host[ FILENAME_LEN ] = "";
+    for ( const char* line = line_end + 1; line < end; )
+    {
+        const char* next = ( const char* )memchr( line, '\n', end - line );
+        if ( ! next || next - line <= 1 )
+        {
+            break;
+        }
+        if ( next - line > 5 && strncasecmp( line, "Host:", 5 ) == 0 )
+        {
+            const char* value = line + 5;
+            value += strspn( value, " \t" );
+            int len = next - value;
+            if ( len > 0 && value[ len - 1 ] == '\r' )
+            {
+                --len;
+            }
+            if ( len > 0 && len < FILENAME_LEN )
+            {
+                memcpy( host, value, len );
+                host[ len ] = '\0';
+            }
+            break;
+        }
+        line = next + 1;
+    }
+
+    route_table* routes = m_routes.acquire();
+    const route* r = routes ? routes->match( host[0] ? host : NULL, path ) : NULL;
+    if ( r && r->proxy )
+    {
+        m_request_class = CLASS_UPSTREAM;
+    }
+    else if ( r )
+    {
+        const char* rest = path + r->prefix.size() - 1;
+        int len = r->root.size();
+        char real_file[ FILENAME_LEN ];
+        if ( len + strlen( rest ) < ( size_t )FILENAME_LEN )
+        {
+            memcpy( real_file, r->root.c_str(), len );
+            strcpy( real_file + len, rest );
+            if ( ! m_file_cache || ! m_file_cache->cached( real_file ) )
+            {
+                m_request_class = CLASS_DISK;
+            }
+        }
+    }
+    if ( routes )
+    {
+        routes->release();
+    }
+    return m_request_class;
+}
+
+/* 把请求转发给路由指定的上游服务器。上游连接上的每一步都是非阻塞的：这里取得连接并尽量推进，需要等待时返回 PROXY_PENDING，
+由调用者把上游连接注册到客户连接所在的事件表中，之后的建立连接、发送请求和读取应答头部都由上游连接上的事件推进（见 upstream_event），
+处理请求的线程不会等待上游服务器。改写之后的应答头部放入写缓冲，消息体则由 splice 经过管道转发，不进入用户空间 */
+http_conn::HTTP_CODE http_conn::do_proxy( const route* r, const char* path )
+{
+    TRACE_SPAN( "upstream", m_sockfd );
+    if ( ! m_upstream_pool )
+    {
+        return BAD_GATEWAY;
+    }
+    if ( m_pipefd[0] < 0 )
+    {
+        if ( pipe2( m_pipefd, O_NONBLOCK | O_CLOEXEC ) < 0 )
+        {
+            m_pipefd[0] = m_pipefd[1] = -1;
+            return INTERNAL_ERROR;
+        }
+        // 加大管道的容量以减少 splice 的次数，超过 /proc/sys/fs/pipe-max-size 时失败，保持默认容量
+        fcntl( m_pipefd[1], F_SETPIPE_SZ, FILE_WINDOW_SIZE );
+        m_pipe_size = fcntl( m_pipefd[1], F_GETPIPE_SZ );
+    }
+    m_backend = r->backend;
+
+    // 请求在发送完之前放在写缓冲中。重试时要重新生成请求，规范化之后的路径保存在 m_real_file 中（代理请求不使用它）
+    strcpy( m_real_file, path );
+    m_upstream_request_len = make_upstream_request( path, m_write_buf, WRITE_BUFFER_SIZE );
+    if ( m_upstream_request_len < 0 )
+    {
+        return BAD_REQUEST;
+    }
+    if ( ! connect_upstream( true ) )
+    {
+        return BAD_GATEWAY;
+    }
+    return advance_upstream();
+}
+
+/* 取得一个上游连接并从头发送写缓冲中的请求：pooled 为 true 时优先取出连接池中的空闲连接，否则新建一个非阻塞的连接。
+新建的连接还没有建立时从 UPSTREAM_CONNECT 阶段开始。失败时返回 false */
+bool http_conn::connect_upstream( bool pooled )
+{
+    m_upstream_fd = pooled ? m_upstream_pool->acquire( m_backend ) : -1;
+    m_upstream_reused = ( m_upstream_fd >= 0 );
+    m_upstream_state = UPSTREAM_SEND;
+    m_upstream_idx = 0;
+    if ( ! m_upstream_reused )
+    {
+        bool connected = false;
+        m_upstream_fd = upstream_pool::connect_to( m_backend, &connected );
+        if ( m_upstream_fd < 0 )
+        {
+            m_upstream_state = UPSTREAM_IDLE;
+            return false;
+        }
+        if ( ! connected )
+        {
+            m_upstream_state = UPSTREAM_CONNECT;
+        }
+    }
+    return true;
+}
+
+/* 发送请求或者读取应答头部时发现上游连接已经关闭。池中的空闲连接可能在归还之后被上游关闭，这要等到使用时才能发现，
+此时换一个新建的连接重新发送请求；新建的连接出错时不再重试，返回 false */
+bool http_conn::retry_upstream()
+{
+    bool reused = m_upstream_reused;
+    release_upstream( false );
+    if ( ! reused )
+    {
+        return false;
+    }
+    // 读取应答头部时写缓冲中的请求已经被覆盖
+    m_upstream_request_len = make_upstream_request( m_real_file, m_write_buf, WRITE_BUFFER_SIZE );
+    return connect_upstream( false );
+}
+
+/* 推进代理请求直到需要等待为止：建立连接、发送请求、读取应答头部。需要等待时记下等待的事件并返回 PROXY_PENDING，
+由调用者在处理完这个连接之后调用 wait_upstream 注册（注册之后事件随时可能被其他线程处理）。
+收到完整的应答头部时返回 PROXY_REQUEST，上游出错时返回 BAD_GATEWAY */
+http_conn::HTTP_CODE http_conn::advance_upstream()
+{
+    m_upstream_waiting = false;
+    while ( true )
+    {
+        switch ( m_upstream_state )
+        {
+            case UPSTREAM_CONNECT:
+            {
+                // 连接建立（或者失败）时 socket 变为可写，SO_ERROR 给出连接的结果
+                if ( ! upstream_pool::ready( m_upstream_fd, POLLOUT ) )
+                {
+                    m_upstream_events = EPOLLOUT;
+                    return PROXY_PENDING;
+                }
+                if ( upstream_pool::connect_error( m_upstream_fd ) != 0 )
+                {
+                    release_upstream( false );
+                    return BAD_GATEWAY;
+                }
+                m_upstream_state = UPSTREAM_SEND;
+                break;
+            }
+            case UPSTREAM_SEND:
+            {
+                int ret = send( m_upstream_fd, m_write_buf + m_upstream_idx, m_upstream_request_len - m_upstream_idx, MSG_NOSIGNAL );
+                if ( ret < 0 )
+                {
+                    if ( errno == EAGAIN )
+                    {
+                        m_upstream_events = EPOLLOUT;
+                        return PROXY_PENDING;
+                    }
+                    if ( ! retry_upstream() )
+                    {
+                        return BAD_GATEWAY;
+                    }
+                    break;
+                }
+                m_upstream_idx += ret;
+                if ( m_upstream_idx == m_upstream_request_len )
+                {
+                    m_upstream_state = UPSTREAM_HEADER;
+                    m_upstream_idx = 0;
+                }
+                break;
+            }
+            case UPSTREAM_HEADER:
+            {
+                // 请求已经发送完，应答头部读入写缓冲。和头部一起读入的消息体由 finish_upstream_header 放进管道
+                int ret = recv( m_upstream_fd, m_write_buf + m_upstream_idx, WRITE_BUFFER_SIZE - 1 - m_upstream_idx, 0 );
+                if ( ret < 0 && errno == EAGAIN )
+                {
+                    m_upstream_events = EPOLLIN;
+                    return PROXY_PENDING;
+                }
+                if ( ret == 0 || ret < 0 )
+                {
+                    // 还没有收到任何数据连接就被关闭：取自连接池的连接已经失效，重试一次
+                    bool closed = ( ret == 0 || errno == ECONNRESET );
+                    if ( closed && m_upstream_idx == 0 && retry_upstream() )
+                    {
+                        break;
+                    }
+                    release_upstream( false );
+                    return BAD_GATEWAY;
+                }
+                m_upstream_idx += ret;
+                m_write_buf[ m_upstream_idx ] = '\0';
+                char* end = strstr( m_write_buf, "\r\n\r\n" );
+                if ( end )
+                {
+                    return finish_upstream_header( end + 4 - m_write_buf );
+                }
+                // 头部太长
+                if ( m_upstream_idx == WRITE_BUFFER_SIZE - 1 )
+                {
+                    release_upstream( false );
+                    return BAD_GATEWAY;
+                }
+                break;
+            }
+            default:
+            {
+                return BAD_GATEWAY;
+            }
+        }
+    }
+}
+
+/* 写缓冲中已经读入了完整的应答头部（长度为 header_len）和紧随其后的一部分消息体。解析头部并改写到写缓冲中，
+把已经读入的消息体写进管道，再把上游接收队列中的消息体 splice 进管道 */
+http_conn::HTTP_CODE http_conn::finish_upstream_header( int header_len )
+{
+    // 改写之后的头部要写回写缓冲，所以先复制一份
+    char buf[ WRITE_BUFFER_SIZE ];
+    int len = m_upstream_idx;
+    memcpy( buf, m_write_buf, len + 1 );
+    m_upstream_state = UPSTREAM_IDLE;
+    if ( ! parse_upstream_header( buf ) )
+    {
+        m_write_idx = 0;
+        release_upstream( false );
+        return BAD_GATEWAY;
+    }
+
+    // 管道此时是空的，容量至少一页，这些数据一定能一次写入
+    long long body = len - header_len;
+    if ( m_proxy_remaining >= 0 && body > m_proxy_remaining )
+    {
+        // 上游发来了比 Content-Length 更多的数据，这个连接不能再复用
+        body = m_proxy_remaining;
+        m_upstream_reusable = false;
+    }
+    if ( body > 0 )
+    {
+        if ( ::write( m_pipefd[1], buf + header_len, body ) != body )
+        {
+            m_write_idx = 0;
+            release_upstream( false );
+            return BAD_GATEWAY;
+        }
+        m_pipe_pending += body;
+        if ( m_proxy_remaining > 0 )
+        {
+            m_proxy_remaining -= body;
+        }
+    }
+    fill_pipe();
+    return PROXY_REQUEST;
+}
+
+/* 生成转发给上游的请求。用 HTTP/1.0 请求并要求保持连接，这样上游的应答不会使用分块编码，
+消息体要么由 Content-Length 给出长度，要么以关闭连接为结束。URL 使用规范化之后的路径，
+客户的条件请求和区间请求字段也一并转发。请求太长时返回 -1 */
+int http_conn::make_upstream_request( const char* path, char* buf, int len )
+{
+    const char* query = strchr( m_url, '?' );
+    int query_len = query ? strcspn( query, "#" ) : 0;
+    char ip[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &m_address.sin_addr, ip, INET_ADDRSTRLEN );
+    int idx = snprintf( buf, len, "GET %s%.*s HTTP/1.0\r\nHost: %s\r\nConnection: keep-alive\r\nX-Forwarded-For: %s\r\n",
+                        path, query_len, query ? query : "", m_host ? m_host : m_backend.name, ip );
+    if ( idx < len && m_range )
+    {
+        idx += snprintf( buf + idx, len - idx, "Range: %s\r\n", m_range );
+    }
+    if ( idx < len && m_if_none_match )
+    {
+        idx += snprintf( buf + idx, len - idx, "If-None-Match: %s\r\n", m_if_none_match );
+    }
+    if ( idx < len && m_if_modified_since )
+    {
+        idx += snprintf( buf + idx, len - idx, "If-Modified-Since: %s\r\n", m_if_modified_since );
+    }
+    if ( idx < len )
+    {
+        idx += snprintf( buf + idx, len - idx, "\r\n" );
+    }
+    return ( idx < len ) ? idx : -1;
+}
+
+/* 判断头部字段 line 的名字（长度为 name_len）是否为 name */
+static bool header_is( const char* line, int name_len, const char* name )
+{
+    return ( int )strlen( name ) == name_len && strncasecmp( line, name, name_len ) == 0;
+}
+
+/* 解析上游应答的头部，把状态行和端到端的头部字段写入写缓冲。逐跳字段（Connection、Keep-Alive 等）只对上游连接有效，
+由本服务器按客户连接的情况重新生成。同时确定消息体的长度和上游连接能否复用 */
+bool http_conn::parse_upstream_header( char* buf )
+{
+    char* line = buf;
+    char* next = strstr( line, "\r\n" );
+    *next = '\0';
+    int major = 0, minor = 0, status = 0;
+    if ( sscanf( line, "HTTP/%d.%d %d", &major, &minor, &status ) != 3 || status < 200 || status > 999 )
+    {
+        return false;
+    }
+    // 原因短语跟在版本号和状态码之后，它们之间的分隔符可能是空格也可能是制表符
+    const char* reason = line + strcspn( line, " \t" );
+    reason += strspn( reason, " \t" );
+    reason += strcspn( reason, " \t" );
+    reason += strspn( reason, " \t" );
+    // HTTP/1.1 默认保持连接，HTTP/1.0 只有带上 "Connection: keep-alive" 时才保持连接
+    bool keep_alive = ( major == 1 && minor >= 1 );
+    long long length = -1;
+
+    m_write_idx = 0;
+    if ( ! add_status_line( status, reason ) )
+    {
+        return false;
+    }
+    // 头部以空行结束，buf 中的内容一定以 "\r\n\r\n" 结尾
+    for ( line = next + 2; *line != '\r'; line = next + 2 )
+    {
+        next = strstr( line, "\r\n" );
+        *next = '\0';
+        char* colon = strchr( line, ':' );
+        if ( ! colon )
+        {
+            return false;
+        }
+        int name_len = colon - line;
+        const char* value = colon + 1 + strspn( colon + 1, " \t" );
+        if ( header_is( line, name_len, "Connection" ) )
+        {
+            if ( strcasestr( value, "close" ) )
+            {
+                keep_alive = false;
+            }
+            else if ( strcasestr( value, "keep-alive" ) )
+            {
+                keep_alive = true;
+            }
+            continue;
+        }
+        if ( header_is( line, name_len, "Keep-Alive" ) || header_is( line, name_len, "Proxy-Connection" ) )
+        {
+            continue;
+        }
+        // HTTP/1.0 请求的应答不应该使用分块编码
+        if ( header_is( line, name_len, "Transfer-Encoding" ) )
+        {
+            return false;
+        }
+        if ( header_is( line, name_len, "Content-Length" ) )
+        {
+            length = atoll( value );
+        }
+        if ( ! add_response( "%s\r\n", line ) )
+        {
+            return false;
+        }
+    }
+
+    // 204 和 304 应答没有消息体；没有 Content-Length 时消息体以上游关闭连接为结束，客户连接也只能用关闭来标记应答的结束
+    if ( status == 204 || status == 304 )
+    {
+        length = 0;
+    }
+    if ( length < 0 )
+    {
+        keep_alive = false;
+        m_linger = false;
+    }
+    m_proxy_remaining = length;
+    m_upstream_reusable = keep_alive;
+    return add_linger() && add_blank_line();
+}
+
+/* 把上游应答的消息体读入管道，直到读完、管道已满或者上游暂时没有数据为止。
+消息体已经全部到达并且能放进管道时（小应答的常见情况），上游连接在这里就可以归还给连接池 */
+void http_conn::fill_pipe()
+{
+    while ( m_proxy_remaining != 0 && m_pipe_pending < m_pipe_size )
+    {
+        size_t len = m_pipe_size - m_pipe_pending;
+        if ( m_proxy_remaining > 0 && m_proxy_remaining < ( long long )len )
+        {
+            len = m_proxy_remaining;
+        }
+        int ret = splice( m_upstream_fd, NULL, m_pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        // EOF、出错和暂时没有数据都留给 relay_body 处理，还没有到达的消息体由上游连接上的事件驱动转发
+        if ( ret <= 0 )
+        {
+            break;
+        }
+        m_pipe_pending += ret;
+        if ( m_proxy_remaining > 0 )
+        {
+            m_proxy_remaining -= ret;
+        }
+    }
+    if ( m_proxy_remaining == 0 )
+    {
+        release_upstream( true );
+    }
+}
+
+/* 转发上游应答的消息体：上游 socket -> 管道 -> 客户 socket。返回 1 表示已经转发完，
+0 表示需要等待客户连接可写或上游连接可读（已经注册了相应的事件），-1 表示出错，应该关闭客户连接 */
+int http_conn::relay_body()
+{
+    m_upstream_waiting = false;
+    while ( true )
+    {
+        // 用户态加密时先发送上一次从管道中读出、还没有加密发送完的数据
+        if ( m_tls && m_tls->buffered() )
+        {
+            int ret = m_tls->flush();
+            if ( ret <= 0 )
+            {
+                if ( ret == 0 )
+                {
+                    rearm( EPOLLOUT );
+                }
+                return ret;
+            }
+        }
+        // 先把管道中的数据发送给客户。用户态加密时只能把数据读出管道，用 SSL_write 加密发送
+        if ( m_pipe_pending > 0 )
+        {
+            int ret;
+            if ( tls_userspace() )
+            {
+                ret = m_tls->send_body( m_pipefd[0], NULL, m_pipe_pending );
+            }
+            else
+            {
+                ret = splice( m_pipefd[0], NULL, m_sockfd, NULL, m_pipe_pending,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK | ( ( m_upstream_fd >= 0 ) ? SPLICE_F_MORE : 0 ) );
+            }
+            if ( ret < 0 )
+            {
+                if ( errno == EAGAIN )
+                {
+                    rearm( EPOLLOUT );
+                    return 0;
+                }
+                return -1;
+            }
+            m_pipe_pending -= ret;
+            m_bytes_sent += ret;
+            continue;
+        }
+        if ( m_upstream_fd < 0 )
+        {
+            return 1;
+        }
+
+        // 管道已经清空，再从上游读入下一段。只在管道为空时读，所以 EAGAIN 一定表示上游暂时没有数据
+        size_t len = m_pipe_size;
+        if ( m_proxy_remaining > 0 && m_proxy_remaining < ( long long )len )
+        {
+            len = m_proxy_remaining;
+        }
+        int ret = splice( m_upstream_fd, NULL, m_pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( ret == 0 )
+        {
+            // 消息体以关闭连接为结束时读到 EOF 就转发完了，否则上游提前关闭了连接，应答已经无法完整发送
+            release_upstream( false );
+            return ( m_proxy_remaining < 0 ) ? 1 : -1;
+        }
+        if ( ret < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                m_upstream_events = EPOLLIN;
+                wait_upstream();
+                return 0;
+            }
+            release_upstream( false );
+            return -1;
+        }
+        m_pipe_pending += ret;
+        if ( m_proxy_remaining > 0 )
+        {
+            m_proxy_remaining -= ret;
+            if ( m_proxy_remaining == 0 )
+            {
+                release_upstream( true );
+            }
+        }
+    }
+}
+
+/* 上游连接上的事件（oneshot 模式下由主线程处理，领导者/追随者模式下由取到事件的线程处理）：还没有收到应答头部时推进代理请求，
+收到之后组装应答并开始发送；已经在转发消息体时继续转发 */
+bool http_conn::upstream_event()
+{
+    if ( m_upstream_state != UPSTREAM_IDLE )
+    {
+        HTTP_CODE ret = advance_upstream();
+        if ( ret == PROXY_PENDING )
+        {
+            wait_upstream();
+            return true;
+        }
+        if ( ! process_write( ret ) )
+        {
+            return false;
+        }
+    }
+    return write();
+}
+
+/* 等待上游连接上的 m_upstream_events 事件（连接建立或者可以继续发送请求时是 EPOLLOUT，有应答数据时是 EPOLLIN）。
+上游连接以 EPOLLONESHOT 注册到客户连接所在的事件表中，data.fd 设为客户连接，这样事件到来时可以直接找到对应的 http_conn 对象。
+EPOLLONESHOT 模式下等待期间客户连接上没有注册任何事件，两者不会同时被处理 */
+void http_conn::wait_upstream()
+{
+    // 必须在 epoll_ctl 之前设置：事件可能在 epoll_ctl 返回之前就被主线程取走
+    m_upstream_waiting = true;
+    epoll_event event;
+    event.data.fd = m_sockfd;
+    event.events = m_upstream_events | EPOLLONESHOT;
+    epoll_ctl( m_conn_epollfd, m_upstream_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, m_upstream_fd, &event );
+    m_upstream_registered = true;
+    m_epoll_ctl_count++;
+}
+
+/* 结束对上游连接的使用。应答已经完整读出并且上游同意保持连接时归还到连接所在事件循环的连接池，否则关闭 */
+void http_conn::release_upstream( bool reuse )
+{
+    if ( m_upstream_fd < 0 )
+    {
+        return;
+    }
+    if ( m_upstream_registered )
+    {
+        epoll_ctl( m_conn_epollfd, EPOLL_CTL_DEL, m_upstream_fd, 0 );
+        m_epoll_ctl_count++;
+        m_upstream_registered = false;
+    }
+    m_upstream_waiting = false;
+    m_upstream_state = UPSTREAM_IDLE;
+    if ( reuse && m_upstream_reusable )
+    {
+        m_upstream_pool->release( m_backend, m_upstream_fd );
+    }
+    else
+    {
+        close( m_upstream_fd );
+    }
+    m_upstream_fd = -1;
+}
+
+/* 关闭正在发送的目标文件 */
+void http_conn::close_file()
+{
+    if( m_file_fd >= 0 )
+    {
+        close( m_file_fd );
+        m_file_fd = -1;
+    }
+}
+
+/* 写 HTTP 响应：先发送写缓冲中的应答头部，再用 sendfile 按窗口发送文件区间，或者用 splice 转发代理应答的消息体。
+每次只写出一部分时都记录下进度（m_write_sent 和 m_file_offset），下一轮 EPOLLOUT 事件到来时从断点继续，而不会重发已经发送的字节。 */
+bool http_conn::write()
+{
+    TRACE_SPAN( "write", m_sockfd );
+    int temp = 0;
+    if ( m_h2 )
+    {
+        return write_h2();
+    }
+    // EPOLLONESHOT 模式下 TLS 握手在等待 socket 可写
+    if ( m_tls && ! m_tls->ready() )
+    {
+        int ret = tls_handshake();
+        if ( ret < 0 )
+        {
+            return false;
+        }
+        rearm( ( ret == 0 && m_tls->want_write() ) ? EPOLLOUT : EPOLLIN );
+        return true;
+    }
+    if ( m_write_idx == 0 )
+    {
+        rearm( EPOLLIN );
+        init();
+        return true;
+    }
+
+    // 在应答发送完之前设置 TCP_CORK，头部、文件内容（以及连接归属模式下紧随其后的流水线应答）被合并成尽量少的满长度报文段
+    if ( m_flush_policy == FLUSH_CORK )
+    {
+        set_cork( true );
+    }
+
+    while( 1 )
+    {
+        // 用户态加密时先发送上一次读出、还没有加密发送完的文件内容
+        if ( m_tls && m_tls->buffered() )
+        {
+            int ret = m_tls->flush();
+            if ( ret < 0 )
+            {
+                close_file();
+                return false;
+            }
+            if ( ret == 0 )
+            {
+                rearm( EPOLLOUT );
+                return true;
+            }
+        }
+        if ( m_write_sent < m_write_idx )
+        {
+            // 后面还有文件内容时带上 MSG_MORE，让内核把头部和 sendfile 发送的第一段内容合并到同一个报文段中。
+            // 否则小文件的头部和内容分成两个报文段，后者会被 Nagle 算法扣住直到对方的延迟确认到达
+            bool body = ( m_file_fd >= 0 || m_upstream_fd >= 0 || m_pipe_pending > 0 );
+            temp = send_client( m_write_buf + m_write_sent, m_write_idx - m_write_sent, body ? MSG_MORE : 0 );
+        }
+        else if ( m_file_fd < 0 )
+        {
+            // 代理应答的消息体
+            int ret = relay_body();
+            if ( ret <= 0 )
+            {
+                return ret == 0;
+            }
+            temp = 0;
+        }
+        else
+        {
+            off_t window = m_file_end - m_file_offset;
+            if ( window > FILE_WINDOW_SIZE )
+            {
+                window = FILE_WINDOW_SIZE;
+            }
+            // kTLS 连接上 sendfile 仍然是零拷贝的，内核在发送时加密；用户态加密只能把文件读出来再用 SSL_write 发送
+            if ( tls_userspace() )
+            {
+                temp = m_tls->send_body( m_file_fd, &m_file_offset, window );
+            }
+            else
+            {
+                temp = sendfile( m_sockfd, m_file_fd, &m_file_offset, window );
+            }
+            // 文件在发送过程中被截断，已经无法按 Content-Length 发完，只能关闭连接
+            if ( temp == 0 )
+            {
+                close_file();
+                return false;
+            }
+        }
+
+        if ( temp <= -1 )
+        {
+            // 如果 TCP 写缓冲没有空间，则等待下一轮 EPOLLOUT 事件。虽然在此期间，服务器无法理解接收到同一客户的下一个请求，但这可以保证连接的完整性。
+            if( errno == EAGAIN )
+            {
+                rearm( EPOLLOUT );
+                return true;
+            }
+            close_file();
+            return false;
+        }
+
+        m_bytes_sent += temp;
+        if ( m_write_sent < m_write_idx )
+        {
+            m_write_sent += temp;
+        }
+        if ( m_write_sent >= m_write_idx && ( m_file_fd < 0 || m_file_offset >= m_file_end )
+             && m_upstream_fd < 0 && m_pipe_pending == 0 && ! ( m_tls && m_tls->buffered() ) )
+        {
+            // 发送 HTTP 响应成功，根据 HTTP 请求中的 Connection 字段决定是否立即关闭连接。
+            // 访问日志要在 next_request 之前写，之后读缓冲中的 URL 和 Host 会被流水线请求覆盖
+            close_file();
+            log_access();
+            // 连接归属模式下等处理完所有流水线请求之后再由 handle_events 取消 TCP_CORK
+            if ( m_oneshot )
+            {
+                set_cork( false );
+            }
+            if ( m_count_segments )
+            {
+                count_segments();
+            }
+            if( m_linger )
+            {
+                next_request();
+                // 读缓冲（或者 OpenSSL 的缓冲）中还有流水线请求时不重新注册 EPOLLIN，由调用者把连接再次交给工作线程
+                if ( ! has_buffered_request() )
+                {
+                    rearm( EPOLLIN );
+                }
+                return true;
+            }
+            else
+            {
+                rearm( EPOLLIN );
+                return false;
+            } 
+        }
+    }
+}
+
+// 往写缓冲中写入待发送的数据
+bool http_conn::add_response( const char* format, ... )
+{
     if( m_write_idx >= WRITE_BUFFER_SIZE )
     {
-        return false;
+        return false;
+    }
+    va_list arg_list;
+    va_start( arg_list, format );
+    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
+    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) )
+    {
+        return false;
+    }
+    m_write_idx += len;
+    va_end( arg_list );
+    return true;
+}
+
+/* 添加状态行 */
+bool http_conn::add_status_line( int status, const char* title )
+{
+    m_status = status;
+    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+}
+
+/* 添加头部字段 */
+bool http_conn::add_headers( off_t content_len )
+{
+    return add_content_length( content_len ) && add_linger() && add_blank_line();
+}
+
+/* 添加内容字段 */
+bool http_conn::add_content_length( off_t content_len )
+{
+    return add_response( "Content-Length: %lld\r\n", ( long long )content_len );
+}
+
+/* 添加区间字段：206 应答给出本次发送的区间，416 应答给出文件的完整长度 */
+bool http_conn::add_content_range()
+{
+    if ( m_partial )
+    {
+        return add_response( "Content-Range: bytes %lld-%lld/%lld\r\n", ( long long )m_file_offset,
+                             ( long long )m_file_end - 1, ( long long )m_file_stat.st_size );
+    }
+    return add_response( "Content-Range: bytes */%lld\r\n", ( long long )m_file_stat.st_size );
+}
+
+/* 把时间格式化为 HTTP 日期 */
+static void format_http_date( time_t t, char* date, int len )
+{
+    struct tm tm;
+    gmtime_r( &t, &tm );
+    strftime( date, len, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+}
+
+/* 添加缓存验证字段 ETag 和 Last-Modified */
+bool http_conn::add_validators()
+{
+    char etag[ ETAG_LEN ];
+    make_etag( etag, ETAG_LEN );
+    char date[ 64 ];
+    format_http_date( m_file_stat.st_mtime, date, sizeof( date ) );
+    return add_response( "ETag: %s\r\nLast-Modified: %s\r\n", etag, date );
+}
+
+/* 添加保持连接字段 */
+bool http_conn::add_linger()
+{
+    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+}
+
+/* 添加空白行 */
+bool http_conn::add_blank_line()
+{
+    return add_response( "%s", "\r\n" );
+}
+
+/* 添加字符串内容 */
+bool http_conn::add_content( const char* content )
+{
+    return add_response( "%s", content );
+}
+
+// 根据服务器处理 HTTP 请求的结果，决定返回给客户端的内容
+bool http_conn::process_write( HTTP_CODE ret )
+{
+    switch ( ret )
+    {
+        case INTERNAL_ERROR:// 服务器内部错误
+        {
+            add_status_line( 500, error_500_title );
+            add_headers( strlen( error_500_form ) );
+            if ( ! add_content( error_500_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case BAD_REQUEST:// 请求错误
+        {
+            add_status_line( 400, error_400_title );
+            add_headers( strlen( error_400_form ) );
+            if ( ! add_content( error_400_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case NO_RESOURCE:// 无资源
+        {
+            add_status_line( 404, error_404_title );
+            add_headers( strlen( error_404_form ) );
+            if ( ! add_content( error_404_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case FORBIDDEN_REQUEST:// 无权限
+        {
+            add_status_line( 403, error_403_title );
+            add_headers( strlen( error_403_form ) );
+            if ( ! add_content( error_403_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case RANGE_NOT_SATISFIABLE:// 请求的区间超出了文件的范围
+        {
+            add_status_line( 416, error_416_title );
+            add_content_range();
+            add_headers( strlen( error_416_form ) );
+            if ( ! add_content( error_416_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case NOT_MODIFIED:// 客户端缓存仍然有效，只发送头部，没有消息体
+        {
+            add_status_line( 304, ok_304_title );
+            add_validators();
+            if ( ! ( add_linger() && add_blank_line() ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case BAD_GATEWAY:// 上游服务器没有返回有效的应答
+        {
+            add_status_line( 502, error_502_title );
+            add_headers( strlen( error_502_form ) );
+            if ( ! add_content( error_502_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case MISDIRECTED_REQUEST:// HTTP/2 连接上请求了代理路由，只在 serve_stream 中出现
+        {
+            return false;
+        }
+        case H2_UPGRADE:// 切换到 HTTP/2：先发送 101 应答，升级前的请求在流 1 上应答
+        {
+            add_status_line( 101, switching_101_title );
+            if ( ! add_response( "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n" ) )
+            {
+                return false;
+            }
+            return start_h2( true );
+        }
+        case H2_PREFACE:// 客户端直接使用 HTTP/2
+        {
+            return start_h2( false );
+        }
+        case WS_UPGRADE:// 切换到 WebSocket：101 应答由会话发送，排在所有 WebSocket 帧之前
+        {
+            char accept[ ws_codec::ACCEPT_LEN + 1 ];
+            ws_codec::accept_key( m_ws_key, accept );
+            add_status_line( 101, switching_101_title );
+            if ( ! add_response( "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept ) )
+            {
+                m_ws_room->release();
+                m_ws_room = NULL;
+                return false;
+            }
+            return start_ws();
+        }
+        case PROXY_REQUEST:// 反向代理：do_proxy 已经把改写之后的上游应答头部放入写缓冲，消息体由 write 从管道中转发
+        {
+            break;
+        }
+        case FILE_REQUEST:// 文件请求成功
+        {
+            if ( m_file_end > m_file_offset )
+            {
+                // 添加状态行和头部字段，文件内容由 write 从 m_file_fd 中发送
+                if ( m_partial )
+                {
+                    add_status_line( 206, ok_206_title );
+                    add_content_range();
+                }
+                else
+                {
+                    add_status_line( 200, ok_200_title );
+                }
+                add_response( "Accept-Ranges: bytes\r\n" );
+                add_validators();
+                return add_headers( m_file_end - m_file_offset );
+            }
+            else
+            {
+                // 返回网页内容
+                close_file();
+                add_status_line( 200, ok_200_title );
+                add_headers( strlen( ok_200_form ) );
+                if ( ! add_content( ok_200_form ) )
+                {
+                    return false;
+                }
+            }
+            break;
+        }
+        default:
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// 由线程池中的工作线程调用，这是处理 HTTP 请求的入口函数
+void http_conn::process()
+{
+    if ( m_h2 )
+    {
+        process_h2();
+        return;
+    }
+    if ( m_websocket )
+    {
+        process_ws();
+        return;
+    }
+    // 读缓冲满时 OpenSSL 中可能还留有解密之后的流水线请求，这些数据已经不在 socket 中，不会再触发 EPOLLIN，所以在这里读出
+    if ( m_tls && m_tls->pending() > 0 && m_read_idx < READ_BUFFER_SIZE && ! read() )
+    {
+        close_conn();
+        return;
+    }
+    // 请求在最后一次调用中解析完整，所以从这里开始计算处理时长
+    m_request_start = monotonic_ns();
+    HTTP_CODE read_ret = process_read();
+    if ( read_ret == NO_REQUEST && m_read_idx >= READ_BUFFER_SIZE )
+    {
+        // 读缓冲已满而请求仍不完整（请求头或消息体超过了 READ_BUFFER_SIZE），再等也读不进新数据，回答 400 并在应答之后关闭连接
+        read_ret = BAD_REQUEST;
+        m_linger = false;
+    }
+    if ( read_ret == NO_REQUEST )
+    {
+        // 向 m_epollfd 上注册 m_sockfd 上的读事件，TLS 握手可能需要等待可写
+        rearm( ( m_tls && m_tls->want_write() ) ? EPOLLOUT : EPOLLIN );
+        return;
+    }
+    m_request_count++;
+    if ( read_ret == PROXY_PENDING )
+    {
+        // 代理请求在等待上游服务器，之后由上游连接上的事件继续处理。注册之后连接随时可能被其他线程处理，所以这是最后一步
+        wait_upstream();
+        return;
+    }
+
+    bool write_ret = process_write( read_ret );
+    if ( ! write_ret )
+    {
+        close_conn();// 关闭客户端连接
+    }
+    else if ( m_websocket )
+    {
+        // 刚刚切换到 WebSocket，连接仍然由当前线程处理，交还给主线程的方式也随之改变
+        process_ws();
+        return;
+    }
+    // 向 m_epollfd 上注册 m_sockfd 上的读事件
+    rearm( EPOLLOUT );
+}
+
+/* 连接归属模式下由拥有该连接的线程调用，读取、解析请求和发送应答都在同一个线程中完成。
+因为是边沿触发且不会重新注册事件，所以应答没有发完时到达的请求不能丢掉，先记在 m_read_pending 中，
+等应答发送完毕之后再读取。 */
+bool http_conn::handle_events( uint32_t events )
+{
+    // TLS 握手的每一步都由 read 推进，不论它等待的是可读还是可写事件
+    if ( ( events & EPOLLIN ) || ( m_tls && ! m_tls->ready() ) )
+    {
+        m_read_pending = true;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) )
+
+    bool ret = m_h2 ? serve_h2() : ( m_websocket ? serve_ws() : serve_requests() );
+    // 本轮的所有应答（包括流水线请求的应答）都已经写入 socket，取消 TCP_CORK 把它们一次性发送出去
+    if ( ret && m_corked )
     {
-        return false;
+        set_cork( false );
     }
-    m_write_idx += len;
-    va_end( arg_list );
-    return true;
+    return ret;
 }
 
-/* 添加状态行 */
-bool http_conn::add_status_line( int status, const char* title )
+/* 循环发送应答、读取并处理请求，直到需要等待新的事件为止 */
+bool http_conn::serve_requests()
 {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+    while ( true )
+    {
+        // 代理请求还在等待上游服务器。事件可能来自上游连接，也可能来自客户连接，总是尝试推进一次，仍需等待时重新注册上游连接
+        if ( m_upstream_state != UPSTREAM_IDLE )
+        {
+            HTTP_CODE ret = advance_upstream();
+            if ( ret == PROXY_PENDING )
+            {
+                wait_upstream();
+                return true;
+            }
+            if ( ! process_write( ret ) )
+            {
+                return false;
+            }
+        }
+
+        // 有待发送的应答：发送它，没有发完就等待下一个 EPOLLOUT 边沿
+        if ( m_write_idx > 0 )
+        {
+            if ( ! write() )
+            {
+                return false;
+            }
+            if ( m_write_idx > 0 )
+            {
+                return true;
+            }
+        }
+
+        // 有新数据到达就先读取；否则只有读缓冲中还有尚未分析的流水线请求时才继续处理
+        if ( m_read_pending )
+        {
+            m_read_pending = false;
+            if ( ! read() )
+            {
+                return false;
+            }
+        }
+        else if ( m_checked_idx >= m_read_idx )
+        {
+            return true;
+        }
+        m_request_start = monotonic_ns();
+        HTTP_CODE read_ret = process_read();
+        if ( read_ret == NO_REQUEST && m_read_idx >= READ_BUFFER_SIZE )
+        {
+            // 请求超过了读缓冲，和 process 中的处理相同
+            read_ret = BAD_REQUEST;
+            m_linger = false;
+        }
+        if ( read_ret == NO_REQUEST )
+        {
+            return true;
+        }
+        m_request_count++;
+        if ( read_ret == PROXY_PENDING )
+        {
+            wait_upstream();
+            return true;
+        }
+        if ( ! process_write( read_ret ) )
+        {
+            return false;
+        }
+        if ( m_h2 )
+        {
+            return serve_h2();
+        }
+        if ( m_websocket )
+        {
+            return serve_ws();
+        }
+    }
 }
 
-/* 添加头部字段 */
-bool http_conn::add_headers( int content_len )
+/* Proactor 模式下推进连接的状态，和 serve_requests 的顺序相同：先发送应答，再处理读缓冲中的流水线请求，最后读取新数据。
+区别在于这里不循环读写，每一步都只是发起一个异步操作然后返回，操作完成时 on_recv 或 on_send 带着传输的字节数再次调用它。
+请求解析和应答组装和其他模式完全相同，只有 I/O 的方式不同 */
+void http_conn::serve_async()
 {
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    while ( true )
+    {
+        if ( m_write_idx > 0 )
+        {
+            // 后面还有文件内容时带上 MSG_MORE，理由和 write 中的相同
+            if ( m_write_sent < m_write_idx )
+            {
+                int flags = ( m_file_fd >= 0 ) ? MSG_MORE : 0;
+                m_proactor->async_send( m_sockfd, m_write_buf + m_write_sent, m_write_idx - m_write_sent, flags, &m_send_op );
+                return;
+            }
+            if ( m_file_fd >= 0 && m_file_offset < m_file_end )
+            {
+                off_t window = m_file_end - m_file_offset;
+                if ( window > FILE_WINDOW_SIZE )
+                {
+                    window = FILE_WINDOW_SIZE;
+                }
+                if ( ! m_proactor->async_sendfile( m_sockfd, m_file_fd, m_file_offset, window, 0, &m_async_file, &m_send_op ) )
+                {
+                    close_conn();
+                }
+                return;
+            }
+            // 应答发送完毕
+            close_file();
+            log_access();
+            set_cork( false );
+            if ( m_count_segments )
+            {
+                count_segments();
+            }
+            if ( ! m_linger )
+            {
+                close_conn();
+                return;
+            }
+            next_request();
+        }
+
+        // 读缓冲中有尚未分析的流水线请求时先处理它们，否则读取新数据。请求还不完整时也读取新数据
+        // （消息体和连接前言不完整时 m_checked_idx 并不前进，所以不能再用它判断）
+        HTTP_CODE read_ret = NO_REQUEST;
+        if ( m_checked_idx < m_read_idx )
+        {
+            m_request_start = monotonic_ns();
+            read_ret = process_read();
+        }
+        if ( read_ret == NO_REQUEST && m_read_idx < READ_BUFFER_SIZE )
+        {
+            m_proactor->async_recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, &m_recv_op );
+            return;
+        }
+        if ( read_ret == NO_REQUEST )
+        {
+            // 请求超过了读缓冲，和 process 中的处理相同
+            read_ret = BAD_REQUEST;
+            m_linger = false;
+        }
+        // 不支持的 HTTP/2 连接前言
+        if ( read_ret == H2_PREFACE )
+        {
+            close_conn();
+            return;
+        }
+        m_request_count++;
+        if ( m_flush_policy == FLUSH_CORK )
+        {
+            set_cork( true );
+        }
+        if ( ! process_write( read_ret ) )
+        {
+            close_conn();
+            return;
+        }
+    }
 }
 
-/* 添加内容字段 */
-bool http_conn::add_content_length( int content_len )
+/* 接收操作完成，result 是读入读缓冲的字节数 */
+void http_conn::on_recv( async_op* op, int result )
 {
-    return add_response( "Content-Length: %d\r\n", content_len );
+    http_conn* conn = ( http_conn* )op->arg;
+    if ( result <= 0 )
+    {
+        conn->close_conn();
+        return;
+    }
+    conn->m_read_idx += result;
+    conn->serve_async();
 }
 
-/* 添加保持连接字段 */
-bool http_conn::add_linger()
+/* 发送操作完成，result 是发送的字节数：头部的发送推进 m_write_sent，文件的发送推进 m_file_offset */
+void http_conn::on_send( async_op* op, int result )
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    http_conn* conn = ( http_conn* )op->arg;
+    if ( result <= 0 )
+    {
+        // 文件在发送过程中被截断（result 为 0）时也只能关闭连接
+        conn->close_conn();
+        return;
+    }
+    conn->m_bytes_sent += result;
+    if ( conn->m_write_sent < conn->m_write_idx )
+    {
+        conn->m_write_sent += result;
+    }
+    else
+    {
+        conn->m_file_offset += result;
+    }
+    conn->serve_async();
 }
 
-/* 添加空白行 */
-bool http_conn::add_blank_line()
+/* 切换到 HTTP/2。读缓冲中还没有处理的数据（连接前言以及随后的帧）交给会话，之后连接上的读写都由会话完成 */
+bool http_conn::start_h2( bool upgraded )
 {
-    return add_response( "%s", "\r\n" );
+    // 切换协议本身不是一个请求，升级前的请求作为流 1 在 serve_stream 中计数
+    m_request_count--;
+    m_h2 = new h2_session( m_sockfd, m_address, h2_handler, this, m_access_log );
+    int consumed = 0;
+    if ( upgraded )
+    {
+        h2_request request;
+        request.method = "GET";
+        request.path = m_url;
+        request.authority = m_host;
+        request.range = m_range;
+        request.if_none_match = m_if_none_match;
+        request.if_modified_since = m_if_modified_since;
+        consumed = m_checked_idx;
+        if ( ! m_h2->upgrade( m_http2_settings, request ) )
+        {
+            return false;
+        }
+    }
+    if ( ! m_h2->feed( m_read_buf + consumed, m_read_idx - consumed ) )
+    {
+        return false;
+    }
+    m_read_idx = 0;
+    m_checked_idx = 0;
+    m_h2->process();
+    return true;
 }
 
-/* 添加字符串内容 */
-bool http_conn::add_content( const char* content )
+/* EPOLLONESHOT 模式下由工作线程处理主线程读入的帧。有数据要发送时同时注册可写和可读事件；
+所有的流都在等待对方的 WINDOW_UPDATE 时只需要等待可读 */
+void http_conn::process_h2()
 {
-    return add_response( "%s", content );
+    TRACE_SPAN( "h2 frames", m_sockfd );
+    m_h2->process();
+    if ( m_h2->finished() )
+    {
+        close_conn();
+        return;
+    }
+    rearm( m_h2->want_write() ? EPOLLOUT | EPOLLIN : EPOLLIN );
 }
 
-// 根据服务器处理 HTTP 请求的结果，决定返回给客户端的内容
-bool http_conn::process_write( HTTP_CODE ret )
+/* 发送 HTTP/2 连接上的数据：通过 Upgrade 切换时先发送写缓冲中的 101 应答，之后由会话发送帧。
+发送缓冲已满时除了可写事件还要等待可读事件，对方的 WINDOW_UPDATE 和新的请求不能因为发送受阻而得不到处理 */
+bool http_conn::write_h2()
 {
-    switch ( ret )
+    while ( m_write_sent < m_write_idx )
     {
-        case INTERNAL_ERROR:// 服务器内部错误
+        int ret = send( m_sockfd, m_write_buf + m_write_sent, m_write_idx - m_write_sent, MSG_NOSIGNAL | MSG_MORE );
+        if ( ret < 0 )
         {
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) )
+            if ( errno == EAGAIN )
             {
-                return false;
+                rearm( EPOLLOUT );
+                return true;
             }
-            break;
+            return false;
         }
-        case BAD_REQUEST:// 请求错误
+        m_write_sent += ret;
+    }
+    m_write_idx = 0;
+    m_write_sent = 0;
+    int ret = m_h2->write();
+    if ( ret < 0 || m_h2->finished() )
+    {
+        return false;
+    }
+    rearm( ( ret == 0 ) ? EPOLLOUT | EPOLLIN : EPOLLIN );
+    return true;
+}
+
+/* 连接归属模式下处理 HTTP/2 连接：读取并处理所有到达的帧，再发送应答，直到需要等待新的事件为止 */
+bool http_conn::serve_h2()
+{
+    while ( true )
+    {
+        bool more = false;
+        if ( m_read_pending )
         {
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) )
+            m_read_pending = false;
+            if ( ! m_h2->read( &more ) )
             {
                 return false;
             }
-            break;
         }
-        case NO_RESOURCE:// 无资源
+        m_h2->process();
+        if ( ! write_h2() )
         {
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) )
+            return false;
+        }
+        // 输入缓冲曾经被填满，socket 中可能还有数据，边沿触发不会再通知
+        if ( ! more )
+        {
+            return true;
+        }
+        m_read_pending = true;
+    }
+}
+
+void http_conn::h2_handler( const h2_request& request, h2_response* response, void* arg )
+{
+    ( ( http_conn* )arg )->serve_stream( request, response );
+}
+
+/* 用 HTTP/1.1 请求的处理流程（路由、规范化、文件信息缓存、条件请求和区间请求）处理一个 HTTP/2 请求。
+请求的字段只在这次调用期间有效，所以目标文件在这里打开，文件描述符的所有权交给会话 */
+void http_conn::serve_stream( const h2_request& request, h2_response* response )
+{
+    m_request_count++;
+    m_url = ( char* )request.path;
+    m_host = ( char* )request.authority;
+    m_range = ( char* )request.range;
+    m_if_none_match = ( char* )request.if_none_match;
+    m_if_modified_since = ( char* )request.if_modified_since;
+    m_partial = false;
+    m_file_offset = 0;
+    m_file_end = 0;
+    HTTP_CODE ret = BAD_REQUEST;
+    if ( strcmp( request.method, "GET" ) == 0 && m_url[0] == '/' )
+    {
+        ret = do_request();
+    }
+
+    const char* form = NULL;
+    char etag[ ETAG_LEN ];
+    char date[ 64 ];
+    switch ( ret )
+    {
+        case FILE_REQUEST:
+        {
+            if ( m_file_end <= m_file_offset )
             {
-                return false;
+                // 和 HTTP/1.1 一样，空文件应答一个空白网页
+                close_file();
+                response->status = 200;
+                form = ok_200_form;
+                break;
             }
-            break;
+            response->status = m_partial ? 206 : 200;
+            if ( m_partial )
+            {
+                response->add_header( "content-range", "bytes %lld-%lld/%lld", ( long long )m_file_offset,
+                                      ( long long )m_file_end - 1, ( long long )m_file_stat.st_size );
+            }
+            response->add_header( "accept-ranges", "bytes" );
+            // 文件区间交给会话发送
+            response->fd = m_file_fd;
+            response->offset = m_file_offset;
+            response->end = m_file_end;
+            m_file_fd = -1;
         }
-        case FORBIDDEN_REQUEST:// 无权限
+        // fall through
+        case NOT_MODIFIED:
         {
-            add_status_line( 403, error_403_title );
-            add_headers( strlen( error_403_form ) );
-            if ( ! add_content( error_403_form ) )
+            if ( ret == NOT_MODIFIED )
             {
-                return false;
+                response->status = 304;
             }
+            make_etag( etag, ETAG_LEN );
+            format_http_date( m_file_stat.st_mtime, date, sizeof( date ) );
+            response->add_header( "etag", "%s", etag );
+            response->add_header( "last-modified", "%s", date );
             break;
         }
-        case FILE_REQUEST:// 文件请求成功
+        case RANGE_NOT_SATISFIABLE:
         {
-            add_status_line( 200, ok_200_title );
-            if ( m_file_stat.st_size != 0 )
-            {
-                // 添加头部字段
-                add_headers( m_file_stat.st_size );
-                m_iv[ 0 ].iov_base = m_write_buf;
-                m_iv[ 0 ].iov_len = m_write_idx;
-                m_iv[ 1 ].iov_base = m_file_address;
-                m_iv[ 1 ].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
-                return true;
-            }
-            else
-            {
-                // 返回网页内容
-                const char* ok_string = "<html><body></body></html>";
-                add_headers( strlen( ok_string ) );
-                if ( ! add_content( ok_string ) )
-                {
-                    return false;
-                }
-            }
+            response->status = 416;
+            response->add_header( "content-range", "bytes */%lld", ( long long )m_file_stat.st_size );
+            form = error_416_form;
+            break;
+        }
+        case BAD_REQUEST:
+        {
+            response->status = 400;
+            form = error_400_form;
+            break;
+        }
+        case NO_RESOURCE:
+        {
+            response->status = 404;
+            form = error_404_form;
+            break;
+        }
+        case FORBIDDEN_REQUEST:
+        {
+            response->status = 403;
+            form = error_403_form;
+            break;
+        }
+        case MISDIRECTED_REQUEST:
+        {
+            response->status = 421;
+            form = error_421_form;
+            break;
         }
         default:
         {
-            return false;
+            close_file();
+            response->status = 500;
+            form = error_500_form;
+            break;
         }
     }
+    if ( form )
+    {
+        response->body = form;
+        response->body_len = strlen( form );
+    }
+}
+
+/* 检查 WebSocket 握手请求。请求的路径（不含查询字符串）就是房间名，同一路径上的连接互相收到对方的消息。
+这里取得房间的引用，由 start_ws 交给会话 */
+http_conn::HTTP_CODE http_conn::do_websocket()
+{
+    // WebSocket 会话直接读写 socket，不支持 TLS 连接
+    if ( m_tls || m_method != GET || ! m_url || ! m_ws_key || ! m_ws_version || strcmp( m_ws_version, "13" ) != 0 )
+    {
+        return BAD_REQUEST;
+    }
+    m_ws_room = ws_room::find( m_url, strcspn( m_url, "?" ) );
+    return m_ws_room ? WS_UPGRADE : INTERNAL_ERROR;
+}
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+/* 切换到 WebSocket。101 应答在加入房间之前放入会话的输出队列，所以一定先于广播的消息发送；
+读缓冲中握手请求之后的数据（客户端紧接着发送的帧）交给会话 */
+bool http_conn::start_ws()
+{
+    // 房间的引用由 join 交给会话，在这之前出错时在这里释放
+    ws_room* room = m_ws_room;
+    m_ws_room = NULL;
+    if ( ! m_ws )
+    {
+        m_ws = new ws_session;
+    }
+    m_ws->open( m_sockfd, m_conn_epollfd, m_oneshot, ws_handler, this );
+    m_websocket = true;
+    // 每个消息都是用一次 sendmsg 写出的完整帧，等待合并只会增加延迟
+    set_cork( false );
+    int on = 1;
+    setsockopt( m_sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    if ( ! m_ws->send_raw( m_write_buf, m_write_idx ) )
+    {
+        room->release();
+        return false;
+    }
+    m_bytes_sent = m_write_idx;
+    log_access();
+    m_write_idx = 0;
+    if ( ! m_ws->feed( m_read_buf + m_checked_idx, m_read_idx - m_checked_idx ) )
+    {
+        room->release();
+        return false;
+    }
+    m_read_idx = 0;
+    m_checked_idx = 0;
+    if ( ! room->join( m_ws ) )
+    {
+        m_ws->fail( ws_codec::CLOSE_TRY_AGAIN_LATER );
+        return true;
+    }
+    m_ws->process();
     return true;
 }
 
-// 由线程池中的工作线程调用，这是处理 HTTP 请求的入口函数
-void http_conn::process()
+/* EPOLLONESHOT 模式下由工作线程处理 WebSocket 连接的事件，然后由会话重新注册事件，把连接交还给主线程 */
+void http_conn::process_ws()
 {
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST )
+    TRACE_SPAN( "ws frames", m_sockfd );
+    m_read_pending = true;
+    if ( ! serve_ws() )
     {
-        // 向 m_epollfd 上注册 m_sockfd 上的写事件
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        close_conn();
         return;
     }
+    m_ws->rearm();
+}
 
-    bool write_ret = process_write( read_ret );
-    if ( ! write_ret )
+/* 读取并处理到达的所有帧，再发送输出队列中的消息。对方关闭连接时也先处理已经读到的帧，这样它的关闭帧能得到回应 */
+bool http_conn::serve_ws()
+{
+    while ( m_read_pending )
     {
-        close_conn();// 关闭客户端连接
+        m_read_pending = false;
+        bool more = false;
+        bool alive = m_ws->read( &more );
+        m_ws->process();
+        if ( ! alive )
+        {
+            m_ws->flush();
+            return false;
+        }
+        m_read_pending = more;
     }
-    // 向 m_epollfd 上注册 m_sockfd 上的读事件
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
-}
\ No newline at end of file
+    return m_ws->flush() && ! m_ws->finished();
+}
+
+void http_conn::ws_handler( ws_session* session, int opcode, const char* data, int len, void* arg )
+{
+    session->room()->broadcast( opcode, data, len, session );
+}
+
+/* 拒绝请求时不分析请求、不查找文件，只发送固定的 503 应答。应答很小，新连接的发送缓冲一定放得下，失败了也不重试。
+WebSocket 和 HTTP/2 连接的事件不能丢弃（EPOLLONESHOT 不会再被注册），关闭已经建立的长连接又只会换来代价更高的重连和握手，所以照常处理。
+HTTP/2 连接上更不能写入 HTTP/1.1 的应答：它可能插在一个 DATA 帧的中间，对方只会把它当作协议错误，连同其他的流一起放弃 */
+void http_conn::shed()
+{
+    if ( m_h2 )
+    {
+        process_h2();
+        return;
+    }
+    if ( m_websocket )
+    {
+        process_ws();
+        return;
+    }
+    m_request_start = monotonic_ns();
+    int ret = send_client( overload_503_response, sizeof( overload_503_response ) - 1, MSG_DONTWAIT | MSG_NOSIGNAL );
+    m_status = 503;
+    m_bytes_sent = ( ret > 0 ) ? ret : 0;
+    log_access();
+    close_conn();
+}
+
+/* 把本次请求的信息写入访问日志。记录只是被复制到当前线程的环形缓冲中，格式化和写文件都由日志的后台线程完成 */
+void http_conn::log_access()
+{
+    if ( ! m_access_log )
+    {
+        return;
+    }
+    static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+    access_record record;
+    record.duration_us = ( monotonic_ns() - m_request_start ) / 1000;
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    record.time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    record.bytes = m_bytes_sent;
+    record.addr = m_address.sin_addr;
+    record.port = ntohs( m_address.sin_port );
+    record.status = m_status;
+    // 请求行不完整或有错时没有 URL
+    record.method = m_url ? method_names[ m_method ] : "-";
+    snprintf( record.host, access_record::HOST_LEN, "%s", m_host ? m_host : "-" );
+    snprintf( record.url, access_record::URL_LEN, "%s", m_url ? m_url : "-" );
+    m_access_log->append( record );
+}
@@ -9,13 +9,27 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "chapter14/14_2_locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "chapter15/15_7_file_cache.h"
+#include "chapter15/15_8_acceptor.h"
+#include "chapter15/15_9_route_table.h"
+#include "chapter15/15_11_access_log.h"
+#include "chapter15/15_12_trace.h"
+#include "chapter15/15_16_tls.h"
+#include "chapter15/15_17_coroutine.h"
+#include "chapter15/15_18_affinity.h"
+#include "chapter15/15_21_pool_stats.h"
+#include "chapter15/15_22_leader_follower.h"
+#include "chapter15/15_23_proactor.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
+#define MAX_OWNER_THREAD 64
 
 extern int addfd( int epollfd, int fd, bool one_shot );
 extern int removefd( int epollfd, int fd );
@@ -37,6 +51,200 @@ void addsig( int sig, void( handler )(int), bool restart = true )
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
+// 收到 SIGINT 或 SIGTERM 之后置为 true，主循环和所有线程据此退出
+static volatile sig_atomic_t stop_server = false;
+
+void stop_handler( int sig )
+{
+    stop_server = true;
+}
+
+// 收到 SIGHUP 之后置为 true，主循环据此重新加载路由配置
+static volatile sig_atomic_t reload_routes = false;
+
+void reload_handler( int sig )
+{
+    reload_routes = true;
+}
+
+// 收到 SIGUSR1 之后置为 true，主循环据此输出线程池的运行统计（以及 LOCK_PROFILE 构建中锁的竞争统计）
+static volatile sig_atomic_t dump_stats = false;
+
+void stats_handler( int sig )
+{
+    dump_stats = true;
+}
+
+/* 连接归属模式下的线程：每个线程拥有自己的事件表，连接在 accept 时被分配给其中一个线程，之后始终由它处理 */
+struct owner_thread
+{
+    pthread_t tid;
+    int epollfd;
+    http_conn* users;
+    // 线程固定运行的 CPU（没有固定时为 -1），以及从该 CPU 所在节点分配的连接对象表（没有固定时使用全局的用户表）
+    int cpu;
+    node_table< http_conn >* table;
+    // 这个线程的连接使用的上游连接池
+    upstream_pool* upstreams;
+};
+
+/* fd 是否在 fds 的前 count 个元素中。一轮事件中关闭的连接很少，顺序查找就够了 */
+static bool in_list( const int* fds, int count, int fd )
+{
+    for( int i = 0; i < count; ++i )
+    {
+        if( fds[i] == fd )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void* owner_loop( void* arg )
+{
+    owner_thread* owner = ( owner_thread* )arg;
+    TRACE_THREAD_NAME( "owner" );
+    epoll_event events[ MAX_EVENT_NUMBER ];
+    // 这一轮事件中已经关闭的连接
+    int closed[ MAX_EVENT_NUMBER ];
+    while( ! stop_server )
+    {
+        // 设置超时时间是为了定期检查 stop_server
+        int number = epoll_wait( owner->epollfd, events, MAX_EVENT_NUMBER, 1000 );
+        if ( ( number < 0 ) && ( errno != EINTR ) )
+        {
+            printf( "epoll failure\n" );
+            break;
+        }
+        int closed_count = 0;
+        for ( int i = 0; i < number; i++ )
+        {
+            int sockfd = events[i].data.fd;
+            // 上游连接的事件和客户连接的事件可能同时取出。前一个事件关闭了连接之后，
+            // 描述符可能已经被主线程用于新的连接并交给了其他线程，后一个事件不能再处理
+            if( in_list( closed, closed_count, sockfd ) )
+            {
+                continue;
+            }
+            http_conn* conn = owner->users + sockfd;
+            unsigned int generation = conn->generation();
+            // 等待上游连接时，出错和挂断可能来自上游连接（例如连接被拒绝），由 handle_events 推进代理请求时处理并应答 502
+            bool hangup = ( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) && ! conn->waiting_upstream();
+            if( hangup || ! conn->handle_events( events[i].events ) )
+            {
+                conn->close_conn();
+            }
+            if( conn->generation() != generation )
+            {
+                closed[ closed_count++ ] = sockfd;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* 领导者/追随者模式下的事件处理函数：和 oneshot 模式中主线程的分派相同，只是读入请求的线程直接处理它，不再交给线程池。
+返回 false 表示处理时连接被关闭了 */
+bool lf_event( int sockfd, uint32_t events, void* arg )
+{
+    http_conn* conn = ( http_conn* )arg + sockfd;
+    unsigned int generation = conn->generation();
+    if( conn->waiting_upstream() )
+    {
+        // 代理请求在等待上游服务器，这个事件来自上游连接：继续建立连接、发送请求、读取应答头部或者转发消息体
+        if( ! conn->upstream_event() )
+        {
+            conn->close_conn();
+        }
+        else if( conn->has_buffered_request() )
+        {
+            conn->process();
+        }
+    }
+    else if( conn->websocket() )
+    {
+        if( conn->claim() )
+        {
+            conn->process();
+        }
+    }
+    else if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+    {
+        conn->close_conn();
+    }
+    else if( events & EPOLLIN )
+    {
+        if( conn->read() )
+        {
+            conn->process();
+        }
+        else
+        {
+            conn->close_conn();
+        }
+    }
+    else if( events & EPOLLOUT )
+    {
+        if( ! conn->write() )
+        {
+            conn->close_conn();
+        }
+        else if( conn->has_buffered_request() )
+        {
+            // 读缓冲中还有流水线请求，接着处理
+            conn->process();
+        }
+    }
+    return conn->generation() == generation;
+}
+
+/* 接受新连接时需要的上下文 */
+struct accept_context
+{
+    http_conn* users;
+    bool owned;
+    owner_thread* owners;
+    int owner_number;
+    int next_owner;
+    // 按照连接的数据包到达的 CPU（SO_INCOMING_CPU）选择线程，以及这样分配出去的连接数
+    bool steer;
+    long steered;
+    // Proactor 模式下连接的读写提交到的 proactor，其他模式为空
+    proactor* ring;
+};
+
+/* 主线程在一轮事件中交给线程池的请求。攒够 MAX_BATCH 个或者这一轮的事件处理完时一次性加入线程池，
+一轮 epoll_wait 返回的几百个请求只需要加几次锁，并且只唤醒需要的线程 */
+struct request_batch
+{
+    http_conn* requests[ threadpool< http_conn >::MAX_BATCH ];
+    int classes[ threadpool< http_conn >::MAX_BATCH ];
+    int count;
+};
+
+/* 把攒下的请求加入线程池。队列已满时立即拒绝没能加入的请求，否则这些连接既得不到应答，EPOLLONESHOT 也不会被重新注册 */
+void flush_requests( threadpool< http_conn >* pool, request_batch* batch )
+{
+    int added = pool->append_batch( batch->requests, batch->classes, batch->count );
+    for( int i = added; i < batch->count; ++i )
+    {
+        batch->requests[i]->shed();
+    }
+    batch->count = 0;
+}
+
+/* 攒下一个请求，攒满时加入线程池 */
+void queue_request( threadpool< http_conn >* pool, request_batch* batch, http_conn* request, int cls )
+{
+    batch->requests[ batch->count ] = request;
+    batch->classes[ batch->count ] = cls;
+    if( ++batch->count == threadpool< http_conn >::MAX_BATCH )
+    {
+        flush_requests( pool, batch );
+    }
+}
+
 /* 显示错误 */
 void show_error( int connfd, const char* info )
 {
@@ -46,98 +254,648 @@ void show_error( int connfd, const char* info )
     close( connfd );
 }
 
+/* 选择新连接归属的线程。开启了中断对齐时，优先选择固定在接收这个连接数据包的 CPU 上的线程，
+网卡中断的软中断处理、socket 缓冲和连接对象都留在同一个 CPU 的缓存中；找不到时轮流分配 */
+owner_thread* pick_owner( accept_context* ctx, int connfd )
+{
+    if( ctx->steer )
+    {
+        int cpu = -1;
+        socklen_t len = sizeof( cpu );
+        if( getsockopt( connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len ) == 0 && cpu >= 0 )
+        {
+            // 从 next_owner 开始查找，固定在同一个 CPU 上的多个线程轮流分配
+            for( int i = 0; i < ctx->owner_number; ++i )
+            {
+                int k = ( ctx->next_owner + i ) % ctx->owner_number;
+                if( ctx->owners[k].cpu == cpu )
+                {
+                    ctx->next_owner = ( k + 1 ) % ctx->owner_number;
+                    ++ctx->steered;
+                    return ctx->owners + k;
+                }
+            }
+        }
+    }
+    owner_thread* owner = ctx->owners + ctx->next_owner;
+    ctx->next_owner = ( ctx->next_owner + 1 ) % ctx->owner_number;
+    return owner;
+}
+
+/* acceptor 的回调函数：初始化新接受的连接 */
+void on_accept( int connfd, const sockaddr_in& client_address, void* arg )
+{
+    accept_context* ctx = ( accept_context* )arg;
+    // 客户数量太多
+    if( connfd >= MAX_FD || http_conn::m_user_count >= MAX_FD )
+    {
+        show_error( connfd, "Internal server busy" );
+        return;
+    }
+    // 初始化客户连接。连接归属模式下分配给其中一个线程，线程有自己的连接对象表时在它的表中构造
+    if( ctx->owned )
+    {
+        owner_thread* owner = pick_owner( ctx, connfd );
+        http_conn* conn = owner->table ? owner->table->get( connfd ) : ctx->users + connfd;
+        conn->init( connfd, client_address, owner->epollfd, owner->upstreams );
+    }
+    else if( ctx->ring )
+    {
+        ctx->users[connfd].init( connfd, client_address, ctx->ring );
+    }
+    else
+    {
+        ctx->users[connfd].init( connfd, client_address );
+    }
+}
+
+/* Proactor 模式下始终有一个进行中的异步 accept，完成时初始化新连接，然后发起下一个 */
+struct async_acceptor
+{
+    async_op op;
+    proactor* ring;
+    int listenfd;
+    sockaddr_in address;
+    socklen_t addrlen;
+    accept_context* ctx;
+    long accepted;
+};
+
+void on_async_accept( async_op* op, int result )
+{
+    async_acceptor* acc = ( async_acceptor* )op->arg;
+    if( result >= 0 )
+    {
+        ++acc->accepted;
+        on_accept( result, acc->address, acc->ctx );
+    }
+    else if( result != -EAGAIN && result != -EINTR && result != -ECONNABORTED )
+    {
+        // 描述符用完（EMFILE、ENFILE）等错误不影响之后的连接，继续接受
+        printf( "async accept failure: %d\n", -result );
+    }
+    acc->ring->async_accept( acc->listenfd, &acc->address, &acc->addrlen, &acc->op );
+}
+
+/* Proactor 模式下 inotify 描述符可读时处理文件变化，然后重新等待 */
+struct async_watch
+{
+    async_op op;
+    proactor* ring;
+    file_cache* cache;
+};
+
+void on_cache_event( async_op* op, int result )
+{
+    async_watch* watch = ( async_watch* )op->arg;
+    if( result > 0 )
+    {
+        watch->cache->process_events();
+    }
+    watch->ring->async_poll( watch->cache->get_fd(), POLLIN, &watch->op );
+}
+
+/* 重新加载路由配置。新表完整构建之后才替换旧表，加载失败时继续使用旧表。
+正在处理的请求（包括等待上游应答的代理请求）各自持有旧表的引用，旧表在它们全部结束之后才被释放 */
+void reload_route_table( const char* route_config )
+{
+    route_table* fresh = route_config ? route_table::load( route_config ) : NULL;
+    if( fresh )
+    {
+        http_conn::m_routes.replace( fresh );
+        printf( "route config %s reloaded\n", route_config );
+    }
+}
+
 
 int main( int argc, char* argv[] )
 {
     if( argc <= 2 )
     {
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
+        printf( "usage: %s ip_address port_number [-m oneshot|owned|leader|proactor] [-t thread_number] [-f nagle|nodelay|cork] [-s]"
+                " [-b backlog] [-a accept_budget] [-d defer_accept_seconds] [-q queue_delay_target_ms] [-c route_config] [-l access_log] [-T trace_file]"
+                " [-C tls_cert -k tls_key [-U]] [-A cpu_list] [-R nic] [-E max_threads] [-P] [-B take_batch]\n", basename( argv[0] ) );
         return 1;
     }
     const char* ip = argv[1];
     int port = atoi( argv[2] );
 
+    // 连接模型：oneshot 为半同步/半反应堆模式，主线程读取请求后交给线程池，每次事件之后都要用 EPOLL_CTL_MOD 重新注册；
+    // owned 模式下每个连接固定归属于一个线程，只注册一次，由该线程完成读取、处理和发送；
+    // leader 为领导者/追随者模式，线程轮流等待连接的事件，拿到事件的线程完成读取、处理和发送，主线程只负责接受连接；
+    // proactor 模式下主线程通过 io_uring 发起异步的 accept、recv、send 和 sendfile，由完成事件驱动，只有一个线程（忽略 -t）
+    bool owned = false;
+    bool leader = false;
+    bool completion = false;
+    int thread_number = 8;
+    // 全连接队列长度（内核会把它限制在 net.core.somaxconn 以内）、每轮最多接受的连接数，以及 TCP_DEFER_ACCEPT 的秒数
+    int backlog = SOMAXCONN;
+    int accept_budget = 64;
+    int defer_accept = 0;
+    // 线程池过载控制的排队时间目标值，0 表示关闭
+    int queue_target_ms = 5;
+    // 线程池弹性伸缩的线程数上限，0 表示线程数固定为 thread_number
+    int max_threads = 0;
+    // 线程池是否按照请求的类别（缓存命中、访问磁盘、代理）分别排队，没有开启时所有请求先进先出
+    bool classify = false;
+    // 工作线程每次从线程池中取出的最大任务数
+    int take_batch = 1;
+    // 虚拟主机的路由配置文件，没有指定时所有请求都在 /var/www/html 下查找
+    const char* route_config = NULL;
+    // 访问日志文件，没有指定时不记录
+    const char* access_log_file = NULL;
+    // 跟踪文件，退出时把记录的区间以 Chrome trace-event JSON 格式写入，只有定义了 HTTP_TRACE 时可用
+    const char* trace_file = NULL;
+    // HTTPS 的证书链和私钥（PEM 格式），指定之后所有连接都使用 TLS，只有定义了 HTTP_TLS 时可用。
+    // 默认尝试启用 kTLS，ktls 为 false 时总是在用户态加密（read + SSL_write），用于对比
+    const char* tls_cert = NULL;
+    const char* tls_key = NULL;
+    bool ktls = true;
+    // 线程固定运行的 CPU 列表（cpulist 格式，如 0-3,8），以及按照哪块网卡的中断所在的 CPU 放置事件循环线程
+    const char* cpu_option = NULL;
+    const char* irq_nic = NULL;
+    int opt;
+    optind = 3;
+    while( ( opt = getopt( argc, argv, "m:t:f:sb:a:d:q:c:l:T:C:k:UA:R:E:PB:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'm':
+                owned = ( strcmp( optarg, "owned" ) == 0 );
+                leader = ( strcmp( optarg, "leader" ) == 0 );
+                completion = ( strcmp( optarg, "proactor" ) == 0 );
+                break;
+            case 't':
+                thread_number = atoi( optarg );
+                break;
+            case 'f':
+                // 应答的发送策略：nodelay 适合交互式的小应答，cork 把头部、内容和流水线应答合并成尽量少的报文段
+                if( strcmp( optarg, "nodelay" ) == 0 )
+                {
+                    http_conn::m_flush_policy = http_conn::FLUSH_NODELAY;
+                }
+                else if( strcmp( optarg, "cork" ) == 0 )
+                {
+                    http_conn::m_flush_policy = http_conn::FLUSH_CORK;
+                }
+                break;
+            case 's':
+                // 通过 TCP_INFO 统计每个应答发送的报文段数，每个应答多一次 getsockopt 调用
+                http_conn::m_count_segments = true;
+                break;
+            case 'b':
+                backlog = atoi( optarg );
+                break;
+            case 'a':
+                accept_budget = atoi( optarg );
+                break;
+            case 'd':
+                defer_accept = atoi( optarg );
+                break;
+            case 'q':
+                queue_target_ms = atoi( optarg );
+                break;
+            case 'c':
+                route_config = optarg;
+                break;
+            case 'l':
+                access_log_file = optarg;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'C':
+                tls_cert = optarg;
+                break;
+            case 'k':
+                tls_key = optarg;
+                break;
+            case 'U':
+                ktls = false;
+                break;
+            case 'A':
+                cpu_option = optarg;
+                break;
+            case 'R':
+                irq_nic = optarg;
+                break;
+            case 'E':
+                max_threads = atoi( optarg );
+                break;
+            case 'P':
+                classify = true;
+                break;
+            case 'B':
+                take_batch = atoi( optarg );
+                break;
+            default:
+                return 1;
+        }
+    }
+    if( thread_number <= 0 || thread_number > MAX_OWNER_THREAD )
+    {
+        printf( "thread_number must be in [1, %d]\n", MAX_OWNER_THREAD );
+        return 1;
+    }
+    if( max_threads && ( max_threads < thread_number || max_threads > threadpool< http_conn >::MAX_THREADS ) )
+    {
+        printf( "max_threads must be in [thread_number, %d]\n", threadpool< http_conn >::MAX_THREADS );
+        return 1;
+    }
+    if( backlog <= 0 || accept_budget <= 0 )
+    {
+        printf( "backlog and accept_budget must be positive\n" );
+        return 1;
+    }
+
+    // 开启跟踪。必须在创建其他线程之前开启，各个线程才能在启动时登记自己的名字
+    if( trace_file )
+    {
+#ifdef HTTP_TRACE
+        tracer::start();
+        TRACE_THREAD_NAME( "reactor" );
+#else
+        printf( "tracing is not compiled in, rebuild with -DHTTP_TRACE\n" );
+        return 1;
+#endif
+    }
+
+    // 加载证书和私钥
+    tls_context* tls = NULL;
+    if( completion && ( tls_cert || tls_key ) )
+    {
+        printf( "tls is not supported in proactor mode\n" );
+        return 1;
+    }
+    if( tls_cert || tls_key )
+    {
+#ifndef HTTP_TLS
+        printf( "tls is not compiled in, rebuild with -DHTTP_TLS and link with -lssl -lcrypto\n" );
+        return 1;
+#endif
+        try
+        {
+            tls = new tls_context( tls_cert ? tls_cert : "", tls_key ? tls_key : "", ktls );
+        }
+        catch( ... )
+        {
+            printf( "cannot load tls certificate %s and key %s\n", tls_cert ? tls_cert : "(none)", tls_key ? tls_key : "(none)" );
+            return 1;
+        }
+        http_conn::m_tls_context = tls;
+    }
+
+    // 加载路由表
+    route_table* routes = route_config ? route_table::load( route_config ) : route_table::single( "/var/www/html" );
+    if( ! routes )
+    {
+        return 1;
+    }
+    http_conn::m_routes.replace( routes );
+
     // 忽略 SIGPIPE 信号
     addsig( SIGPIPE, SIG_IGN );
+    // 收到 SIGINT、SIGTERM 时退出主循环并输出统计信息，收到 SIGHUP 时重新加载路由配置，收到 SIGUSR1 时输出线程池的运行统计。
+    // 创建其他线程之前先屏蔽这些信号，保证它们只会递送给主线程
+    addsig( SIGINT, stop_handler, false );
+    addsig( SIGTERM, stop_handler, false );
+    addsig( SIGHUP, reload_handler, false );
+    addsig( SIGUSR1, stats_handler, false );
+    sigset_t stop_mask;
+    sigemptyset( &stop_mask );
+    sigaddset( &stop_mask, SIGINT );
+    sigaddset( &stop_mask, SIGTERM );
+    sigaddset( &stop_mask, SIGHUP );
+    sigaddset( &stop_mask, SIGUSR1 );
+    pthread_sigmask( SIG_BLOCK, &stop_mask, NULL );
 
-    // 创建线程池
+    // 创建访问日志，它的后台线程同样不接收上面屏蔽的信号
+    access_log* log = NULL;
+    if( access_log_file )
+    {
+        try
+        {
+            log = new access_log( access_log_file );
+        }
+        catch( ... )
+        {
+            printf( "cannot open access log %s\n", access_log_file );
+            return 1;
+        }
+        http_conn::m_access_log = log;
+    }
+
+    // 线程的放置。事件循环线程（oneshot 模式下的主线程、owned 模式下的各个线程）放在网卡中断所在的 CPU 上（-R），
+    // 或者 -A 指定的 CPU 上；oneshot 模式的工作线程放在 -A 指定的 CPU 上，只指定了 -R 时放在主线程所在节点的所有 CPU 上
+    cpu_list cpus;
+    if( cpu_option && ! cpus.parse( cpu_option ) )
+    {
+        printf( "bad cpu list %s\n", cpu_option );
+        return 1;
+    }
+    cpu_list irq_cpus;
+    if( irq_nic && ! affinity::irq_cpus( irq_nic, &irq_cpus ) )
+    {
+        printf( "cannot find the interrupts of %s\n", irq_nic );
+        return 1;
+    }
+    const cpu_list& loop_cpus = irq_nic ? irq_cpus : cpus;
+    bool pinned = ! loop_cpus.empty();
+    cpu_list worker_cpus = cpus;
+    if( pinned )
+    {
+        // 主线程先固定下来，之后由它分配和第一次访问的内存（用户表、事件表、文件缓存）都来自它所在的节点
+        int cpu = loop_cpus.at( 0 );
+        affinity::pin_self( cpu );
+        printf( "reactor pinned to cpu %d (node %d)\n", cpu, affinity::node_of( cpu ) );
+        if( worker_cpus.empty() )
+        {
+            affinity::node_cpus( affinity::node_of( cpu ), &worker_cpus );
+        }
+    }
+
+    // 创建线程池，连接归属模式、领导者/追随者模式和 Proactor 模式下不需要
     threadpool< http_conn >* pool = NULL;
+    if( ! owned && ! leader && ! completion )
+    {
+        try
+        {
+            pool = new threadpool< http_conn >( thread_number, 10000, worker_cpus.empty() ? NULL : &worker_cpus );
+        }
+        catch( ... )
+        {
+            return 1;
+        }
+        pool->set_queue_delay( queue_target_ms * 1000L, 100 * 1000L );
+        if( max_threads )
+        {
+            // 排队超过 1ms 就增加线程（低于过载控制的目标值，先扩容再丢弃），每 10ms 最多增加一个；空闲 5s 的线程退出
+            pool->set_elastic( max_threads, 1000L, 10 * 1000L, 5000L );
+        }
+        pool->set_batch( take_batch );
+        if( classify )
+        {
+            // 缓存命中的请求按 8 : 2 : 1 的权重优先取出；访问磁盘和转发到上游的请求最多分别占用 thread_number - 1 和 thread_number / 2 个线程，
+            // 总有线程留给缓存命中的请求，它们的延迟不再受最慢的请求影响
+            pool->set_class( http_conn::CLASS_CACHED, 8, 0 );
+            pool->set_class( http_conn::CLASS_DISK, 2, ( thread_number > 1 ) ? thread_number - 1 : 1 );
+            pool->set_class( http_conn::CLASS_UPSTREAM, 1, ( thread_number > 1 ) ? thread_number / 2 : 1 );
+        }
+    }
+
+    // 预先为每个可能的客户连接分配一个 http_conn 对象。连接归属模式下固定了线程时，连接对象由各个线程的节点本地表提供
+    http_conn* users = NULL;
+    if( ! ( owned && pinned ) )
+    {
+        users = new http_conn[ MAX_FD ];
+        assert( users );
+    }
+
+    // 创建监听 socket
+    acceptor* listener = NULL;
     try
     {
-        pool = new threadpool< http_conn >;
+        listener = new acceptor( ip, port, backlog, defer_accept );
     }
     catch( ... )
     {
+        printf( "listen on %s:%d failed, errno is: %d\n", ip, port, errno );
         return 1;
     }
-
-    // 预先为每个可能的客户连接分配一个 http_conn 对象
-    http_conn* users = new http_conn[ MAX_FD ];
-    assert( users );
-    int user_count = 0;
-
-    // 创建 socket
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
-    struct linger tmp = { 1, 0 };
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+    int listenfd = listener->get_fd();
+    long overflows_start = 0, drops_start = 0;
+    acceptor::read_listen_drops( &overflows_start, &drops_start );
 
     int ret = 0;
-    // 初始化 socket 地址信息
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
-
-    // 绑定 socket 地址
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret >= 0 );
-
-    // 监听 socket
-    ret = listen( listenfd, 5 );
-    assert( ret >= 0 );
-
     epoll_event events[ MAX_EVENT_NUMBER ];
     int epollfd = epoll_create( 5 );    // 创建事件表
     assert( epollfd != -1 );
     addfd( epollfd, listenfd, false );  // 向 epollfd 上注册事件
     http_conn::m_epollfd = epollfd;
 
-    while( true )
+    // 创建文件信息缓存，并把它的 inotify 文件描述符注册到事件表中，文件发生变化时由主线程使缓存项失效
+    file_cache* cache = NULL;
+    try
+    {
+        cache = new file_cache;
+    }
+    catch( ... )
+    {
+        return 1;
+    }
+    http_conn::m_file_cache = cache;
+    addfd( epollfd, cache->get_fd(), false );
+
+    // 连接归属模式下，为每个线程创建自己的事件表
+    owner_thread owners[ MAX_OWNER_THREAD ];
+    if( owned )
+    {
+        for( int i = 0; i < thread_number; ++i )
+        {
+            owners[i].epollfd = epoll_create( 5 );
+            assert( owners[i].epollfd != -1 );
+            owners[i].users = users;
+            owners[i].cpu = -1;
+            owners[i].table = NULL;
+            owners[i].upstreams = new upstream_pool;
+            pthread_attr_t attr;
+            pthread_attr_init( &attr );
+            if( pinned )
+            {
+                // 线程固定在一个 CPU 上，它处理的连接对象从这个 CPU 所在的节点分配
+                owners[i].cpu = loop_cpus.at( i );
+                int node = affinity::node_of( owners[i].cpu );
+                try
+                {
+                    owners[i].table = new node_table< http_conn >( MAX_FD, node );
+                }
+                catch( ... )
+                {
+                    printf( "cannot reserve the connection table for owner %d\n", i );
+                    return 1;
+                }
+                owners[i].users = owners[i].table->data();
+                affinity::set_attr( &attr, owners[i].cpu );
+                printf( "owner %d on cpu %d (node %d)\n", i, owners[i].cpu, node );
+            }
+            ret = pthread_create( &owners[i].tid, &attr, owner_loop, &owners[i] );
+            pthread_attr_destroy( &attr );
+            assert( ret == 0 );
+        }
+    }
+
+    // 领导者/追随者模式下，连接注册到单独的事件表上，由这组线程轮流等待；主线程的事件表中只剩下监听 socket 和 inotify。
+    // 线程同时负责读取和处理，和事件循环线程一样放在网卡中断所在的 CPU 上。-B 指定领导者每次取出的事件数
+    leader_follower* lf = NULL;
+    int lf_epollfd = -1;
+    if( leader )
     {
-        // 获得等待事件数
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        lf_epollfd = epoll_create( 5 );
+        assert( lf_epollfd != -1 );
+        http_conn::m_epollfd = lf_epollfd;
+        try
+        {
+            lf = new leader_follower( thread_number, lf_epollfd, lf_event, users, pinned ? &loop_cpus : NULL, take_batch );
+        }
+        catch( ... )
+        {
+            return 1;
+        }
+    }
+
+    // Proactor 模式下创建 io_uring。监听 socket 改回阻塞的：非阻塞的监听 socket 上异步 accept 会立即以 EAGAIN 完成，而不是等待连接。
+    // inotify 描述符没有对应的异步操作，用异步 poll 等待它可读
+    proactor* ring = NULL;
+    async_acceptor acc;
+    async_watch watch;
+    if( completion )
+    {
+        try
+        {
+            ring = new proactor( 4096 );
+        }
+        catch( ... )
+        {
+            printf( "cannot create io_uring, errno is: %d\n", errno );
+            return 1;
+        }
+        fcntl( listenfd, F_SETFL, fcntl( listenfd, F_GETFL ) & ~O_NONBLOCK );
+        watch.op.handler = on_cache_event;
+        watch.op.arg = &watch;
+        watch.ring = ring;
+        watch.cache = cache;
+        ring->async_poll( cache->get_fd(), POLLIN, &watch.op );
+    }
+
+    accept_context ctx;
+    ctx.users = users;
+    ctx.owned = owned;
+    ctx.owners = owners;
+    ctx.owner_number = thread_number;
+    ctx.next_owner = 0;
+    ctx.steer = owned && irq_nic;
+    ctx.steered = 0;
+    ctx.ring = ring;
+    if( ring )
+    {
+        acc.op.handler = on_async_accept;
+        acc.op.arg = &acc;
+        acc.ring = ring;
+        acc.listenfd = listenfd;
+        acc.ctx = &ctx;
+        acc.accepted = 0;
+        ring->async_accept( listenfd, &acc.address, &acc.addrlen, &acc.op );
+    }
+    // 上一轮用完了接受连接的预算，队列中可能还有连接
+    bool accept_pending = false;
+    // 这一轮事件中等待加入线程池的请求
+    request_batch batch;
+    batch.count = 0;
+
+    // 所有线程都已创建，主线程重新接收 SIGINT、SIGTERM、SIGHUP、SIGUSR1
+    pthread_sigmask( SIG_UNBLOCK, &stop_mask, NULL );
+
+    // Proactor 模式的事件循环：提交这一轮发起的所有操作并等待完成，完成处理函数中发起下一步的操作。
+    // 信号会中断等待，使循环及时检查下面这些标志
+    while( ring && ! stop_server )
+    {
+        if( ring->run_once() < 0 )
+        {
+            printf( "io_uring failure\n" );
+            break;
+        }
+        if( reload_routes )
+        {
+            reload_routes = false;
+            reload_route_table( route_config );
+        }
+        if( dump_stats )
+        {
+            dump_stats = false;
+            printf( "proactor: submitted %ld, completions %ld, io_uring_enter calls %ld\n", ring->submitted(), ring->completed(),
+                    ring->enter_calls() );
+#ifdef LOCK_PROFILE
+            lock_profile::dump( stdout );
+#endif
+            fflush( stdout );
+        }
+    }
+
+    while( ! ring && ! stop_server )
+    {
+        // 获得等待事件数。还有连接等待接受时不阻塞，处理完已经就绪的事件之后马上继续接受
+        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, accept_pending ? 0 : -1 );
         if ( ( number < 0 ) && ( errno != EINTR ) )
         {
             printf( "epoll failure\n" );
             break;
         }
 
+        // 重新加载路由配置
+        if( reload_routes )
+        {
+            reload_routes = false;
+            reload_route_table( route_config );
+        }
+
+        // 输出线程池的运行统计，用于在负载下观察排队时间和线程的忙碌程度
+        if( dump_stats )
+        {
+            dump_stats = false;
+            if( pool || lf )
+            {
+                pool_stats* stats = new pool_stats;
+                if( pool )
+                {
+                    pool->stats( stats );
+                }
+                else
+                {
+                    lf->stats( stats );
+                }
+                stats->print( stdout );
+                fflush( stdout );
+                delete stats;
+            }
+#ifdef LOCK_PROFILE
+            // 各个锁的竞争统计，找出是哪一把锁上的等待最多
+            lock_profile::dump( stdout );
+#endif
+        }
+
         for ( int i = 0; i < number; i++ )
         {
             int sockfd = events[i].data.fd;
-            // 如果就绪的文件描述符是 listenfd，则处理新的连接
+            // 如果就绪的文件描述符是 listenfd，则记下有新连接等待接受
             if( sockfd == listenfd )
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                // 从等待队列中选择一个客户端的 socket，用该 socket 来与被接受连接的客户端进行通信
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                // 接收客户端连接失败
-                if ( connfd < 0 )
+                accept_pending = true;
+            }
+            else if( sockfd == cache->get_fd() )
+            {
+                cache->process_events();
+            }
+            else if( users[sockfd].waiting_upstream() )
+            {
+                // 代理请求在等待上游服务器，这个事件来自上游连接：继续建立连接、发送请求、读取应答头部或者转发消息体。
+                // 这些操作都是非阻塞的，所以直接在主线程中完成
+                if( ! users[sockfd].upstream_event() )
                 {
-                    printf( "errno is: %d\n", errno );
-                    continue;
+                    users[sockfd].close_conn();
+                }
+                else if( users[sockfd].has_buffered_request() )
+                {
+                    queue_request( pool, &batch, users + sockfd, classify ? users[sockfd].request_class() : 0 );
                 }
-                // 客户数量太多
-                if( http_conn::m_user_count >= MAX_FD )
+            }
+            else if( users[sockfd].websocket() )
+            {
+                // WebSocket 连接的读写（包括对方关闭连接）都由工作线程处理。广播的线程可能在事件到达之后、
+                // 工作线程接手之前替连接重新注册过事件，这样产生的重复事件被 claim 过滤掉
+                if( users[sockfd].claim() && ! pool->append( users + sockfd ) )
                 {
-                    show_error( connfd, "Internal server busy" );
-                    continue;
+                    users[sockfd].close_conn();
                 }
-                // 初始化客户连接
-                users[connfd].init( connfd, client_address );
             }
             else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
             {
@@ -149,8 +907,8 @@ int main( int argc, char* argv[] )
                 // 根据读的结果，决定是将任务添加到线程池，还是关闭连接
                 if( users[sockfd].read() )
                 {
-                    // 添加到线程池中
-                    pool->append( users + sockfd );
+                    // 攒下来，这一轮事件处理完时成批地添加到线程池中
+                    queue_request( pool, &batch, users + sockfd, classify ? users[sockfd].request_class() : 0 );
                 }
                 else
                 {
@@ -166,15 +924,127 @@ int main( int argc, char* argv[] )
                     // 关闭连接
                     users[sockfd].close_conn();
                 }
+                else if( users[sockfd].has_buffered_request() )
+                {
+                    // 读缓冲中还有流水线请求，直接交给线程池处理
+                    queue_request( pool, &batch, users + sockfd, classify ? users[sockfd].request_class() : 0 );
+                }
             }
             else
             {}
         }
+        if( batch.count > 0 )
+        {
+            flush_requests( pool, &batch );
+        }
+
+        // 其他就绪事件都处理完之后再成批接受新连接，每轮最多 accept_budget 个
+        if( accept_pending )
+        {
+            TRACE_SPAN( "accept", listenfd );
+            accept_pending = listener->accept_batch( accept_budget, on_accept, &ctx );
+        }
+    }
+
+    // 等待连接归属模式下的线程退出
+    if( owned )
+    {
+        for( int i = 0; i < thread_number; ++i )
+        {
+            pthread_join( owners[i].tid, NULL );
+            close( owners[i].epollfd );
+            delete owners[i].table;
+            delete owners[i].upstreams;
+        }
+        if( ctx.steer )
+        {
+            printf( "connections steered by incoming cpu: %ld\n", ctx.steered );
+        }
+    }
+
+    // 等待领导者/追随者模式下的线程退出
+    if( lf )
+    {
+        pool_stats* stats = new pool_stats;
+        lf->stats( stats );
+        delete lf;
+        close( lf_epollfd );
+        stats->print( stdout );
+        delete stats;
+    }
+
+    // Proactor 模式下每个请求的系统调用只有 io_uring_enter（加上 sendfile 管道的创建、文件的 open 和 close 等），和 epoll 模式下的
+    // epoll_wait、recv、send、sendfile 相比较
+    if( ring )
+    {
+        long served = http_conn::m_request_count;
+        printf( "proactor: accepted %ld, submitted %ld, completions %ld, io_uring_enter calls %ld, per request %.2f\n", acc.accepted,
+                ring->submitted(), ring->completed(), ring->enter_calls(), served ? ( double )ring->enter_calls() / served : 0.0 );
+    }
+
+    long requests = http_conn::m_request_count;
+    long epoll_ctls = http_conn::m_epoll_ctl_count;
+    printf( "requests: %ld, epoll_ctl calls: %ld, epoll_ctl per request: %.2f\n", requests, epoll_ctls,
+            requests ? ( double )epoll_ctls / requests : 0.0 );
+    long overflows_end = 0, drops_end = 0;
+    acceptor::read_listen_drops( &overflows_end, &drops_end );
+    printf( "accepted: %ld, accept budget exhausted: %ld, listen overflows: %ld, listen drops: %ld\n",
+            listener->accepted(), listener->exhausted(), overflows_end - overflows_start, drops_end - drops_start );
+    if( pool )
+    {
+        printf( "shed requests: %ld\n", pool->shed_count() );
+        if( max_threads )
+        {
+            printf( "pool threads: %d, grown: %ld, retired: %ld\n", pool->thread_count(), pool->grown_count(), pool->retired_count() );
+        }
+        if( classify )
+        {
+            printf( "requests by class: cached %ld, disk %ld, upstream %ld\n", pool->class_count( http_conn::CLASS_CACHED ),
+                    pool->class_count( http_conn::CLASS_DISK ), pool->class_count( http_conn::CLASS_UPSTREAM ) );
+        }
+        pool_stats* stats = new pool_stats;
+        pool->stats( stats );
+        stats->print( stdout );
+        delete stats;
     }
+    if( log )
+    {
+        printf( "access log records: %ld written, %ld dropped\n", log->written(), log->dropped() );
+    }
+    if( tls )
+    {
+        printf( "tls handshakes: %ld, ktls enabled: %ld\n", http_conn::m_tls_handshakes.load(), http_conn::m_ktls_count.load() );
+    }
+#ifdef HTTP_COROUTINE
+    printf( "coroutine frames allocated from heap: %ld\n", frame_pool::heap_allocations() );
+#endif
+    if( http_conn::m_count_segments )
+    {
+        long responses = http_conn::m_response_count;
+        long segments = http_conn::m_segment_count;
+        printf( "responses: %ld, segments: %ld, segments per response: %.2f\n", responses, segments,
+                responses ? ( double )segments / responses : 0.0 );
+    }
+
+#ifdef LOCK_PROFILE
+    // 在释放线程池等对象之前输出，它们的锁届时会从登记表中移除
+    lock_profile::dump( stdout );
+#endif
 
     close( epollfd );   // 关闭事件表
-    close( listenfd );  // 关闭 socket 连接
+    delete listener;    // 关闭监听 socket
+    delete pool;        // 等待所有工作线程退出，之后才能释放它们正在使用的用户表
+    delete ring;        // 关闭 io_uring，取消进行中的操作，之后才能释放它们使用的读写缓冲
     delete [] users;    // 释放用户表资源
-    delete pool;        // 释放线程池资源
+    delete cache;       // 释放文件信息缓存
+    http_conn::m_routes.replace( NULL );    // 释放路由表，连接持有的引用已经随用户表释放
+    delete log;         // 写出剩下的访问日志
+    delete tls;         // 释放 TLS 配置，所有连接的 SSL 对象已经随用户表释放
+#ifdef HTTP_TRACE
+    if( trace_file && tracer::dump( trace_file ) )
+    {
+        printf( "trace written to %s\n", trace_file );
+    }
+#endif
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,363 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <exception>
+#include <atomic>
+#include <map>
+#include <string>
+#include "chapter14/14_2_locker.h"
+
+/* 缓存的文件信息。exists 为 false 表示文件不存在（负缓存），这样反复请求不存在的文件也不必每次都调用 stat */
+struct file_meta
+{
+    bool exists;
+    struct stat st;
+};
+
+/* 文件信息缓存：以规范化之后的完整路径为键，保存 stat 的结果。
+哈希表被分成 SHARD_NUMBER 个分片，每个分片由自己的互斥锁保护，工作线程并发查找时只会在同一个分片上竞争。
+缓存用 inotify 监视路径上的每一级目录，文件被修改、删除、重命名时由 process_events 使对应的缓存项失效。 */
+class file_cache
+{
+public:
+    // 路径的最大长度，与 http_conn::FILENAME_LEN 一致
+    static const int PATH_LEN = 200;
+    // 分片数量
+    static const int SHARD_NUMBER = 16;
+    // 每个分片的哈希桶数量
+    static const int BUCKET_NUMBER = 1024;
+    // 每个分片最多缓存的文件数，超过时清空该分片，防止大量随机的 404 请求耗尽内存
+    static const int MAX_ENTRIES = 4096;
+
+private:
+    /* 哈希链表的节点 */
+    struct entry
+    {
+        char path[ PATH_LEN ];
+        unsigned int hash;
+        file_meta meta;
+        entry* next;
+    };
+
+    /* 一个分片：哈希桶数组、其中的缓存项数和保护它们的互斥锁 */
+    struct shard
+    {
+        entry* buckets[ BUCKET_NUMBER ];
+        int count;
+        locker lock;
+    };
+
+public:
+    file_cache() : m_inotifyfd( -1 ), m_generation( 0 )
+    {
+        m_inotifyfd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+        if( m_inotifyfd < 0 )
+        {
+            throw std::exception();
+        }
+        for( int i = 0; i < SHARD_NUMBER; ++i )
+        {
+            memset( m_shards[i].buckets, 0, sizeof( m_shards[i].buckets ) );
+            m_shards[i].count = 0;
+            m_shards[i].lock.set_name( "file_cache shard" );
+        }
+        m_watchlocker.set_name( "file_cache watch" );
+    }
+
+    ~file_cache()
+    {
+        for( int i = 0; i < SHARD_NUMBER; ++i )
+        {
+            clear_shard( m_shards[i] );
+        }
+        close( m_inotifyfd );
+    }
+
+    /* 返回 inotify 文件描述符，由主线程把它注册到 epoll 内核事件表中 */
+    int get_fd() const { return m_inotifyfd; }
+
+    /* 查找 path 对应的文件信息。path 的前 root_len 个字符是网站根目录，只监视根目录及其下面的目录。
+    命中缓存时不需要任何系统调用；未命中时调用 stat，并把结果（包括文件不存在）放入缓存。
+    返回值表示文件是否存在，存在时 st 中保存文件的状态。 */
+    bool lookup( const char* path, int root_len, struct stat* st )
+    {
+        unsigned int hash = hash_path( path );
+        shard& s = m_shards[ hash % SHARD_NUMBER ];
+
+        s.lock.lock();
+        for( entry* e = s.buckets[ ( hash / SHARD_NUMBER ) % BUCKET_NUMBER ]; e; e = e->next )
+        {
+            if( e->hash == hash && strcmp( e->path, path ) == 0 )
+            {
+                bool exists = e->meta.exists;
+                if( exists )
+                {
+                    *st = e->meta.st;
+                }
+                s.lock.unlock();
+                return exists;
+            }
+        }
+        s.lock.unlock();
+
+        // 先监视路径上的目录再调用 stat，这样 stat 之后发生的修改一定会产生 inotify 事件。
+        // 只有路径上的目录都被监视之后才能缓存，否则之后的修改无法使缓存项失效
+        unsigned int generation = m_generation.load();
+        bool watched = watch_dirs( path, root_len );
+        file_meta meta;
+        meta.exists = ( stat( path, &meta.st ) == 0 );
+        if( ! meta.exists && errno != ENOENT && errno != ENOTDIR )
+        {
+            // 权限不足等其他错误不缓存
+            return false;
+        }
+        // 如果在 stat 和插入之间处理过 inotify 事件，刚得到的结果可能已经过时，不放入缓存
+        if( watched && generation == m_generation.load() )
+        {
+            insert( path, hash, meta );
+        }
+        if( meta.exists )
+        {
+            *st = meta.st;
+        }
+        return meta.exists;
+    }
+
+    /* path 的文件信息是否已经在缓存中（包括文件不存在的结果）。只查找，不调用 stat，主线程用它预先判断请求是否需要访问磁盘 */
+    bool cached( const char* path )
+    {
+        unsigned int hash = hash_path( path );
+        shard& s = m_shards[ hash % SHARD_NUMBER ];
+        bool found = false;
+        s.lock.lock();
+        for( entry* e = s.buckets[ ( hash / SHARD_NUMBER ) % BUCKET_NUMBER ]; e && ! found; e = e->next )
+        {
+            found = ( e->hash == hash && strcmp( e->path, path ) == 0 );
+        }
+        s.lock.unlock();
+        return found;
+    }
+
+    /* 处理 inotify 事件，使被修改的文件和目录的缓存项失效。inotify 文件描述符是非阻塞的，循环读取直到没有事件为止 */
+    void process_events()
+    {
+        char buf[ 4096 ] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+        while( true )
+        {
+            int len = read( m_inotifyfd, buf, sizeof( buf ) );
+            if( len <= 0 )
+            {
+                break;
+            }
+            for( char* ptr = buf; ptr < buf + len; )
+            {
+                struct inotify_event* event = ( struct inotify_event* )ptr;
+                ptr += sizeof( struct inotify_event ) + event->len;
+                handle_event( event );
+            }
+        }
+    }
+
+private:
+    /* FNV-1a 哈希 */
+    static unsigned int hash_path( const char* path )
+    {
+        unsigned int hash = 2166136261u;
+        for( ; *path; ++path )
+        {
+            hash = ( hash ^ ( unsigned char )*path ) * 16777619u;
+        }
+        return hash;
+    }
+
+    /* 监视根目录到 path 所在目录之间的每一级目录。对同一个目录重复调用 inotify_add_watch 会返回同一个监视描述符 */
+    bool watch_dirs( const char* path, int root_len )
+    {
+        char dir[ PATH_LEN ];
+        const uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM
+                              | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+        const char* slash = path + root_len;
+        while( ( slash = strchr( slash, '/' ) ) )
+        {
+            int len = slash - path;
+            memcpy( dir, path, len );
+            dir[ len ] = '\0';
+            if( len == 0 )
+            {
+                strcpy( dir, "/" );
+            }
+            int wd = inotify_add_watch( m_inotifyfd, dir, mask );
+            if( wd < 0 )
+            {
+                return false;
+            }
+            m_watchlocker.lock();
+            m_watches[ wd ] = dir;
+            m_watchlocker.unlock();
+            ++slash;
+        }
+        return true;
+    }
+
+    /* 插入一个缓存项。并发未命中时可能已经有其他线程插入了同一个路径，此时用新结果覆盖 */
+    void insert( const char* path, unsigned int hash, const file_meta& meta )
+    {
+        if( strlen( path ) >= PATH_LEN )
+        {
+            return;
+        }
+        shard& s = m_shards[ hash % SHARD_NUMBER ];
+        entry*& head = s.buckets[ ( hash / SHARD_NUMBER ) % BUCKET_NUMBER ];
+        s.lock.lock();
+        for( entry* e = head; e; e = e->next )
+        {
+            if( e->hash == hash && strcmp( e->path, path ) == 0 )
+            {
+                e->meta = meta;
+                s.lock.unlock();
+                return;
+            }
+        }
+        if( s.count >= MAX_ENTRIES )
+        {
+            clear_shard( s );
+        }
+        entry* e = new entry;
+        strcpy( e->path, path );
+        e->hash = hash;
+        e->meta = meta;
+        e->next = head;
+        head = e;
+        ++s.count;
+        s.lock.unlock();
+    }
+
+    /* 使 path 对应的缓存项失效 */
+    void invalidate( const char* path )
+    {
+        unsigned int hash = hash_path( path );
+        shard& s = m_shards[ hash % SHARD_NUMBER ];
+        s.lock.lock();
+        for( entry** e = &s.buckets[ ( hash / SHARD_NUMBER ) % BUCKET_NUMBER ]; *e; e = &( *e )->next )
+        {
+            if( ( *e )->hash == hash && strcmp( ( *e )->path, path ) == 0 )
+            {
+                entry* tmp = *e;
+                *e = tmp->next;
+                delete tmp;
+                --s.count;
+                break;
+            }
+        }
+        s.lock.unlock();
+    }
+
+    /* 使所有以 prefix 开头的缓存项失效，用于目录被删除或重命名的情况。需要遍历整个缓存，但这种事件很少发生 */
+    void invalidate_prefix( const char* prefix )
+    {
+        int len = strlen( prefix );
+        for( int i = 0; i < SHARD_NUMBER; ++i )
+        {
+            shard& s = m_shards[i];
+            s.lock.lock();
+            for( int j = 0; j < BUCKET_NUMBER; ++j )
+            {
+                for( entry** e = &s.buckets[j]; *e; )
+                {
+                    if( strncmp( ( *e )->path, prefix, len ) == 0 )
+                    {
+                        entry* tmp = *e;
+                        *e = tmp->next;
+                        delete tmp;
+                        --s.count;
+                    }
+                    else
+                    {
+                        e = &( *e )->next;
+                    }
+                }
+            }
+            s.lock.unlock();
+        }
+    }
+
+    /* 删除分片中的所有缓存项，除析构函数之外，调用者需要持有该分片的锁 */
+    static void clear_shard( shard& s )
+    {
+        for( int j = 0; j < BUCKET_NUMBER; ++j )
+        {
+            while( s.buckets[j] )
+            {
+                entry* tmp = s.buckets[j];
+                s.buckets[j] = tmp->next;
+                delete tmp;
+            }
+        }
+        s.count = 0;
+    }
+
+    void handle_event( struct inotify_event* event )
+    {
+        ++m_generation;
+        // 事件队列溢出，丢失了部分事件，只能清空整个缓存
+        if( event->mask & IN_Q_OVERFLOW )
+        {
+            invalidate_prefix( "" );
+            return;
+        }
+
+        m_watchlocker.lock();
+        std::map< int, std::string >::iterator it = m_watches.find( event->wd );
+        if( it == m_watches.end() )
+        {
+            m_watchlocker.unlock();
+            return;
+        }
+        std::string dir = it->second;
+        // 目录被删除之后内核自动移除监视，发送 IN_IGNORED 事件
+        if( event->mask & IN_IGNORED )
+        {
+            m_watches.erase( it );
+        }
+        m_watchlocker.unlock();
+
+        if( dir != "/" )
+        {
+            dir += "/";
+        }
+        if( event->len > 0 )
+        {
+            // 目录中的某个文件或子目录发生了变化
+            std::string path = dir + event->name;
+            invalidate( path.c_str() );
+            if( event->mask & IN_ISDIR )
+            {
+                invalidate_prefix( ( path + "/" ).c_str() );
+            }
+        }
+        else if( event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) )
+        {
+            // 被监视的目录本身被删除或重命名
+            invalidate_prefix( dir.c_str() );
+        }
+    }
+
+private:
+    // inotify 文件描述符
+    int m_inotifyfd;
+    // 每处理一个 inotify 事件加 1，用来发现与事件处理并发的 stat 结果
+    std::atomic< unsigned int > m_generation;
+    // 缓存的分片
+    shard m_shards[ SHARD_NUMBER ];
+    // 监视描述符到目录路径的映射，以及保护它的互斥锁
+    std::map< int, std::string > m_watches;
+    locker m_watchlocker;
+};
+
+#endif
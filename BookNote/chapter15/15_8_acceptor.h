@@ -0,0 +1,174 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <exception>
+
+/* 监听 socket 的封装：负责创建监听 socket，并在每次 EPOLLIN 时用 accept4 成批接受新连接。
+监听 socket 以 ET 模式注册，一次事件可能对应队列中的多个连接，所以每次都要尽量把队列取空；
+但为了不让连接风暴饿死已有连接，每轮最多接受 budget 个，剩下的留到处理完其他事件之后再接受。 */
+class acceptor
+{
+public:
+    /* 新连接的回调函数，connfd 已经是非阻塞的，arg 是调用 accept_batch 时传入的参数 */
+    typedef void ( *conn_callback )( int connfd, const sockaddr_in& addr, void* arg );
+
+    /* 参数 backlog 是 listen 的全连接队列长度，defer_accept 大于 0 时设置 TCP_DEFER_ACCEPT，
+    连接只有在收到客户数据之后才会出现在队列中，最多等待 defer_accept 秒 */
+    acceptor( const char* ip, int port, int backlog, int defer_accept )
+        : m_listenfd( -1 ), m_idlefd( -1 ), m_accepted( 0 ), m_exhausted( 0 )
+    {
+        m_listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+        if( m_listenfd < 0 )
+        {
+            throw std::exception();
+        }
+        // 注意不能设置 SO_LINGER 为 { 1, 0 }：该选项会被连接 socket 继承，close 时直接发送 RST 并丢弃发送缓冲中尚未发出的数据，
+        // 大文件应答的最后一段会因此被截断
+        // 服务器主动关闭的连接会进入 TIME_WAIT 状态，设置 SO_REUSEADDR 使得服务器重启后能立即重新绑定端口
+        int reuse = 1;
+        setsockopt( m_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+        if( defer_accept > 0 )
+        {
+            setsockopt( m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof( defer_accept ) );
+        }
+
+        struct sockaddr_in address;
+        bzero( &address, sizeof( address ) );
+        address.sin_family = AF_INET;
+        inet_pton( AF_INET, ip, &address.sin_addr );
+        address.sin_port = htons( port );
+        if( bind( m_listenfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0
+            || listen( m_listenfd, backlog ) < 0 )
+        {
+            close( m_listenfd );
+            throw std::exception();
+        }
+
+        // 预留一个文件描述符。进程的文件描述符耗尽时 accept 返回 EMFILE，但连接仍留在队列中，ET 模式下不会再有新的事件，
+        // 这时先关闭预留的描述符，接受并立即关闭该连接，再重新预留
+        m_idlefd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+    }
+
+    ~acceptor()
+    {
+        close( m_listenfd );
+        if( m_idlefd >= 0 )
+        {
+            close( m_idlefd );
+        }
+    }
+
+    int get_fd() const { return m_listenfd; }
+    // 累计接受的连接数
+    long accepted() const { return m_accepted; }
+    // 因为用完预算而留下连接的轮数
+    long exhausted() const { return m_exhausted; }
+
+    /* 最多接受 budget 个连接，对每个连接调用 cb。返回 true 表示预算已用完而队列中可能还有连接，
+    调用者应该在处理完其他就绪事件之后再次调用；返回 false 表示队列已经取空 */
+    bool accept_batch( int budget, conn_callback cb, void* arg )
+    {
+        for( int i = 0; i < budget; ++i )
+        {
+            struct sockaddr_in client_address;
+            socklen_t client_addrlength = sizeof( client_address );
+            // accept4 直接返回非阻塞的连接 socket，省去了之后的两次 fcntl 调用
+            int connfd = accept4( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC );
+            if( connfd < 0 )
+            {
+                if( errno == EINTR || errno == ECONNABORTED )
+                {
+                    continue;
+                }
+                if( ( errno == EMFILE || errno == ENFILE ) && m_idlefd >= 0 )
+                {
+                    close( m_idlefd );
+                    connfd = accept( m_listenfd, NULL, NULL );
+                    if( connfd >= 0 )
+                    {
+                        close( connfd );
+                    }
+                    m_idlefd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+                    continue;
+                }
+                if( errno != EAGAIN && errno != EWOULDBLOCK )
+                {
+                    printf( "accept errno is: %d\n", errno );
+                }
+                return false;
+            }
+            ++m_accepted;
+            cb( connfd, client_address, arg );
+        }
+        ++m_exhausted;
+        return true;
+    }
+
+    /* 从 /proc/net/netstat 读取全连接队列溢出（ListenOverflows）和因此丢弃的 SYN（ListenDrops）的累计次数，
+    它们是整个系统的计数，比较启动和退出时的值就能知道运行期间发生了多少次 */
+    static bool read_listen_drops( long* overflows, long* drops )
+    {
+        FILE* fp = fopen( "/proc/net/netstat", "r" );
+        if( ! fp )
+        {
+            return false;
+        }
+        // 该文件中每组计数由两行组成：第一行是名字，第二行是对应的值
+        static const int LINE_LEN = 8192;
+        char* names = new char[ LINE_LEN ];
+        char* values = new char[ LINE_LEN ];
+        bool found = false;
+        while( ! found && fgets( names, LINE_LEN, fp ) && fgets( values, LINE_LEN, fp ) )
+        {
+            if( strncmp( names, "TcpExt:", 7 ) != 0 )
+            {
+                continue;
+            }
+            char* name_save = NULL;
+            char* value_save = NULL;
+            char* name = strtok_r( names, " \n", &name_save );
+            char* value = strtok_r( values, " \n", &value_save );
+            while( name && value )
+            {
+                if( strcmp( name, "ListenOverflows" ) == 0 )
+                {
+                    *overflows = atol( value );
+                }
+                else if( strcmp( name, "ListenDrops" ) == 0 )
+                {
+                    *drops = atol( value );
+                }
+                name = strtok_r( NULL, " \n", &name_save );
+                value = strtok_r( NULL, " \n", &value_save );
+            }
+            found = true;
+        }
+        delete [] names;
+        delete [] values;
+        fclose( fp );
+        return found;
+    }
+
+private:
+    // 监听 socket
+    int m_listenfd;
+    // 预留的文件描述符
+    int m_idlefd;
+    // 统计信息
+    long m_accepted;
+    long m_exhausted;
+};
+
+#endif
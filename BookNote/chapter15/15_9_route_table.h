@@ -0,0 +1,407 @@
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "chapter14/14_2_locker.h"
+#include "chapter15/15_10_upstream.h"
+
+/* 一条路由：Host 为 host 且规范化之后的 URL 以 prefix 开头的请求，到 root 目录下查找文件，或者转发给上游服务器 backend。
+例如 prefix 为 "/static/"、root 为 "/srv/static" 时，"/static/a.css" 对应的文件是 "/srv/static/a.css" */
+struct route
+{
+    std::string host;
+    std::string prefix;
+    std::string root;
+    // 为 true 时该路由是反向代理，请求被原样转发给 backend
+    bool proxy;
+    upstream backend;
+};
+
+/* 路由表：启动或重新加载配置时一次性构建，之后只读，所以工作线程查找时不需要加锁。
+主机名用完美哈希定位（构建时选择一个没有冲突的哈希种子，查找时只需计算一次哈希、比较一次字符串），
+每个主机的 URL 前缀保存在一棵基数树中，查找时沿着树走一遍即可得到最长匹配的前缀。
+路由表带有引用计数，由 route_holder 发布：请求在使用它返回的 route 期间一直持有引用，重新加载配置之后旧表在最后一个引用释放时才被删除 */
+class route_table
+{
+private:
+    /* 基数树的节点：label 是从父节点到该节点的边上的字符串，value 非空表示从根到该节点的前缀对应一条路由 */
+    struct radix_node
+    {
+        std::string label;
+        const route* value;
+        std::vector< radix_node* > children;
+
+        radix_node() : value( NULL ) {}
+        ~radix_node()
+        {
+            for( size_t i = 0; i < children.size(); ++i )
+            {
+                delete children[i];
+            }
+        }
+    };
+
+    /* 一个主机：主机名和它的 URL 前缀树 */
+    struct vhost
+    {
+        std::string name;
+        radix_node tree;
+    };
+
+public:
+    // 配置文件中一行的最大长度
+    static const int LINE_LEN = 1024;
+
+    // 增加一个引用
+    void acquire()
+    {
+        m_refs.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    // 释放一个引用，最后一个引用释放时删除路由表
+    void release()
+    {
+        if( m_refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+        {
+            delete this;
+        }
+    }
+
+private:
+    // 只能通过 release 删除
+    ~route_table()
+    {
+        for( size_t i = 0; i < m_hosts.size(); ++i )
+        {
+            delete m_hosts[i];
+        }
+        for( size_t i = 0; i < m_routes.size(); ++i )
+        {
+            delete m_routes[i];
+        }
+    }
+
+public:
+    /* 只有一条路由的路由表：所有主机的所有 URL 都在 root 下查找 */
+    static route_table* single( const char* root )
+    {
+        route_table* table = new route_table;
+        table->add_route( "*", "/", root, NULL );
+        table->build();
+        return table;
+    }
+
+    /* 从配置文件加载路由表。每行依次是主机名、URL 前缀和目标，用空白字符分隔，主机名为 "*" 的路由用于没有匹配到任何主机的请求，
+    '#' 开头的行是注释。目标以 '/' 开头时是根目录，否则是反向代理的上游地址（"unix:/path" 或 "ip:port"）。例如：
+        example.com   /          /var/www/example
+        example.com   /static/   /srv/static
+        example.com   /api/      unix:/run/app.sock
+        *             /          /var/www/html
+    格式错误时返回 NULL。返回的路由表带有一个引用 */
+    static route_table* load( const char* filename )
+    {
+        FILE* fp = fopen( filename, "r" );
+        if( ! fp )
+        {
+            printf( "cannot open route config %s\n", filename );
+            return NULL;
+        }
+        route_table* table = new route_table;
+        char line[ LINE_LEN ];
+        int lineno = 0;
+        while( fgets( line, LINE_LEN, fp ) )
+        {
+            ++lineno;
+            char host[ LINE_LEN ], prefix[ LINE_LEN ], target[ LINE_LEN ];
+            char* text = line + strspn( line, " \t" );
+            if( *text == '#' || *text == '\n' || *text == '\0' )
+            {
+                continue;
+            }
+            upstream backend;
+            if( sscanf( text, "%s %s %s", host, prefix, target ) != 3 || prefix[0] != '/'
+                || ( target[0] != '/' && ! upstream::parse( target, &backend ) ) )
+            {
+                printf( "bad route at %s:%d\n", filename, lineno );
+                fclose( fp );
+                delete table;
+                return NULL;
+            }
+            table->add_route( host, prefix, target, ( target[0] == '/' ) ? NULL : &backend );
+        }
+        fclose( fp );
+        table->build();
+        return table;
+    }
+
+    /* 查找 host 上与 path 最长匹配的路由。host 可以带端口号，不区分大小写；没有匹配的主机时使用 "*" 主机。找不到时返回 NULL */
+    const route* match( const char* host, const char* path ) const
+    {
+        const vhost* vh = NULL;
+        if( host && ! m_slots.empty() )
+        {
+            int len = strcspn( host, ": \t" );
+            const vhost* candidate = m_slots[ hash_host( host, len, m_seed ) & ( m_slots.size() - 1 ) ];
+            if( candidate && ( int )candidate->name.size() == len && strncasecmp( candidate->name.c_str(), host, len ) == 0 )
+            {
+                vh = candidate;
+            }
+        }
+        if( ! vh )
+        {
+            vh = m_default;
+        }
+        return vh ? longest_prefix( &vh->tree, path ) : NULL;
+    }
+
+private:
+    route_table() : m_refs( 1 ), m_seed( 0 ), m_default( NULL ) {}
+
+    /* 主机名的哈希函数（FNV-1a，加入种子，不区分大小写） */
+    static unsigned int hash_host( const char* host, int len, unsigned int seed )
+    {
+        unsigned int hash = 2166136261u ^ seed;
+        for( int i = 0; i < len; ++i )
+        {
+            hash = ( hash ^ ( unsigned char )tolower( host[i] ) ) * 16777619u;
+        }
+        return hash;
+    }
+
+    /* 添加一条路由，backend 不为空时是反向代理路由 */
+    void add_route( const char* host, const char* prefix, const char* root, const upstream* backend )
+    {
+        route* r = new route;
+        r->host = host;
+        for( size_t i = 0; i < r->host.size(); ++i )
+        {
+            r->host[i] = tolower( r->host[i] );
+        }
+        // 前缀总是以 '/' 结尾，这样 "/api" 不会匹配到 "/apix"
+        r->prefix = prefix;
+        if( r->prefix[ r->prefix.size() - 1 ] != '/' )
+        {
+            r->prefix += '/';
+        }
+        // 根目录去掉结尾的 '/'，与以 '/' 开头的剩余路径直接拼接（根目录为 "/" 时变成空串）
+        r->root = root;
+        while( ! r->root.empty() && r->root[ r->root.size() - 1 ] == '/' )
+        {
+            r->root.erase( r->root.size() - 1 );
+        }
+        r->proxy = ( backend != NULL );
+        if( backend )
+        {
+            r->backend = *backend;
+        }
+        m_routes.push_back( r );
+
+        vhost* vh = find_host( r->host );
+        if( ! vh )
+        {
+            vh = new vhost;
+            vh->name = r->host;
+            m_hosts.push_back( vh );
+        }
+        insert( &vh->tree, r->prefix, r );
+    }
+
+    vhost* find_host( const std::string& name )
+    {
+        for( size_t i = 0; i < m_hosts.size(); ++i )
+        {
+            if( m_hosts[i]->name == name )
+            {
+                return m_hosts[i];
+            }
+        }
+        return NULL;
+    }
+
+    /* 构建主机名的完美哈希表：槽位数取不小于主机数两倍的 2 的幂，依次尝试不同的种子，直到所有主机都落在不同的槽位上 */
+    void build()
+    {
+        std::vector< vhost* > named;
+        for( size_t i = 0; i < m_hosts.size(); ++i )
+        {
+            if( m_hosts[i]->name == "*" )
+            {
+                m_default = m_hosts[i];
+            }
+            else
+            {
+                named.push_back( m_hosts[i] );
+            }
+        }
+        if( named.empty() )
+        {
+            return;
+        }
+
+        size_t size = 1;
+        while( size < named.size() * 2 )
+        {
+            size <<= 1;
+        }
+        for( unsigned int seed = 1; ; ++seed )
+        {
+            // 尝试多个种子仍有冲突时扩大哈希表
+            if( seed % 64 == 0 )
+            {
+                size <<= 1;
+            }
+            m_slots.assign( size, NULL );
+            bool collision = false;
+            for( size_t i = 0; i < named.size() && ! collision; ++i )
+            {
+                const std::string& name = named[i]->name;
+                unsigned int slot = hash_host( name.c_str(), name.size(), seed ) & ( size - 1 );
+                collision = ( m_slots[ slot ] != NULL );
+                m_slots[ slot ] = named[i];
+            }
+            if( ! collision )
+            {
+                m_seed = seed;
+                return;
+            }
+        }
+    }
+
+    /* 把前缀 key 插入基数树：沿着与 key 有公共前缀的边向下走，必要时把一条边拆成两段 */
+    static void insert( radix_node* node, const std::string& key, const route* value )
+    {
+        size_t pos = 0;
+        while( pos < key.size() )
+        {
+            radix_node* next = NULL;
+            size_t common = 0;
+            for( size_t i = 0; i < node->children.size(); ++i )
+            {
+                const std::string& label = node->children[i]->label;
+                common = 0;
+                while( common < label.size() && pos + common < key.size() && label[ common ] == key[ pos + common ] )
+                {
+                    ++common;
+                }
+                if( common > 0 )
+                {
+                    next = node->children[i];
+                    break;
+                }
+            }
+
+            if( ! next )
+            {
+                // 没有公共前缀的边，直接添加一个新的叶子节点
+                radix_node* leaf = new radix_node;
+                leaf->label = key.substr( pos );
+                leaf->value = value;
+                node->children.push_back( leaf );
+                return;
+            }
+            if( common < next->label.size() )
+            {
+                // 只和边的一部分相同，把这条边拆成公共部分和剩余部分
+                radix_node* rest = new radix_node;
+                rest->label = next->label.substr( common );
+                rest->value = next->value;
+                rest->children.swap( next->children );
+                next->label.erase( common );
+                next->value = NULL;
+                next->children.push_back( rest );
+            }
+            node = next;
+            pos += common;
+        }
+        // 重复的前缀以最后一条为准
+        node->value = value;
+    }
+
+    /* 在基数树中查找与 path 最长匹配的前缀 */
+    static const route* longest_prefix( const radix_node* node, const char* path )
+    {
+        const route* best = node->value;
+        while( *path )
+        {
+            const radix_node* next = NULL;
+            for( size_t i = 0; i < node->children.size(); ++i )
+            {
+                const std::string& label = node->children[i]->label;
+                if( strncmp( label.c_str(), path, label.size() ) == 0 )
+                {
+                    next = node->children[i];
+                    break;
+                }
+            }
+            if( ! next )
+            {
+                break;
+            }
+            path += next->label.size();
+            node = next;
+            if( node->value )
+            {
+                best = node->value;
+            }
+        }
+        return best;
+    }
+
+private:
+    // 引用计数，创建时为 1
+    std::atomic< int > m_refs;
+    // 所有路由和主机，路由表析构时释放
+    std::vector< route* > m_routes;
+    std::vector< vhost* > m_hosts;
+    // 完美哈希表的种子和槽位
+    unsigned int m_seed;
+    std::vector< const vhost* > m_slots;
+    // 主机名为 "*" 的默认主机
+    const vhost* m_default;
+};
+
+/* 当前使用的路由表。取得引用和替换表都在一把自旋锁中进行，这样读取指针和增加引用计数之间旧表不会被删除；
+临界区只有几条指令，所以用 spin_locker。请求不在锁中使用路由表，而是持有取得的引用直到请求结束 */
+class route_holder
+{
+public:
+    route_holder() : m_table( NULL ) {}
+
+    // 取得当前路由表的一个引用，用完之后调用它的 release。还没有路由表时返回 NULL
+    route_table* acquire()
+    {
+        m_lock.lock();
+        route_table* table = m_table;
+        if( table )
+        {
+            table->acquire();
+        }
+        m_lock.unlock();
+        return table;
+    }
+
+    // 用 table 替换当前的路由表（接管它的引用），放弃对旧表的引用。仍在使用旧表的请求不受影响
+    void replace( route_table* table )
+    {
+        m_lock.lock();
+        route_table* old = m_table;
+        m_table = table;
+        m_lock.unlock();
+        if( old )
+        {
+            old->release();
+        }
+    }
+
+private:
+    spin_locker m_lock;
+    route_table* m_table;
+};
+
+#endif